@@ -15,10 +15,6 @@ BYTE find_end_of_bitshifted_sync(BYTE **pt, BYTE *gcr_end);
 BYTE find_bitshifted_sync(BYTE **pt, BYTE *gcr_end);
 int  isImageAligned(BYTE *track_buffer);
 
-#ifndef min
-#define min(a,b)  (((a) < (b))? (a) : (b))
-#endif
-
 // Determine if a track is bitshifted (sectors not sync aligned).
 //
 // 'track_start' points to start of track data.
@@ -415,61 +411,35 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 // Mode 1: Insert '1' bits (sync).
 // Mode 99: Copy bitshifted track data.
 //
+// The bits are moved by the bit stream helpers in gcr.c, 32 at a time.
+//
 // Returns always 1 (Everything ok).
 BYTE
 ShiftCopyXBitsFromPBtoQC(BYTE **p, BYTE *b, BYTE **q, BYTE *c, int NumDataBits, BYTE mode)
 {
-	BYTE db, d;
+	size_t srcbit, dstbit;
 
-	// Loop while bits are to be copied (return if target buffer is full, see below)
-	while (NumDataBits > 0)
-	{
-		// If target Q.C byte is full move Q (pointer) to next byte and reset C (used bits)
-		if (*c == 8)
-		{
-			*c = 0;
-			(*q)++;
-		}
+	if (NumDataBits <= 0)
+		return 1;
 
-		// Determine which bits to insert/copy.
-		if (mode == 0) db = 0;         // Mode  0: Insert '0' bits (before sync)
-		else if (mode == 1) db = 0xff; // Mode  1: Insert '1' bits (sync)
-		else db = **p;                 // Mode 99: Copy (bitshifted) track data
-
-		// Copy bits from 'db' to Q, but no more than 'db' has, and at most NumDataBits:
-		// > Number of used bits in target byte Q.C = *c
-		// > Number of free bits in target byte Q.C = (8-*c)
-		// > 0 <= C <= 7 (see above)
-		// > *b = Next bit position to be copied from 'db' (1 <= B <= 8)
-		// > [ ((Q << C) & 0xff00) + new bits from db ] >> C
-		**q = ( ( (int)((**q) >> (8-*c)) << 8) | (((int)db << (*b-1)) & 0xff) ) >> *c;
-
-		// Determine number 'd' of copied bits (lowest value of following):
-		// - At most (8-*c) free bits in Q were filled
-		// - At most (9-*b) bits could be copied from db
-		// - At most NumDataBits were left to be copied
-		d = min(min(8-*c, 9-*b), NumDataBits);
-		// Now: 1 <= d <= 8
-
-		// Update source position P.B
-		if (mode > 0)
-		{
-			*b += d; // Add number of copied bits: 1 <= B <= 9 (because of min(..,9-*b) above)
-			*p += *b/9; // Move P only if B points to next byte's first bit (9)
-			if (*b == 9) *b = 1; // Reset B if it points to next byte's first bit (P just updated)
-		}
+	srcbit = *b - 1;
+	dstbit = *c;
 
-		// 'd' bits added/copied, update NumDataBits and C (bit counter)
-		NumDataBits -= d;
-		*c += d;
+	if (mode == 99)
+		copy_bits(*q, dstbit, *p, srcbit, NumDataBits);
+	else
+		fill_bits(*q, dstbit, NumDataBits, mode);
 
-		// At most (8-*c) free bits in Q were filled (see above)
-		// If target Q.C byte is full move Q (pointer) to next byte and reset C (used bits)
-		if (*c == 8)
-		{
-			*c = 0;
-			(*q)++;
-		}
+	// Target always moves, source only if bits were taken from it (mode 1 and 99).
+	dstbit += NumDataBits;
+	*q += dstbit >> 3;
+	*c = (BYTE)(dstbit & 7);
+
+	if (mode > 0)
+	{
+		srcbit += NumDataBits;
+		*p += srcbit >> 3;
+		*b = (BYTE)((srcbit & 7) + 1);
 	}
 	return 1;
 }
@@ -481,30 +451,14 @@ ShiftCopyXBitsFromPBtoQC(BYTE **p, BYTE *b, BYTE **q, BYTE *c, int NumDataBits,
 BYTE
 find_end_of_bitshifted_sync(BYTE **pt, BYTE *gcr_end)
 {
-    BYTE last_sync_bit = 0;
+	BYTE last_sync_bit = 0;
 
 	// skip 0xff sync bytes
-	while (*pt < gcr_end && **pt == 0xff) (*pt)++;
+	if (*pt < gcr_end)
+		*pt += count_one_bits(*pt, 0, (gcr_end - *pt) * 8) >> 3;
 
 	if (*pt <= gcr_end)
-	{
-		if ( **pt == 0xff )               // 1111.1111
-			last_sync_bit = 8;
-		else if ( (**pt & 0xfe) == 0xfe ) // 1111.1110
-			last_sync_bit = 7;
-		else if ( (**pt & 0xfc) == 0xfc ) // 1111.1100
-			last_sync_bit = 6;
-		else if ( (**pt & 0xf8) == 0xf8 ) // 1111.1000
-			last_sync_bit = 5;
-		else if ( (**pt & 0xf0) == 0xf0 ) // 1111.0000
-			last_sync_bit = 4;
-		else if ( (**pt & 0xe0) == 0xe0 ) // 1110.0000
-			last_sync_bit = 3;
-		else if ( (**pt & 0xc0) == 0xc0 ) // 1100.0000
-			last_sync_bit = 2;
-		else if ( (**pt & 0x80) == 0x80 ) // 1000.0000
-			last_sync_bit = 1;
-	}
+		last_sync_bit = (BYTE)count_one_bits(*pt, 0, 8);
 
 	return last_sync_bit;
 }
@@ -526,51 +480,26 @@ find_bitshifted_sync(BYTE **pt, BYTE *gcr_end)
 	        111.1111111
 	         11.11111111
 	          1.11111111.1
+
+	   so any 10 '1' bits in a row that end by gcr_end.
 	*/
 
-	BYTE sync_start_bit = 0;
+	size_t end, sync;
+
+	if (*pt >= gcr_end)
+		return 0;
+
+	end = (gcr_end - *pt + 1) * 8;
+	sync = find_sync_bits(*pt, 0, end);
 
-	while ( ((*pt) < gcr_end) && (!sync_start_bit) )
+	if (sync == end)
 	{
-		// 11111111.11
-		if ( (*pt)[0] == 0xff && ((*pt)[1] & 0xc0) == 0xc0 )
-			sync_start_bit = 1; // bits numbered 1-8
-
-		// 1111111.111
-		else if ( ((*pt)[0] & 0x7f) == 0x7f && ((*pt)[1] & 0xe0) == 0xe0 )
-			sync_start_bit = 2; // bits numbered 1-8
-
-		// 111111.1111
-		else if ( ((*pt)[0] & 0x3f) == 0x3f && ((*pt)[1] & 0xf0) == 0xf0 )
-			sync_start_bit = 3; // bits numbered 1-8
-
-		// 11111.11111
-		else if ( ((*pt)[0] & 0x1f) == 0x1f && ((*pt)[1] & 0xf8) == 0xf8 )
-			sync_start_bit = 4; // bits numbered 1-8
-
-		// 1111.111111
-		else if ( ((*pt)[0] & 0x0f) == 0x0f && ((*pt)[1] & 0xfc) == 0xfc )
-			sync_start_bit = 5; // bits numbered 1-8
-
-		// 111.1111111
-		else if ( ((*pt)[0] & 0x07) == 0x07 && ((*pt)[1] & 0xfe) == 0xfe )
-			sync_start_bit = 6; // bits numbered 1-8
-
-		// 11.11111111
-		else if ( ((*pt)[0] & 0x03) == 0x03 && (*pt)[1] == 0xff )
-			sync_start_bit = 7; // bits numbered 1-8
-
-		// 1.11111111.1
-		else if ( ((*pt)+1) < gcr_end )
-			if ( ((*pt)[0] & 0x01) == 0x01
-				&& (*pt)[1] == 0xff
-				&& ((*pt)[2] & 0x80) == 0x80 )
-					sync_start_bit = 8; // bits numbered 1-8
-
-		if (!sync_start_bit) (*pt)++;
+		*pt = gcr_end;
+		return 0;
 	}
 
-	return sync_start_bit;
+	*pt += sync >> 3;
+	return (BYTE)((sync & 7) + 1); // bits numbered 1-8
 }
 
 
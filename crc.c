@@ -137,6 +137,7 @@ crcSlow(unsigned char const message[], int nBytes)
 
 
 crc  crcTable[256];
+static int crcReady = 0;
 
 
 /*********************************************************************
@@ -148,6 +149,7 @@ crc  crcTable[256];
  * Notes:		This function must be rerun any time the CRC standard
  *				is changed.  If desired, it can be run "offline" and
  *				the table results stored in an embedded system's ROM.
+ *				The table is only built by the first call.
  *
  * Returns:		None defined.
  *
@@ -160,6 +162,11 @@ crcInit(void)
 	unsigned char  bit;
 
 
+    if (crcReady)
+    {
+        return;
+    }
+
     /*
      * Compute the remainder of each possible dividend.
      */
@@ -193,6 +200,7 @@ crcInit(void)
          */
         crcTable[dividend] = remainder;
     }
+    crcReady = 1;
 
 }   /* crcInit() */
 
@@ -18,6 +18,7 @@
 #include "prot.h"
 #include "crc.h"
 #include "md5.h"
+#include "lz.h"
 //#include "bitshifter.c"
 
 void parseargs(char *argv[])
@@ -332,6 +333,18 @@ void parseargs(char *argv[])
 			}
 			break;
 
+		case 'j':
+			align_jobs = atoi(&(*argv)[2]);
+			if (align_jobs < 1) align_jobs = 1;
+			printf("* Align and compress tracks with %d parallel jobs\n", align_jobs);
+			break;
+
+		case 'Z':
+			compress_level = atoi(&(*argv)[2]);
+			if ((compress_level < 1) || (compress_level > 9)) compress_level = LZ_DEFAULT_LEVEL;
+			printf("* NBZ compression level %d\n", compress_level);
+			break;
+
 		/* this is only used in reading or unformat */
 		case 'k':
 			read_killer = 0;
@@ -353,6 +366,8 @@ void switchusage(void)
 	" -G[n]: Alternate gap match length\n"
 	" -C[n]: Simulate 'n' RPM track capacity\n"
 	" -T[n]: Track skew simulation (in ms, max 200ms)\n"
+	" -j[n]: Align and compress tracks with 'n' parallel jobs\n"
+	" -Z[n]: NBZ compression level 'n' (1 fast - 9 small)\n"
  	" -g: Enable gap reduction\n"
  	" -0: Enable bad GCR run reduction\n"
  	" -r: Disable automatic sync reduction\n"
@@ -365,64 +380,766 @@ int load_file(char *filename, BYTE *file_buffer)
 	int size;
 	FILE *fpin;
 
-	printf("Loading \"%s\"...\n",filename);
+	printf("Loading \"%s\"...\n",filename);
+
+	if ((fpin = fopen(filename, "rb")) == NULL)
+	{
+		printf("Couldn't open input file %s!\n", filename);
+		return 0;
+	}
+
+	fseek(fpin, 0, SEEK_END);
+	size = ftell(fpin);
+	rewind(fpin);
+
+	if (fread(file_buffer, size, 1, fpin) != 1) {
+			printf("unable to read file\n");
+			return 0;
+	}
+
+	printf("Successfully loaded %d bytes.", size);
+	fclose(fpin);
+	return size;
+}
+
+static DWORD
+get_dword(BYTE *buffer)
+{
+	return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (DWORD) buffer[3] << 24;
+}
+
+static void
+put_dword(BYTE *buffer, DWORD value)
+{
+	buffer[0] = value & 0xff;
+	buffer[1] = (value >> 8) & 0xff;
+	buffer[2] = (value >> 16) & 0xff;
+	buffer[3] = (value >> 24) & 0xff;
+}
+
+/* parallel jobs to use for units of independent work */
+static int
+job_count(int units)
+{
+#ifdef ARCH_THREADS
+	int jobs = align_jobs;
+
+	if (jobs > MAX_ALIGN_JOBS) jobs = MAX_ALIGN_JOBS;
+	if (jobs > units) jobs = units;
+	return (jobs > 1) ? jobs : 1;
+#else
+	return 1;
+#endif
+}
+
+typedef void (*job_func)(void *job);
+
+#ifdef ARCH_THREADS
+typedef struct
+{
+	job_func func;
+	void *job;
+} job_start;
+
+static ARCH_THREADFUNC
+job_thread(void *arg)
+{
+	job_start *start = (job_start *) arg;
+
+	start->func(start->job);
+	return 0;
+}
+#endif
+
+/*
+	Run func on count jobs, size bytes apart, each on a thread of its own.
+	A job that can not get a thread runs on the calling one.
+*/
+static void
+run_jobs(job_func func, void *jobs, size_t size, int count)
+{
+	int i;
+#ifdef ARCH_THREADS
+	arch_thread thread[MAX_ALIGN_JOBS];
+	job_start start[MAX_ALIGN_JOBS];
+	int started[MAX_ALIGN_JOBS];
+
+	for (i = 0; i < count; i++)
+	{
+		start[i].func = func;
+		start[i].job = (BYTE *) jobs + (i * size);
+		started[i] = (count > 1) && (arch_thread_create(&thread[i], job_thread, &start[i]));
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (started[i])
+			arch_thread_join(thread[i]);
+		else
+			func(start[i].job);
+	}
+#else
+	for (i = 0; i < count; i++)
+		func((BYTE *) jobs + (i * size));
+#endif
+}
+
+/*
+	Map filename, or read it into one heap buffer where the platform has
+	no mapping.  A mapping shares the page cache, so scanning many images
+	does not copy each one of them through stdio first.
+*/
+static BYTE *
+map_image_file(align_context *ctx, char *filename, size_t *size, int *mapped)
+{
+	BYTE *data;
+	long length;
+	FILE *fpin;
+#ifdef ARCH_MMAP
+	struct stat st;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) >= 0)
+	{
+		if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+		{
+			data = (BYTE *) arch_map_file(fd, (size_t) st.st_size);
+			if (!arch_map_failed(data))
+			{
+				close(fd);
+				*size = (size_t) st.st_size;
+				*mapped = 1;
+				return data;
+			}
+		}
+		close(fd);
+	}
+#endif
+
+	*mapped = 0;
+
+	if ((fpin = fopen(filename, "rb")) == NULL)
+	{
+		align_printf(ctx, "Couldn't open input file %s!\n", filename);
+		return NULL;
+	}
+
+	fseek(fpin, 0, SEEK_END);
+	length = ftell(fpin);
+	rewind(fpin);
+
+	data = (length > 0) ? malloc(length) : NULL;
+	if ((!data) || (fread(data, length, 1, fpin) != 1))
+	{
+		align_printf(ctx, "unable to read file\n");
+		free(data);
+		fclose(fpin);
+		return NULL;
+	}
+
+	fclose(fpin);
+	*size = (size_t) length;
+	return data;
+}
+
+/* NBZ data is read and uncompressed in chunks of this size */
+#define NBZ_CHUNK_SIZE 0x10000
+
+typedef struct
+{
+	FILE *fpin;
+	BYTE in[NBZ_CHUNK_SIZE];
+	unsigned int inpos, insize;
+	int bad;
+	lz_stream lz;
+	align_context *ctx;
+} nbz_reader;
+
+static nbz_reader *
+open_nbz(align_context *ctx, char *filename)
+{
+	nbz_reader *nbz;
+	long size;
+
+	align_printf(ctx, "Uncompressing NBZ...\n");
+	align_printf(ctx, "Loading \"%s\"...\n",filename);
+
+	if (!(nbz = malloc(sizeof(nbz_reader))))
+	{
+		align_printf(ctx, "Error: Could not allocate memory for NBZ data.\n");
+		return NULL;
+	}
+
+	if ((nbz->fpin = fopen(filename, "rb")) == NULL)
+	{
+		align_printf(ctx, "Couldn't open input file %s!\n", filename);
+		free(nbz);
+		return NULL;
+	}
+
+	fseek(nbz->fpin, 0, SEEK_END);
+	size = ftell(nbz->fpin);
+	rewind(nbz->fpin);
+
+	nbz->inpos = nbz->insize = 0;
+	nbz->bad = 0;
+	nbz->ctx = ctx;
+	LZ_StreamInit(&nbz->lz);
+
+	align_printf(ctx, "Successfully loaded %d bytes.", (int) size);
+	return nbz;
+}
+
+static void
+close_nbz(nbz_reader *nbz)
+{
+	fclose(nbz->fpin);
+	free(nbz);
+}
+
+/*
+	Uncompress the next length bytes of NIB data into out.  Returns the
+	number of bytes written, less than length at the end of the data.
+*/
+static size_t
+read_nbz_data(nbz_reader *nbz, BYTE *out, size_t length)
+{
+	size_t done = 0;
+	unsigned int used;
+	int n;
+
+	while ((done < length) && (!nbz->bad))
+	{
+		n = LZ_StreamUncompress(&nbz->lz, nbz->in + nbz->inpos, nbz->insize - nbz->inpos,
+			&used, out + done, length - done);
+		if (n < 0)
+		{
+			align_printf(nbz->ctx, "\nCorrupt NBZ data\n");
+			nbz->bad = 1;
+			break;
+		}
+		nbz->inpos += used;
+		done += n;
+
+		if ((done < length) && (nbz->inpos >= nbz->insize))
+		{
+			nbz->inpos = 0;
+			if (!(nbz->insize = fread(nbz->in, 1, NBZ_CHUNK_SIZE, nbz->fpin)))
+			{
+				if (!LZ_StreamEnd(&nbz->lz))
+					align_printf(nbz->ctx, "\nNBZ data is truncated\n");
+				break;
+			}
+		}
+	}
+	return done;
+}
+
+/*
+	Uncompress a whole NBZ file for a view, into a buffer the size of the
+	largest NIB image.
+*/
+static int
+read_nbz_view(align_context *ctx, char *filename, image_view *view)
+{
+	nbz_reader *nbz;
+	BYTE extra;
+	int result;
+
+	if (!(nbz = open_nbz(ctx, filename)))
+		return 0;
+
+	if (!(view->image = malloc((MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH)))
+	{
+		align_printf(ctx, "Error: Could not allocate memory for NBZ data.\n");
+		close_nbz(nbz);
+		return 0;
+	}
+
+	view->image_size = read_nbz_data(nbz, view->image, (MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH);
+	if ((view->image_size == (MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH) && (read_nbz_data(nbz, &extra, 1)))
+	{
+		align_printf(ctx, "\nNBZ data is too large for a NIB image\n");
+		nbz->bad = 1;
+	}
+
+	result = (!nbz->bad) && (view->image_size);
+	close_nbz(nbz);
+	return result;
+}
+
+static int
+check_nib_header(align_context *ctx, BYTE *image, size_t size)
+{
+	align_printf(ctx, "\nParsing NIB data...\n");
+
+	if ((size < 0x100) || (memcmp(image, "MNIB-1541-RAW", 13) != 0))
+	{
+		align_printf(ctx, "Not valid NIB data!\n");
+		return 0;
+	}
+	else
+		align_printf(ctx, "NIB file version %d\n", image[13]);
+	return 1;
+}
+
+/*
+	Read the tracks of an NBZ file straight into the track buffers, one
+	track at a time as they are uncompressed.  Only a chunk of the file
+	and the decoder history are held in memory.
+*/
+static int
+read_nbz_tracks(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density)
+{
+	nbz_reader *nbz;
+	BYTE header[0x100];
+	BYTE *track_data;
+	int track, t_index=0, h_index=0, result;
+
+	if (!(nbz = open_nbz(ctx, filename)))
+		return 0;
+
+	if (!check_nib_header(ctx, header, read_nbz_data(nbz, header, sizeof(header))))
+	{
+		close_nbz(nbz);
+		return 0;
+	}
+
+	while((h_index < 0xf0) && (header[0x10+h_index]))
+	{
+		track = header[0x10+h_index];
+		if (track > MAX_HALFTRACKS_1541 + 1)
+			break;
+
+		/* stop at a truncated image, and leave out the partial track */
+		track_data = track_buffer + (track * NIB_TRACK_LENGTH);
+		if (read_nbz_data(nbz, track_data, NIB_TRACK_LENGTH) < NIB_TRACK_LENGTH)
+		{
+			memset(track_data, 0, NIB_TRACK_LENGTH);
+			break;
+		}
+		track_density[track] = header[0x10 + h_index + 1] % BM_MATCH;  	 /* discard unused BM_MATCH mark */
+
+		h_index+=2;
+		t_index++;
+	}
+	align_printf(ctx, "Successfully parsed NIB data for %d tracks\n", t_index);
+
+	result = !nbz->bad;
+	close_nbz(nbz);
+	return result;
+}
+
+static int
+parse_nib_view(align_context *ctx, image_view *view)
+{
+	BYTE *image = view->image;
+	size_t offset;
+	int track, t_index=0, h_index=0;
+
+	if (!check_nib_header(ctx, image, view->image_size))
+		return 0;
+
+	while((h_index < 0xf0) && (image[0x10+h_index]))
+	{
+		track = image[0x10+h_index];
+		offset = 0x100 + (t_index * NIB_TRACK_LENGTH);
+
+		/* stop at a truncated image */
+		if ((track > MAX_HALFTRACKS_1541 + 1) || (offset + NIB_TRACK_LENGTH > view->image_size))
+			break;
+
+		view->density[track] = image[0x10 + h_index + 1] % BM_MATCH;  	 /* discard unused BM_MATCH mark */
+		view->track[track] = image + offset;
+		view->length[track] = NIB_TRACK_LENGTH;
+		view->tracks = track;
+
+		h_index+=2;
+		t_index++;
+	}
+	align_printf(ctx, "Successfully parsed NIB data for %d tracks\n", t_index);
+	return 1;
+}
+
+static int
+parse_g64_view(align_context *ctx, char *filename, image_view *view)
+{
+	BYTE *header = view->data;
+	size_t offset, length;
+	int track, g64maxtrack, g64tracks;
+	int pointer=0;
+
+	if (view->size < 0x7f0)
+	{
+		align_printf(ctx, "unable to read G64 header\n");
+		return 0;
+	}
+
+	if (memcmp(header, "GCR-1541", 8) != 0)
+	{
+		align_printf(ctx, "input file %s isn't a G64 data file!\n", filename);
+		return 0;
+	}
+
+	if (memcmp(header+0x2ac, "EXT", 3) == 0)
+	{
+		align_printf(ctx, "\nExtended SPS G64 detected\n");
+		ctx->sync_align_buffer = 1;
+	}
+
+	g64tracks = (char)header[0x9];
+	g64maxtrack = (BYTE)header[0xb] << 8 | (BYTE)header[0xa];
+	if(ctx->verbose) align_printf(ctx, "\nTracks:%d\nSize:%d\n", g64tracks, g64maxtrack);
+
+	if(g64maxtrack>NIB_TRACK_LENGTH)
+	{
+			align_printf(ctx, "\nContains too large track!\nLikely corrupt G64 file\nWill attempt to skip bad tracks\n");
+			//return 0;
+	}
+
+	if (g64tracks > MAX_HALFTRACKS_1541 + 1)
+		g64tracks = MAX_HALFTRACKS_1541 + 1;
+	view->tracks = g64tracks;
+
+	for (track = 2; track <= g64tracks; track++, pointer += 4)
+	{
+		offset = get_dword(header + 0xc + pointer);
+
+		/* check to see if track exists in file, else skip it */
+		if((!offset) || (offset + 2 > view->size))
+			continue;
+
+		/* get density from header */
+		view->density[track] = header[0x15c + pointer];
+
+		/* get length */
+		length = header[offset + 1] << 8 | header[offset];
+		if(length>NIB_TRACK_LENGTH)
+		{
+			length = NIB_TRACK_LENGTH;
+			//align_printf(ctx, " skipping extra data");
+		}
+		if(length > view->size - offset - 2)
+			length = view->size - offset - 2;
+
+		view->track[track] = header + offset + 2;
+		view->length[track] = length;
+
+		/* output some specs */
+		if(ctx->verbose)
+		{
+			align_printf(ctx, "%4.1f: ",(float) track/2);
+			if(view->density[track] & BM_NO_SYNC) align_printf(ctx, "NOSYNC!");
+			if(view->density[track] & BM_FF_TRACK) align_printf(ctx, "KILLER!");
+			align_printf(ctx, "%d (density:%d)\n", (int) length, view->density[track]);
+		}
+	}
+	return 1;
+}
+
+static int
+parse_nbz2_view(align_context *ctx, image_view *view)
+{
+	BYTE *image = view->image;
+	BYTE *entry;
+	DWORD offset, size;
+	int track, t_index=0;
+
+	align_printf(ctx, "\nParsing NBZ2 index...\n");
+
+	if ((view->image_size < NBZ2_HEADER_LENGTH) || (memcmp(image, "NBZ2-1541-RAW", 13) != 0))
+	{
+		align_printf(ctx, "Not valid NBZ2 data!\n");
+		return 0;
+	}
+	else
+		align_printf(ctx, "NIB file version %d\n", image[13]);
+
+	/* frames are checked as they are decoded */
+	crcInit();
+
+	for (entry = image + 0x10; (entry < image + NBZ2_HEADER_LENGTH) && (entry[0]); entry += 16)
+	{
+		track = entry[0];
+		offset = get_dword(entry + 4);
+		size = get_dword(entry + 8);
+
+		if ((track > MAX_HALFTRACKS_1541 + 1) || (offset > view->image_size) ||
+			(size > view->image_size - offset) ||
+			((entry[2] & NBZ2_STORED) && (size != NIB_TRACK_LENGTH)))
+		{
+			align_printf(ctx, "Skipping bad index entry for track %d\n", track);
+			continue;
+		}
+
+		view->density[track] = entry[1] % BM_MATCH;
+		view->length[track] = NIB_TRACK_LENGTH;
+		view->crc[track] = get_dword(entry + 12);
+		if (entry[2] & NBZ2_STORED)
+			view->track[track] = image + offset;
+		else
+		{
+			view->frame[track] = image + offset;
+			view->frame_size[track] = size;
+		}
+		view->tracks = track;
+		t_index++;
+	}
+	align_printf(ctx, "Successfully parsed NBZ2 index for %d tracks\n", t_index);
+	return 1;
+}
+
+/*
+	Open a NIB, NBZ, NBZ2 or G64 image.  Only NBZ data is copied, because it has
+	to be uncompressed as a whole (in chunks, straight from the file); NBZ2
+	tracks are decoded one by one on request and all other tracks point into
+	the file itself.  Messages go to ctx, which also gets the options the
+	image sets.
+*/
+int open_image_view_r(align_context *ctx, char *filename, image_view *view)
+{
+	int nbz, nbz2;
+
+	memset(view, 0, sizeof(image_view));
+	nbz = compare_extension((unsigned char *) filename, (unsigned char *) "NBZ");
+	nbz2 = compare_extension((unsigned char *) filename, (unsigned char *) "NBZ2");
+
+	if (compare_extension((unsigned char *) filename, (unsigned char *) "G64"))
+	{
+		align_printf(ctx, "\nReading G64 file...");
+
+		if (!(view->data = map_image_file(ctx, filename, &view->size, &view->mapped)))
+			return 0;
+
+		view->image = view->data;
+		view->image_size = view->size;
+		view->g64 = 1;
+
+		if (!parse_g64_view(ctx, filename, view))
+		{
+			close_image_view(view);
+			return 0;
+		}
+		align_printf(ctx, "Successfully loaded G64 file\n");
+		return 1;
+	}
+
+	if (nbz)
+	{
+		if ((!read_nbz_view(ctx, filename, view)) || (!parse_nib_view(ctx, view)))
+		{
+			close_image_view(view);
+			return 0;
+		}
+		return 1;
+	}
+
+	align_printf(ctx, "Loading \"%s\"...\n",filename);
+
+	if (!(view->data = map_image_file(ctx, filename, &view->size, &view->mapped)))
+		return 0;
+
+	align_printf(ctx, "Successfully loaded %d bytes.", (int) view->size);
+
+	view->image = view->data;
+	view->image_size = view->size;
+
+	if (!((nbz2) ? parse_nbz2_view(ctx, view) : parse_nib_view(ctx, view)))
+	{
+		close_image_view(view);
+		return 0;
+	}
+	return 1;
+}
+
+int open_image_view(char *filename, image_view *view)
+{
+	align_context ctx;
+	int result;
+
+	init_align_context(&ctx);
+	result = open_image_view_r(&ctx, filename, view);
+	sync_align_buffer = ctx.sync_align_buffer;
+	return result;
+}
+
+void close_image_view(image_view *view)
+{
+	if (view->image != view->data)
+		free(view->image);
+
+#ifdef ARCH_MMAP
+	if (view->mapped)
+		arch_unmap_file(view->data, view->size);
+	else
+#endif
+		free(view->data);
+
+	memset(view, 0, sizeof(image_view));
+}
+
+/* current data of a track, NULL if it is not in the image */
+BYTE *
+view_track(image_view *view, int track)
+{
+	return view->track[track];
+}
+
+/*
+	Read one track into buffer, NIB_TRACK_LENGTH bytes.  Compressed frames
+	are decoded and checked, so this is the way to get at single tracks
+	without touching the rest of the image.  Returns the track length, 0
+	if the track is missing or damaged.
+*/
+size_t
+view_read_track(image_view *view, int track, BYTE *buffer)
+{
+	if (view_track(view, track))
+	{
+		memcpy(buffer, view_track(view, track), view->length[track]);
+		return view->length[track];
+	}
+
+	if (!view->frame[track])
+		return 0;
+
+	if ((LZ_UncompressBounded(view->frame[track], buffer, view->frame_size[track], NIB_TRACK_LENGTH) != NIB_TRACK_LENGTH) ||
+		(crcFast(buffer, NIB_TRACK_LENGTH) != view->crc[track]))
+		return 0;
+
+	return NIB_TRACK_LENGTH;
+}
+
+typedef struct
+{
+	image_view *view;
+	BYTE *track_buffer;
+	int first, step;	/* tracks of this job */
+	BYTE *bad;
+} view_job;
+
+static void
+read_view_tracks(void *arg)
+{
+	view_job *job = (view_job *) arg;
+	image_view *view = job->view;
+	int track;
+
+	for (track = job->first; track < MAX_HALFTRACKS_1541 + 2; track += job->step)
+		if ((view->track[track]) || (view->frame[track]))
+			job->bad[track] = !view_read_track(view, track, job->track_buffer + (track * NIB_TRACK_LENGTH));
+}
 
-	if ((fpin = fopen(filename, "rb")) == NULL)
+/*
+	Copy the tracks of the image into the track buffers.  NBZ2 frames are
+	decoded on up to ctx->jobs threads.
+*/
+int view_to_tracks_r(align_context *ctx, image_view *view, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	view_job job[MAX_ALIGN_JOBS];
+	BYTE bad[MAX_HALFTRACKS_1541 + 2];
+	int track, frames = 0, jobs, i;
+
+	for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track++)
+		if (view->frame[track])
+			frames++;
+
+	memset(bad, 0, sizeof(bad));
+	jobs = job_count(frames);
+	if (jobs > ctx->jobs) jobs = (ctx->jobs > 1) ? ctx->jobs : 1;
+	for (i = 0; i < jobs; i++)
 	{
-		printf("Couldn't open input file %s!\n", filename);
-		return 0;
+		job[i].view = view;
+		job[i].track_buffer = track_buffer;
+		job[i].first = i;
+		job[i].step = jobs;
+		job[i].bad = bad;
 	}
+	run_jobs(read_view_tracks, job, sizeof(view_job), jobs);
 
-	fseek(fpin, 0, SEEK_END);
-	size = ftell(fpin);
-	rewind(fpin);
+	for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track++)
+	{
+		if ((view->track[track]) || (view->frame[track]))
+		{
+			track_density[track] = view->density[track];
+			if (bad[track])
+				align_printf(ctx, "Bad data in track %d\n", track);
 
-	if (fread(file_buffer, size, 1, fpin) != 1) {
-			printf("unable to read file\n");
-			return 0;
+			/* NIB tracks leave the length to the alignment */
+			if (view->g64)
+				track_length[track] = view->length[track];
+		}
+		else if ((view->g64) && (track >= 2) && (track <= view->tracks))
+			track_length[track] = 0;
 	}
+	return 1;
+}
 
-	printf("Successfully loaded %d bytes.", size);
-	fclose(fpin);
-	return size;
+int view_to_tracks(image_view *view, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return view_to_tracks_r(&ctx, view, track_buffer, track_density, track_length);
 }
 
 int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
-	int track, t_index=0, h_index=0;
+	align_context ctx;
+	image_view view;
 
-	printf("\nParsing NIB data...\n");
+	init_align_context(&ctx);
+	memset(&view, 0, sizeof(image_view));
+	view.image = file_buffer;
+	view.image_size = file_buffer_size;
 
-	if (memcmp(file_buffer, "MNIB-1541-RAW", 13) != 0)
-	{
-		printf("Not valid NIB data!\n");
+	if (!parse_nib_view(&ctx, &view))
 		return 0;
-	}
+
+	return view_to_tracks_r(&ctx, &view, track_buffer, track_density, track_length);
+}
+
+/*
+	Load a NIB, NBZ or NBZ2 file.  With aligned set the tracks are aligned
+	straight out of the file data, else the raw tracks are copied; NBZ
+	tracks are then uncompressed right into place.
+*/
+int read_nib_file_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment, int aligned)
+{
+	image_view view;
+	int result;
+
+	if ((!aligned) && (compare_extension((unsigned char *) filename, (unsigned char *) "NBZ")))
+		return read_nbz_tracks(ctx, filename, track_buffer, track_density);
+
+	if (!open_image_view_r(ctx, filename, &view))
+		return 0;
+
+	if (aligned)
+		result = align_view_tracks_r(ctx, &view, track_buffer, track_density, track_length, track_alignment);
 	else
-		printf("NIB file version %d\n", file_buffer[13]);
+		result = view_to_tracks_r(ctx, &view, track_buffer, track_density, track_length);
 
-	while(file_buffer[0x10+h_index])
-	{
-		track = file_buffer[0x10+h_index];
-		track_density[track] = (BYTE)(file_buffer[0x10 + h_index + 1]);
-		track_density[track] %= BM_MATCH;  	 /* discard unused BM_MATCH mark */
+	close_image_view(&view);
+	return result;
+}
 
-		memcpy(track_buffer + (track * NIB_TRACK_LENGTH),
-			file_buffer + (t_index * NIB_TRACK_LENGTH) + 0x100,
-			NIB_TRACK_LENGTH);
+int read_nib_file(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment, int aligned)
+{
+	align_context ctx;
 
-		h_index+=2;
-		t_index++;
-	}
-	printf("Successfully parsed NIB data for %d tracks\n", t_index);
-	return 1;
+	init_align_context(&ctx);
+	return read_nib_file_r(&ctx, filename, track_buffer, track_density, track_length, track_alignment, aligned);
 }
 
-int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int read_nb2_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
 	int track, pass_density, pass, nibsize, temp_track_inc, numtracks;
 	int header_entry = 0;
+	int entry, passes, first_pass, id_density;
+	long offset;
 	char header[0x100];
+	BYTE pass_table[0x100];
 	BYTE nibdata[0x2000];
 	BYTE tmpdata[0x2000];
 	BYTE diskid[2], dummy;
@@ -431,78 +1148,109 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 	size_t length, best_len;
 	char errorstring[0x1000];
 
-	printf("\nReading NB2 file...");
+	align_printf(ctx, "\nReading NB2 file...");
 
 	temp_track_inc = 1;  /* all nb2 files contain halftracks */
 
 	if ((fpin = fopen(filename, "rb")) == NULL)
 	{
-		printf("Couldn't open input file %s!\n", filename);
+		align_printf(ctx, "Couldn't open input file %s!\n", filename);
 		return 0;
 	}
 
 	if (fread(header, sizeof(header), 1, fpin) != 1)
 	{
-		printf("unable to read NIB header\n");
+		align_printf(ctx, "unable to read NIB header\n");
 		return 0;
 	}
 
 	if (memcmp(header, "MNIB-1541-RAW", 13) != 0)
 	{
-		printf("input file %s isn't an NB2 data file!\n", filename);
+		align_printf(ctx, "input file %s isn't an NB2 data file!\n", filename);
 		return 0;
 	}
 
+	/* adaptive captures have the passes of every track in a table, the others four at each density */
+	offset = sizeof(header);
+	if (header[14] & NB2_ADAPTIVE)
+	{
+		if (fread(pass_table, sizeof(pass_table), 1, fpin) != 1)
+		{
+			align_printf(ctx, "unable to read NB2 pass table\n");
+			return 0;
+		}
+		offset += sizeof(pass_table);
+	}
+	else
+		memset(pass_table, (NB2_PASSES << 4) | NB2_PASSES, sizeof(pass_table));
+
 	/* Determine number of tracks in image (estimated by filesize) */
 	fseek(fpin, 0, SEEK_END);
 	nibsize = ftell(fpin);
-	numtracks = (nibsize - NIB_HEADER_SIZE) / (NIB_TRACK_LENGTH * 16);
+	if (header[14] & NB2_ADAPTIVE)
+		for (numtracks = 0; (numtracks < (int) ((sizeof(header) - 0x10) / 2)) && (header[0x10 + (numtracks * 2)]); numtracks++);
+	else
+		numtracks = (nibsize - NIB_HEADER_SIZE) / (NIB_TRACK_LENGTH * 16);
 	temp_track_inc = 1;
-	printf("\n%d track image (filesize = %d bytes)\n", numtracks, nibsize);
+	align_printf(ctx, "\n%d track image (filesize = %d bytes)\n", numtracks, nibsize);
+
+	/* get disk id from track 18, read at density 2 unless that was left out */
+	entry = 17 * 2;
+	id_density = (NB2_PASS_COUNT(pass_table, entry, 2)) ? 2 : (header[0x10 + (entry * 2) + 1] & 3);
+	for (header_entry = 0; header_entry <= entry; header_entry++)
+		for (pass_density = 0; pass_density < 4; pass_density++)
+			if ((header_entry < entry) || (pass_density < id_density))
+				offset += NB2_PASS_COUNT(pass_table, header_entry, pass_density) * NIB_TRACK_LENGTH;
+	header_entry = 0;
 
-	/* get disk id */
 	rewind(fpin);
-	fseek(fpin, sizeof(header) + (17 * 2 * NIB_TRACK_LENGTH * 16) + (8 * NIB_TRACK_LENGTH), SEEK_SET);
+	fseek(fpin, offset, SEEK_SET);
 	fread(tmpdata, NIB_TRACK_LENGTH, 1, fpin);
 
 	if (!extract_id(tmpdata, diskid))
 	{
-			printf("Cannot find directory sector.\n");
+			align_printf(ctx, "Cannot find directory sector.\n");
 			return 0;
 	}
-	if(verbose) printf("\ndiskid: %c%c\n", diskid[0], diskid[1]);
+	if(ctx->verbose) align_printf(ctx, "\ndiskid: %c%c\n", diskid[0], diskid[1]);
 
 	rewind(fpin);
 	if (fread(header, sizeof(header), 1, fpin) != 1) {
-		printf("unable to read NB2 header\n");
+		align_printf(ctx, "unable to read NB2 header\n");
 		return 0;
 	}
+	if (header[14] & NB2_ADAPTIVE)
+		fseek(fpin, sizeof(pass_table), SEEK_CUR);
 
 	for (track = 2; track <= end_track; track += temp_track_inc)
 	{
 		/* get density from header or use default */
 		track_density[track] = (BYTE)(header[0x10 + (header_entry * 2) + 1]);
-		header_entry++;
+		entry = header_entry++;
 
 		best_pass = 0;
 		best_err = 0;
 		best_len = 0;  /* unused for now */
 
-		if(verbose) printf("\n%4.1f:",(float) track / 2);
+		if(ctx->verbose) align_printf(ctx, "\n%4.1f:",(float) track / 2);
 
-		/* contains 16 passes of track, four for each density */
+		/* contains up to 16 passes of track, four for each density */
 		for(pass_density = 0; pass_density < 4; pass_density ++)
 		{
-			if(verbose) printf(" (%d)", pass_density);
+			if(ctx->verbose) align_printf(ctx, " (%d)", pass_density);
+
+			/* the first pass after the density change only counts if it is the only one */
+			passes = (int) NB2_PASS_COUNT(pass_table, entry, pass_density);
+			first_pass = (passes > 1) ? 1 : 0;
 
-			for(pass = 0; pass <= 3; pass ++)
+			for(pass = 0; pass < passes; pass ++)
 			{
 				/* get track from file */
 				if(pass_density == track_density[track])
 				{
 					fread(nibdata, NIB_TRACK_LENGTH, 1, fpin);
 
-					length = extract_GCR_track(tmpdata, nibdata,
+					length = extract_GCR_track_r(ctx, tmpdata, nibdata,
 						&dummy,
 						track/2,
 						capacity_min[track_density[track]&3],
@@ -510,7 +1258,7 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 
 					errors = check_errors(tmpdata, length, track, diskid, errorstring);
 
-					if( (pass == 1) || (errors < best_err) )
+					if( (pass == first_pass) || (errors < best_err) )
 					{
 						//track_length[track] = 0x2000;
 						memcpy(track_buffer + (track * NIB_TRACK_LENGTH), nibdata, NIB_TRACK_LENGTH);
@@ -524,139 +1272,70 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		}
 
 		/* output some specs */
-		if(verbose)
+		if(ctx->verbose)
 		{
-			printf(" (");
-			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC!");
-			if(track_density[track] & BM_FF_TRACK) printf("KILLER!");
+			align_printf(ctx, " (");
+			if(track_density[track] & BM_NO_SYNC) align_printf(ctx, "NOSYNC!");
+			if(track_density[track] & BM_FF_TRACK) align_printf(ctx, "KILLER!");
 
-			printf("%d:%d) (pass %d, %d errors) %.1d%%", track_density[track]&3, track_length[track],
-				best_pass, best_err,
-				((track_length[track] / capacity[track_density[track]&3]) * 100));
+			align_printf(ctx, "%d:%d) (pass %d, %d errors) %.1d%%", track_density[track]&3, (int) track_length[track],
+				(int) best_pass, (int) best_err,
+				(int) ((track_length[track] / ctx->capacity[track_density[track]&3]) * 100));
 		}
 	}
 	fclose(fpin);
-	printf("\nSuccessfully loaded NB2 file\n");
+	align_printf(ctx, "\nSuccessfully loaded NB2 file\n");
 	return 1;
 }
 
-int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
-	int track, g64maxtrack, g64tracks, headersize;
-	int pointer=0;
-	BYTE header[0x7f0];
-	BYTE length_record[2];
-	FILE *fpin;
-
-	printf("\nReading G64 file...");
-
-	if ((fpin = fopen(filename, "rb")) == NULL)
-	{
-		printf("Couldn't open input file %s!\n", filename);
-		return 0;
-	}
-
-	if (fread(header, sizeof(header), 1, fpin) != 1)
-	{
-		printf("unable to read G64 header\n");
-		return 0;
-	}
-
-	if (memcmp(header, "GCR-1541", 8) != 0)
-	{
-		printf("input file %s isn't a G64 data file!\n", filename);
-		return 0;
-	}
+	align_context ctx;
 
-	if (memcmp(header+0x2ac, "EXT", 3) == 0)
-	{
-		printf("\nExtended SPS G64 detected\n");
-		headersize=0x7f0;
-		sync_align_buffer=1;
-	}
-	else
-		headersize=0x2ac;
+	init_align_context(&ctx);
+	return read_nb2_r(&ctx, filename, track_buffer, track_density, track_length);
+}
 
-	g64tracks = (char)header[0x9];
-	g64maxtrack = (BYTE)header[0xb] << 8 | (BYTE)header[0xa];
-	if(verbose) printf("\nTracks:%d\nSize:%d\n", g64tracks, g64maxtrack);
-	rewind(fpin);
+int read_g64_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	image_view view;
+	int result;
 
-	if (fread(header, headersize, 1, fpin) != 1)
-	{
-		printf("unable to read G64 header\n");
+	if (!open_image_view_r(ctx, filename, &view))
 		return 0;
-	}
-
-	if(g64maxtrack>NIB_TRACK_LENGTH)
-	{
-			printf("\nContains too large track!\nLikely corrupt G64 file\nWill attempt to skip bad tracks\n");
-			//return 0;
-	}
-
-	for (track = 2; track <= g64tracks; track++, pointer += 4)
-	{
-		int pointer2 = *(int*)(header+0xc+pointer);
-		int tmpLength;
-
-		/* check to see if track exists in file, else skip it */
-		if(!pointer2)
-		{
-			track_length[track]=0;
-			continue;
-		}
-
-		/* get density from header */
-		track_density[track] = header[0x15c + pointer];
-
-		fseek(fpin, pointer2, SEEK_SET);
-		//printf("\nDEBUG: filepointer=%d\n",pointer2);
-
-		/* get length */
-		fread(length_record, 2, 1, fpin);
-		tmpLength = length_record[1] << 8 | length_record[0];
 
-		if(tmpLength>NIB_TRACK_LENGTH)
-		{
-			tmpLength = NIB_TRACK_LENGTH;
-			//printf(" skipping extra data");
-		}
-		track_length[track] = tmpLength;
+	result = view_to_tracks_r(ctx, &view, track_buffer, track_density, track_length);
+	close_image_view(&view);
+	return result;
+}
 
-		/* get track from file */
-		fread(track_buffer + (track * NIB_TRACK_LENGTH), tmpLength, 1, fpin);
+int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+	int result;
 
-		/* output some specs */
-		if(verbose)
-		{
-			printf("%4.1f: ",(float) track/2);
-			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC!");
-			if(track_density[track] & BM_FF_TRACK) printf("KILLER!");
-			printf("%d (density:%d)\n", track_length[track], track_density[track]);
-		}
-	}
-	fclose(fpin);
-	printf("Successfully loaded G64 file\n");
-	return 1;
+	init_align_context(&ctx);
+	result = read_g64_r(&ctx, filename, track_buffer, track_density, track_length);
+	sync_align_buffer = ctx.sync_align_buffer;
+	return result;
 }
 
 
-int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int read_d64_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
 	int track, sector, sector_ref;
-	BYTE buffer[256];
-	BYTE gcrdata[NIB_TRACK_LENGTH];
+	BYTE buffer[MAX_SECTORS_D64 * 256];
 	BYTE errorinfo[MAXBLOCKSONDISK];
 	BYTE id[3] = { 0, 0, 0 };
 	int error, d64size, last_track, cur_sector=0;
 	char errorstring[0x1000], tmpstr[8];
 	FILE *fpin;
 
-	printf("\nReading D64 file...");
+	align_printf(ctx, "\nReading D64 file...");
 
 	if ((fpin = fopen(filename, "rb")) == NULL)
 	{
-		printf("Couldn't open input file %s!\n", filename);
+		align_printf(ctx, "Couldn't open input file %s!\n", filename);
 		return 0;
 	}
 
@@ -689,8 +1368,8 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		//rewind(fpin);
 		//printf("Bad d64 image size.\n");
 		//return 0;
-		printf("\nNon-standard D64 image... attempting to load as 40-track anyway\n");
-		printf("%d sectors in file\n", d64size/256);
+		align_printf(ctx, "\nNon-standard D64 image... attempting to load as 40-track anyway\n");
+		align_printf(ctx, "%d sectors in file\n", d64size/256);
 		last_track = 40;
 		break;
 	}
@@ -703,14 +1382,12 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 	sector_ref = 0;
 	for (track = 1; track <= last_track; track++)
 	{
-		// clear buffers
-		memset(gcrdata, 0x55, sizeof(gcrdata));
 		errorstring[0] = '\0';
 
 		for (sector = 0; sector < sector_map[track]; sector++)
 		{
-			// get error and increase reference pointer in errorinfo
-			error = errorinfo[sector_ref++];
+			// get error
+			error = errorinfo[sector_ref + sector];
 
 			if (error != SECTOR_OK)
 			{
@@ -720,26 +1397,23 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 
 			// read sector from file
 			if(d64size/256 > cur_sector)
-				fread(buffer, 256, 1, fpin); // @@@SRT: check success
+				fread(buffer + (sector * 256), 256, 1, fpin); // @@@SRT: check success
 			else
-				memset(buffer, fillbyte, sizeof(buffer));
+				memset(buffer + (sector * 256), ctx->fillbyte, 256);
 
-			// convert to gcr
-			convert_sector_to_GCR(buffer, gcrdata + (sector * (SECTOR_SIZE + sector_gap_length[track])), track, sector, id, error);
 			cur_sector++;
 		}
 
-		// calculate track length
-		track_length[track*2] = sector_map[track] * (SECTOR_SIZE + sector_gap_length[track]);
+		// convert whole track to gcr, straight into the track buffer
+		track_length[track*2] = convert_track_to_GCR(buffer,
+			track_buffer + (track * 2 * NIB_TRACK_LENGTH), track, id, errorinfo + sector_ref);
+		sector_ref += sector_map[track];
 
 		// no half tracks in D64, so clear them
 		track_length[(track*2)+1] = 0;
 
 		// use default densities for D64
 		track_density[track*2] = speed_map[track];
-
-		// write track
-		memcpy(track_buffer + (track * 2 * NIB_TRACK_LENGTH), gcrdata, track_length[track*2]);
 		//printf("%s", errorstring);
 	}
 
@@ -754,72 +1428,400 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		}
 	}
 	fclose(fpin);
-	printf("\nSuccessfully loaded D64 file\n");
+	align_printf(ctx, "\nSuccessfully loaded D64 file\n");
 	return 1;
 }
 
-int save_file(char *filename, BYTE *file_buffer, int length)
+int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return read_d64_r(&ctx, filename, track_buffer, track_density, track_length);
+}
+
+int save_file_r(align_context *ctx, char *filename, BYTE *file_buffer, int length)
 {
 		FILE *fpout;
 
 		/* create output file */
 		if ((fpout = fopen(filename, "wb")) == NULL)
 		{
-			printf("Couldn't create output file %s!\n", filename);
+			align_printf(ctx, "Couldn't create output file %s!\n", filename);
 			return 0;
 		}
 
 		if(!(fwrite(file_buffer, length, 1, fpout)))
 		{
-			printf("Couldn't write to output file %s!\n", filename);
+			align_printf(ctx, "Couldn't write to output file %s!\n", filename);
 			return 0;
 		}
 
-		fclose(fpout);
-		printf("Successfully saved file %s\n", filename);
-		return 1;
+		fclose(fpout);
+		align_printf(ctx, "Successfully saved file %s\n", filename);
+		return 1;
+}
+
+int save_file(char *filename, BYTE *file_buffer, int length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return save_file_r(&ctx, filename, file_buffer, length);
+}
+
+int write_nib_r(align_context *ctx, BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+    /*	writes contents of buffers into NIB file, with header and density information
+			it does not process the track
+    */
+
+	int track;
+	char header[0x100];
+	int header_entry = 0;
+
+	align_printf(ctx, "\nConverting to NIB format...\n");
+
+	/* clear header */
+	memset(header, 0, sizeof(header));
+
+	/* header now contains whether halftracks were read */
+	if(track_inc == 1)
+		sprintf(header, "MNIB-1541-RAW%c%c%c", 3, 0, 1);
+	else
+		sprintf(header, "MNIB-1541-RAW%c%c%c", 3, 0, 0);
+
+	for (track = start_track; track <= end_track; track += track_inc)
+	{
+		header[0x10 + (header_entry * 2)] = (BYTE)track;
+		header[0x10 + (header_entry * 2) + 1] = track_density[track];
+
+		/* process and save track to disk */
+		memcpy(file_buffer + sizeof(header) + (NIB_TRACK_LENGTH * header_entry),
+			track_buffer + (NIB_TRACK_LENGTH * track), NIB_TRACK_LENGTH);
+
+		header_entry++;
+	}
+	memcpy(file_buffer, header, sizeof(header));
+	align_printf(ctx, "Successfully parsed data to NIB format\n");
+
+	return (sizeof(header) + (header_entry * NIB_TRACK_LENGTH));
+}
+
+int write_nib(BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return write_nib_r(&ctx, file_buffer, track_buffer, track_density, track_length);
+}
+
+
+/*
+	NBZ2 compresses every track as a frame of its own, so a reader can get
+	at single tracks, or decode them in parallel.
+
+	0x00	"NBZ2-1541-RAW", NIB version, 0, halftrack flag
+	0x10	one 16 byte entry per track, a zero halftrack ends the list:
+			halftrack, density, flags, 0, frame offset, frame size, CRC32
+	NBZ2_HEADER_LENGTH	frames
+
+	Tracks that do not compress are stored raw (NBZ2_STORED).
+*/
+typedef struct
+{
+	BYTE *track_buffer;
+	BYTE *frames;
+	int *size;
+	int first, last, step;	/* tracks of this job */
+} frame_job;
+
+static void
+compress_frames(void *arg)
+{
+	frame_job *job = (frame_job *) arg;
+	int track;
+
+	for (track = job->first; track <= job->last; track += job->step)
+		job->size[track] = LZ_CompressLevel(job->track_buffer + (track * NIB_TRACK_LENGTH),
+			job->frames + (track * NBZ2_FRAME_LENGTH), NIB_TRACK_LENGTH, compress_level);
+}
+
+int write_nbz2_r(align_context *ctx, BYTE *file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	frame_job job[MAX_ALIGN_JOBS];
+	int frame_size[MAX_HALFTRACKS_1541 + 2];
+	BYTE *frames, *entry, *track_data;
+	DWORD offset = NBZ2_HEADER_LENGTH;
+	int track, size, jobs, i, header_entry = 0;
+
+	align_printf(ctx, "\nConverting to NBZ2 format...\n");
+	crcInit();
+
+	if (!(frames = malloc((MAX_HALFTRACKS_1541 + 2) * NBZ2_FRAME_LENGTH)))
+	{
+		align_printf(ctx, "Could not allocate compression buffer\n");
+		return 0;
+	}
+
+	/* tracks are compressed on their own, so spread them over the jobs */
+	jobs = job_count((end_track - start_track) / track_inc + 1);
+	if (jobs > ctx->jobs) jobs = (ctx->jobs > 1) ? ctx->jobs : 1;
+	for (i = 0; i < jobs; i++)
+	{
+		job[i].track_buffer = track_buffer;
+		job[i].frames = frames;
+		job[i].size = frame_size;
+		job[i].first = start_track + (i * track_inc);
+		job[i].last = end_track;
+		job[i].step = jobs * track_inc;
+	}
+	run_jobs(compress_frames, job, sizeof(frame_job), jobs);
+
+	memset(file_buffer, 0, NBZ2_HEADER_LENGTH);
+	memcpy(file_buffer, "NBZ2-1541-RAW", 13);
+	file_buffer[13] = 3;
+	file_buffer[15] = (track_inc == 1) ? 1 : 0;
+
+	for (track = start_track; (track <= end_track) && (header_entry <= MAX_HALFTRACKS_1541); track += track_inc)
+	{
+		entry = file_buffer + 0x10 + (header_entry * 16);
+		track_data = track_buffer + (NIB_TRACK_LENGTH * track);
+
+		entry[0] = (BYTE)track;
+		entry[1] = track_density[track];
+
+		size = frame_size[track];
+		if ((size <= 0) || (size >= NIB_TRACK_LENGTH))
+		{
+			entry[2] = NBZ2_STORED;
+			size = NIB_TRACK_LENGTH;
+			memcpy(file_buffer + offset, track_data, size);
+		}
+		else
+			memcpy(file_buffer + offset, frames + (track * NBZ2_FRAME_LENGTH), size);
+
+		put_dword(entry + 4, offset);
+		put_dword(entry + 8, size);
+		put_dword(entry + 12, crcFast(track_data, NIB_TRACK_LENGTH));
+
+		offset += size;
+		header_entry++;
+	}
+	free(frames);
+	align_printf(ctx, "Successfully compressed %d tracks to NBZ2 format\n", header_entry);
+
+	return offset;
+}
+
+int write_nbz2(BYTE *file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return write_nbz2_r(&ctx, file_buffer, track_buffer, track_density, track_length);
+}
+
+/*
+	Raw track dumps keep the tracks of a scanned image as they were
+	scanned, with their true lengths, for nibwrite -R.
+
+	0x00	"RAW-1541-DUMP", version, 0, 0
+	0x10	one 16 byte entry per track, a zero halftrack ends the list:
+			halftrack, density, 0, 0, offset, length, CRC32
+	RAW_DUMP_HEADER_LENGTH	track data
+
+	Every halftrack from start_track to end_track that has a length is
+	written.
+*/
+int write_raw_dump(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return write_raw_dump_r(&ctx, filename, track_buffer, track_density, track_length);
+}
+
+int write_raw_dump_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	BYTE header[RAW_DUMP_HEADER_LENGTH];
+	BYTE *entry;
+	DWORD offset = RAW_DUMP_HEADER_LENGTH;
+	FILE *fpout;
+	int track, header_entry = 0, result = 1;
+
+	crcInit();
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, "RAW-1541-DUMP", 13);
+	header[13] = 1;
+
+	for (track = start_track; (track <= end_track) && (header_entry <= MAX_HALFTRACKS_1541); track++)
+	{
+		if ((!track_length[track]) || (track_length[track] > NIB_TRACK_LENGTH))
+			continue;
+
+		entry = header + 0x10 + (header_entry * 16);
+		entry[0] = (BYTE)track;
+		entry[1] = track_density[track];
+		put_dword(entry + 4, offset);
+		put_dword(entry + 8, (DWORD) track_length[track]);
+		put_dword(entry + 12, crcFast(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]));
+
+		offset += (DWORD) track_length[track];
+		header_entry++;
+	}
+
+	if ((fpout = fopen(filename, "wb")) == NULL)
+	{
+		align_printf(ctx, "Couldn't create output file %s!\n", filename);
+		return 0;
+	}
+
+	/* header first, then the track data in the same order */
+	if (fwrite(header, sizeof(header), 1, fpout) != 1)
+		result = 0;
+
+	for (entry = header + 0x10; (result) && (entry[0]); entry += 16)
+		if (fwrite(track_buffer + (NIB_TRACK_LENGTH * entry[0]), get_dword(entry + 8), 1, fpout) != 1)
+			result = 0;
+
+	if (fclose(fpout) != 0)
+		result = 0;
+
+	if (!result)
+		align_printf(ctx, "Couldn't write to output file %s!\n", filename);
+	else if (ctx->verbose)
+		align_printf(ctx, "Dumped %d raw tracks to %s\n", header_entry, filename);
+
+	return result;
 }
 
-int write_nib(BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+/*
+	Read a raw track dump into the track buffers.  Tracks not in the dump
+	are left with a length of 0.  Returns the number of tracks read.
+*/
+int read_raw_dump(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
-    /*	writes contents of buffers into NIB file, with header and density information
-			it does not process the track
-    */
+	BYTE *data, *entry;
+	DWORD offset, length;
+	size_t size;
+	int track, mapped, t_index = 0;
 
-	int track;
-	char header[0x100];
-	int header_entry = 0;
+	printf("Loading \"%s\"...\n",filename);
 
-	printf("\nConverting to NIB format...\n");
+	if (!(data = map_image_file(default_align_context(), filename, &size, &mapped)))
+		return 0;
 
-	/* clear header */
-	memset(header, 0, sizeof(header));
+	if ((size < RAW_DUMP_HEADER_LENGTH) || (memcmp(data, "RAW-1541-DUMP", 13) != 0))
+		printf("Not a valid raw track dump!\n");
+	else
+	{
+		crcInit();
 
-	/* header now contains whether halftracks were read */
-	if(track_inc == 1)
-		sprintf(header, "MNIB-1541-RAW%c%c%c", 3, 0, 1);
+		for (entry = data + 0x10; (entry < data + RAW_DUMP_HEADER_LENGTH) && (entry[0]); entry += 16)
+		{
+			track = entry[0];
+			offset = get_dword(entry + 4);
+			length = get_dword(entry + 8);
+
+			if ((track > MAX_HALFTRACKS_1541 + 1) || (!length) || (length > NIB_TRACK_LENGTH) ||
+				(offset > size) || (length > size - offset) ||
+				(crcFast(data + offset, length) != get_dword(entry + 12)))
+			{
+				printf("Skipping bad dump of track %d\n", track);
+				continue;
+			}
+
+			memset(track_buffer + (NIB_TRACK_LENGTH * track), 0, NIB_TRACK_LENGTH);
+			memcpy(track_buffer + (NIB_TRACK_LENGTH * track), data + offset, length);
+			track_density[track] = entry[1];
+			track_length[track] = length;
+			t_index++;
+		}
+		printf("Successfully loaded %d raw tracks\n", t_index);
+	}
+
+#ifdef ARCH_MMAP
+	if (mapped)
+		arch_unmap_file(data, size);
 	else
-		sprintf(header, "MNIB-1541-RAW%c%c%c", 3, 0, 0);
+#endif
+		free(data);
 
-	for (track = start_track; track <= end_track; track += track_inc)
-	{
-		header[0x10 + (header_entry * 2)] = (BYTE)track;
-		header[0x10 + (header_entry * 2) + 1] = track_density[track];
+	return t_index;
+}
 
-		/* process and save track to disk */
-		memcpy(file_buffer + sizeof(header) + (NIB_TRACK_LENGTH * header_entry),
-			track_buffer + (NIB_TRACK_LENGTH * track), NIB_TRACK_LENGTH);
+typedef struct
+{
+	BYTE *in;
+	BYTE *out;
+	unsigned int start, end;	/* block of the input */
+	BYTE marker;
+	int size;
+} lz_job;
 
-		header_entry++;
+static void
+compress_block(void *arg)
+{
+	lz_job *job = (lz_job *) arg;
+
+	job->size = LZ_CompressFastBlock(job->in, job->out, job->start, job->end, job->marker, compress_level);
+}
+
+/*
+	LZ_CompressLevel() for NIB data on align_jobs threads.  The data is cut
+	on track boundaries, and as every block can still refer back into the
+	ones before it, the result is one plain NBZ stream for LZ_Uncompress()
+	that compresses nearly as well as a serial run.
+*/
+int compress_nbz_r(align_context *ctx, BYTE *file_buffer, BYTE *compressed_buffer, int file_buffer_size)
+{
+	lz_job job[MAX_ALIGN_JOBS];
+	BYTE marker;
+	int tracks, jobs, size, i;
+
+	tracks = (file_buffer_size - 0x100) / NIB_TRACK_LENGTH;
+	jobs = job_count(tracks);
+	if (jobs > ctx->jobs) jobs = (ctx->jobs > 1) ? ctx->jobs : 1;
+	if (jobs <= 1)
+		return LZ_CompressLevel(file_buffer, compressed_buffer, file_buffer_size, compress_level);
+
+	marker = (BYTE) LZ_Marker(file_buffer, file_buffer_size);
+	for (i = 0; i < jobs; i++)
+	{
+		job[i].in = file_buffer;
+		job[i].start = (i) ? 0x100 + ((tracks * i / jobs) * NIB_TRACK_LENGTH) : 0;
+		job[i].end = (i < jobs - 1) ? 0x100 + ((tracks * (i + 1) / jobs) * NIB_TRACK_LENGTH) : file_buffer_size;
+		job[i].marker = marker;
+		if (!(job[i].out = malloc(((job[i].end - job[i].start) * 257 / 256) + 1)))
+		{
+			align_printf(ctx, "Could not allocate compression buffer\n");
+			exit(0);
+		}
 	}
-	memcpy(file_buffer, header, sizeof(header));
-	printf("Successfully parsed data to NIB format\n");
+	run_jobs(compress_block, job, sizeof(lz_job), jobs);
 
-	return (sizeof(header) + (header_entry * NIB_TRACK_LENGTH));
+	compressed_buffer[0] = marker;
+	size = 1;
+	for (i = 0; i < jobs; i++)
+	{
+		memcpy(compressed_buffer + size, job[i].out, job[i].size);
+		size += job[i].size;
+		free(job[i].out);
+	}
+	return size;
 }
 
+int compress_nbz(BYTE *file_buffer, BYTE *compressed_buffer, int file_buffer_size)
+{
+	align_context ctx;
 
-int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+	init_align_context(&ctx);
+	return compress_nbz_r(&ctx, file_buffer, compressed_buffer, file_buffer_size);
+}
+
+int write_d64_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
     /*	writes contents of buffers into D64 file, with errorblock information (if detected) */
 
@@ -839,8 +1841,9 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	BYTE d64data[MAXBLOCKSONDISK * 256], *d64ptr;
 	BYTE errorinfo[MAXBLOCKSONDISK], errorcode;
 	int blocks_to_save;
+	sector_index index;
 
-	printf("\nWriting D64 file...\n");
+	align_printf(ctx, "\nWriting D64 file...\n");
 
 	memset(errorinfo, 0,sizeof(errorinfo));
 	memset(rawdata, 0,sizeof(rawdata));
@@ -849,7 +1852,7 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	/* create output file */
 	if ((fpout = fopen(filename, "wb")) == NULL)
 	{
-		printf("Couldn't create output file %s!\n", filename);
+		align_printf(ctx, "Couldn't create output file %s!\n", filename);
 		return 0;
 	}
 
@@ -861,12 +1864,12 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 		offset = 18 - track;
 		if (!offset || !extract_id(track_buffer + ((18+offset)*2*NIB_TRACK_LENGTH), id))
 		{
-			printf("Cannot find directory sector.\n");
+			align_printf(ctx, "Cannot find directory sector.\n");
 			return 0;
 		}
 		else
 		{
-			printf("Track offset found in image: %d\n",offset);
+			align_printf(ctx, "Track offset found in image: %d\n",offset);
 			//offset++; // the rest of the routines for D64 only operate on every other track
 		}
 	}
@@ -879,7 +1882,7 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 		cycle_stop = track_buffer + ((track+(offset*2)) * NIB_TRACK_LENGTH) + track_length[track+(offset*2)];
 		//printf("debug: start=%d, stop=%d\n",cycle_start,cycle_stop);
 
-		if(verbose) printf("%.2d (%d):" ,track/2, capacity[speed_map[track/2]]);
+		if(ctx->verbose) align_printf(ctx, "%.2d (%d):" ,track/2, (int) ctx->capacity[speed_map[track/2]]);
 
 		if (track+offset < 2 || track+offset > 80)
 		{
@@ -887,63 +1890,67 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 			errorinfo[blockindex] = SYNC_NOT_FOUND;
 		}
 		else
-		for (sector = 0; sector < sector_map[track/2]; sector++)
 		{
-			if(verbose) printf("%d", sector);
-
-			memset(rawdata, 0,sizeof(rawdata));
-			errorcode = convert_GCR_sector(cycle_start, cycle_stop, rawdata, track/2, sector, id);
-			errorinfo[blockindex] = errorcode;	/* OK by default */
+			index_GCR_sectors(cycle_start, cycle_stop, track/2, id, &index);
 
-			if (errorcode != SECTOR_OK)
+			for (sector = 0; sector < sector_map[track/2]; sector++)
 			{
-				if (track/2 <= 35)
+				if(ctx->verbose) align_printf(ctx, "%d", sector);
+
+				memset(rawdata, 0,sizeof(rawdata));
+				errorcode = convert_indexed_sector(&index, sector, rawdata);
+				errorinfo[blockindex] = errorcode;	/* OK by default */
+
+				if (errorcode != SECTOR_OK)
 				{
-					save_errorinfo = 1;
-					errors++;
+					if (track/2 <= 35)
+					{
+						save_errorinfo = 1;
+						errors++;
+					}
+					else
+					{
+						save_40_errors = 1;
+						hi_errors++;
+					}
 				}
-				else
+				if((track/2 > 35) &&
+					(errorcode != SYNC_NOT_FOUND) &&
+					(errorcode != HEADER_NOT_FOUND))
 				{
-					save_40_errors = 1;
-					hi_errors++;
+					save_40_tracks = 1;
 				}
-			}
-			if((track/2 > 35) &&
-				(errorcode != SYNC_NOT_FOUND) &&
-				(errorcode != HEADER_NOT_FOUND))
-			{
-				save_40_tracks = 1;
-			}
 
-			/* screen information */
-			if (errorcode == SECTOR_OK)
-			{
-				if(verbose) printf(" ");
-			}
-			else
-			{
-				if(verbose)
-					printf("%.1x", errorcode);
+				/* screen information */
+				if (errorcode == SECTOR_OK)
+				{
+					if(ctx->verbose) align_printf(ctx, " ");
+				}
 				else
-					if(track/2<=35)
-						printf("Error %.1d on Track %d, Sector %d\n", errorcode, track/2, sector);
-			}
+				{
+					if(ctx->verbose)
+						align_printf(ctx, "%.1x", errorcode);
+					else
+						if(track/2<=35)
+							align_printf(ctx, "Error %.1d on Track %d, Sector %d\n", errorcode, track/2, sector);
+				}
 
-			/* dump to buffer */
-			memcpy(d64ptr, rawdata+1 , 256);
-			d64ptr += 256;
+				/* dump to buffer */
+				memcpy(d64ptr, rawdata+1 , 256);
+				d64ptr += 256;
 
-			blockindex++;
+				blockindex++;
+			}
 		}
-		if(verbose) printf("\n");
+		if(ctx->verbose) align_printf(ctx, "\n");
 	}
-	if(verbose) printf("\n");
+	if(ctx->verbose) align_printf(ctx, "\n");
 
 	blocks_to_save = (save_40_tracks) ? MAXBLOCKSONDISK : BLOCKSONDISK;
 
 	if (fwrite(d64data, blocks_to_save * 256, 1, fpout) != 1)
 	{
-		printf("Cannot write d64 data.\n");
+		align_printf(ctx, "Cannot write d64 data.\n");
 		return 0;
 	}
 
@@ -953,23 +1960,31 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 
 		if (fwrite(errorinfo, blocks_to_save, 1, fpout) != 1)
 		{
-			printf("Cannot write sector data.\n");
+			align_printf(ctx, "Cannot write sector data.\n");
 			return 0;
 		}
 
 		if(blocks_to_save > 683)
-			printf("Converted %d errors into errorblock\n", errors+hi_errors);
+			align_printf(ctx, "Converted %d errors into errorblock\n", errors+hi_errors);
 		else
-			printf("Converted %d errors into errorblock\n", errors);
+			align_printf(ctx, "Converted %d errors into errorblock\n", errors);
 	}
 
 	fclose(fpout);
-	printf("Converted %d blocks into D64 file\n", blocks_to_save);
+	align_printf(ctx, "Converted %d blocks into D64 file\n", blocks_to_save);
 	return 1;
 }
 
+int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return write_d64_r(&ctx, filename, track_buffer, track_density, track_length);
+}
+
 
-int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int write_g64_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
 	/* writes contents of buffers into G64 file, with header and density information */
 
@@ -993,12 +2008,12 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	size_t raw_track_size[4] = { 6250, 6666, 7142, 7692 };
 	//char errorstring[0x1000];
 
-	printf("Writing G64 file...\n");
+	align_printf(ctx, "Writing G64 file...\n");
 
 	fpout = fopen(filename, "wb");
 	if (fpout == NULL)
 	{
-		printf("Cannot open G64 image %s.\n", filename);
+		align_printf(ctx, "Cannot open G64 image %s.\n", filename);
 		return 0;
 	}
 
@@ -1008,7 +2023,7 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	//	if(track_length[index+2] > G64_TRACK_MAXLEN)
 	//		G64_TRACK_MAXLEN = track_length[index+2];
 	//}
-	printf("G64 Track Length = %d", G64_TRACK_MAXLEN);
+	align_printf(ctx, "G64 Track Length = %d", G64_TRACK_MAXLEN);
 
 	/* Create G64 header */
 	strcpy((char *) header, "GCR-1541");
@@ -1020,7 +2035,7 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 
 	if (fwrite(header, sizeof(header), 1, fpout) != 1)
 	{
-		printf("Cannot write G64 header.\n");
+		align_printf(ctx, "Cannot write G64 header.\n");
 		return 0;
 	}
 
@@ -1037,21 +2052,21 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	/* write headers */
 	if (write_dword(fpout, gcr_track_p, sizeof(gcr_track_p)) < 0)
 	{
-		printf("Cannot write track header.\n");
+		align_printf(ctx, "Cannot write track header.\n");
 		return 0;
 	}
 
 	if (write_dword(fpout, gcr_speed_p, sizeof(gcr_speed_p)) < 0)
 	{
-		printf("Cannot write speed header.\n");
+		align_printf(ctx, "Cannot write speed header.\n");
 		return 0;
 	}
 
 	/* shuffle raw GCR between formats */
 	for (track = 2; track <= MAX_HALFTRACKS_1541+1; track +=track_inc)
 	{
-		fillbyte = track_buffer[(track * NIB_TRACK_LENGTH) + track_length[track] - 1];
-		memset(buffer, fillbyte, sizeof(buffer));
+		ctx->fillbyte = track_buffer[(track * NIB_TRACK_LENGTH) + track_length[track] - 1];
+		memset(buffer, ctx->fillbyte, sizeof(buffer));
 
 		track_len = track_length[track];
 		if(track_len>G64_TRACK_MAXLEN) track_len=G64_TRACK_MAXLEN;
@@ -1061,14 +2076,14 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 		memcpy(buffer, track_buffer + (track * NIB_TRACK_LENGTH), track_len);
 
 		/* user display */
-		if(verbose)
+		if(ctx->verbose)
 		{
-			printf("\n%4.1f: (", (float)track/2);
-			printf("%d", track_density[track]&3);
-			if ( (track_density[track]&3) != speed_map[track/2]) printf("!");
-			printf(":%d) ", track_length[track]);
-			if (track_density[track] & BM_NO_SYNC) printf("NOSYNC ");
-			if (track_density[track] & BM_FF_TRACK) printf("KILLER ");
+			align_printf(ctx, "\n%4.1f: (", (float)track/2);
+			align_printf(ctx, "%d", track_density[track]&3);
+			if ( (track_density[track]&3) != speed_map[track/2]) align_printf(ctx, "!");
+			align_printf(ctx, ":%d) ", (int) track_length[track]);
+			if (track_density[track] & BM_NO_SYNC) align_printf(ctx, "NOSYNC ");
+			if (track_density[track] & BM_FF_TRACK) align_printf(ctx, "KILLER ");
 		}
 
 		/* process/compress GCR data */
@@ -1078,12 +2093,12 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 			{
 				added_sync = lengthen_sync(buffer, track_len, G64_TRACK_MAXLEN);
 				track_len += added_sync;
-				if(verbose) printf("[+sync:%d]", added_sync);
+				if(ctx->verbose) align_printf(ctx, "[+sync:%d]", added_sync);
 			}
 		}
 
-		badgcr = check_bad_gcr(buffer, track_len);
-		if(verbose>1) printf("(weak:%d)",badgcr);
+		badgcr = check_bad_gcr_r(ctx, buffer, track_len);
+		if(ctx->verbose>1) align_printf(ctx, "(weak:%d)",(int) badgcr);
 
 		if(rpm_real)
 		{
@@ -1091,34 +2106,34 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 			switch (track_density[track])
 			{
 				case 0:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY0/rpm_real);
+					ctx->capacity[speed_map[track/2]] = (size_t)(DENSITY0/rpm_real);
 					break;
 				case 1:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY1/rpm_real);
+					ctx->capacity[speed_map[track/2]] = (size_t)(DENSITY1/rpm_real);
 					break;
 				case 2:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY2/rpm_real);
+					ctx->capacity[speed_map[track/2]] = (size_t)(DENSITY2/rpm_real);
 					break;
 				case 3:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY3/rpm_real);
+					ctx->capacity[speed_map[track/2]] = (size_t)(DENSITY3/rpm_real);
 				break;
 			}
 
 			//printf("\ntrack=%d density=%d rpmreal=%d speedmap=%d capacity:%d\n",track,DENSITY0,rpm_real,speed_map[track/2],capacity[speed_map[track/2]]);
 
-			if(capacity[speed_map[track/2]] > G64_TRACK_MAXLEN)
-				capacity[speed_map[track/2]] = G64_TRACK_MAXLEN;
+			if(ctx->capacity[speed_map[track/2]] > G64_TRACK_MAXLEN)
+				ctx->capacity[speed_map[track/2]] = G64_TRACK_MAXLEN;
 
-			if(track_len > capacity[speed_map[track/2]])
-				track_len = compress_halftrack(track, buffer, track_density[track], track_len);
-			if(verbose) printf("(%d)", track_len);
+			if(track_len > ctx->capacity[speed_map[track/2]])
+				track_len = compress_halftrack_r(ctx, track, buffer, track_density[track], track_len);
+			if(ctx->verbose) align_printf(ctx, "(%d)", (int) track_len);
 		}
 		else
 		{
-			capacity[speed_map[track/2]] = G64_TRACK_MAXLEN;
-			track_len = compress_halftrack(track, buffer, track_density[track], track_len);
+			ctx->capacity[speed_map[track/2]] = G64_TRACK_MAXLEN;
+			track_len = compress_halftrack_r(ctx, track, buffer, track_density[track], track_len);
 		}
-		if(verbose>1) printf("(fill:$%.2x)",fillbyte);
+		if(ctx->verbose>1) align_printf(ctx, "(fill:$%.2x)",ctx->fillbyte);
 
 		gcr_track[0] = (BYTE) (track_len % 256);
 		gcr_track[1] = (BYTE) (track_len / 256);
@@ -1136,23 +2151,40 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 
 		memcpy(gcr_track+2, buffer, track_len);
 
+		/* pad with zeros, not with the end of the last track */
+		memset(gcr_track + 2 + track_len, 0, sizeof(gcr_track) - 2 - track_len);
+
 		if (fwrite(gcr_track, (G64_TRACK_MAXLEN + 2), 1, fpout) != 1)
 		{
-			printf("Cannot write track data.\n");
+			align_printf(ctx, "Cannot write track data.\n");
 			return 0;
 		}
 	}
 	fclose(fpout);
-	printf("\nSuccessfully saved G64 file\n");
+	align_printf(ctx, "\nSuccessfully saved G64 file\n");
 	return 1;
 }
 
-size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_t length)
+/* the capacities and fill byte it leaves are kept for what follows, as before */
+int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+	int result;
+
+	init_align_context(&ctx);
+	result = write_g64_r(&ctx, filename, track_buffer, track_density, track_length);
+	memcpy(capacity, ctx.capacity, sizeof(ctx.capacity));
+	fillbyte = ctx.fillbyte;
+	return result;
+}
+
+size_t compress_halftrack_r(align_context * ctx, int halftrack, BYTE *track_buffer, BYTE density, size_t length)
 {
 	size_t orglen;
 	BYTE gcrdata[NIB_TRACK_LENGTH];
 
 	/* copy to spare buffer */
+	invalidate_sector_cache(track_buffer);
 	memcpy(gcrdata, track_buffer, NIB_TRACK_LENGTH);
 	memset(track_buffer, 0, NIB_TRACK_LENGTH);
 
@@ -1162,38 +2194,38 @@ size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_
 		/* If our track contains sync, we reduce to a minimum of 32 bits
 		   less is too short for some loaders including CBM, but only 10 bits are technically required */
 		orglen = length;
-		if ( (length > (capacity[density&3])) && (!(density & BM_NO_SYNC)) &&
-			(reduce_map[halftrack/2] & REDUCE_SYNC) )
+		if ( (length > (ctx->capacity[density&3])) && (!(density & BM_NO_SYNC)) &&
+			(ctx->reduce_map[halftrack/2] & REDUCE_SYNC) )
 		{
 			/* reduce sync marks within the track */
-			length = reduce_runs(gcrdata, length, capacity[density&3], reduce_sync, 0xff);
-			if(verbose) printf("(sync:-%d)", orglen - length);
+			length = reduce_runs(gcrdata, length, ctx->capacity[density&3], ctx->reduce_sync, 0xff);
+			if(ctx->verbose) align_printf(ctx, "(sync:-%d)", (int) (orglen - length));
 		}
 
 		/* reduce bad GCR runs */
 		orglen = length;
-		if ( (length > (capacity[density&3])) &&
-			(reduce_map[halftrack/2] & REDUCE_BAD) )
+		if ( (length > (ctx->capacity[density&3])) &&
+			(ctx->reduce_map[halftrack/2] & REDUCE_BAD) )
 		{
-			length = reduce_runs(gcrdata, length, capacity[density&3], 0, 0x00);
-			if(verbose) printf("(badgcr-%d)", orglen - length);
+			length = reduce_runs(gcrdata, length, ctx->capacity[density&3], 0, 0x00);
+			if(ctx->verbose) align_printf(ctx, "(badgcr-%d)", (int) (orglen - length));
 		}
 
 		/* reduce sector gaps -  they occur at the end of every sector and vary from 4-19 bytes, typically  */
 		orglen = length;
-		if ( (length > (capacity[density&3])) &&
-			(reduce_map[halftrack/2] & REDUCE_GAP) )
+		if ( (length > (ctx->capacity[density&3])) &&
+			(ctx->reduce_map[halftrack/2] & REDUCE_GAP) )
 		{
-			length = reduce_gaps(gcrdata, length, capacity[density & 3]);
-			if(verbose) printf("(gap-%d)", orglen - length);
+			length = reduce_gaps(gcrdata, length, ctx->capacity[density & 3]);
+			if(ctx->verbose) align_printf(ctx, "(gap-%d)", (int) (orglen - length));
 		}
 
 		/* still not small enough, we have to truncate the end (reduce tail) */
 		orglen = length;
-		if (length > capacity[density&3])
+		if (length > ctx->capacity[density&3])
 		{
-			length = capacity[density&3];
-			if(verbose) printf("(trunc-%d)", orglen - length);
+			length = ctx->capacity[density&3];
+			if(ctx->verbose) align_printf(ctx, "(trunc-%d)", (int) (orglen - length));
 		}
 	}
 
@@ -1209,120 +2241,285 @@ size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_
 	return length;
 }
 
-int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_t length)
+{
+	return compress_halftrack_r(default_align_context(), halftrack, track_buffer, density, length);
+}
+
+/* work on one halftrack, output goes through the context */
+typedef void (*halftrack_func)(align_context *ctx, image_view *view, int track, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+
+typedef struct
 {
+	halftrack_func process;
+	align_context ctx;
+	image_view *view;
+	int first, last, step;	/* tracks of this worker */
+	BYTE *track_buffer;
+	BYTE *track_density;
+	size_t *track_length;
+	BYTE *track_alignment;
+	char **output;			/* buffered output per track */
+} halftrack_worker;
+
+static void
+run_halftrack_worker(void *arg)
+{
+	halftrack_worker *worker = (halftrack_worker *) arg;
 	int track;
+
+	for (track = worker->first; track <= worker->last; track += worker->step)
+	{
+		worker->ctx.log_buffer = NULL;
+		worker->ctx.log_used = worker->ctx.log_size = 0;
+		worker->process(&worker->ctx, worker->view, track, worker->track_buffer, worker->track_density,
+			worker->track_length, worker->track_alignment);
+		worker->output[track] = worker->ctx.log_buffer;
+	}
+}
+
+/*
+	Run process on halftracks first to last of view (or of the track
+	buffer), spread over up to ctx->jobs workers.  Tracks are independent,
+	the output of each one is buffered and printed to ctx in track order
+	so it matches a serial run.  Workers only write their own halftracks,
+	the align and reduce maps are only read.
+*/
+static void
+process_halftracks(align_context *ctx, halftrack_func process, image_view *view, int first, int last,
+	BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	halftrack_worker worker[MAX_ALIGN_JOBS];
+	char *output[MAX_HALFTRACKS_1541 + 2];
+	int jobs, track, i;
+
+	jobs = job_count(last - first + 1);
+	if (jobs > ctx->jobs) jobs = (ctx->jobs > 1) ? ctx->jobs : 1;
+
+	/* RapidLok alignment carries the TV standard from track to track */
+	for (track = first; track <= last; track++)
+		if (ctx->align_map[track/2] == ALIGN_RAPIDLOK)
+			jobs = 1;
+
+	if (jobs <= 1)
+	{
+		for (track = first; track <= last; track++)
+			process(ctx, view, track, track_buffer, track_density, track_length, track_alignment);
+		return;
+	}
+
+	memset(output, 0, sizeof(output));
+	for (i = 0; i < jobs; i++)
+	{
+		worker[i].process = process;
+		worker[i].ctx = *ctx;
+		worker[i].ctx.buffered = 1;
+		worker[i].ctx.jobs = 1;
+		worker[i].view = view;
+		worker[i].first = first + i;
+		worker[i].last = last;
+		worker[i].step = jobs;
+		worker[i].track_buffer = track_buffer;
+		worker[i].track_density = track_density;
+		worker[i].track_length = track_length;
+		worker[i].track_alignment = track_alignment;
+		worker[i].output = output;
+	}
+
+	run_jobs(run_halftrack_worker, worker, sizeof(halftrack_worker), jobs);
+
+	for (track = first; track <= last; track++)
+	{
+		if (output[track])
+		{
+			align_puts(ctx, output[track]);
+			free(output[track]);
+		}
+	}
+}
+
+static void
+sync_halftrack(align_context *ctx, image_view *view, int track, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
 	BYTE temp_buffer[NIB_TRACK_LENGTH*2];
 	//BYTE *nibdata_aligned; // aligned track
 	//int aligned_len;       // aligned track length
 
-	printf("\nByte-syncing tracks...\n");
-	for (track = start_track; track <= end_track; track ++)
+	if(track_length[track])
 	{
-		if(track_length[track])
-		{
-			if(verbose) printf("\n%4.1f: (%d) ",(float) track/2, track_length[track]);
+		if(ctx->verbose) align_printf(ctx, "\n%4.1f: (%d) ",(float) track/2, (int) track_length[track]);
 
-			if(track_length[track]==NIB_TRACK_LENGTH) continue;
+		if(track_length[track]==NIB_TRACK_LENGTH) return;
 
-			check_bad_gcr(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
+		check_bad_gcr_r(ctx, track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
 
-			/* Pete's version */
-			if(!sync_align(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]))
-			{
-					printf("{nosync}");
-					continue;
-			}
-			/* end Pete's version */
-
-			/* Arnd's version */
-			//if (isTrackBitshifted(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]))
-			//{
-			//	printf("[bitshifted] ");
-			//	align_bitshifted_kf_track(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track], &nibdata_aligned, &aligned_len);
-
-			//	if(aligned_len<0x2000)
-			//		track_length[track] = aligned_len;
-			//	else
-			//	{
-			//		aligned_len = 0x2000;
-			//		printf("aligned data too long, truncated ");
-			//	}
-			//	memcpy(track_buffer+(track*NIB_TRACK_LENGTH), nibdata_aligned, aligned_len);
-			//}
-			//else continue; // Continue if track is aligned or if no sync found.
-			/* end Arnd version */
-
-			/* re-extract/align data, since KF images are just index to index */
-			memcpy(temp_buffer, track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
-			memcpy(temp_buffer+track_length[track], track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
-
-			track_length[track] = extract_GCR_track(
-						track_buffer + (track * NIB_TRACK_LENGTH),
-						temp_buffer,
-						&track_alignment[track],
-						track/2,
-						capacity_min[track_density[track]&3],
-						capacity_max[track_density[track]&3] );
+		/* Pete's version */
+		if(!sync_align_r(ctx, track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]))
+		{
+				align_printf(ctx, "{nosync}");
+				return;
 		}
+		/* end Pete's version */
+
+		/* Arnd's version */
+		//if (isTrackBitshifted(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]))
+		//{
+		//	printf("[bitshifted] ");
+		//	align_bitshifted_kf_track(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track], &nibdata_aligned, &aligned_len);
+
+		//	if(aligned_len<0x2000)
+		//		track_length[track] = aligned_len;
+		//	else
+		//	{
+		//		aligned_len = 0x2000;
+		//		printf("aligned data too long, truncated ");
+		//	}
+		//	memcpy(track_buffer+(track*NIB_TRACK_LENGTH), nibdata_aligned, aligned_len);
+		//}
+		//else continue; // Continue if track is aligned or if no sync found.
+		/* end Arnd version */
+
+		/* re-extract/align data, since KF images are just index to index */
+		invalidate_sector_cache(track_buffer+(track*NIB_TRACK_LENGTH));
+		memcpy(temp_buffer, track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
+		memcpy(temp_buffer+track_length[track], track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
+
+		track_length[track] = extract_GCR_track_r(ctx,
+					track_buffer + (track * NIB_TRACK_LENGTH),
+					temp_buffer,
+					&track_alignment[track],
+					track/2,
+					capacity_min[track_density[track]&3],
+					capacity_max[track_density[track]&3] );
 	}
-	if(verbose) printf("\n");
+}
+
+int sync_tracks_r(align_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	align_printf(ctx, "\nByte-syncing tracks...\n");
+	process_halftracks(ctx, sync_halftrack, NULL, start_track, end_track, track_buffer, track_density, track_length, track_alignment);
+	if(ctx->verbose) align_printf(ctx, "\n");
 	return 1;
 }
 
-int align_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	return sync_tracks_r(default_align_context(), track_buffer, track_density, track_length, track_alignment);
+}
+
+/*
+	Raw data of a track to align from.  The cycle checks peek a few bytes
+	past the end of the track, so a track is only used in place when more
+	image data follows; others are read into buffer.
+*/
+static BYTE *
+view_align_source(image_view *view, int track, BYTE *buffer)
+{
+	BYTE *data = view->track[track];
+
+	if (view->length[track] != NIB_TRACK_LENGTH)
+		return NULL;
+
+	if ((data) && (data + NIB_TRACK_LENGTH + 0x100 <= view->image + view->image_size))
+		return data;
+
+	return (view_read_track(view, track, buffer)) ? buffer : NULL;
+}
+
+/* view is the image to align from instead of track_buffer, only read */
+static void
+align_halftrack(align_context *ctx, image_view *view, int track, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
 {
-	int track;
 	BYTE nibdata[NIB_TRACK_LENGTH];
+	BYTE *source = NULL;
 
-	memset(nibdata, 0, sizeof(nibdata));
-	printf("Aligning tracks...\n");
+	if (view)
+	{
+		source = view_align_source(view, track, nibdata);
+		if ((!source) && (view->frame[track]))
+			align_printf(ctx, "%4.1f: bad data in NBZ2 frame\n", (float) track/2);
+	}
 
-	//for (track = start_track; track <= end_track; track ++)
-	for (track = 1; track <= 84; track ++)
+	invalidate_sector_cache(track_buffer+(track*NIB_TRACK_LENGTH));
+	if (!source)
 	{
 		memcpy(nibdata, track_buffer+(track*NIB_TRACK_LENGTH), NIB_TRACK_LENGTH);
-		memset(track_buffer + (track * NIB_TRACK_LENGTH), 0x00, NIB_TRACK_LENGTH);
+		source = nibdata;
+	}
+	memset(track_buffer + (track * NIB_TRACK_LENGTH), 0x00, NIB_TRACK_LENGTH);
+
+	/* process track cycle */
+	track_length[track] = extract_GCR_track_r(ctx,
+		track_buffer + (track * NIB_TRACK_LENGTH),
+		source,
+		&track_alignment[track],
+		track/2,
+		capacity_min[track_density[track]&3],
+		capacity_max[track_density[track]&3]
+	);
+
+	/* output some specs */
+	if((ctx->verbose)&&(track_length[track]>0))
+	{
+		align_printf(ctx, "%4.1f: ",(float) track/2);
+		if(track_density[track] & BM_NO_SYNC) align_printf(ctx, "NOSYNC:");
+		if(track_density[track] & BM_FF_TRACK) align_printf(ctx, "KILLER:");
+		align_printf(ctx, "(%d:", track_density[track]&3);
+		align_printf(ctx, "%d) ", (int) track_length[track]);
+		align_printf(ctx, "[align=%s]\n",alignments[track_alignment[track]]);
+	}
+}
 
-		/* process track cycle */
-		track_length[track] = extract_GCR_track(
-			track_buffer + (track * NIB_TRACK_LENGTH),
-			nibdata,
-			&track_alignment[track],
-			track/2,
-			capacity_min[track_density[track]&3],
-			capacity_max[track_density[track]&3]
-		);
+int align_tracks_r(align_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	align_printf(ctx, "Aligning tracks...\n");
 
-		/* output some specs */
-		if((verbose)&&(track_length[track]>0))
-		{
-			printf("%4.1f: ",(float) track/2);
-			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC:");
-			if(track_density[track] & BM_FF_TRACK) printf("KILLER:");
-			printf("(%d:", track_density[track]&3);
-			printf("%d) ", track_length[track]);
-			printf("[align=%s]\n",alignments[track_alignment[track]]);
-		}
-	}
+	//for (track = start_track; track <= end_track; track ++)
+	process_halftracks(ctx, align_halftrack, NULL, 1, 84, track_buffer, track_density, track_length, track_alignment);
 	return 1;
 }
 
-int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+int align_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	return align_tracks_r(default_align_context(), track_buffer, track_density, track_length, track_alignment);
+}
+
+/* align the tracks of an image view, reading the raw tracks in place */
+int align_view_tracks_r(align_context *ctx, image_view *view, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	int track;
+
+	for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track++)
+		if ((view->track[track]) || (view->frame[track]))
+			track_density[track] = view->density[track];
+
+	align_printf(ctx, "Aligning tracks...\n");
+	process_halftracks(ctx, align_halftrack, view, 1, 84, track_buffer, track_density, track_length, track_alignment);
+	return 1;
+}
+
+int align_view_tracks(image_view *view, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	return align_view_tracks_r(default_align_context(), view, track_buffer, track_density, track_length, track_alignment);
+}
+
+int rig_tracks_r(align_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
 {
 	int track;
 
-	printf("Rigging tracks...\n");
+	align_printf(ctx, "Rigging tracks...\n");
 
 	for (track = start_track; track <= end_track; track ++)
 	{
 		if(track_length[track]==0) continue;
 
-		if(track_length[track] < capacity[track_density[track]&3])
+		invalidate_sector_cache(track_buffer+(track*NIB_TRACK_LENGTH));
+
+		if(track_length[track] < ctx->capacity[track_density[track]&3])
 		{
-			memset(track_buffer + (track*NIB_TRACK_LENGTH) + track_length[track], 0x55, capacity[track_density[track]&3] - track_length[track]);
+			memset(track_buffer + (track*NIB_TRACK_LENGTH) + track_length[track], 0x55, ctx->capacity[track_density[track]&3] - track_length[track]);
 			//printf("Padded %d bytes\n", capacity[track_density[track]&3]-track_length[track]);
-			track_length[track] = capacity[track_density[track]&3];
+			track_length[track] = ctx->capacity[track_density[track]&3];
 		}
 
 		memcpy(track_buffer + (track*NIB_TRACK_LENGTH) + track_length[track],
@@ -1333,6 +2530,14 @@ int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BY
 
 }
 
+int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return rig_tracks_r(&ctx, track_buffer, track_density, track_length, track_alignment);
+}
+
 int compare_extension(unsigned char * filename, unsigned char * extension)
 {
 	unsigned char *dot;
@@ -1351,6 +2556,119 @@ int compare_extension(unsigned char * filename, unsigned char * extension)
 		return (0);
 }
 
+/* extensions of the image files taken from a directory */
+static int
+is_image_name(char *filename)
+{
+	return (compare_extension((unsigned char *) filename, (unsigned char *) "D64")) || (compare_extension((unsigned char *) filename, (unsigned char *) "G64")) ||
+		(compare_extension((unsigned char *) filename, (unsigned char *) "NIB")) || (compare_extension((unsigned char *) filename, (unsigned char *) "NBZ")) ||
+		(compare_extension((unsigned char *) filename, (unsigned char *) "NBZ2")) || (compare_extension((unsigned char *) filename, (unsigned char *) "NB2"));
+}
+
+static int
+add_name(char *filename, char ***names, int *count)
+{
+	char **list;
+
+	if (!(list = realloc(*names, (*count + 1) * sizeof(char *))))
+		return 0;
+	*names = list;
+
+	if (!(list[*count] = malloc(strlen(filename) + 1)))
+		return 0;
+	strcpy(list[*count], filename);
+	(*count)++;
+	return 1;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+	Add filename to names, or every image file in the tree below it when
+	it is a directory.  A name starting with '@' is a list file with one
+	name per line.  Directory entries are sorted so that runs over the
+	same tree come out in the same order.  Returns 0 on errors.
+*/
+int
+collect_images(char *filename, char ***names, int *count)
+{
+	char line[256];
+	FILE *list;
+	int result = 1;
+#ifdef ARCH_DIRS
+	char path[1024];
+	struct stat st;
+	arch_dir dir;
+	arch_dir_entry entry;
+	int first;
+#endif
+
+	if (filename[0] == '@')
+	{
+		if (!(list = fopen(filename + 1, "r")))
+		{
+			printf("Couldn't open list file %s!\n", filename + 1);
+			return 0;
+		}
+
+		while (fgets(line, sizeof(line), list))
+		{
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0])
+				result &= collect_images(line, names, count);
+		}
+		fclose(list);
+		return result;
+	}
+
+#ifdef ARCH_DIRS
+	if (arch_is_dir(filename, &st))
+	{
+		if (!(dir = arch_dir_open(filename)))
+		{
+			printf("Couldn't open directory %s!\n", filename);
+			return 0;
+		}
+
+		first = *count;
+		while ((entry = arch_dir_read(dir)))
+		{
+			if (arch_dir_name(entry)[0] == '.')
+				continue;
+
+			if (strlen(filename) + strlen(arch_dir_name(entry)) + 2 > sizeof(path))
+			{
+				printf("Path name too long in %s\n", filename);
+				result = 0;
+				continue;
+			}
+			strcpy(path, filename);
+			strcat(path, "/");
+			strcat(path, arch_dir_name(entry));
+
+			if ((arch_is_dir(path, &st)) || (is_image_name(path)))
+				result &= collect_images(path, names, count);
+		}
+		arch_dir_close(dir);
+
+		/* full paths, so the whole tree below comes out in path order */
+		qsort(*names + first, *count - first, sizeof(char *), compare_names);
+		return result;
+	}
+#endif
+
+	if (!add_name(filename, names, count))
+	{
+		printf("Error: Could not allocate memory for file names.\n");
+		return 0;
+	}
+	return 1;
+}
+
 int write_dword(FILE *fd, DWORD * buf, int num)
 {
 	int i;
@@ -1376,6 +2694,14 @@ int write_dword(FILE *fd, DWORD * buf, int num)
 }
 
 unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return crc_dir_track_r(&ctx, track_buffer, track_length);
+}
+
+unsigned int crc_dir_track_r(align_context *ctx, BYTE *track_buffer, size_t *track_length)
 {
 	/* this calculates a CRC32 for the BAM and first directory sector, which is sufficient to differentiate most disks */
 
@@ -1390,7 +2716,7 @@ unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length)
 	/* get disk id */
 	if (!extract_id(track_buffer + (18 * 2 * NIB_TRACK_LENGTH), id))
 	{
-		printf("Cannot find directory sector.\n");
+		align_printf(ctx, "Cannot find directory sector.\n");
 		return 0;
 	}
 
@@ -1417,6 +2743,14 @@ unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length)
 }
 
 unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return crc_all_tracks_r(&ctx, track_buffer, track_length);
+}
+
+unsigned int crc_all_tracks_r(align_context *ctx, BYTE *track_buffer, size_t *track_length)
 {
 	/* this calculates a CRC32 for all sectors on the disk */
 
@@ -1426,6 +2760,7 @@ unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
 	BYTE id[3];
 	BYTE rawdata[260];
 	BYTE errorcode;
+	sector_index secindex;
 
 	memset(data, 0, sizeof(data));
 	crcInit();
@@ -1433,21 +2768,23 @@ unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
 	/* get disk id */
 	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
 	{
-		printf("Cannot find directory sector.\n");
+		align_printf(ctx, "Cannot find directory sector.\n");
 		return 0;
 	}
 
 	index = valid = 0;
 	for (track = start_track; track <= 35*2; track += 2)
 	{
+		index_GCR_sectors(
+			track_buffer + (track * NIB_TRACK_LENGTH),
+			track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
+			track/2, id, &secindex);
+
 		for (sector = 0; sector < sector_map[track/2]; sector++)
 		{
 			memset(rawdata, 0, sizeof(rawdata));
 
-			errorcode = convert_GCR_sector(
-				track_buffer + (track * NIB_TRACK_LENGTH),
-				track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-				rawdata, track/2, sector, id);
+			errorcode = convert_indexed_sector(&secindex, sector, rawdata);
 
 			memcpy(data+(index*256), rawdata+1, 256);
 			index++;
@@ -1458,13 +2795,21 @@ unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
 	}
 
 	if(index != valid)
-		if(verbose) printf("[%d/%d sectors] ", valid, index);
+		if(ctx->verbose) align_printf(ctx, "[%d/%d sectors] ", valid, index);
 
 	result = crcFast(data, sizeof(data));
 	return result;
 }
 
 unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned char *result)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return md5_dir_track_r(&ctx, track_buffer, track_length, result);
+}
+
+unsigned int md5_dir_track_r(align_context *ctx, BYTE *track_buffer, size_t *track_length, unsigned char *result)
 {
 	/* this calculates a MD5 hash of the BAM and first directory sector, which is sufficient to differentiate most disks */
 
@@ -1479,7 +2824,7 @@ unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned ch
 	/* get disk id */
 	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
 	{
-		printf("Cannot find directory sector.\n");
+		align_printf(ctx, "Cannot find directory sector.\n");
 		return 0;
 	}
 
@@ -1504,6 +2849,14 @@ unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned ch
 }
 
 unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned char *result)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	return md5_all_tracks_r(&ctx, track_buffer, track_length, result);
+}
+
+unsigned int md5_all_tracks_r(align_context *ctx, BYTE *track_buffer, size_t *track_length, unsigned char *result)
 {
 	/* this calculates an MD5 hash for all sectors on the disk */
 
@@ -1512,6 +2865,7 @@ unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned c
 	BYTE id[3];
 	BYTE rawdata[260];
 	BYTE errorcode;
+	sector_index secindex;
 
 	crcInit();
 	memset(data, 0, sizeof(data));
@@ -1519,21 +2873,23 @@ unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned c
 	/* get disk id */
 	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
 	{
-		printf("Cannot find directory sector.\n");
+		align_printf(ctx, "Cannot find directory sector.\n");
 		return 0;
 	}
 
 	index = valid = 0;
 	for (track = start_track; track <= 35*2; track += 2)
 	{
+		index_GCR_sectors(
+			track_buffer + (track * NIB_TRACK_LENGTH),
+			track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
+			track/2, id, &secindex);
+
 		for (sector = 0; sector < sector_map[track/2]; sector++)
 		{
 			memset(rawdata, 0, sizeof(rawdata));
 
-			errorcode = convert_GCR_sector(
-				track_buffer + (track * NIB_TRACK_LENGTH),
-				track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-				rawdata, track/2, sector, id);
+			errorcode = convert_indexed_sector(&secindex, sector, rawdata);
 
 			memcpy(data+(index*256), rawdata+1, 256);
 			index++;
@@ -1544,7 +2900,7 @@ unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned c
 	}
 
 	if(index != valid)
-		if(verbose) printf("[%d/%d sectors] ", valid, index);
+		if(ctx->verbose) align_printf(ctx, "[%d/%d sectors] ", valid, index);
 
 	md5(data, sizeof(data), result);
 	return 1;
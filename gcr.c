@@ -21,10 +21,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <assert.h>
 #include "gcr.h"
 #include "prot.h"
 #include "crc.h"
 
+extern int fix_gcr;
+extern int reduce_sync;
+extern int sync_align_buffer;
+extern int fattrack;
+extern int align_jobs;
+extern BYTE fillbyte;
+
+#if defined(_MSC_VER) && (_MSC_VER < 1900)
+#define vsnprintf _vsnprintf
+#endif
+
 BYTE sector_map[MAX_TRACKS_1541 + 1] = {
 	0,
 	21, 21, 21, 21, 21, 21, 21, 21, 21, 21,	/*  1 - 10 */
@@ -74,6 +87,96 @@ BYTE reduce_map[MAX_TRACKS_1541 + 1] = {
 
 char alignments[][20] = { "NONE", "GAP", "SEC0", "SYNC", "BADGCR", "VMAX", "AUTO", "VMAX-CW", "RAW", "PIRATESLAYER", "RAPIDLOK"};
 
+/*
+	The plain functions run the pipeline with the command line globals,
+	through one shared context that also keeps the RapidLok TV standard
+	between tracks.
+*/
+static align_context global_context;
+
+void
+init_align_context(align_context * ctx)
+{
+	memset(ctx, 0, sizeof(align_context));
+	ctx->gap_match_length = gap_match_length;
+	ctx->cap_min_ignore = cap_min_ignore;
+	ctx->fix_gcr = fix_gcr;
+	ctx->reduce_sync = reduce_sync;
+	ctx->verbose = verbose;
+	ctx->align_map = align_map;
+	ctx->reduce_map = reduce_map;
+	ctx->sync_align_buffer = sync_align_buffer;
+	ctx->fattrack = fattrack;
+	ctx->jobs = align_jobs;
+	memcpy(ctx->capacity, capacity, sizeof(ctx->capacity));
+	ctx->fillbyte = fillbyte;
+	ctx->log = stdout;
+}
+
+align_context *
+default_align_context(void)
+{
+	int rl_tv;
+
+	rl_tv = global_context.rl_tv;
+	init_align_context(&global_context);
+	global_context.rl_tv = rl_tv;
+	return &global_context;
+}
+
+/* text of any length, such as the collected output of another context */
+void
+align_puts(align_context * ctx, const char *text)
+{
+	char *grown;
+	size_t len;
+
+	if (ctx->buffered)
+	{
+		/* keep the output of a worker until it can be printed in order */
+		len = strlen(text);
+		if (ctx->log_used + len + 1 > ctx->log_size)
+		{
+			if (!(grown = realloc(ctx->log_buffer, (ctx->log_used + len + 1) * 2)))
+				return;
+			ctx->log_buffer = grown;
+			ctx->log_size = (ctx->log_used + len + 1) * 2;
+		}
+		memcpy(ctx->log_buffer + ctx->log_used, text, len + 1);
+		ctx->log_used += len;
+		return;
+	}
+
+	if (ctx->log != NULL)
+		fputs(text, ctx->log);
+}
+
+void
+align_printf(align_context * ctx, const char *format, ...)
+{
+	va_list args;
+
+	char line[1024];
+
+	if (ctx->buffered)
+	{
+		line[sizeof(line) - 1] = '\0';
+		va_start(args, format);
+		vsnprintf(line, sizeof(line) - 1, format, args);
+		va_end(args);
+
+		align_puts(ctx, line);
+		return;
+	}
+
+	if (ctx->log == NULL)
+		return;
+
+	va_start(args, format);
+	vfprintf(ctx->log, format, args);
+	va_end(args);
+}
+
 /* Burst Nibbler defaults
 size_t capacity_min[] = 		{ 6183, 6598, 7073, 7616 };
 size_t capacity[] = 				{ 6231, 6646, 7121, 7664 };
@@ -164,6 +267,126 @@ find_header(BYTE ** gcr_pptr, BYTE * gcr_end)
 	return (*gcr_pptr < gcr_end);
 }
 
+/* any byte of the word is 0xff */
+#define HAS_FF_BYTE(w) ((~(w) - 0x01010101) & (w) & 0x80808080)
+
+void
+build_sync_map(BYTE * buffer, BYTE * end, sync_map * map)
+{
+	size_t len, pos, run;
+	DWORD word;
+
+	map->buffer = buffer;
+	map->end = end;
+	map->overflow = 0;
+	map->syncs = map->headers = map->marks = 0;
+
+	if (end <= buffer)
+		return;
+
+	len = end - buffer;
+	if (len > NIB_TRACK_LENGTH)
+	{
+		map->overflow = 1;
+		return;
+	}
+
+	pos = 0;
+	while (pos < len)
+	{
+		/* skip a word at a time until one holds a 0xff byte */
+		while (pos + 4 <= len)
+		{
+			memcpy(&word, buffer + pos, 4);
+			if (HAS_FF_BYTE(word))
+				break;
+			pos += 4;
+		}
+		while (pos < len && buffer[pos] != 0xff)
+			pos++;
+		if (pos >= len)
+			break;
+
+		for (run = pos; run < len && buffer[run] == 0xff; run++);
+
+		/* same rule as find_sync(), a sync can be short a bit */
+		if ((pos > 0 && (buffer[pos - 1] & 0x01)) || (run - pos >= 2))
+		{
+			map->sync_start[map->syncs] = (pos > 0 && (buffer[pos - 1] & 0x01)) ? pos - 1 : pos;
+			map->sync_end[map->syncs] = run;
+			map->syncs++;
+
+			if (run < len && buffer[run] == 0x52)
+				map->header_end[map->headers++] = run;
+		}
+
+		if (run < len && buffer[run] == 0x52)
+			map->mark[map->marks++] = run - 1;
+
+		pos = run + 1;
+	}
+}
+
+/* first entry of list whose sync can still be found from pos */
+static int
+search_sync_list(unsigned short *list, int entries, size_t pos)
+{
+	int low, high, mid;
+
+	low = 0;
+	high = entries;
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+		/* the last byte that starts a sync of this run is 2 bytes before its end */
+		if ((size_t) list[mid] < pos + 2)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* same as find_sync(gcr_pptr, map->end), without rescanning */
+int
+map_find_sync(sync_map * map, BYTE ** gcr_pptr)
+{
+	int i;
+
+	if (map->overflow || *gcr_pptr < map->buffer)
+		return find_sync(gcr_pptr, map->end);
+
+	i = search_sync_list(map->sync_end, map->syncs, *gcr_pptr - map->buffer);
+	if (i >= map->syncs)
+	{
+		*gcr_pptr = map->end;
+		return 0;
+	}
+
+	*gcr_pptr = map->buffer + map->sync_end[i];
+	return (*gcr_pptr < map->end);
+}
+
+/* same as find_header(gcr_pptr, map->end), without rescanning */
+int
+map_find_header(sync_map * map, BYTE ** gcr_pptr)
+{
+	int i;
+
+	if (map->overflow || *gcr_pptr < map->buffer)
+		return find_header(gcr_pptr, map->end);
+
+	i = search_sync_list(map->header_end, map->headers, *gcr_pptr - map->buffer);
+	if (i >= map->headers)
+	{
+		*gcr_pptr = map->end;
+		return 0;
+	}
+
+	*gcr_pptr = map->buffer + map->header_end[i] - 1;
+	return 1;
+}
+
 void
 convert_4bytes_to_GCR(BYTE * buffer, BYTE * ptr)
 {
@@ -192,6 +415,55 @@ convert_4bytes_to_GCR(BYTE * buffer, BYTE * ptr)
 	*ptr |= GCR_conv_data[(*buffer) & 0x0f];
 }
 
+/* byte to GCR pair (10 bits) conversion table */
+static unsigned short GCR_encode_pair[256];
+static int GCR_encode_pair_ready = 0;
+
+static void
+init_GCR_encode_pair(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		GCR_encode_pair[i] = (GCR_conv_data[i >> 4] << 5) | GCR_conv_data[i & 0x0f];
+
+	GCR_encode_pair_ready = 1;
+}
+
+/*
+ * Encode 'groups' groups of 4 bytes into 5 GCR bytes each.
+ * Every byte is converted by a single table lookup and the four 10 bit
+ * pairs of a group are packed in one 32 bit word plus one byte.
+ * Gives the same result as calling convert_4bytes_to_GCR() per group.
+ */
+void
+convert_block_to_GCR(BYTE * plain, BYTE * gcr, int groups)
+{
+	DWORD word;
+	unsigned short last;
+	int i;
+
+	if (!GCR_encode_pair_ready)
+		init_GCR_encode_pair();
+
+	for (i = 0; i < groups; i++)
+	{
+		last = GCR_encode_pair[plain[3]];
+		word = ((DWORD) GCR_encode_pair[plain[0]] << 22) |
+			((DWORD) GCR_encode_pair[plain[1]] << 12) |
+			((DWORD) GCR_encode_pair[plain[2]] << 2) | (last >> 8);
+
+		gcr[0] = (BYTE) (word >> 24);
+		gcr[1] = (BYTE) (word >> 16);
+		gcr[2] = (BYTE) (word >> 8);
+		gcr[3] = (BYTE) word;
+		gcr[4] = (BYTE) last;
+
+		plain += 4;
+		gcr += 5;
+	}
+}
+
 int
 convert_4bytes_from_GCR(BYTE * gcr, BYTE * plain)
 {
@@ -229,6 +501,116 @@ convert_4bytes_from_GCR(BYTE * gcr, BYTE * plain)
 	return (nConverted);
 }
 
+/* GCR pair (10 bits) to byte, 0x200/0x100 flag a bad high/low quintet */
+static unsigned short GCR_decode_pair[1024];
+static int GCR_decode_pair_ready = 0;
+
+static void
+init_GCR_decode_pair(void)
+{
+	BYTE hnibble, lnibble;
+	int i;
+
+	for (i = 0; i < 1024; i++)
+	{
+		hnibble = GCR_decode_high[i >> 5];
+		lnibble = GCR_decode_low[i & 0x1f];
+
+		GCR_decode_pair[i] = hnibble | lnibble;
+		if (hnibble == 0xff)
+			GCR_decode_pair[i] |= 0x200;
+		if (lnibble == 0xff)
+			GCR_decode_pair[i] |= 0x100;
+	}
+	GCR_decode_pair_ready = 1;
+}
+
+/*
+	Build the conversion tables that are otherwise made on first use.
+	Call it before starting threads that convert GCR.
+*/
+void
+init_GCR_tables(void)
+{
+	if (!GCR_encode_pair_ready)
+		init_GCR_encode_pair();
+	if (!GCR_decode_pair_ready)
+		init_GCR_decode_pair();
+}
+
+/*
+ * Decode a whole GCR data block (65 groups, 325 bytes) into 260 bytes in one pass.
+ * Each 5 byte group is split into four 10 bit pairs that are decoded by a single
+ * table lookup each, which gives the same bytes as convert_4bytes_from_GCR().
+ * If given, badmap receives one byte per group with a bit set for every invalid
+ * quintet (first quintet in bit 7), and checksum the XOR of data bytes 1-256.
+ * Returns the number of invalid quintets.
+ */
+int
+convert_GCR_block(BYTE * gcr, BYTE * plain, BYTE * badmap, BYTE * checksum)
+{
+	unsigned short pair[4];
+	DWORD word;
+	BYTE chksum, flags;
+	int i, j, bad;
+
+	if (!GCR_decode_pair_ready)
+		init_GCR_decode_pair();
+
+	bad = 0;
+	chksum = 0;
+
+	for (i = 0; i < 65; i++)
+	{
+		word = ((DWORD) gcr[0] << 24) | ((DWORD) gcr[1] << 16) | ((DWORD) gcr[2] << 8) | gcr[3];
+
+		pair[0] = GCR_decode_pair[word >> 22];
+		pair[1] = GCR_decode_pair[(word >> 12) & 0x3ff];
+		pair[2] = GCR_decode_pair[(word >> 2) & 0x3ff];
+		pair[3] = GCR_decode_pair[((word & 0x03) << 8) | gcr[4]];
+
+		flags = 0;
+		for (j = 0; j < 4; j++)
+		{
+			plain[j] = (BYTE) pair[j];
+			chksum ^= plain[j];
+			flags = (flags << 2) | (pair[j] >> 8);
+			bad += (pair[j] >> 9) + ((pair[j] >> 8) & 1);
+		}
+
+		if (badmap != NULL)
+			badmap[i] = flags;
+
+		gcr += 5;
+		plain += 4;
+	}
+
+	/* only bytes 1-256 are covered by the block checksum */
+	plain -= 260;
+	if (checksum != NULL)
+		*checksum = chksum ^ plain[0] ^ plain[257] ^ plain[258] ^ plain[259];
+
+	return bad;
+}
+
+/*
+ * is_bad_gcr() for four bytes at once: a zero bit whose two predecessors in
+ * the stream are zero ends a "000" run.  lastbits are the low two bits of
+ * the byte before.  Returns one bit per bad byte, the first one in bit 0.
+ */
+static DWORD
+badgcr_bits(DWORD data, DWORD lastbits)
+{
+	DWORD zero, bad;
+
+	zero = ~data;
+	bad = zero & ((zero >> 1) | ((~lastbits & 1) << 31)) & ((zero >> 2) | ((~lastbits & 3) << 30));
+
+	/* set the top bit of every non-zero byte, then gather them */
+	bad = (((bad & 0x7f7f7f7f) + 0x7f7f7f7f) | bad) & 0x80808080;
+	return (bad >> 31) | ((bad >> 22) & 2) | ((bad >> 13) & 4) | ((bad >> 4) & 8);
+}
+
 int
 extract_id(BYTE * gcr_track, BYTE * id)
 {
@@ -281,26 +663,13 @@ extract_cosmetic_id(BYTE * gcr_track, BYTE * id)
 	return 1;
 }
 
-BYTE
-convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track, int sector, BYTE *id)
+/* initialize sector data with Original Format Pattern */
+static void
+init_GCR_sector(BYTE *d64_sector)
 {
- 	// we should later try to repair some common GCR errors
- 	//	1) tri-bit error, in which 01110 is misinterpreted as 01000
-	// 2) low frequency error, in which 10010 is misinterpreted as 11000
-
-	BYTE header[10];        /* block header */
-	BYTE hdr_chksum;        /* header checksum */
-	BYTE blk_chksum;        /* block  checksum */
-	BYTE *gcr_ptr, *gcr_end;
-	BYTE *sectordata;
-	BYTE error_code;
-	size_t track_len;
-	int i, j;
-
-	if ((gcr_cycle == NULL) || (gcr_cycle <= gcr_start))
-		return SYNC_NOT_FOUND;
+	BYTE blk_chksum;
+	int i;
 
-	/* initialize sector data with Original Format Pattern */
 	memset(d64_sector, 0x01, 260);
 	d64_sector[0] = 0x07;   /* Block header mark */
 	d64_sector[1] = 0x4b;   /* Use Original Format Pattern */
@@ -308,44 +677,17 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 	for (blk_chksum = 0, i = 1; i < 257; i++)
 		blk_chksum ^= d64_sector[i + 1];
 	d64_sector[257] = blk_chksum;
+}
 
-	/* setup pointers */
-	track_len = gcr_cycle - gcr_start;
-	gcr_ptr = gcr_start;
-	gcr_end = gcr_start + track_len;
-	error_code = SECTOR_OK;
-
-	/* Check for at least one Sync */
-	if (!find_sync(&gcr_ptr, gcr_end))
-		return SYNC_NOT_FOUND;
-
-	/* Try to find a good block header for Track/Sector */
-	error_code = HEADER_NOT_FOUND;
-
-	//for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-1; gcr_ptr++)
-	for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-10; gcr_ptr++)
-	{
-		if ((gcr_ptr[0] == 0xff) && (gcr_ptr[1] == 0x52))
-		{
-			gcr_ptr++;
-			memset(header, 0, 10);
-
-			convert_4bytes_from_GCR(gcr_ptr, header);
-			convert_4bytes_from_GCR(gcr_ptr+5, header+4);
-
-			if ((header[0] == 0x08) && (header[2] == sector) && (header[3] == track) )
-			{
-				/* this is the header we are searching for */
-				error_code = SECTOR_OK;
-				break;
-			}
-			if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
-				gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
-		}
-	}
+/* check a decoded block header, gcr_ptr points to the 0x52 header byte */
+static BYTE
+check_GCR_header(BYTE *gcr_ptr, BYTE *header, BYTE *id)
+{
+	BYTE hdr_chksum;
+	BYTE error_code;
+	int i, j;
 
-	if(error_code != SECTOR_OK)
-		return error_code;
+	error_code = SECTOR_OK;
 
 	/* Header checksum calc */
 	hdr_chksum = 0;
@@ -365,30 +707,44 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 		if (is_bad_gcr(gcr_ptr - 1, 10, j))
 			error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
 	}
+	return error_code;
+}
 
-	/* done with header checks */
-	if((error_code != SECTOR_OK) && (error_code != ID_MISMATCH))
-		return error_code;
-
-	/* check for data sector, it will always be the data following header */
+/* find the data block following the header at gcr_ptr, wrapping to the start of the cycle once */
+static BYTE *
+find_GCR_data(BYTE *gcr_ptr, BYTE *gcr_start, BYTE *gcr_end)
+{
 	if (!find_sync(&gcr_ptr, gcr_end))
 	{
 		gcr_ptr = gcr_start;
 		if (!find_sync(&gcr_ptr, gcr_end))
-			return DATA_NOT_FOUND;
+			return NULL;
 	}
+	return gcr_ptr;
+}
 
-	for (i = 0, sectordata = d64_sector; i < 65; i++)
-	{
-		convert_4bytes_from_GCR(gcr_ptr, sectordata);
+/* decode and verify the 325 byte data block at gcr_ptr */
+static BYTE
+convert_GCR_data(BYTE *gcr_ptr, BYTE *d64_sector, BYTE error_code)
+{
+	BYTE blk_chksum;        /* block  checksum */
+	BYTE *gcr_group, *sectordata;
+	DWORD data, lastbits;
+	int i, j;
 
-		if(verbose>3)
+	convert_GCR_block(gcr_ptr, d64_sector, NULL, &blk_chksum);
+
+	if(verbose>3)
+	{
+		for (i = 0, gcr_group = gcr_ptr, sectordata = d64_sector; i < 65; i++)
+		{
 			printf("%.4x: %.2x%.2x%.2x%.2x%.2x --- %.2x%.2x%.2x%.2x\n", (i*4),
-				gcr_ptr[0], gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4],
+				gcr_group[0], gcr_group[1], gcr_group[2], gcr_group[3], gcr_group[4],
 				sectordata[0], sectordata[1], sectordata[2], sectordata[3]);
 
-		gcr_ptr += 5;
-		sectordata += 4;
+			gcr_group += 5;
+			sectordata += 4;
+		}
 	}
 
 	/* check for Block header mark */
@@ -398,38 +754,379 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 		if(verbose>3) printf("\nIncorrect Block Header: 0x%.2x != 0x07\n", d64_sector[0]);
 	}
 
-	/* Block checksum calc */
-	for (i = 1, blk_chksum = 0; i <= 256; i++)
-		blk_chksum ^= d64_sector[i];
-
 	if (blk_chksum != d64_sector[257])
 		error_code = (error_code == SECTOR_OK) ? BAD_DATA_CHECKSUM : error_code;
 
 	/* verify that our data contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 320; j++)
+	/* the first byte follows the last one, as in is_bad_gcr() */
+	lastbits = gcr_ptr[319] & 0x03;
+	for(j = 0; j < 320; j += 4)
 	{
-		if (is_bad_gcr(gcr_ptr - 325, 320, j))
+		data = ((DWORD)gcr_ptr[j] << 24) | ((DWORD)gcr_ptr[j + 1] << 16) |
+			((DWORD)gcr_ptr[j + 2] << 8) | (DWORD)gcr_ptr[j + 3];
+		if (badgcr_bits(data, lastbits))
+		{
 			error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
+			break;
+		}
+		lastbits = data & 0x03;
 	}
 	return error_code;
 }
 
-void
-convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * diskID, int error)
+BYTE
+convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track, int sector, BYTE *id)
 {
-	int i;
-	BYTE buf[4], databuf[0x104], chksum;
-	BYTE tempID[3];
+ 	// we should later try to repair some common GCR errors
+ 	//	1) tri-bit error, in which 01110 is misinterpreted as 01000
+	// 2) low frequency error, in which 10010 is misinterpreted as 11000
 
-	memcpy(tempID, diskID, 3);
-	memset(ptr, 0x55, SECTOR_SIZE + sector_gap_length[track]);	/* 'unformat' GCR sector */
+	BYTE header[10];        /* block header */
+	BYTE *gcr_ptr, *gcr_end;
+	BYTE error_code;
+	size_t track_len;
 
-	if (error == SYNC_NOT_FOUND)
-		return;
+	if ((gcr_cycle == NULL) || (gcr_cycle <= gcr_start))
+		return SYNC_NOT_FOUND;
 
-	if (error == HEADER_NOT_FOUND)
-	{
-		ptr += 24;
+	init_GCR_sector(d64_sector);
+
+	/* setup pointers */
+	track_len = gcr_cycle - gcr_start;
+	gcr_ptr = gcr_start;
+	gcr_end = gcr_start + track_len;
+	error_code = SECTOR_OK;
+
+	/* Check for at least one Sync */
+	if (!find_sync(&gcr_ptr, gcr_end))
+		return SYNC_NOT_FOUND;
+
+	/* Try to find a good block header for Track/Sector */
+	error_code = HEADER_NOT_FOUND;
+
+	//for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-1; gcr_ptr++)
+	for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-10; gcr_ptr++)
+	{
+		if ((gcr_ptr[0] == 0xff) && (gcr_ptr[1] == 0x52))
+		{
+			gcr_ptr++;
+			memset(header, 0, 10);
+
+			convert_4bytes_from_GCR(gcr_ptr, header);
+			convert_4bytes_from_GCR(gcr_ptr+5, header+4);
+
+			if ((header[0] == 0x08) && (header[2] == sector) && (header[3] == track) )
+			{
+				/* this is the header we are searching for */
+				error_code = SECTOR_OK;
+				break;
+			}
+			if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
+				gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
+		}
+	}
+
+	if(error_code != SECTOR_OK)
+		return error_code;
+
+	error_code = check_GCR_header(gcr_ptr, header, id);
+
+	/* done with header checks */
+	if((error_code != SECTOR_OK) && (error_code != ID_MISMATCH))
+		return error_code;
+
+	/* check for data sector, it will always be the data following header */
+	if ((gcr_ptr = find_GCR_data(gcr_ptr, gcr_start, gcr_end)) == NULL)
+		return DATA_NOT_FOUND;
+
+	return convert_GCR_data(gcr_ptr, d64_sector, error_code);
+}
+
+/*
+ * Index all sector headers of a track cycle in a single pass, so callers
+ * that want every sector on the track don't rescan it once per sector.
+ * Results are identical to calling convert_GCR_sector() for each sector.
+ */
+static void
+build_sector_index(BYTE *gcr_start, BYTE *gcr_cycle, int track, BYTE *id, sector_index *index)
+{
+	BYTE header[10];
+	BYTE *gcr_ptr;
+	int sector, mark;
+	sync_map map;
+
+	memset(index, 0, sizeof(sector_index));
+	index->gcr_start = gcr_start;
+	index->gcr_end = gcr_cycle;
+	index->track = track;
+	memcpy(index->id, id, 2);
+
+	if ((gcr_cycle == NULL) || (gcr_cycle <= gcr_start))
+		return;
+	index->valid = 1;
+
+	build_sync_map(gcr_start, gcr_cycle, &map);
+
+	/* Check for at least one Sync */
+	gcr_ptr = gcr_start;
+	if (!map_find_sync(&map, &gcr_ptr))
+		return;
+	index->has_sync = 1;
+
+	/* first good block header for each sector wins, same as convert_GCR_sector() */
+	for (mark = 0, gcr_ptr = gcr_start; gcr_ptr < gcr_cycle-10; gcr_ptr++)
+	{
+		if (!map.overflow)
+		{
+			/* jump to the next 0xff 0x52 pair of the map */
+			if (mark >= map.marks)
+				break;
+			gcr_ptr = gcr_start + map.mark[mark++];
+			if (gcr_ptr >= gcr_cycle-10)
+				break;
+		}
+
+		if ((gcr_ptr[0] == 0xff) && (gcr_ptr[1] == 0x52))
+		{
+			gcr_ptr++;
+			memset(header, 0, 10);
+
+			convert_4bytes_from_GCR(gcr_ptr, header);
+			convert_4bytes_from_GCR(gcr_ptr+5, header+4);
+
+			sector = header[2];
+			if ((header[0] != 0x08) || (header[3] != track) ||
+				(sector >= SECTOR_INDEX_SIZE) || (index->header[sector] != NULL))
+			{
+				if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
+					gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
+				continue;
+			}
+
+			index->header[sector] = gcr_ptr;
+			index->header_error[sector] = check_GCR_header(gcr_ptr, header, id);
+			index->data[sector] = find_GCR_data(gcr_ptr, gcr_start, gcr_cycle);
+			index->sectors++;
+		}
+	}
+}
+
+/* decode a sector from the index, without going through the cache */
+static BYTE
+decode_indexed_sector(sector_index *index, int sector, BYTE *d64_sector)
+{
+	BYTE error_code;
+
+	init_GCR_sector(d64_sector);
+
+	if (!index->has_sync)
+		return SYNC_NOT_FOUND;
+
+	if (index->header[sector] == NULL)
+		return HEADER_NOT_FOUND;
+
+	error_code = index->header_error[sector];
+
+	/* done with header checks */
+	if((error_code != SECTOR_OK) && (error_code != ID_MISMATCH))
+		return error_code;
+
+	if (index->data[sector] == NULL)
+		return DATA_NOT_FOUND;
+
+	return convert_GCR_data(index->data[sector], d64_sector, error_code);
+}
+
+/*
+ * Decoded-sector cache for the track buffers of loaded images.
+ * Analysis passes (error/empty checks, CRC, MD5, compares) decode the same
+ * sectors over and over, so once an image is attached the index and the
+ * decoded sectors of each of its halftracks are kept until the track
+ * buffer is modified.  Buffers that are not attached are never cached.
+ *
+ * The cache is not locked.  Images are only attached and flushed while no
+ * worker threads run, workers (-j) use it for the halftracks they own,
+ * every halftrack has a slot of its own.
+ */
+#define SECTOR_CACHE_IMAGES 2
+
+struct sector_cache
+{
+	int filled;
+	sector_index index;
+	BYTE decoded[SECTOR_INDEX_SIZE];
+	BYTE error[SECTOR_INDEX_SIZE];
+	BYTE data[SECTOR_INDEX_SIZE][260];
+};
+
+static BYTE *cache_image[SECTOR_CACHE_IMAGES];
+static int cache_next_image;
+static struct sector_cache cache_tracks[SECTOR_CACHE_IMAGES][MAX_HALFTRACKS_1541 + 2];
+
+/* attached image whose track buffer gcrdata points into, or -1 */
+static int
+find_cached_image(BYTE *gcrdata)
+{
+	int image;
+
+	for (image = 0; image < SECTOR_CACHE_IMAGES; image++)
+	{
+		if ((cache_image[image] != NULL) && (gcrdata >= cache_image[image]) &&
+			((size_t)(gcrdata - cache_image[image]) < (MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH))
+			return image;
+	}
+	return -1;
+}
+
+/* find cache slot for a track buffer, NULL if it isn't the start of an attached halftrack */
+static struct sector_cache *
+find_sector_cache(BYTE *gcrdata)
+{
+	size_t offset;
+	int image;
+
+	if ((image = find_cached_image(gcrdata)) < 0)
+		return NULL;
+
+	offset = gcrdata - cache_image[image];
+	if (offset % NIB_TRACK_LENGTH)
+		return NULL;
+
+	return &cache_tracks[image][offset / NIB_TRACK_LENGTH];
+}
+
+/* start caching decoded sectors for an image's track buffer */
+void
+attach_sector_cache(BYTE *track_buffer)
+{
+	int image;
+
+	for (image = 0; image < SECTOR_CACHE_IMAGES; image++)
+	{
+		if (cache_image[image] == track_buffer)
+			break;
+	}
+
+	if (image == SECTOR_CACHE_IMAGES)
+	{
+		image = cache_next_image;
+		cache_next_image = (cache_next_image + 1) % SECTOR_CACHE_IMAGES;
+		cache_image[image] = track_buffer;
+	}
+
+	memset(cache_tracks[image], 0, sizeof(cache_tracks[image]));
+}
+
+/* drop everything cached */
+void
+flush_sector_cache(void)
+{
+	memset(cache_image, 0, sizeof(cache_image));
+	memset(cache_tracks, 0, sizeof(cache_tracks));
+	cache_next_image = 0;
+}
+
+/* cache slot still holds what was indexed for this track cycle */
+static int
+sector_cache_matches(struct sector_cache *cache, BYTE *gcr_cycle, int track, BYTE *id)
+{
+	return ((cache->filled) &&
+		(cache->index.gcr_end == gcr_cycle) && (cache->index.track == track) &&
+		(cache->index.id[0] == id[0]) && (cache->index.id[1] == id[1]));
+}
+
+/*
+	Track buffer is about to change, forget what was decoded from it.
+	gcrdata has to be the start of a halftrack, a pointer into the middle
+	of an attached buffer would leave its halftrack cached.
+*/
+void
+invalidate_sector_cache(BYTE *gcrdata)
+{
+	struct sector_cache *cache;
+
+	if ((cache = find_sector_cache(gcrdata)) != NULL)
+		cache->filled = 0;
+	else
+		assert(find_cached_image(gcrdata) < 0);
+}
+
+void
+index_GCR_sectors(BYTE *gcr_start, BYTE *gcr_cycle, int track, BYTE *id, sector_index *index)
+{
+	struct sector_cache *cache;
+
+	cache = find_sector_cache(gcr_start);
+
+	if ((cache != NULL) && sector_cache_matches(cache, gcr_cycle, track, id))
+	{
+		memcpy(index, &cache->index, sizeof(sector_index));
+		return;
+	}
+
+	build_sector_index(gcr_start, gcr_cycle, track, id, index);
+
+	if (cache != NULL)
+	{
+		index->cache = cache;
+		memcpy(&cache->index, index, sizeof(sector_index));
+		memset(cache->decoded, 0, sizeof(cache->decoded));
+		cache->filled = 1;
+	}
+}
+
+/* decode a sector through a track index built by index_GCR_sectors() */
+BYTE
+convert_indexed_sector(sector_index *index, int sector, BYTE *d64_sector)
+{
+	struct sector_cache *cache;
+	BYTE error_code;
+
+	if (!index->valid)
+		return SYNC_NOT_FOUND;
+
+	/* headers beyond the index can't be looked up, fall back to a scan */
+	if ((sector < 0) || (sector >= SECTOR_INDEX_SIZE))
+		return convert_GCR_sector(index->gcr_start, index->gcr_end, d64_sector, index->track, sector, index->id);
+
+	/* the cache slot is only trusted while it still holds this index */
+	cache = index->cache;
+	if ((cache != NULL) && !sector_cache_matches(cache, index->gcr_end, index->track, index->id))
+		cache = NULL;
+
+	if ((cache != NULL) && (cache->decoded[sector]))
+	{
+		memcpy(d64_sector, cache->data[sector], 260);
+		return cache->error[sector];
+	}
+
+	error_code = decode_indexed_sector(index, sector, d64_sector);
+
+	if (cache != NULL)
+	{
+		memcpy(cache->data[sector], d64_sector, 260);
+		cache->error[sector] = error_code;
+		cache->decoded[sector] = 1;
+	}
+	return error_code;
+}
+
+void
+convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * diskID, int error)
+{
+	int i;
+	BYTE buf[8], databuf[0x104], chksum;
+	BYTE tempID[3];
+
+	memcpy(tempID, diskID, 3);
+	memset(ptr, 0x55, SECTOR_SIZE + sector_gap_length[track]);	/* 'unformat' GCR sector */
+
+	if (error == SYNC_NOT_FOUND)
+		return;
+
+	if (error == HEADER_NOT_FOUND)
+	{
+		ptr += 24;
 	}
 	else
 	{
@@ -450,13 +1147,11 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 		if (error == BAD_HEADER_CHECKSUM)
 			buf[1] ^= 0xff;
 
-		convert_4bytes_to_GCR(buf, ptr);
-		ptr += 5;
-		buf[0] = tempID[1];
-		buf[1] = tempID[0];
-		buf[2] = buf[3] = 0x0f;
-		convert_4bytes_to_GCR(buf, ptr);
-		ptr += 5;
+		buf[4] = tempID[1];
+		buf[5] = tempID[0];
+		buf[6] = buf[7] = 0x0f;
+		convert_block_to_GCR(buf, ptr, 2);
+		ptr += HEADER_LENGTH;
 		memset(ptr, 0x55, HEADER_GAP_LENGTH);	/* Header Gap */
 		ptr += HEADER_GAP_LENGTH;
 	}
@@ -482,11 +1177,8 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 	databuf[0x102] = 0;	/* 2 bytes filler */
 	databuf[0x103] = 0;
 
-	for (i = 0; i < 65; i++)
-	{
-		convert_4bytes_to_GCR(databuf + (4 * i), ptr);
-		ptr += 5;
-	}
+	convert_block_to_GCR(databuf, ptr, 65);
+	ptr += DATA_LENGTH;
 
 	memset(ptr, 0x55, sector_gap_length[track]);	 /* tail gap*/
 	ptr += sector_gap_length[track];
@@ -494,8 +1186,93 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 	//ptr += SECTOR_GAP_LENGTH;
 }
 
+/*
+ * Build a whole standard track from its sectors (256 bytes each) directly
+ * into 'ptr', which is usually the track slot in the track buffer.
+ * errorinfo holds one error code per sector.  Returns the track length.
+ */
+size_t
+convert_track_to_GCR(BYTE * sectors, BYTE * ptr, int track, BYTE * diskID, BYTE * errorinfo)
+{
+	int sector;
+	size_t sector_len;
+
+	sector_len = SECTOR_SIZE + sector_gap_length[track];
+
+	for (sector = 0; sector < sector_map[track]; sector++)
+	{
+		convert_sector_to_GCR(sectors, ptr, track, sector, diskID, errorinfo[sector]);
+		sectors += 256;
+		ptr += sector_len;
+	}
+	return sector_map[track] * sector_len;
+}
+
+size_t
+find_track_cycle_headers_r(align_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+{
+	BYTE *nib_track;	/* start of nibbled track data */
+	BYTE *start_pos;	/* start of periodic area */
+	BYTE *cycle_pos;	/* start of cycle repetition */
+	BYTE *stop_pos;		/* maximum position allowed for cycle */
+	BYTE *data_pos;		/* cycle search variable */
+	BYTE *p1, *p2;		/* local pointers for comparisons */
+	sync_map map;		/* syncs of the track, scanned once */
+
+	nib_track = *cycle_start;
+	stop_pos = nib_track + NIB_TRACK_LENGTH - ctx->gap_match_length;
+	cycle_pos = NULL;
+
+	build_sync_map(nib_track, stop_pos, &map);
+
+	/* try to find a normal track cycle  */
+	for (start_pos = nib_track;; map_find_header(&map, &start_pos))
+	{
+		if ((data_pos = start_pos + cap_min) >= stop_pos)
+			break;	/* no cycle found */
+
+		while (map_find_header(&map, &data_pos))
+		{
+			p1 = start_pos;
+			cycle_pos = data_pos;
+
+			for (p2 = cycle_pos; p2 < stop_pos;)
+			{
+				/* try to match all remaining syncs, too */
+				if (memcmp(p1, p2, ctx->gap_match_length) != 0)
+				{
+					cycle_pos = NULL;
+					break;
+				}
+				if (!map_find_header(&map, &p1))
+					break;
+				if (!map_find_header(&map, &p2))
+					break;
+			}
+
+			if ((cycle_pos != NULL) && (check_valid_data(data_pos, ctx->gap_match_length)))
+			{
+				*cycle_start = start_pos;
+				*cycle_stop = cycle_pos;
+				return (cycle_pos - start_pos);
+			}
+		}
+	}
+
+	/* we got nothing useful, return it all */
+	*cycle_start = nib_track;
+	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
+	return NIB_TRACK_LENGTH;
+}
+
 size_t
 find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+{
+	return find_track_cycle_headers_r(default_align_context(), cycle_start, cycle_stop, cap_min, cap_max);
+}
+
+size_t
+find_track_cycle_syncs_r(align_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
 {
 	BYTE *nib_track;	/* start of nibbled track data */
 	BYTE *start_pos;	/* start of periodic area */
@@ -503,18 +1280,21 @@ find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min
 	BYTE *stop_pos;		/* maximum position allowed for cycle */
 	BYTE *data_pos;		/* cycle search variable */
 	BYTE *p1, *p2;		/* local pointers for comparisons */
+	sync_map map;		/* syncs of the track, scanned once */
 
 	nib_track = *cycle_start;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
+	stop_pos = nib_track + NIB_TRACK_LENGTH - ctx->gap_match_length;
 	cycle_pos = NULL;
 
+	build_sync_map(nib_track, stop_pos, &map);
+
 	/* try to find a normal track cycle  */
-	for (start_pos = nib_track;; find_header(&start_pos, stop_pos))
+	for (start_pos = nib_track;; map_find_sync(&map, &start_pos))
 	{
 		if ((data_pos = start_pos + cap_min) >= stop_pos)
 			break;	/* no cycle found */
 
-		while (find_header(&data_pos, stop_pos))
+		while (map_find_sync(&map, &data_pos))
 		{
 			p1 = start_pos;
 			cycle_pos = data_pos;
@@ -522,18 +1302,18 @@ find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min
 			for (p2 = cycle_pos; p2 < stop_pos;)
 			{
 				/* try to match all remaining syncs, too */
-				if (memcmp(p1, p2, gap_match_length) != 0)
+				if (memcmp(p1, p2, ctx->gap_match_length) != 0)
 				{
 					cycle_pos = NULL;
 					break;
 				}
-				if (!find_header(&p1, stop_pos))
+				if (!map_find_sync(&map, &p1))
 					break;
-				if (!find_header(&p2, stop_pos))
+				if (!map_find_sync(&map, &p2))
 					break;
 			}
 
-			if ((cycle_pos != NULL) && (check_valid_data(data_pos, gap_match_length)))
+			if ((cycle_pos != NULL) && (check_valid_data(data_pos, ctx->gap_match_length)))
 			{
 				*cycle_start = start_pos;
 				*cycle_stop = cycle_pos;
@@ -542,109 +1322,458 @@ find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min
 		}
 	}
 
-	/* we got nothing useful, return it all */
-	*cycle_start = nib_track;
-	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
-	return NIB_TRACK_LENGTH;
+	/* we got nothing useful, return it all */
+	*cycle_start = nib_track;
+	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
+	return NIB_TRACK_LENGTH;
+}
+
+size_t
+find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+{
+	return find_track_cycle_syncs_r(default_align_context(), cycle_start, cycle_stop, cap_min, cap_max);
+}
+
+/* rolling hash of gap_match_length bytes, folded to a bucket */
+#define CYCLE_HASH_BITS 12
+#define CYCLE_HASH_SIZE (1 << CYCLE_HASH_BITS)
+#define CYCLE_HASH_BASE 257
+#define CYCLE_NONE 0xffff
+
+size_t
+find_track_cycle_raw_r(align_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+{
+	BYTE *nib_track;	/* start of nibbled track data */
+	size_t positions;	/* number of match windows in the track */
+	size_t p1, p2;		/* window offsets for comparisons */
+	unsigned short bucket[NIB_TRACK_LENGTH];	/* hash bucket of each window */
+	unsigned short next[NIB_TRACK_LENGTH];		/* next valid window in the same bucket */
+	unsigned short head[CYCLE_HASH_SIZE];		/* first valid window not yet too close */
+	DWORD hash, power;
+	int i;
+
+	nib_track = *cycle_start;
+
+	if (ctx->gap_match_length < 0 || ctx->gap_match_length >= NIB_TRACK_LENGTH)
+		goto no_cycle;
+	positions = NIB_TRACK_LENGTH - ctx->gap_match_length;
+
+	/* hash all windows in one rolling pass */
+	for (hash = 0, power = 1, i = 0; i < ctx->gap_match_length; i++)
+	{
+		hash = hash * CYCLE_HASH_BASE + nib_track[i];
+		if (i) power *= CYCLE_HASH_BASE;
+	}
+	for (p1 = 0; p1 < positions; p1++)
+	{
+		bucket[p1] = (unsigned short)(((hash * 2654435761U) & 0xffffffffU) >> (32 - CYCLE_HASH_BITS));
+		if (ctx->gap_match_length)
+			hash = (hash - nib_track[p1] * power) * CYCLE_HASH_BASE + nib_track[p1 + ctx->gap_match_length];
+	}
+
+	/* chain the windows that can end a cycle, in ascending order */
+	memset(head, 0xff, sizeof(head));
+	for (p2 = positions; p2-- > 0;)
+	{
+		if (check_valid_data(nib_track + p2, ctx->gap_match_length))
+		{
+			next[p2] = head[bucket[p2]];
+			head[bucket[p2]] = (unsigned short) p2;
+		}
+	}
+
+	/*
+		Same search order as comparing every pair: the first start with any match,
+		then its nearest match at least cap_min + CAP_ALLOWANCE bytes away.
+		That distance only grows, so windows too close are dropped for good.
+	*/
+	for (p1 = 0; p1 < positions; p1++)
+	{
+		while ((head[bucket[p1]] != CYCLE_NONE) && (head[bucket[p1]] < p1 + cap_min + CAP_ALLOWANCE))
+			head[bucket[p1]] = next[head[bucket[p1]]];
+
+		for (p2 = head[bucket[p1]]; p2 != CYCLE_NONE; p2 = next[p2])
+		{
+			if (memcmp(nib_track + p1, nib_track + p2, ctx->gap_match_length) == 0)
+			{
+				*cycle_start = nib_track + p1;
+				*cycle_stop = nib_track + p2;
+				return (p2 - p1);
+			}
+		}
+	}
+
+no_cycle:
+	/* we got nothing useful */
+	*cycle_start = nib_track;
+	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
+	return NIB_TRACK_LENGTH;
+}
+
+size_t
+find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+{
+	return find_track_cycle_raw_r(default_align_context(), cycle_start, cycle_stop, cap_min, cap_max);
+}
+
+/*
+	Bit stream helpers.  A buffer is taken as one stream of bits, the first
+	bit is the MSB of buffer[0], so data that is not byte aligned can be
+	moved and searched 32 bits at a time.
+*/
+
+/* 32 bits of a bit stream from any bit position, first bit is the MSB of buffer[0] */
+DWORD
+get_stream_bits(BYTE * buffer, size_t bit)
+{
+	BYTE *p;
+	int shift;
+	DWORD word;
+
+	p = buffer + (bit >> 3);
+	shift = bit & 7;
+	word = ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | (DWORD)p[3];
+	if (shift)
+		word = (word << shift) | (p[4] >> (8 - shift));
+	return word;
+}
+
+static int
+count_bits(DWORD word)
+{
+	word = word - ((word >> 1) & 0x55555555);
+	word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+	word = (word + (word >> 4)) & 0x0f0f0f0f;
+	return (int)(((word * 0x01010101) & 0xffffffff) >> 24);
+}
+
+/* up to 24 bits from any bit position, right aligned, reads only the bytes holding them */
+static DWORD
+read_stream_bits(BYTE * buffer, size_t bit, int count)
+{
+	BYTE *p;
+	DWORD word;
+	int need, bytes, i;
+
+	p = buffer + (bit >> 3);
+	need = (int)(bit & 7) + count;
+	bytes = (need + 7) >> 3;
+
+	for (word = 0, i = 0; i < bytes; i++)
+		word = (word << 8) | p[i];
+
+	return (word >> (bytes * 8 - need)) & (((DWORD)1 << count) - 1);
+}
+
+/* store up to 24 right aligned bits at any bit position, leaving the bits around them */
+static void
+write_stream_bits(BYTE * buffer, size_t bit, DWORD value, int count)
+{
+	BYTE *p;
+	DWORD word, mask;
+	int need, bytes, i;
+
+	p = buffer + (bit >> 3);
+	need = (int)(bit & 7) + count;
+	bytes = (need + 7) >> 3;
+
+	for (word = 0, i = 0; i < bytes; i++)
+		word = (word << 8) | p[i];
+
+	mask = (((DWORD)1 << count) - 1) << (bytes * 8 - need);
+	word = (word & ~mask) | ((value << (bytes * 8 - need)) & mask);
+
+	for (i = bytes - 1; i >= 0; i--, word >>= 8)
+		p[i] = (BYTE)(word & 0xff);
+}
+
+/*
+	Copy count bits between any bit positions.  The areas may overlap if the
+	source lies after the destination, as when shifting a buffer left.
+*/
+void
+copy_bits(BYTE * dst, size_t dst_bit, BYTE * src, size_t src_bit, size_t count)
+{
+	BYTE *q;
+	DWORD word;
+	size_t n;
+
+	/* up to the next byte of the destination */
+	if ((dst_bit & 7) && count)
+	{
+		n = 8 - (dst_bit & 7);
+		if (n > count)
+			n = count;
+		write_stream_bits(dst, dst_bit, read_stream_bits(src, src_bit, (int)n), (int)n);
+		dst_bit += n;
+		src_bit += n;
+		count -= n;
+	}
+
+	q = dst + (dst_bit >> 3);
+	if (!(src_bit & 7))
+	{
+		n = count >> 3;
+		memmove(q, src + (src_bit >> 3), n);
+		q += n;
+		src_bit += n * 8;
+		count -= n * 8;
+	}
+	else
+	{
+		for (; count >= 32; count -= 32, src_bit += 32, q += 4)
+		{
+			word = get_stream_bits(src, src_bit);
+			q[0] = (BYTE)(word >> 24);
+			q[1] = (BYTE)(word >> 16);
+			q[2] = (BYTE)(word >> 8);
+			q[3] = (BYTE)word;
+		}
+		for (; count >= 8; count -= 8, src_bit += 8)
+			*q++ = (BYTE)read_stream_bits(src, src_bit, 8);
+	}
+
+	if (count)
+		write_stream_bits(q, 0, read_stream_bits(src, src_bit, (int)count), (int)count);
+}
+
+/* set count bits from any bit position to 1 or 0 */
+void
+fill_bits(BYTE * dst, size_t dst_bit, size_t count, int one)
+{
+	size_t n;
+
+	if ((dst_bit & 7) && count)
+	{
+		n = 8 - (dst_bit & 7);
+		if (n > count)
+			n = count;
+		write_stream_bits(dst, dst_bit, one ? ((DWORD)1 << n) - 1 : 0, (int)n);
+		dst_bit += n;
+		count -= n;
+	}
+
+	memset(dst + (dst_bit >> 3), one ? 0xff : 0x00, count >> 3);
+	dst_bit += count & ~(size_t)7;
+	count &= 7;
+
+	if (count)
+		write_stream_bits(dst, dst_bit, one ? ((DWORD)1 << count) - 1 : 0, (int)count);
+}
+
+/* shift a buffer left by bits, the bits shifted in are 1 or 0 */
+void
+shift_bits_left(BYTE * buffer, size_t length, size_t bits, int one)
+{
+	if (bits >= length * 8)
+		bits = length * 8;
+	else
+		copy_bits(buffer, 0, buffer, bits, length * 8 - bits);
+
+	fill_bits(buffer, length * 8 - bits, bits, one);
+}
+
+/* shift a buffer right by bits, the bits shifted in are 1 or 0 */
+void
+shift_bits_right(BYTE * buffer, size_t length, size_t bits, int one)
+{
+	DWORD word, fill;
+	size_t bytes, i;
+	int shift;
+
+	if (bits >= length * 8)
+	{
+		fill_bits(buffer, 0, length * 8, one);
+		return;
+	}
+
+	/* work down from the end, so the source is read before it is overwritten */
+	bytes = bits >> 3;
+	shift = (int)(bits & 7);
+	fill = one ? 0xff : 0x00;
+
+	for (i = length; i >= bytes + 5; i -= 4)
+	{
+		word = ((DWORD)buffer[i - bytes - 4] << 24) | ((DWORD)buffer[i - bytes - 3] << 16) |
+			((DWORD)buffer[i - bytes - 2] << 8) | (DWORD)buffer[i - bytes - 1];
+		if (shift)
+			word = (word >> shift) | ((DWORD)buffer[i - bytes - 5] << (32 - shift));
+		buffer[i - 4] = (BYTE)(word >> 24);
+		buffer[i - 3] = (BYTE)(word >> 16);
+		buffer[i - 2] = (BYTE)(word >> 8);
+		buffer[i - 1] = (BYTE)word;
+	}
+	for (; i > bytes; i--)
+	{
+		word = ((i > bytes + 1) ? buffer[i - bytes - 2] : fill) << 8 | buffer[i - bytes - 1];
+		buffer[i - 1] = (BYTE)(word >> shift);
+	}
+	memset(buffer, (int)fill, bytes);
+}
+
+/* shift track data by bits, left if positive and right if negative, 0 bits are shifted in */
+void
+bitshift(BYTE * gcrdata, size_t length, int bits)
+{
+	invalidate_sector_cache(gcrdata);
+
+	if (bits > 0)
+		shift_bits_left(gcrdata, length, (size_t)bits, 0);
+	else if (bits < 0)
+		shift_bits_right(gcrdata, length, (size_t)-bits, 0);
+}
+
+/* number of 1 bits in a row from bit, stopping at end_bit */
+size_t
+count_one_bits(BYTE * buffer, size_t bit, size_t end_bit)
+{
+	DWORD word;
+	size_t ones;
+
+	for (ones = 0; bit + 32 <= end_bit; bit += 32, ones += 32)
+	{
+		word = get_stream_bits(buffer, bit);
+		if (word != 0xffffffff)
+		{
+			for (; word & 0x80000000; word <<= 1)
+				ones++;
+			return ones;
+		}
+	}
+	for (; (bit < end_bit) && read_stream_bits(buffer, bit, 1); bit++)
+		ones++;
+
+	return ones;
 }
 
+/* first bit from bit on that starts a sync of 10 or more 1 bits ending by end_bit, or end_bit */
 size_t
-find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+find_sync_bits(BYTE * buffer, size_t bit, size_t end_bit)
 {
-	BYTE *nib_track;	/* start of nibbled track data */
-	BYTE *start_pos;	/* start of periodic area */
-	BYTE *cycle_pos;	/* start of cycle repetition */
-	BYTE *stop_pos;		/* maximum position allowed for cycle */
-	BYTE *data_pos;		/* cycle search variable */
-	BYTE *p1, *p2;		/* local pointers for comparisons */
-
-	nib_track = *cycle_start;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
-	cycle_pos = NULL;
+	DWORD word, ones;
+	int i;
 
-	/* try to find a normal track cycle  */
-	for (start_pos = nib_track;; find_sync(&start_pos, stop_pos))
+	/* a bit is left set where it starts 10 ones, for the first 23 bits of the word */
+	for (; bit + 32 <= end_bit; bit += 23)
 	{
-		if ((data_pos = start_pos + cap_min) >= stop_pos)
-			break;	/* no cycle found */
-
-		while (find_sync(&data_pos, stop_pos))
+		word = get_stream_bits(buffer, bit);
+		ones = word & (word << 1);
+		ones = ones & (ones << 2);
+		ones = ones & (ones << 4);
+		ones = ones & (word << 8) & (word << 9);
+		if (ones)
 		{
-			p1 = start_pos;
-			cycle_pos = data_pos;
-
-			for (p2 = cycle_pos; p2 < stop_pos;)
-			{
-				/* try to match all remaining syncs, too */
-				if (memcmp(p1, p2, gap_match_length) != 0)
-				{
-					cycle_pos = NULL;
-					break;
-				}
-				if (!find_sync(&p1, stop_pos))
-					break;
-				if (!find_sync(&p2, stop_pos))
-					break;
-			}
-
-			if ((cycle_pos != NULL) && (check_valid_data(data_pos, gap_match_length)))
-			{
-				*cycle_start = start_pos;
-				*cycle_stop = cycle_pos;
-				return (cycle_pos - start_pos);
-			}
+			for (i = 0; !(ones & 0x80000000); i++)
+				ones <<= 1;
+			return bit + i;
 		}
 	}
-
-	/* we got nothing useful, return it all */
-	*cycle_start = nib_track;
-	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
-	return NIB_TRACK_LENGTH;
+	for (; bit + 10 <= end_bit; bit++)
+	{
+		if (read_stream_bits(buffer, bit, 10) == 0x3ff)
+			return bit;
+	}
+	return end_bit;
 }
 
+/*
+	Find the revolution length to the bit, for captures whose cycle does not
+	repeat on a byte boundary.  The start of the track is compared to the
+	stream shifted by every bit length in the capacity window, 32 bits at a
+	time, and the length with the fewest differing bits wins.  The bits
+	past the last whole byte go to bit_offset unless it is NULL.
+*/
 size_t
-find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+find_track_cycle_bits_r(align_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, int *bit_offset)
 {
 	BYTE *nib_track;	/* start of nibbled track data */
-	BYTE *start_pos;	/* start of periodic area */
-	BYTE *cycle_pos;	/* start of cycle repetition */
-	BYTE *stop_pos;		/* maximum position allowed for cycle */
-	BYTE *p1, *p2;		/* local pointers for comparisons */
+	DWORD reference[BIT_CYCLE_COMPARE / 4];	/* first bytes of the track */
+	size_t compare;		/* bytes compared per cycle length */
+	size_t bits, best_bits, last_bits;
+	int diff, best_diff, limit;
+	size_t i, words;
 
 	nib_track = *cycle_start;
-	start_pos = nib_track;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
-	cycle_pos = NULL;
+	if (bit_offset) *bit_offset = 0;
+
+	/* leave room to compare, plus the bytes read past a shifted word */
+	if (cap_max + BIT_CYCLE_MIN_COMPARE + 8 > NIB_TRACK_LENGTH)
+		cap_max = NIB_TRACK_LENGTH - BIT_CYCLE_MIN_COMPARE - 8;
+	if (cap_min < 1 || cap_min > cap_max)
+		goto no_cycle;
 
-	/* try to find a track cycle ignoring sync  */
-	for (p1 = start_pos; p1 < stop_pos; p1++)
+	compare = NIB_TRACK_LENGTH - cap_max - 8;
+	if (compare > BIT_CYCLE_COMPARE)
+		compare = BIT_CYCLE_COMPARE;
+	words = compare / 4;
+
+	for (i = 0; i < words; i++)
+		reference[i] = get_stream_bits(nib_track, i * 32);
+
+	limit = (int)(words * 32 * (100 - MIN_BIT_CYCLE_CONFIDENCE) / 100);
+	best_diff = limit + 1;
+	best_bits = 0;
+	last_bits = cap_max * 8 + 7;
+
+	for (bits = cap_min * 8; bits <= last_bits; bits++)
 	{
-		/* now try to match it */
-		for (p2 = p1 + (cap_min + CAP_ALLOWANCE); p2 < stop_pos; p2++)
-		//for (p2 = p1 + cap_max; p2 > p1 + cap_min; p2--)
-		{
-			/* try to match data */
-			if (memcmp(p1, p2, gap_match_length) != 0)
-				cycle_pos = NULL;
-			else
-				cycle_pos = p2;
+		for (diff = 0, i = 0; i < words && diff < best_diff; i++)
+			diff += count_bits(reference[i] ^ get_stream_bits(nib_track, bits + i * 32));
 
-			/* we found one! */
-			if ((cycle_pos != NULL) && (check_valid_data(cycle_pos, gap_match_length)))
-			{
-				*cycle_start = p1;
-				*cycle_stop = cycle_pos;
-				return (cycle_pos - p1);
-			}
+		if (diff < best_diff)
+		{
+			best_diff = diff;
+			best_bits = bits;
+			if (!diff) break;
 		}
 	}
 
+	if (!best_bits)
+		goto no_cycle;
+
+	if (ctx->verbose>2) align_printf(ctx, "{bits:%d+%d;%d%%}", (int)(best_bits >> 3), (int)(best_bits & 7),
+		100 - (int)((best_diff * 100) / (words * 32)));
+
+	if (bit_offset) *bit_offset = best_bits & 7;
+	*cycle_stop = nib_track + (best_bits >> 3);
+	return (best_bits >> 3);
+
+no_cycle:
 	/* we got nothing useful */
 	*cycle_start = nib_track;
 	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
 	return NIB_TRACK_LENGTH;
 }
 
+size_t
+find_track_cycle_bits(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, int *bit_offset)
+{
+	return find_track_cycle_bits_r(default_align_context(), cycle_start, cycle_stop, cap_min, cap_max, bit_offset);
+}
+
+/*
+	Percentage of the bytes after a cycle that repeat the cycle,
+	real revolutions score high, chance matches of a few bytes low.
+*/
+int
+cycle_confidence(BYTE * cycle_start, BYTE * cycle_stop, BYTE * track_end)
+{
+	size_t i, overlap, matches;
+
+	if ((cycle_stop <= cycle_start) || (cycle_stop >= track_end))
+		return 0;
+
+	overlap = track_end - cycle_stop;
+	if (overlap > (size_t)(cycle_stop - cycle_start))
+		overlap = cycle_stop - cycle_start;
+
+	for (matches = 0, i = 0; i < overlap; i++)
+		if (cycle_start[i] == cycle_stop[i])
+			matches++;
+
+	return (int)((matches * 100) / overlap);
+}
+
 int
 check_valid_data(BYTE * data, int matchlen)
 {
@@ -718,6 +1847,10 @@ find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 	while (pos >= work_buffer + tracklen)
 		pos -= tracklen;
 
+	/* the byte before the first is the last of the cycle, which the work buffer has twice */
+	if (pos == work_buffer)
+		pos += tracklen;
+
 	if(*(pos-1)&1)
 		return pos - 1;  // go to  last byte that contains first few bits of sync
 	else
@@ -778,6 +1911,10 @@ find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 	while (pos >= work_buffer + tracklen)
 		pos -= tracklen;
 
+	/* the byte before the first is the last of the cycle, which the work buffer has twice */
+	if (pos == work_buffer)
+		pos += tracklen;
+
 	if(*(pos-1)&1)
 		return pos - 1;  // go to  last byte that contains first few bits of sync
 	else
@@ -787,22 +1924,49 @@ find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 /* checks if there is any reasonable section of formatted (GCR) data */
 int check_formatted(BYTE *gcrdata, size_t length)
 {
-	size_t i, run = 0;
+	size_t pos, start, run;
+	badgcr_map map;
 
-	/* try to find longest good gcr run */
-	for (i = 0; i < length; i++)
-	{
-		if (is_bad_gcr(gcrdata, length, i))
-			run = 0;
-		else
-			run++;
+	build_badgcr_map(gcrdata, length, &map);
 
-		if (run >= GCR_MIN_FORMATTED)
+	/* look for a long enough good gcr run between the bad ones */
+	for (pos = 0; pos < map.length; pos = start + run)
+	{
+		start = next_badgcr_run(&map, pos, map.length, &run);
+		if (start - pos >= GCR_MIN_FORMATTED)
 			return 1;
 	}
 	return 0;
 }
 
+/*
+   Run another cycle finder and keep its cycle if the current one is out of
+   the capacity window, or if the new one is in it and repeats better.
+*/
+static void
+choose_track_cycle(align_context *ctx, size_t (*finder)(align_context *, BYTE **, BYTE **, size_t, size_t), BYTE *source,
+	BYTE **cycle_start, BYTE **cycle_stop, int *confidence, size_t cap_min, size_t cap_max)
+{
+	BYTE *start, *stop;
+	size_t len;
+	int score;
+
+	start = *cycle_start;
+	finder(ctx, &start, &stop, cap_min, cap_max);
+	len = stop - start;
+	score = cycle_confidence(start, stop, source + NIB_TRACK_LENGTH);
+
+	if (ctx->verbose>2) align_printf(ctx, "{%d%%}", score);
+
+	if (((size_t)(*cycle_stop - *cycle_start) > cap_max) || ((size_t)(*cycle_stop - *cycle_start) < cap_min) ||
+		((len >= cap_min) && (len <= cap_max) && (score > *confidence)))
+	{
+		*cycle_start = start;
+		*cycle_stop = stop;
+		*confidence = score;
+	}
+}
+
 /*
    Try to extract one complete cycle of GCR data from an 8kB buffer.
    Align track to sector gap if possible, else align to sector 0,
@@ -812,20 +1976,27 @@ int check_formatted(BYTE *gcrdata, size_t length)
    [Return] length of copied track fragment
 */
 size_t
-extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_t cap_min, size_t cap_max)
+extract_GCR_track_r(align_context * ctx, BYTE *destination, BYTE *source, BYTE *align, int track, size_t cap_min, size_t cap_max)
 {
 	BYTE work_buffer[NIB_TRACK_LENGTH*2];	/* working buffer */
+	BYTE track_data[NIB_TRACK_LENGTH*2];	/* source, padded for the cycle search */
 	BYTE *cycle_start;	/* start position of cycle */
 	BYTE *cycle_stop;	/* stop position of cycle  */
+	BYTE *bits_start, *bits_stop;	/* cycle found to the bit */
 	BYTE *sector0_pos;	/* position of sector 0 */
 	BYTE *sectorgap_pos;/* position of sector gap */
 	BYTE *longsync_pos;	/* position of longest sync run */
 	BYTE *badgap_pos;	/* position of bad gcr bit run */
 	BYTE *marker_pos;	/* generic marker used by protection handlers */
 	size_t track_len;
+	size_t bits_len;
 	size_t sector0_len;	/* length of gap before sector 0 */
 	size_t sectorgap_len;	/* length of longest gap */
 	BYTE fake_density = 0;
+	BYTE forced;		/* alignment the map asks for */
+	int confidence;		/* how well the cycle repeats, in percent */
+	int bit_offset = 0;	/* bits of the cycle past its last whole byte */
+	int offset;
 	int i ,j;
 
 	sector0_pos = NULL;
@@ -835,7 +2006,7 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	marker_pos = NULL;
 
 	/* ignore minumum capacity by RPM/density */
-	if(!cap_min_ignore)
+	if(!ctx->cap_min_ignore)
 	{
 		cap_min -= CAP_ALLOWANCE;
 		cap_max += CAP_ALLOWANCE;
@@ -848,127 +2019,172 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	/* if this track is all sync, return */
 	if(check_sync_flags(source, fake_density, NIB_TRACK_LENGTH) & BM_FF_TRACK)
 	{
-		if(verbose) printf("KILLER! ");
+		if(ctx->verbose) align_printf(ctx, "KILLER! ");
 		memcpy(destination, source, NIB_TRACK_LENGTH);
 		return NIB_TRACK_LENGTH;
 	}
 
+	/* the cycle search looks up to a track length past where it starts,
+	   which runs off the end of a single track buffer */
+	memcpy(track_data, source, NIB_TRACK_LENGTH);
+	memset(track_data + NIB_TRACK_LENGTH, 0, NIB_TRACK_LENGTH);
+	source = track_data;
+
 	cycle_start = source;
 	memset(work_buffer, 0, sizeof(work_buffer));
 	memcpy(work_buffer, cycle_start, NIB_TRACK_LENGTH);
 
 	/* find cycle */
-	if(verbose>1) printf("H");
-	find_track_cycle_headers(&cycle_start, &cycle_stop, cap_min, cap_max);
+	if(ctx->verbose>1) align_printf(ctx, "H");
+	find_track_cycle_headers_r(ctx, &cycle_start, &cycle_stop, cap_min, cap_max);
 	track_len = cycle_stop - cycle_start;
+	confidence = cycle_confidence(cycle_start, cycle_stop, source + NIB_TRACK_LENGTH);
 
 	/* second pass to find a cycle in track w/non-standard headers */
-	if ((track_len > cap_max) || (track_len < cap_min))
+	if ((track_len > cap_max) || (track_len < cap_min) || (confidence < MIN_CYCLE_CONFIDENCE))
 	{
-		if(verbose>1) printf("/S");
-		find_track_cycle_syncs(&cycle_start, &cycle_stop, cap_min, cap_max);
+		if(ctx->verbose>1) align_printf(ctx, "/S");
+		choose_track_cycle(ctx, find_track_cycle_syncs_r, source, &cycle_start, &cycle_stop, &confidence, cap_min, cap_max);
 		track_len = cycle_stop - cycle_start;
 	}
 
 	/* third pass to find a cycle in track w/non-standard headers */
-	if ((track_len > cap_max) || (track_len < cap_min))
+	if ((track_len > cap_max) || (track_len < cap_min) || (confidence < MIN_CYCLE_CONFIDENCE))
 	{
-		if(verbose>1) printf("/R");
-		find_track_cycle_raw(&cycle_start, &cycle_stop, cap_min, cap_max);
+		if(ctx->verbose>1) align_printf(ctx, "/R");
+		choose_track_cycle(ctx, find_track_cycle_raw_r, source, &cycle_start, &cycle_stop, &confidence, cap_min, cap_max);
 		track_len = cycle_stop - cycle_start;
 	}
 
+	/*
+		fourth pass for tracks that do not repeat on a byte boundary, a bit
+		cycle only turns up when 90% of the bits repeat, so it also beats a
+		cycle that repeats poorly
+	*/
+	if ((track_len > cap_max) || (track_len < cap_min) || (confidence < MIN_CYCLE_CONFIDENCE))
+	{
+		if(ctx->verbose>1) align_printf(ctx, "/B");
+		bits_start = cycle_start;
+		bits_len = find_track_cycle_bits_r(ctx, &bits_start, &bits_stop, cap_min, cap_max, &offset);
+
+		if ((track_len > cap_max) || (track_len < cap_min) || ((bits_len >= cap_min) && (bits_len <= cap_max)))
+		{
+			cycle_start = bits_start;
+			cycle_stop = bits_stop;
+			track_len = bits_len;
+			bit_offset = offset;
+			confidence = cycle_confidence(cycle_start, cycle_stop, source + NIB_TRACK_LENGTH);
+		}
+	}
+
 	if (track_len <= cap_min)
 	{
-		if(verbose>1) printf("/+");
+		if(ctx->verbose>1) align_printf(ctx, "/+");
 		track_len += (cap_max-cap_min)/2;
+		bit_offset = 0;
 	}
 
-	if(verbose>2)
+	if(ctx->verbose>2)
 	{
 		if (track_len > cap_max)
-			printf("[LONG, max=%d<%d] ",cap_max, track_len);
+			align_printf(ctx, "[LONG, max=%d<%d] ",(int) cap_max, (int) track_len);
 		if(track_len < cap_min)
-			printf("[SHORT, min=%d>%d] ", cap_min, track_len);
+			align_printf(ctx, "[SHORT, min=%d>%d] ", (int) cap_min, (int) track_len);
 
-		printf("{cycle:");
-		for(i=0;i<gap_match_length;i++)
-			printf("%.2x",cycle_start[i]);
-		printf("}");
+		align_printf(ctx, "{cycle:");
+		for(i=0;i<ctx->gap_match_length;i++)
+			align_printf(ctx, "%.2x",cycle_start[i]);
+		align_printf(ctx, ";%d%%}", confidence);
 	}
 
-	/* copy twice the data to work buffer */
-	memcpy(work_buffer, cycle_start, track_len);
-	memcpy(work_buffer + track_len, cycle_start, track_len);
+	/*
+		copy twice the data to work buffer, the second copy of a bit cycle
+		starts at its exact bit so the seam has no stray bits, those fall
+		out at the end of the aligned track instead
+	*/
+	if (bit_offset)
+	{
+		memcpy(work_buffer, cycle_start, track_len + 1);
+		copy_bits(work_buffer, track_len * 8 + bit_offset, cycle_start, 0, track_len * 8 + bit_offset);
+	}
+	else
+	{
+		memcpy(work_buffer, cycle_start, track_len);
+		memcpy(work_buffer + track_len, cycle_start, track_len);
+	}
 
 	/* print sector0 offset from beginning of data (for index hole check) */
-	if(verbose>1)
+	if(ctx->verbose>1)
 	{
 		sector0_pos = find_sector0(work_buffer, track_len, &sector0_len);
-		printf("{sec0=%.4d;len=%d} ",(int)(sector0_pos - work_buffer), sector0_len);
+		align_printf(ctx, "{sec0=%.4d;len=%d} ",(int)(sector0_pos - work_buffer), (int) sector0_len);
 	}
 
-	/* forced track alignments */
-	if (align_map[track] != ALIGN_NONE)
+	/*
+		forced track alignments, a V-MAX track without the CW marker falls
+		back to V-MAX for this read only, the map is shared by all threads
+	*/
+	forced = ctx->align_map[track];
+	if (forced != ALIGN_NONE)
 	{
-		if (align_map[track] == ALIGN_VMAX_CW)
+		if (forced == ALIGN_VMAX_CW)
 		{
 			*align = ALIGN_VMAX_CW;
 			marker_pos = align_vmax_cw(work_buffer, track_len);
 
 			if(!marker_pos)
-				align_map[track] = ALIGN_VMAX;
+				forced = ALIGN_VMAX;
 		}
 
-		if (align_map[track] == ALIGN_VMAX)
+		if (forced == ALIGN_VMAX)
 		{
 			*align = ALIGN_VMAX;
 			marker_pos = align_vmax_new(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_PSLAYER)
+		if (forced == ALIGN_PSLAYER)
 		{
 			*align = ALIGN_PSLAYER;
-			marker_pos = align_pirateslayer(work_buffer, track_len);
+			marker_pos = align_pirateslayer_r(ctx, work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_RAPIDLOK)
+		if (forced == ALIGN_RAPIDLOK)
 		{
 			*align = ALIGN_RAPIDLOK;
-			marker_pos = align_rl_special(work_buffer, track_len);
+			marker_pos = align_rl_special_r(ctx, work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_AUTOGAP)
+		if (forced == ALIGN_AUTOGAP)
 		{
 			*align = ALIGN_AUTOGAP;
 			marker_pos = auto_gap(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_LONGSYNC)
+		if (forced == ALIGN_LONGSYNC)
 		{
 			*align = ALIGN_LONGSYNC;
 			marker_pos = find_long_sync(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_BADGCR)
+		if (forced == ALIGN_BADGCR)
 		{
 			*align = ALIGN_BADGCR;
 			marker_pos = find_bad_gap(work_buffer, track_len);
 		}
 
-		if (align_map[track] == ALIGN_GAP)
+		if (forced == ALIGN_GAP)
 		{
 			*align = ALIGN_GAP;
 			marker_pos = find_sector_gap(work_buffer, track_len, &sectorgap_len);
 		}
 
-		if (align_map[track] == ALIGN_SEC0)
+		if (forced == ALIGN_SEC0)
 		{
 			*align = ALIGN_SEC0;
 			marker_pos = find_sector0(work_buffer, track_len, &sector0_len);
 		}
 
-		if (align_map[track] == ALIGN_RAW)
+		if (forced == ALIGN_RAW)
 		{
 			*align = ALIGN_RAW;
 			marker_pos = work_buffer;
@@ -1008,12 +2224,12 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	sector0_pos = find_sector0(work_buffer, track_len, &sector0_len);
 	sectorgap_pos = find_sector_gap(work_buffer, track_len, &sectorgap_len);
 
-	if(verbose>1)
-		printf("{gap=%.4d;len=%d) ", (int)(sectorgap_pos-work_buffer), (int)sectorgap_len);
+	if(ctx->verbose>1)
+		align_printf(ctx, "{gap=%.4d;len=%d) ", (int)(sectorgap_pos-work_buffer), (int)sectorgap_len);
 
 	if((sectorgap_pos-work_buffer == sector0_pos-work_buffer) &&
-		(sectorgap_pos != NULL) &&	(sector0_pos != NULL) && (verbose>1))
-		printf("(sec0=gap) ");
+		(sectorgap_pos != NULL) &&	(sector0_pos != NULL) && (ctx->verbose>1))
+		align_printf(ctx, "(sec0=gap) ");
 
 	/* if (sectorgap_len >= sector0_len + 0x40) */ /* Burstnibbler's calc */
 	if (sectorgap_len > GCR_BLOCK_DATA_LEN + SIGNIFICANT_GAPLEN_DIFF)
@@ -1064,23 +2280,29 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 
 aligned:
 	i=j=0;
-	if(verbose>1)
+	if(ctx->verbose>1)
 	{
-		if(verbose>1) printf("{align:");
-		while((i<gap_match_length) && (i<(int)track_len))
+		if(ctx->verbose>1) align_printf(ctx, "{align:");
+		while((i<ctx->gap_match_length) && (i<(int)track_len))
 		{
 			if(destination[j] != 0xff)
 			{
-				if(verbose>1) printf("%.2x",destination[j]);
+				if(ctx->verbose>1) align_printf(ctx, "%.2x",destination[j]);
 				j++; i++;
 			}
 			else j++;
 		}
-		printf("}");
+		align_printf(ctx, "}");
 	}
 	return track_len;
 }
 
+size_t
+extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_t cap_min, size_t cap_max)
+{
+	return extract_GCR_track_r(default_align_context(), destination, source, align, track, cap_min, cap_max);
+}
+
 size_t
 lengthen_sync(BYTE *buffer, size_t length, size_t length_max)
 {
@@ -1116,6 +2338,9 @@ lengthen_sync(BYTE *buffer, size_t length, size_t length_max)
 
         } while (source <= end);
 
+        if (added)
+                invalidate_sector_cache(buffer);
+
         memcpy(buffer, newbuf, length+added);
         return added;
 }
@@ -1136,6 +2361,8 @@ kill_partial_sync(BYTE * gcrdata, size_t length, size_t length_max)
 	memset(sync_pre, 0, sizeof(sync_pre));
 	memset(sync_pre2, 0, sizeof(sync_pre2));
 
+	invalidate_sector_cache(gcrdata);
+
 	// count syncs/lengths
 	for (locked=0, i=0; i<length-1; i++)
 	{
@@ -1186,6 +2413,8 @@ strip_runs(BYTE * buffer, size_t length, size_t length_max, size_t minrun, BYTE
 	skipped = 0;
 	end = buffer + length;
 
+	invalidate_sector_cache(buffer);
+
 	for (source = buffer; source < end; source++)
 	{
 		if ( (*source == target) && (length - skipped >= length_max) )
@@ -1206,24 +2435,97 @@ strip_runs(BYTE * buffer, size_t length, size_t length_max, size_t minrun, BYTE
 	return skipped;
 }
 
-/* try to shorten inert data until length <= length_max */
+/*
+	try to shorten inert data until length <= length_max
+
+	This gives the same result as calling strip_runs() until the track fits,
+	but plans it from the run lengths: pass p takes a byte from every run
+	that is longer than minrun + p - 1, and the pass that reaches length_max
+	only takes from the first runs.  The buffer is then compacted once.
+ */
 size_t
 reduce_runs(BYTE * buffer, size_t length, size_t length_max, size_t minrun, BYTE target)
 {
 	/* minrun is number of bytes to leave behind */
-	size_t skipped;
+	unsigned short excess[NIB_TRACK_LENGTH + 1];	/* runs by bytes over minrun */
+	size_t skipped, passes, partial, eligible, total, run, cut, i, out;
 
-	do
+	if (length <= length_max)
+		return (length);
+
+	/* areas longer than a track take the stripping passes */
+	if (length > NIB_TRACK_LENGTH)
 	{
-		if (length <= length_max)
-			return (length);
+		do
+		{
+			skipped = strip_runs(buffer, length, length_max, minrun, target);
+			length -= skipped;
+		}
+		while (skipped > 0 && length > length_max);
 
-		skipped = strip_runs(buffer, length, length_max, minrun, target);
-		length -= skipped;
+		return (length);
 	}
-	while (skipped > 0 && length > length_max);
 
-	return (length);
+	invalidate_sector_cache(buffer);
+
+	/* measure the runs */
+	memset(excess, 0, sizeof(excess));
+	eligible = 0;
+	for (i = 0; i < length; i += run)
+	{
+		for (run = 0; (i + run < length) && (buffer[i + run] == target); run++);
+
+		if (run > minrun)
+		{
+			excess[run - minrun]++;
+			eligible++;
+		}
+		if (!run)
+			run = 1;
+	}
+
+	/* count the full passes and the runs cut by the last one */
+	total = length;
+	passes = partial = 0;
+	while (length > length_max && eligible > 0)
+	{
+		if (eligible > length - length_max + 1)
+		{
+			partial = length - length_max + 1;
+			length -= partial;
+			break;
+		}
+		length -= eligible;
+		passes++;
+		eligible -= excess[passes];
+	}
+
+	/* compact */
+	for (i = out = 0; i < total; i += run)
+	{
+		for (run = 0; (i + run < total) && (buffer[i + run] == target); run++);
+
+		if (!run)
+		{
+			buffer[out++] = buffer[i];
+			run = 1;
+			continue;
+		}
+
+		cut = (run > minrun) ? run - minrun : 0;
+		if (cut > passes)
+		{
+			cut = passes;
+			if (partial)
+			{
+				cut++;
+				partial--;
+			}
+		}
+		memset(buffer + out, target, run - cut);
+		out += run - cut;
+	}
+	return (out);
 }
 
 size_t
@@ -1235,6 +2537,8 @@ strip_gaps(BYTE * buffer, size_t length)
 	skipped = 0;
 	end = buffer + length;
 
+	invalidate_sector_cache(buffer);
+
 	/* this is crude, I know */
 	/* this will find a sync that is of sufficient length and strip the byte before it */
 	/* this can damage real data if done too much and will damage signatures before a sync */
@@ -1248,21 +2552,130 @@ strip_gaps(BYTE * buffer, size_t length)
 	return skipped;
 }
 
-/* try to shorten tail gaps until length <= length_max */
+/* byte at pos of a track kept as segments of the original buffer plus a two byte tail */
+static BYTE
+gap_segment_byte(BYTE * buffer, unsigned short * seg_start, unsigned short * seg_len, int segs,
+	size_t body, BYTE * tail, size_t pos)
+{
+	int i;
+
+	if (pos >= body)
+		return (pos == body) ? tail[0] : tail[1];
+
+	for (i = segs - 1; i >= 0; i--)
+	{
+		body -= seg_len[i];
+		if (pos >= body)
+			break;
+	}
+	return buffer[seg_start[i] + pos - body];
+}
+
+/*
+	try to shorten tail gaps until length <= length_max
+
+	This gives the same result as calling strip_gaps() until the track fits.
+	A pass takes the last byte of every gap in front of a sync of two or more
+	bytes, and its last two bytes are left over from before the compaction.
+	The passes are played out on the runs of the track instead of its bytes
+	and the buffer is compacted once.
+*/
 size_t
 reduce_gaps(BYTE * buffer, size_t length, size_t length_max)
 {
-	size_t skipped;
+	unsigned short seg_start[NIB_TRACK_LENGTH], seg_len[NIB_TRACK_LENGTH];
+	unsigned short cut[NIB_TRACK_LENGTH / 2];
+	BYTE tail[2], new_tail[2];
+	size_t skipped, body, run, len, i;
+	int segs, gap, cuts, sync, s;
 
-	do
+	if (length <= length_max)
+		return (length);
+
+	/* areas longer than a track take the stripping passes */
+	if ((length < 3) || (length > NIB_TRACK_LENGTH))
+	{
+		do
+		{
+			skipped = strip_gaps(buffer, length);
+			length -= skipped;
+		}
+		while (skipped > 0 && length > length_max);
+
+		return (length);
+	}
+
+	invalidate_sector_cache(buffer);
+
+	/* split all but the last two bytes into runs of sync and non-sync bytes */
+	body = length - 2;
+	tail[0] = buffer[body];
+	tail[1] = buffer[body + 1];
+	for (segs = 0, i = 0; i < body; i += run, segs++)
 	{
-		if (length <= length_max)
-			return (length);
+		for (run = 1; (i + run < body) && ((buffer[i + run] == 0xff) == (buffer[i] == 0xff)); run++);
+		seg_start[segs] = (unsigned short)i;
+		seg_len[segs] = (unsigned short)run;
+	}
+
+	while (length > length_max)
+	{
+		/* find the gaps in front of syncs, emptied gaps join their neighbours */
+		gap = -1;
+		run = 0;
+		cuts = 0;
+		for (s = 0; s <= segs + 2; s++)
+		{
+			if (s < segs)
+			{
+				if (!seg_len[s])
+					continue;
+				sync = (buffer[seg_start[s]] == 0xff);
+				len = seg_len[s];
+			}
+			else if (s < segs + 2)
+			{
+				sync = (tail[s - segs] == 0xff);
+				len = 1;
+			}
+			else
+				sync = 0;	/* end of track */
+
+			if (sync)
+			{
+				run += len;
+				continue;
+			}
+
+			if ((run >= 2) && (gap >= 0))
+				cut[cuts++] = (unsigned short)gap;
+			gap = (s < segs) ? s : -1;
+			run = 0;
+		}
 
-		skipped = strip_gaps(buffer, length);
-		length -= skipped;
+		if (!cuts)
+			break;
+
+		/* the last two bytes are not moved by the compaction */
+		new_tail[0] = gap_segment_byte(buffer, seg_start, seg_len, segs, body, tail, body - cuts);
+		new_tail[1] = gap_segment_byte(buffer, seg_start, seg_len, segs, body, tail, body - cuts + 1);
+		tail[0] = new_tail[0];
+		tail[1] = new_tail[1];
+
+		for (s = 0; s < cuts; s++)
+			seg_len[cut[s]]--;
+		body -= cuts;
+		length -= cuts;
+	}
+
+	/* compact */
+	for (i = 0, s = 0; s < segs; s++)
+	{
+		memmove(buffer + i, buffer + seg_start[s], seg_len[s]);
+		i += seg_len[s];
 	}
-	while (skipped > 0 && length > length_max);
+	buffer[i] = tail[0];
+	buffer[i + 1] = tail[1];
 
 	return (length);
 }
@@ -1462,6 +2875,7 @@ compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BY
 	BYTE secbuf1[260], secbuf2[260];
 	char tmpstr[256];
 	unsigned int crcresult1, crcresult2;
+	sector_index index1, index2;
 
 	sec_match = 0;
 	numsecs = 0;
@@ -1475,6 +2889,9 @@ compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BY
 		 (length1 == NIB_TRACK_LENGTH) || (length2 == NIB_TRACK_LENGTH))
 		return 0;
 
+	index_GCR_sectors(track1, track1+length1, track/2, id1, &index1);
+	index_GCR_sectors(track2, track2+length2, track/2, id2, &index2);
+
 	/* check for sector matches */
 	for (sector = 0; sector < sector_map[track/2]; sector++)
 	{
@@ -1484,8 +2901,8 @@ compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BY
 		memset(secbuf2, 0, sizeof(secbuf2));
 		tmpstr[0] = '\0';
 
-		error1 = convert_GCR_sector(track1, track1+length1, secbuf1, track/2, sector, id1);
-		error2 = convert_GCR_sector(track2, track2+length2, secbuf2, track/2, sector, id2);
+		error1 = convert_indexed_sector(&index1, sector, secbuf1);
+		error2 = convert_indexed_sector(&index2, sector, secbuf2);
 
 		/* compare data returned */
 		checksum1 = 0;
@@ -1607,13 +3024,16 @@ check_errors(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorst
 	int errors, sector;
 	char tmpstr[16];
 	BYTE secbuf[260], errorcode;
+	sector_index index;
 
 	errors = 0;
 	errorstring[0] = '\0';
 
+	index_GCR_sectors(gcrdata, gcrdata + length, (track/2), id, &index);
+
 	for (sector = 0; sector < sector_map[track/2]; sector++)
 	{
-		errorcode = convert_GCR_sector(gcrdata, gcrdata + length, secbuf, (track/2), sector, id);
+		errorcode = convert_indexed_sector(&index, sector, secbuf);
 
 		if (errorcode != SECTOR_OK)
 		{
@@ -1632,14 +3052,17 @@ check_empty(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstr
 	int i, empty, sector, errorcode;
 	char tmpstr[16], temp_errorstring[256];
 	BYTE secbuf[260];
+	sector_index index;
 
 	empty = 0;
 	errorstring[0] = '\0';
 	temp_errorstring[0] = '\0';
 
+	index_GCR_sectors(gcrdata, gcrdata + length, (track / 2), id, &index);
+
 	for (sector = 0; sector < sector_map[track / 2]; sector++)
 	{
-		errorcode = convert_GCR_sector(gcrdata, gcrdata + length, secbuf, (track / 2), sector, id);
+		errorcode = convert_indexed_sector(&index, sector, secbuf);
 
 		if (errorcode == SECTOR_OK)
 		{
@@ -1680,6 +3103,8 @@ replace_bytes(BYTE * buffer, size_t length, BYTE srcbyte, BYTE dstbyte)
 
 	replaced = 0;
 
+	invalidate_sector_cache(buffer);
+
 	for (i = 0; i < length; i++)
 	{
 		if (buffer[i] == srcbyte)
@@ -1708,6 +3133,93 @@ is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos)
 	return (mask >= 7);
 }
 
+/*
+ * Map the bytes for which is_bad_gcr() is true, four bytes per step.
+ */
+size_t
+build_badgcr_map(BYTE * gcrdata, size_t length, badgcr_map * map)
+{
+	DWORD data, lastbits;
+	size_t i, end, pos, run;
+
+	memset(map, 0, sizeof(badgcr_map));
+	if (!length)
+		return 0;
+
+	end = (length > BADGCR_MAP_LENGTH) ? BADGCR_MAP_LENGTH : length;
+	map->length = end;
+
+	/* the first byte follows the last one, as in is_bad_gcr() */
+	lastbits = gcrdata[length - 1] & 0x03;
+
+	for (i = 0; i + 4 <= end; i += 4)
+	{
+		data = ((DWORD)gcrdata[i] << 24) | ((DWORD)gcrdata[i + 1] << 16) |
+			((DWORD)gcrdata[i + 2] << 8) | (DWORD)gcrdata[i + 3];
+		map->bits[i >> 5] |= badgcr_bits(data, lastbits) << (i & 31);
+
+		lastbits = data & 0x03;
+	}
+	for (; i < end; i++)
+	{
+		if (is_bad_gcr(gcrdata, length, i))
+			map->bits[i >> 5] |= (DWORD)1 << (i & 31);
+	}
+
+	for (i = 0; i < (end + 31) / 32; i++)
+		map->total += count_bits(map->bits[i]);
+
+	for (i = 0; (pos = next_badgcr_run(map, i, end, &run)) < end; i = pos + run)
+	{
+		map->runs++;
+		if (run > map->longest)
+			map->longest = run;
+	}
+	return map->total;
+}
+
+/* first position from pos on whose map bit equals bad, or end */
+static size_t
+scan_badgcr_map(badgcr_map * map, size_t pos, size_t end, int bad)
+{
+	DWORD word;
+
+	while (pos < end)
+	{
+		word = map->bits[pos >> 5];
+		if (!bad)
+			word = ~word;
+		word >>= pos & 31;
+
+		if (word)
+		{
+			while (!(word & 1))
+			{
+				word >>= 1;
+				pos++;
+			}
+			return (pos < end) ? pos : end;
+		}
+		pos = (pos | 31) + 1;
+	}
+	return end;
+}
+
+/* start of the next run of bad GCR bytes in [pos, end) and its length, or end */
+size_t
+next_badgcr_run(badgcr_map * map, size_t pos, size_t end, size_t * run)
+{
+	size_t start, limit;
+
+	limit = end;
+	if (end > map->length)
+		end = map->length;
+
+	start = scan_badgcr_map(map, pos, end, 1);
+	*run = scan_badgcr_map(map, start, end, 0) - start;
+	return (start < end) ? start : limit;
+}
+
 /*
  * Check and "correct" bad GCR bits:
  * substitute bad GCR bytes by 0x00 until next good GCR byte
@@ -1719,11 +3231,8 @@ is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos)
  * fix_first, fix_last not used normally because while "correct", the real hardware
  * is not this precise and it fails the protection checks sometimes.
  */
-
-extern int fix_gcr;
-
 size_t
-check_bad_gcr(BYTE * gcrdata, size_t length)
+check_bad_gcr_r(align_context * ctx, BYTE * gcrdata, size_t length)
 {
 	/* state machine definitions */
 	enum ebadgcr { S_BADGCR_OK, S_BADGCR_ONCE_BAD, S_BADGCR_LOST };
@@ -1731,20 +3240,36 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 	size_t i, lastpos;
 	size_t total, b_badgcr;
 	size_t n_badgcr;
+	badgcr_map map;
 
 	/* if empty we are all "bad" GCR */
 	if(!length)
 		return NIB_TRACK_LENGTH;
 
+	build_badgcr_map(gcrdata, length, &map);
+
 	i = 0;
 	total = 0;
 	lastpos = 0;
 	sbadgcr = S_BADGCR_OK;
 
+	/* fixups rewrite the track */
+	if (ctx->fix_gcr)
+		invalidate_sector_cache(gcrdata);
+
 	for (i = 0; i < length - 1; i++)
 	{
-		b_badgcr = is_bad_gcr(gcrdata, length, i);
-		n_badgcr = is_bad_gcr(gcrdata, length, i + 1);
+		/* fixups only touch bytes already passed, except byte 0 on the first pass */
+		if (i + 1 >= map.length || i == 1)
+		{
+			b_badgcr = is_bad_gcr(gcrdata, length, i);
+			n_badgcr = is_bad_gcr(gcrdata, length, i + 1);
+		}
+		else
+		{
+			b_badgcr = BADGCR_BIT(&map, i);
+			n_badgcr = BADGCR_BIT(&map, i + 1);
+		}
 
 		switch (sbadgcr)
 		{
@@ -1753,7 +3278,7 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				{
 					total++;
 
-					if(fix_gcr > 2)
+					if(ctx->fix_gcr > 2)
 					{
 						sbadgcr = S_BADGCR_LOST;  /* most aggressive */
 						gcrdata[lastpos] = 0x00;
@@ -1764,14 +3289,14 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				break;
 
 			case S_BADGCR_ONCE_BAD:
-				if ((b_badgcr) || ((fix_gcr>3) && (n_badgcr)) )
+				if ((b_badgcr) || ((ctx->fix_gcr>3) && (n_badgcr)) )
 				{
 					total++;
 					sbadgcr = S_BADGCR_LOST;
 
-					if(fix_gcr > 1)
+					if(ctx->fix_gcr > 1)
 						fix_first_gcr(gcrdata, length, lastpos);
-					else if (fix_gcr > 2)
+					else if (ctx->fix_gcr > 2)
 						gcrdata[lastpos] = 0x00;
 				}
 				else
@@ -1779,20 +3304,20 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				break;
 
 			case S_BADGCR_LOST:
-				if ((b_badgcr) || ((fix_gcr>3) && (n_badgcr)) )
+				if ((b_badgcr) || ((ctx->fix_gcr>3) && (n_badgcr)) )
 				{
 					total++;
 
-					if (fix_gcr)
+					if (ctx->fix_gcr)
 						gcrdata[lastpos] = 0x00;
 				}
 				else
 				{
 					sbadgcr = S_BADGCR_OK;
 
-					if(fix_gcr > 1)
+					if(ctx->fix_gcr > 1)
 						fix_last_gcr(gcrdata, length, lastpos);
-					else if(fix_gcr > 2)
+					else if(ctx->fix_gcr > 2)
 						gcrdata[lastpos] = 0x00;
 				}
 				break;
@@ -1801,3 +3326,9 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 	}
 	return total;
 }
+
+size_t
+check_bad_gcr(BYTE * gcrdata, size_t length)
+{
+	return check_bad_gcr_r(default_align_context(), gcrdata, length);
+}
@@ -28,6 +28,7 @@
 #define BLOCKSEXTRA 85
 #define MAXBLOCKSONDISK (BLOCKSONDISK+BLOCKSEXTRA)
 #define MAX_TRACK_D64 40
+#define MAX_SECTORS_D64 21
 
 #define SYNC_LENGTH 	5
 #define HEADER_LENGTH 	10
@@ -82,6 +83,14 @@ speed zone divisors are 13, 14, 15, 16 for densities 3, 2, 1, 0 respectively
     This keeps us from getting errors in the track cycle detection */
 #define CAP_ALLOWANCE 0xff
 
+/* a track cycle repeating less than this percentage of its bytes is a chance match */
+#define MIN_CYCLE_CONFIDENCE 50
+
+/* bytes compared per bit length by the bit cycle finder, and percentage of equal bits needed */
+#define BIT_CYCLE_COMPARE 1024
+#define BIT_CYCLE_MIN_COMPARE 64
+#define MIN_BIT_CYCLE_CONFIDENCE 90
+
 /* minimum amount of good sequential GCR for formatted track */
 #define GCR_MIN_FORMATTED 16
 /*#define GCR_MIN_FORMATTED 64 */	/* chessmaster track 29 */
@@ -119,6 +128,87 @@ speed zone divisors are 13, 14, 15, 16 for densities 3, 2, 1, 0 respectively
 #define REDUCE_GAP		0x2
 #define REDUCE_BAD		0x4
 
+/* sector headers indexed per track, enough for non-standard sector counts */
+#define SECTOR_INDEX_SIZE 32
+
+struct sector_cache;
+
+/* single-pass index of the block headers in a track cycle */
+typedef struct
+{
+	BYTE *gcr_start;	/* indexed track cycle */
+	BYTE *gcr_end;
+	int track;
+	BYTE id[2];
+	int valid;			/* cycle is not empty */
+	int has_sync;		/* at least one sync found */
+	int sectors;		/* number of sectors found */
+	BYTE *header[SECTOR_INDEX_SIZE];		/* first matching header (0x52 byte) or NULL */
+	BYTE header_error[SECTOR_INDEX_SIZE];	/* result of the header checks */
+	BYTE *data[SECTOR_INDEX_SIZE];			/* data block following header or NULL */
+	struct sector_cache *cache;			/* decoded sectors of an attached image, or NULL */
+} sector_index;
+
+/* syncs of a track buffer, one entry per run of sync bytes */
+#define SYNC_MAP_SIZE (NIB_TRACK_LENGTH / 2)
+
+typedef struct
+{
+	BYTE *buffer;		/* mapped area */
+	BYTE *end;
+	int overflow;		/* area too large to map, queries fall back to scanning */
+	int syncs;
+	int headers;
+	int marks;
+	unsigned short sync_start[SYNC_MAP_SIZE];	/* byte carrying the first sync bits */
+	unsigned short sync_end[SYNC_MAP_SIZE];		/* first byte after the sync */
+	unsigned short header_end[SYNC_MAP_SIZE];	/* sync_end of syncs followed by 0x52 */
+	unsigned short mark[SYNC_MAP_SIZE];			/* every 0xff 0x52 pair */
+} sync_map;
+
+/* bytes of a track buffer that contain a "000" bit run, one bit per byte */
+#define BADGCR_MAP_LENGTH (NIB_TRACK_LENGTH * 2)
+#define BADGCR_BIT(map, pos) (((map)->bits[(pos) >> 5] >> ((pos) & 31)) & 1)
+
+typedef struct
+{
+	size_t length;		/* mapped bytes, longer areas are cut off */
+	size_t total;		/* bad GCR bytes */
+	size_t runs;		/* runs of bad GCR bytes */
+	size_t longest;		/* longest run */
+	DWORD bits[BADGCR_MAP_LENGTH / 32];
+} badgcr_map;
+
+/* options and state of the track extraction pipeline, one per concurrent caller */
+typedef struct
+{
+	int gap_match_length;
+	int cap_min_ignore;
+	int fix_gcr;
+	int reduce_sync;
+	int verbose;
+	BYTE *align_map;	/* forced alignments, only read */
+	BYTE *reduce_map;
+	int rl_tv;			/* RapidLok TV standard, remembered from track 17 */
+	int sync_align_buffer;	/* set by the loaders for extended G64 images */
+	int fattrack;		/* FAT track option, the loaders set the one found */
+	int jobs;			/* threads it may start for its tracks, 1 in a worker */
+	size_t capacity[4];	/* per density, write_g64 sets it from rpm_real */
+	BYTE fillbyte;		/* for missing D64 sectors, write_g64 leaves the one of its last track */
+	FILE *log;			/* diagnostics, NULL discards them */
+	int buffered;		/* collect diagnostics in log_buffer instead */
+	char *log_buffer;	/* allocated, owned by the caller */
+	size_t log_used;
+	size_t log_size;
+} align_context;
+
+/* lets the compiler check align_printf() formats */
+#if defined(__GNUC__) || defined(__clang__)
+#define ALIGN_PRINTF_FORMAT __attribute__((format(printf, 2, 3)))
+#else
+#define ALIGN_PRINTF_FORMAT
+#endif
+
 /* global variables */
 extern BYTE sector_map[];
 extern BYTE sector_gap_length[];
@@ -138,22 +228,53 @@ extern char alignments[][20];
 /* prototypes */
 int find_sync(BYTE ** gcr_pptr, BYTE * gcr_end);
 int find_header(BYTE ** gcr_pptr, BYTE * gcr_end);
+void build_sync_map(BYTE * buffer, BYTE * end, sync_map * map);
+int map_find_sync(sync_map * map, BYTE ** gcr_pptr);
+int map_find_header(sync_map * map, BYTE ** gcr_pptr);
 void convert_4bytes_to_GCR(BYTE * buffer, BYTE * ptr);
+void convert_block_to_GCR(BYTE * plain, BYTE * gcr, int groups);
 int convert_4bytes_from_GCR(BYTE * gcr, BYTE * plain);
+int convert_GCR_block(BYTE * gcr, BYTE * plain, BYTE * badmap, BYTE * checksum);
+void init_GCR_tables(void);
 int extract_id(BYTE * gcr_track, BYTE * id);
 int extract_cosmetic_id(BYTE * gcr_track, BYTE * id);
+void init_align_context(align_context * ctx);
+align_context * default_align_context(void);
+void align_puts(align_context * ctx, const char *text);
+void align_printf(align_context * ctx, const char *format, ...) ALIGN_PRINTF_FORMAT;
 size_t find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_cycle_headers_r(align_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
 size_t find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_cycle_syncs_r(align_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
 size_t find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_cycle_raw_r(align_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_cycle_bits(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, int *bit_offset);
+size_t find_track_cycle_bits_r(align_context * ctx, BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, int *bit_offset);
+int cycle_confidence(BYTE * cycle_start, BYTE * cycle_stop, BYTE * track_end);
 BYTE convert_GCR_sector(BYTE * gcr_start, BYTE * gcr_end, BYTE * d64_sector, int track, int sector, BYTE * id);
+void index_GCR_sectors(BYTE * gcr_start, BYTE * gcr_end, int track, BYTE * id, sector_index * index);
+BYTE convert_indexed_sector(sector_index * index, int sector, BYTE * d64_sector);
+void attach_sector_cache(BYTE * track_buffer);
+void flush_sector_cache(void);
+void invalidate_sector_cache(BYTE * gcrdata);
 void convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * diskID, int error);
+size_t convert_track_to_GCR(BYTE * sectors, BYTE * ptr, int track, BYTE * diskID, BYTE * errorinfo);
 BYTE * find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen);
 BYTE * find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen);
 size_t extract_GCR_track(BYTE * destination, BYTE * source, BYTE *align, int halftrack, size_t cap_min, size_t cap_max);
+size_t extract_GCR_track_r(align_context * ctx, BYTE * destination, BYTE * source, BYTE *align, int halftrack, size_t cap_min, size_t cap_max);
 int replace_bytes(BYTE * buffer, size_t length, BYTE srcbyte, BYTE dstbyte);
 size_t check_bad_gcr(BYTE * gcrdata, size_t length);
+size_t check_bad_gcr_r(align_context * ctx, BYTE * gcrdata, size_t length);
 BYTE check_sync_flags(BYTE * gcrdata, int density, size_t length);
 void bitshift(BYTE * gcrdata, size_t length, int bits);
+DWORD get_stream_bits(BYTE * buffer, size_t bit);
+void copy_bits(BYTE * dst, size_t dst_bit, BYTE * src, size_t src_bit, size_t count);
+void fill_bits(BYTE * dst, size_t dst_bit, size_t count, int one);
+void shift_bits_left(BYTE * buffer, size_t length, size_t bits, int one);
+void shift_bits_right(BYTE * buffer, size_t length, size_t bits, int one);
+size_t count_one_bits(BYTE * buffer, size_t bit, size_t end_bit);
+size_t find_sync_bits(BYTE * buffer, size_t bit, size_t end_bit);
 size_t check_errors(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring);
 size_t check_empty(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring);
 size_t compare_tracks(BYTE * track1, BYTE * track2, size_t length1, size_t  length2, int same_disk, char * outputstring);
@@ -165,6 +286,8 @@ size_t kill_partial_sync(BYTE * gcrdata, size_t length, size_t length_max);
 size_t strip_gaps(BYTE * buffer, size_t length);
 size_t reduce_gaps(BYTE * buffer, size_t length, size_t length_max);
 size_t is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos);
+size_t build_badgcr_map(BYTE * gcrdata, size_t length, badgcr_map * map);
+size_t next_badgcr_run(badgcr_map * map, size_t pos, size_t end, size_t * run);
 int check_formatted(BYTE * gcrdata, size_t length);
 int check_valid_data(BYTE * data, int matchlen);
 char topetscii(char s);
@@ -1,10 +1,64 @@
 #include <opencbm.h>
 #include <unistd.h>
+#include <pthread.h>
 
+#ifdef VDRIVE
+/* the virtual drive (vdrive.c) keeps its own clock */
+void vdrive_delay(int ms);
+#define delay(x)  vdrive_delay(x)
+#else
 #define delay(x)  usleep((x) * 1000)
+#endif
 #define msleep(x) delay(x)
 
 #define ARCH_MAINDECL
 #define ARCH_SIGNALDECL
 
 typedef unsigned char BYTE;
+
+/* worker threads for track processing */
+#define ARCH_THREADS
+#define ARCH_THREADFUNC void *
+typedef pthread_t arch_thread;
+#define arch_thread_create(t, f, arg) (pthread_create((t), NULL, (f), (arg)) == 0)
+#define arch_thread_join(t) pthread_join((t), NULL)
+
+/* locking for threads that hand work to each other */
+#define ARCH_LOCKS
+typedef pthread_mutex_t arch_mutex;
+typedef pthread_cond_t arch_cond;
+#define arch_mutex_init(m) pthread_mutex_init((m), NULL)
+#define arch_mutex_destroy(m) pthread_mutex_destroy(m)
+#define arch_lock(m) pthread_mutex_lock(m)
+#define arch_unlock(m) pthread_mutex_unlock(m)
+#define arch_cond_init(c) pthread_cond_init((c), NULL)
+#define arch_cond_destroy(c) pthread_cond_destroy(c)
+#define arch_cond_wait(c, m) pthread_cond_wait((c), (m))
+#define arch_cond_broadcast(c) pthread_cond_broadcast(c)
+
+/* CPU time of the calling thread, where the includer enabled clock_gettime() */
+#include <time.h>
+#ifdef CLOCK_THREAD_CPUTIME_ID
+#define ARCH_THREAD_CLOCK
+#define arch_thread_clock(ts) clock_gettime(CLOCK_THREAD_CPUTIME_ID, (ts))
+#endif
+
+/* read-only mapping of image files */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#define ARCH_MMAP
+#define arch_map_file(fd, size) mmap(NULL, (size), PROT_READ, MAP_PRIVATE, (fd), 0)
+#define arch_map_failed(p) ((p) == MAP_FAILED)
+#define arch_unmap_file(p, size) munmap((p), (size))
+
+/* directory listing for collection scans */
+#include <dirent.h>
+#define ARCH_DIRS
+typedef DIR *arch_dir;
+typedef struct dirent *arch_dir_entry;
+#define arch_dir_open(path) opendir(path)
+#define arch_dir_read(d) readdir(d)
+#define arch_dir_name(e) ((e)->d_name)
+#define arch_dir_close(d) closedir(d)
+#define arch_is_dir(path, st) ((stat((path), (st)) == 0) && (S_ISDIR((st)->st_mode)))
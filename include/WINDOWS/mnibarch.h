@@ -5,3 +5,28 @@
 
 #define ARCH_MAINDECL __cdecl
 #define ARCH_SIGNALDECL __cdecl
+
+/* worker threads for track processing, the runtime has to be multithreaded */
+#if !defined(_MSC_VER) || defined(_MT)
+#include <process.h>
+#define ARCH_THREADS
+#define ARCH_THREADFUNC unsigned __stdcall
+typedef HANDLE arch_thread;
+#define arch_thread_create(t, f, arg) ((*(t) = (HANDLE)_beginthreadex(NULL, 0, (f), (arg), 0, NULL)) != 0)
+#define arch_thread_join(t) (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+
+/* locking for threads that hand work to each other, condition variables need Vista */
+#if defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0600)
+#define ARCH_LOCKS
+typedef CRITICAL_SECTION arch_mutex;
+typedef CONDITION_VARIABLE arch_cond;
+#define arch_mutex_init(m) InitializeCriticalSection(m)
+#define arch_mutex_destroy(m) DeleteCriticalSection(m)
+#define arch_lock(m) EnterCriticalSection(m)
+#define arch_unlock(m) LeaveCriticalSection(m)
+#define arch_cond_init(c) InitializeConditionVariable(c)
+#define arch_cond_destroy(c)
+#define arch_cond_wait(c, m) SleepConditionVariableCS((c), (m), INFINITE)
+#define arch_cond_broadcast(c) WakeAllConditionVariable(c)
+#endif
+#endif
@@ -24,11 +24,13 @@
 * slow. I recon the complexity is somewhere between O(n^2) and O(n^3),
 * depending on the input data.
 *
-* There is also a faster implementation that uses a large working buffer
-* in which a "jump table" is stored, which is used to quickly find
-* possible string matches (see the source code for LZ_CompressFast() for
-* more information). The faster method is an order of magnitude faster,
-* but still quite slow compared to other compression methods.
+* There is also a faster implementation that keeps hash chains of the
+* 4-byte strings in a fixed size window, and follows a limited number of
+* links per position (see the source code for LZ_CompressFastBlock() for
+* more information). The search effort is set by a compression level,
+* and lazy matching is used from level 4 up. The faster method is orders
+* of magnitude faster, but still quite slow compared to other compression
+* methods.
 *
 * The upside is that decompression is very fast, and the compression ratio
 * is often very good.
@@ -88,6 +90,22 @@
    you. */
 #define LZ_MAX_OFFSET 100000
 
+/* Hash chains of LZ_CompressFastBlock(). The window has to cover
+   LZ_MAX_OFFSET, the working memory is fixed at (hash + window) integers,
+   no matter how much data is compressed. */
+#define LZ_HASH_BITS   15
+#define LZ_HASH_SIZE   (1 << LZ_HASH_BITS)
+#define LZ_WINDOW_BITS 17
+#define LZ_WINDOW_SIZE (1 << LZ_WINDOW_BITS)
+#define LZ_WINDOW_MASK (LZ_WINDOW_SIZE - 1)
+#define LZ_NO_MATCH    0xffffffff
+
+/* Search effort per compression level: hash chain links to follow, and
+   the match length that ends the search early */
+static const unsigned int _LZ_Depth[ 10 ] = { 0, 4, 8, 16, 16, 32, 64, 256, 1024, 4096 };
+static const unsigned int _LZ_Nice[ 10 ]  = { 0, 16, 32, 64, 64, 128, 256, 1024, 4096, 65536 };
+#define LZ_LAZY_LEVEL  4
+
 
 
 /*************************************************************************
@@ -101,6 +119,8 @@
 #include <time.h>
 #include <ctype.h>
 
+#include "lz.h"
+
 
 /*************************************************************************
 * _LZ_StringCompare() - Return maximum length string match.
@@ -181,6 +201,176 @@ static int _LZ_ReadVarSize( unsigned int * x, unsigned char * buf )
 
 
 
+/*************************************************************************
+* _LZ_Hash() - Hash of the 4-byte string at p.
+*************************************************************************/
+
+static unsigned int _LZ_Hash( unsigned char * p )
+{
+    unsigned int x;
+
+    x = ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+        ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+
+    return (x * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+
+/*************************************************************************
+* _LZ_GoodMatch() - Is a string reference shorter than the string?
+*************************************************************************/
+
+static int _LZ_GoodMatch( unsigned int length, unsigned int offset )
+{
+    return (length >= 8) ||
+           ((length == 4) && (offset <= 0x0000007f)) ||
+           ((length == 5) && (offset <= 0x00003fff)) ||
+           ((length == 6) && (offset <= 0x001fffff)) ||
+           ((length == 7) && (offset <= 0x0fffffff));
+}
+
+
+/*************************************************************************
+* _LZ_FindMatch() - Follow the hash chain for the longest string match
+* at inpos. Returns the match length (3 if there is none), and the
+* offset in *bestoffset.
+*************************************************************************/
+
+static unsigned int _LZ_FindMatch( unsigned char * in, unsigned int inpos,
+  unsigned int insize, unsigned int * head, unsigned int * chain,
+  unsigned int depth, unsigned int nice, unsigned int * bestoffset )
+{
+    unsigned int index, next, maxlength, length, bestlength;
+    unsigned char *ptr1, *ptr2;
+
+    bestlength = 3;
+    *bestoffset = 0;
+
+    /* Strings may overlap the current position, the decoder copies
+       byte by byte */
+    maxlength = insize - inpos;
+    if( maxlength < 4 )
+    {
+        return bestlength;
+    }
+
+    ptr1 = &in[ inpos ];
+    index = head[ _LZ_Hash( ptr1 ) ];
+    while( (index != LZ_NO_MATCH) && (depth -- > 0) &&
+           ((inpos - index) < LZ_MAX_OFFSET) )
+    {
+        /* Get pointer to candidate string */
+        ptr2 = &in[ index ];
+
+        /* Quickly determine if this is a candidate (for speed) */
+        if( ptr2[ bestlength ] == ptr1[ bestlength ] )
+        {
+            /* Count maximum length match at this offset */
+            length = _LZ_StringCompare( ptr1, ptr2, 0, maxlength );
+
+            /* Better match than any previous match? */
+            if( length > bestlength )
+            {
+                bestlength = length;
+                *bestoffset = inpos - index;
+                if( (length >= nice) || (length == maxlength) )
+                {
+                    break;
+                }
+            }
+        }
+
+        /* Chains only lead back, anything else is a reused slot */
+        next = chain[ index & LZ_WINDOW_MASK ];
+        if( next >= index )
+        {
+            break;
+        }
+        index = next;
+    }
+
+    return bestlength;
+}
+
+
+/*************************************************************************
+* _LZ_ReadVarSizeBounded() - Read a variable size number from at most n
+* bytes of buf. Returns the number of bytes read, 0 if the number needs
+* more than n bytes, or -1 if it is longer than five bytes.
+*************************************************************************/
+
+static int _LZ_ReadVarSizeBounded( unsigned int * x, unsigned char * buf,
+  unsigned int n )
+{
+    unsigned int y, b, num_bytes;
+
+    y = 0;
+    num_bytes = 0;
+    do
+    {
+        if( num_bytes >= 5 )
+        {
+            return -1;
+        }
+        if( num_bytes >= n )
+        {
+            return 0;
+        }
+        b = (unsigned int) buf[ num_bytes ++ ];
+        y = (y << 7) | (b & 0x0000007f);
+    }
+    while( b & 0x00000080 );
+
+    *x = y;
+    return num_bytes;
+}
+
+
+/*************************************************************************
+* _LZ_ReadToken() - Read the token that starts with a marker byte, and
+* has at most n bytes in buf. The length is 0 for the escaped marker
+* byte itself. Returns the size of the token, 0 if it needs more than n
+* bytes, or -1 if it is broken.
+*************************************************************************/
+
+static int _LZ_ReadToken( unsigned char * buf, unsigned int n,
+  unsigned int * length, unsigned int * offset )
+{
+    int a, b;
+
+    if( n < 2 )
+    {
+        return 0;
+    }
+
+    /* Single occurrence of the marker byte */
+    if( buf[ 1 ] == 0 )
+    {
+        *length = 0;
+        *offset = 0;
+        return 2;
+    }
+
+    /* Length and offset */
+    a = _LZ_ReadVarSizeBounded( length, &buf[ 1 ], n - 1 );
+    if( a <= 0 )
+    {
+        return a;
+    }
+    if( *length == 0 )
+    {
+        return -1;
+    }
+    b = _LZ_ReadVarSizeBounded( offset, &buf[ 1 + a ], n - 1 - a );
+    if( b <= 0 )
+    {
+        return b;
+    }
+
+    return 1 + a + b;
+}
+
+
 /*************************************************************************
 *                            PUBLIC FUNCTIONS                            *
 *************************************************************************/
@@ -322,62 +512,16 @@ int LZ_Compress( unsigned char *in, unsigned char *out, unsigned int insize )
 
 
 /*************************************************************************
-* LZ_CompressFast() - Compress a block of data using an LZ77 coder.
+* LZ_Marker() - Find the marker symbol for a block of data.
 *  in     - Input (uncompressed) buffer.
-*  out    - Output (compressed) buffer. This buffer must be 0.4% larger
-*           than the input buffer, plus one byte.
 *  insize - Number of input bytes.
-*  work   - Pointer to a temporary buffer (internal working buffer), which
-*           must be able to hold (insize+65536) unsigned integers.
-* The function returns the size of the compressed data.
+* The function returns the least common byte in the input.
 *************************************************************************/
 
-int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
+int LZ_Marker( unsigned char *in, unsigned int insize )
 {
-    unsigned char marker, symbol;
-    unsigned int  inpos, outpos, bytesleft, i, index, symbols;
-    unsigned int  offset, bestoffset;
-    unsigned int  maxlength, length, bestlength;
-    unsigned int  histogram[ 256 ], *lastindex, *jumptable;
-    unsigned char *ptr1, *ptr2;
-    unsigned int *work;
-
-    /* Do we have anything to compress? */
-    if( insize < 1 )
-    {
-        return 0;
-    }
-
-	if(!(work = calloc(insize+65536, sizeof(unsigned int))))
-	{
-		printf("Could not allocate compression buffer\n");
-		exit(0);
-	}
-
-    /* Assign arrays to the working area */
-    lastindex = work;
-    jumptable = &work[ 65536 ];
-
-    /* Build a "jump table". Here is how the jump table works:
-       jumptable[i] points to the nearest previous occurrence of the same
-       symbol pair as in[i]:in[i+1], so in[i] == in[jumptable[i]] and
-       in[i+1] == in[jumptable[i]+1], and so on... Following the jump table
-       gives a dramatic boost for the string search'n'match loop compared
-       to doing a brute force search. The jump table is built in O(n) time,
-       so it is a cheap operation in terms of time, but it is expensice in
-       terms of memory consumption. */
-    for( i = 0; i < 65536; ++ i )
-    {
-        lastindex[ i ] = 0xffffffff;
-    }
-    for( i = 0; i < insize-1; ++ i )
-    {
-        symbols = (((unsigned int)in[i]) << 8) | ((unsigned int)in[i+1]);
-        index = lastindex[ symbols ];
-        lastindex[ symbols ] = i;
-        jumptable[ i ] = index;
-    }
-    jumptable[ insize-1 ] = 0xffffffff;
+    unsigned char marker;
+    unsigned int  histogram[ 256 ], i;
 
     /* Create histogram */
     for( i = 0; i < 256; ++ i )
@@ -399,63 +543,120 @@ int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
         }
     }
 
-    /* Remember the marker symbol for the decoder */
-    out[ 0 ] = marker;
+    return marker;
+}
+
+
+/*************************************************************************
+* LZ_CompressFastBlock() - Compress part of a buffer, without the marker
+* byte in front. Strings may refer back to the data before the block, so
+* blocks compressed with the same marker can be concatenated into one
+* stream for LZ_Uncompress(), and still be compressed independently.
+*  in     - Input (uncompressed) buffer.
+*  out    - Output (compressed) buffer. This buffer must be 0.4% larger
+*           than the block, plus one byte.
+*  start  - Offset of the block in the input buffer.
+*  insize - Offset of the end of the block.
+*  marker - Marker symbol of the stream.
+*  level  - Compression level 1..9, 0 for LZ_DEFAULT_LEVEL.
+* The function returns the size of the compressed block.
+*************************************************************************/
+
+int LZ_CompressFastBlock( unsigned char *in, unsigned char *out,
+  unsigned int start, unsigned int insize, unsigned char marker, int level )
+{
+    unsigned char symbol;
+    unsigned int  inpos, outpos, bytesleft, i, h, base;
+    unsigned int  offset, length, nextoffset, nextlength;
+    unsigned int  depth, nice, lazy;
+    unsigned int  *head, *chain;
+    unsigned int *work;
+
+    /* Do we have anything to compress? */
+    if( insize <= start )
+    {
+        return 0;
+    }
+
+    if( (level < 1) || (level > 9) )
+    {
+        level = LZ_DEFAULT_LEVEL;
+    }
+    depth = _LZ_Depth[ level ];
+    nice = _LZ_Nice[ level ];
+    lazy = (level >= LZ_LAZY_LEVEL);
+
+	if(!(work = malloc((LZ_HASH_SIZE + LZ_WINDOW_SIZE) * sizeof(unsigned int))))
+	{
+		printf("Could not allocate compression buffer\n");
+		exit(0);
+	}
+
+    /* Assign arrays to the working area. head[h] is the latest position
+       of a string with hash h, chain[] links each position to the one
+       before it with the same hash, in a window of LZ_WINDOW_SIZE. */
+    head = work;
+    chain = &work[ LZ_HASH_SIZE ];
+    memset( head, 0xff, LZ_HASH_SIZE * sizeof(unsigned int) );
+
+#define LZ_INSERT( pos ) \
+    if( (pos) + 4 <= insize ) \
+    { \
+        h = _LZ_Hash( &in[ pos ] ); \
+        chain[ (pos) & LZ_WINDOW_MASK ] = head[ h ]; \
+        head[ h ] = (pos); \
+    }
+
+    /* Only the history window before the block can be referenced */
+    base = (start > LZ_MAX_OFFSET) ? start - LZ_MAX_OFFSET : 0;
+    for( i = base; i < start; ++ i )
+    {
+        LZ_INSERT( i );
+    }
 
     /* Start of compression */
-    inpos = 0;
-    outpos = 1;
+    inpos = start;
+    outpos = 0;
 
     /* Main compression loop */
-    bytesleft = insize;
+    bytesleft = insize - start;
+    length = _LZ_FindMatch( in, inpos, insize, head, chain, depth, nice, &offset );
     do
     {
-        /* Get pointer to current position */
-        ptr1 = &in[ inpos ];
+        LZ_INSERT( inpos );
 
-        /* Search history window for maximum length string match */
-        bestlength = 3;
-        bestoffset = 0;
-        index = jumptable[ inpos ];
-        while( (index != 0xffffffff) && ((inpos - index) < LZ_MAX_OFFSET) )
+        /* Was there a good enough match? */
+        if( _LZ_GoodMatch( length, offset ) )
         {
-            /* Get pointer to candidate string */
-            ptr2 = &in[ index ];
-
-            /* Quickly determine if this is a candidate (for speed) */
-            if( ptr2[ bestlength ] == ptr1[ bestlength ] )
+            /* Lazy matching: rather take a longer match one byte later */
+            if( lazy && (bytesleft > 4) && (length < nice) )
             {
-                /* Determine maximum length for this offset */
-                offset = inpos - index;
-                maxlength = (bytesleft < offset ? bytesleft : offset);
-
-                /* Count maximum length match at this offset */
-                length = _LZ_StringCompare( ptr1, ptr2, 2, maxlength );
-
-                /* Better match than any previous match? */
-                if( length > bestlength )
+                nextlength = _LZ_FindMatch( in, inpos + 1, insize, head, chain,
+                    depth, nice, &nextoffset );
+                if( (nextlength > length) && _LZ_GoodMatch( nextlength, nextoffset ) )
                 {
-                    bestlength = length;
-                    bestoffset = offset;
+                    symbol = in[ inpos ++ ];
+                    out[ outpos ++ ] = symbol;
+                    if( symbol == marker )
+                    {
+                        out[ outpos ++ ] = 0;
+                    }
+                    -- bytesleft;
+                    length = nextlength;
+                    offset = nextoffset;
+                    continue;
                 }
             }
 
-            /* Get next possible index from jump table */
-            index = jumptable[ index ];
-        }
-
-        /* Was there a good enough match? */
-        if( (bestlength >= 8) ||
-            ((bestlength == 4) && (bestoffset <= 0x0000007f)) ||
-            ((bestlength == 5) && (bestoffset <= 0x00003fff)) ||
-            ((bestlength == 6) && (bestoffset <= 0x001fffff)) ||
-            ((bestlength == 7) && (bestoffset <= 0x0fffffff)) )
-        {
             out[ outpos ++ ] = (unsigned char) marker;
-            outpos += _LZ_WriteVarSize( bestlength, &out[ outpos ] );
-            outpos += _LZ_WriteVarSize( bestoffset, &out[ outpos ] );
-            inpos += bestlength;
-            bytesleft -= bestlength;
+            outpos += _LZ_WriteVarSize( length, &out[ outpos ] );
+            outpos += _LZ_WriteVarSize( offset, &out[ outpos ] );
+            for( i = 1; i < length; ++ i )
+            {
+                LZ_INSERT( inpos + i );
+            }
+            inpos += length;
+            bytesleft -= length;
         }
         else
         {
@@ -468,9 +669,13 @@ int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
             }
             -- bytesleft;
         }
+
+        length = _LZ_FindMatch( in, inpos, insize, head, chain, depth, nice, &offset );
     }
     while( bytesleft > 3 );
 
+#undef LZ_INSERT
+
     /* Dump remaining bytes, if any */
     while( inpos < insize )
     {
@@ -492,6 +697,51 @@ int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
 }
 
 
+/*************************************************************************
+* LZ_CompressLevel() - Compress a block of data using an LZ77 coder.
+*  in     - Input (uncompressed) buffer.
+*  out    - Output (compressed) buffer. This buffer must be 0.4% larger
+*           than the input buffer, plus one byte.
+*  insize - Number of input bytes.
+*  level  - Compression level 1..9, 0 for LZ_DEFAULT_LEVEL.
+* The function returns the size of the compressed data.
+*************************************************************************/
+
+int LZ_CompressLevel( unsigned char *in, unsigned char *out, unsigned int insize,
+  int level )
+{
+    unsigned char marker;
+
+    /* Do we have anything to compress? */
+    if( insize < 1 )
+    {
+        return 0;
+    }
+
+    /* Remember the marker symbol for the decoder */
+    marker = (unsigned char) LZ_Marker( in, insize );
+    out[ 0 ] = marker;
+
+    return 1 + LZ_CompressFastBlock( in, out + 1, 0, insize, marker, level );
+}
+
+
+/*************************************************************************
+* LZ_CompressFast() - Compress a block of data using an LZ77 coder, at
+* the default level.
+*  in     - Input (uncompressed) buffer.
+*  out    - Output (compressed) buffer. This buffer must be 0.4% larger
+*           than the input buffer, plus one byte.
+*  insize - Number of input bytes.
+* The function returns the size of the compressed data.
+*************************************************************************/
+
+int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize)
+{
+    return LZ_CompressLevel( in, out, insize, LZ_DEFAULT_LEVEL );
+}
+
+
 /*************************************************************************
 * LZ_Uncompress() - Uncompress a block of data using an LZ77 decoder.
 *  in      - Input (compressed) buffer.
@@ -553,3 +803,275 @@ int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
 
     return outpos;
 }
+
+
+/*************************************************************************
+* LZ_UncompressBounded() - Uncompress a block of data using an LZ77
+* decoder, without writing past the end of the output buffer.
+*  in      - Input (compressed) buffer.
+*  out     - Output (uncompressed) buffer.
+*  insize  - Number of input bytes.
+*  outsize - Size of the output buffer.
+* The function returns the size of the uncompressed data, or 0 if the
+* input is corrupt or does not fit in the output buffer.
+*************************************************************************/
+
+int LZ_UncompressBounded( unsigned char *in, unsigned char *out,
+  unsigned int insize, unsigned int outsize )
+{
+    /* Do we have anything to uncompress? */
+    if( insize < 1 )
+    {
+        return 0;
+    }
+
+    return LZ_UncompressBlock( in + 1, out, 0, insize - 1, in[ 0 ], outsize );
+}
+
+
+/*************************************************************************
+* LZ_UncompressBlock() - Uncompress a block made by LZ_CompressFastBlock(),
+* without writing past the end of the output buffer. Strings may refer
+* back to the output before the block.
+*  in      - Input (compressed) block, without a marker byte.
+*  out     - Output buffer, holding the data before the block.
+*  start   - Offset of the block in the output buffer.
+*  insize  - Number of input bytes.
+*  marker  - Marker symbol of the stream.
+*  outsize - Size of the output buffer.
+* The function returns the offset of the end of the block, or 0 if the
+* input is corrupt or does not fit in the output buffer.
+*************************************************************************/
+
+int LZ_UncompressBlock( unsigned char *in, unsigned char *out,
+  unsigned int start, unsigned int insize, unsigned char marker,
+  unsigned int outsize )
+{
+    unsigned char symbol;
+    unsigned int  i, inpos, outpos, length, offset;
+    int           n;
+
+    /* Main decompression loop */
+    inpos = 0;
+    outpos = start;
+    while( inpos < insize )
+    {
+        symbol = in[ inpos ];
+        if( symbol == marker )
+        {
+            n = _LZ_ReadToken( &in[ inpos ], insize - inpos, &length, &offset );
+            if( n <= 0 )
+            {
+                return 0;
+            }
+            inpos += n;
+
+            if( length == 0 )
+            {
+                /* It was a single occurrence of the marker byte */
+                if( outpos >= outsize )
+                {
+                    return 0;
+                }
+                out[ outpos ++ ] = marker;
+            }
+            else
+            {
+                /* The string has to be in the output so far, and fit */
+                if( (offset == 0) || (offset > outpos) ||
+                    (length > outsize - outpos) )
+                {
+                    return 0;
+                }
+
+                /* Copy corresponding data from history window */
+                for( i = 0; i < length; ++ i )
+                {
+                    out[ outpos ] = out[ outpos - offset ];
+                    ++ outpos;
+                }
+            }
+        }
+        else
+        {
+            /* No marker, plain copy */
+            if( outpos >= outsize )
+            {
+                return 0;
+            }
+            out[ outpos ++ ] = symbol;
+            ++ inpos;
+        }
+    }
+
+    return outpos;
+}
+
+
+/*************************************************************************
+* LZ_StreamInit() - Prepare a stream decoder for a new stream.
+*  s       - Decoder state.
+*************************************************************************/
+
+void LZ_StreamInit( lz_stream *s )
+{
+    s->tokenlen = 0;
+    s->total = 0;
+    s->length = 0;
+    s->offset = 0;
+    s->state = 0;
+    s->marker = 0;
+}
+
+
+/*************************************************************************
+* LZ_StreamUncompress() - Uncompress the next part of a stream. The
+* compressed data may be cut into chunks of any size, and the output is
+* written in chunks of at most outsize bytes. The decoder keeps the last
+* LZ_STREAM_WINDOW bytes of output itself, so the caller can reuse out.
+*  s       - Decoder state, see LZ_StreamInit().
+*  in      - Next chunk of input (compressed) data.
+*  insize  - Number of input bytes.
+*  inused  - Number of input bytes taken. They are all taken, unless the
+*            output buffer got full.
+*  out     - Output (uncompressed) buffer.
+*  outsize - Size of the output buffer.
+* The function returns the number of bytes written to out, or -1 if the
+* stream is corrupt.
+*************************************************************************/
+
+int LZ_StreamUncompress( lz_stream *s, unsigned char *in, unsigned int insize,
+  unsigned int *inused, unsigned char *out, unsigned int outsize )
+{
+    unsigned char symbol;
+    unsigned int  inpos, outpos, length, offset;
+    int           n = 0;
+
+    inpos = 0;
+    outpos = 0;
+    *inused = 0;
+
+    if( s->state < 0 )
+    {
+        return -1;
+    }
+
+    /* Get marker symbol from input stream */
+    if( s->state == 0 )
+    {
+        if( insize < 1 )
+        {
+            return 0;
+        }
+        s->marker = in[ inpos ++ ];
+        s->state = 1;
+    }
+
+    while( 1 )
+    {
+        /* Copy what is left of a string from the history window */
+        while( (s->length > 0) && (outpos < outsize) )
+        {
+            symbol = s->window[ (s->total - s->offset) & (LZ_STREAM_WINDOW - 1) ];
+            s->window[ s->total ++ & (LZ_STREAM_WINDOW - 1) ] = symbol;
+            out[ outpos ++ ] = symbol;
+            -- s->length;
+        }
+        if( (outpos >= outsize) || (inpos >= insize) )
+        {
+            break;
+        }
+
+        /* No marker, plain copy */
+        if( (s->tokenlen == 0) && (in[ inpos ] != s->marker) )
+        {
+            symbol = in[ inpos ++ ];
+            s->window[ s->total ++ & (LZ_STREAM_WINDOW - 1) ] = symbol;
+            out[ outpos ++ ] = symbol;
+            continue;
+        }
+
+        /* Read a token, or finish the one the last chunk cut off */
+        if( s->tokenlen == 0 )
+        {
+            n = _LZ_ReadToken( &in[ inpos ], insize - inpos, &length, &offset );
+            if( n == 0 )
+            {
+                if( insize - inpos >= LZ_TOKEN_MAX )
+                {
+                    n = -1;
+                    break;
+                }
+                while( inpos < insize )
+                {
+                    s->token[ s->tokenlen ++ ] = in[ inpos ++ ];
+                }
+                break;
+            }
+            if( n > 0 )
+            {
+                inpos += n;
+            }
+        }
+        else
+        {
+            if( s->tokenlen >= LZ_TOKEN_MAX )
+            {
+                n = -1;
+                break;
+            }
+            s->token[ s->tokenlen ++ ] = in[ inpos ++ ];
+            n = _LZ_ReadToken( s->token, s->tokenlen, &length, &offset );
+            if( n == 0 )
+            {
+                continue;
+            }
+            s->tokenlen = 0;
+        }
+        if( n < 0 )
+        {
+            break;
+        }
+
+        if( length == 0 )
+        {
+            /* It was a single occurrence of the marker byte */
+            s->window[ s->total ++ & (LZ_STREAM_WINDOW - 1) ] = s->marker;
+            out[ outpos ++ ] = s->marker;
+        }
+        else
+        {
+            /* The string has to be in the history window */
+            if( (offset == 0) || (offset > s->total) ||
+                (offset > LZ_STREAM_WINDOW) )
+            {
+                n = -1;
+                break;
+            }
+            s->length = length;
+            s->offset = offset;
+        }
+    }
+
+    *inused = inpos;
+    if( n < 0 )
+    {
+        s->state = -1;
+        return -1;
+    }
+
+    return outpos;
+}
+
+
+/*************************************************************************
+* LZ_StreamEnd() - Check that a stream did not stop in the middle of a
+* token or string.
+*  s       - Decoder state.
+* The function returns 1 if all of the stream has been written out.
+*************************************************************************/
+
+int LZ_StreamEnd( lz_stream *s )
+{
+    return (s->state == 1) && (s->tokenlen == 0) && (s->length == 0);
+}
@@ -37,13 +37,49 @@ extern "C" {
 #endif
 
 
+/* Compression level used by LZ_CompressFast(), levels go from 1 (fast)
+   to 9 (small) */
+#define LZ_DEFAULT_LEVEL 6
+
+/* History kept by the stream decoder, a power of two that covers the
+   largest string offset of the coder */
+#define LZ_STREAM_WINDOW (1 << 17)
+#define LZ_TOKEN_MAX     11
+
+/* State of a stream decoder, see LZ_StreamUncompress() */
+typedef struct
+{
+    unsigned char window[ LZ_STREAM_WINDOW ];  /* last output bytes */
+    unsigned char token[ LZ_TOKEN_MAX ];       /* token cut by a chunk end */
+    unsigned int  tokenlen;
+    unsigned int  total;                       /* output so far */
+    unsigned int  length, offset;              /* string not copied yet */
+    int           state;                       /* 0 new, 1 running, -1 bad */
+    unsigned char marker;
+} lz_stream;
+
+
 /*************************************************************************
 * Function prototypes
 *************************************************************************/
 
 int LZ_Compress( unsigned char *in, unsigned char *out, unsigned int insize );
 int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize);
+int LZ_CompressLevel( unsigned char *in, unsigned char *out, unsigned int insize,
+  int level );
+int LZ_CompressFastBlock( unsigned char *in, unsigned char *out,
+  unsigned int start, unsigned int insize, unsigned char marker, int level );
+int LZ_Marker( unsigned char *in, unsigned int insize );
 int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize );
+int LZ_UncompressBounded( unsigned char *in, unsigned char *out,
+  unsigned int insize, unsigned int outsize );
+int LZ_UncompressBlock( unsigned char *in, unsigned char *out,
+  unsigned int start, unsigned int insize, unsigned char marker,
+  unsigned int outsize );
+void LZ_StreamInit( lz_stream *s );
+int LZ_StreamUncompress( lz_stream *s, unsigned char *in, unsigned int insize,
+  unsigned int *inused, unsigned char *out, unsigned int outsize );
+int LZ_StreamEnd( lz_stream *s );
 
 
 #ifdef __cplusplus
@@ -0,0 +1,251 @@
+/*
+    NIBBENCH - part of the NIBTOOLS package for 1541/1571 disk image nibbling
+
+	Measures NBZ compression and decompression speed on a NIB or NBZ
+	image, single threaded at each compression level and with the -j
+	parallel compressor.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mnibarch.h"
+#include "gcr.h"
+#include "nibtools.h"
+#include "lz.h"
+
+#define BENCH_SECONDS 3
+
+int _dowildcard = 1;
+
+BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+BYTE check_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+BYTE track_density[MAX_HALFTRACKS_1541 + 2];
+BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
+size_t track_length[MAX_HALFTRACKS_1541 + 2];
+int file_buffer_size, compressed_size;
+int start_track, end_track, track_inc;
+int reduce_sync, reduce_badgcr, reduce_gap;
+int fix_gcr, align, force_align;
+int gap_match_length;
+int cap_min_ignore;
+int skip_halftracks;
+int verbose;
+int rpm_real;
+int auto_capacity_adjust;
+int skew;
+int align_disk;
+int ihs;
+int mode;
+int unformat_passes;
+int capacity_margin;
+int align_delay;
+int increase_sync = 0;
+int presync = 0;
+BYTE fillbyte = 0xfe;
+BYTE drive = 8;
+char * cbm_adapter = "";
+int use_floppycode_srq = 0;
+int override_srq = 0;
+int extra_capacity_margin=5;
+int sync_align_buffer=0;
+int fattrack=0;
+int track_match=0;
+int old_g64=0;
+int read_killer=1;
+int backwards=0;
+int align_jobs=1;
+int compress_level=0;
+
+typedef void (*bench_func)(void);
+
+static void
+bench_serial(void)
+{
+	compressed_size = LZ_CompressLevel(file_buffer, compressed_buffer, file_buffer_size, compress_level);
+}
+
+static void
+bench_parallel(void)
+{
+	compressed_size = compress_nbz(file_buffer, compressed_buffer, file_buffer_size);
+}
+
+static void
+bench_uncompress(void)
+{
+	LZ_Uncompress(compressed_buffer, check_buffer, compressed_size);
+}
+
+/*
+	Round trip a buffer of runs and short repeated patterns at every level.
+	The match finder lets strings overlap the bytes they copy, which is how
+	the runs compress, so all decoders have to copy them byte by byte.
+	The stream decoder gets the data in small chunks to cut tokens.
+*/
+static void
+check_overlap(void)
+{
+	lz_stream stream;
+	unsigned int used;
+	int i, size, level, in, out, n;
+
+	size = 0;
+	for (i = 1; size < 0x10000; i++)
+	{
+		/* a run of one byte, then a pattern of 2-9 bytes many times over */
+		memset(file_buffer + size, i & 0xff, 3 + (i * 37) % 200);
+		size += 3 + (i * 37) % 200;
+		for (n = 0; n < 20 + (i * 13) % 300; n++, size++)
+			file_buffer[size] = (BYTE) ((n % (2 + i % 8)) * 0x55 + i);
+		file_buffer[size++] = (BYTE) (i * 7);
+	}
+
+	for (level = 1; level <= 9; level++)
+	{
+		compressed_size = LZ_CompressLevel(file_buffer, compressed_buffer, size, level);
+
+		if ((LZ_UncompressBounded(compressed_buffer, check_buffer, compressed_size, size) != size) ||
+			(memcmp(file_buffer, check_buffer, size) != 0))
+		{
+			printf("Level %d does not decode overlapping strings!\n", level);
+			exit(1);
+		}
+
+		LZ_StreamInit(&stream);
+		in = out = 0;
+		while (in < compressed_size)
+		{
+			n = LZ_StreamUncompress(&stream, compressed_buffer + in,
+				(compressed_size - in < 5) ? compressed_size - in : 5, &used,
+				check_buffer + out, size - out);
+			if ((n < 0) || ((n == 0) && (used == 0))) break;
+			in += used;
+			out += n;
+		}
+		if ((out != size) || !LZ_StreamEnd(&stream) ||
+			(memcmp(file_buffer, check_buffer, size) != 0))
+		{
+			printf("Level %d does not stream decode overlapping strings!\n", level);
+			exit(1);
+		}
+	}
+	printf("Overlapping strings decode at all levels (%d bytes)\n", size);
+}
+
+/*
+	Run func for BENCH_SECONDS of wall time and return MB/s of image data.
+	time() only counts seconds, so the runs start on a clock tick and stop
+	on the tick that ends the last run.
+*/
+static double
+bench(bench_func func)
+{
+	time_t start, now;
+	long runs = 0;
+
+	start = time(NULL);
+	while ((now = time(NULL)) == start);
+	start = now;
+
+	do
+	{
+		func();
+		runs++;
+	}
+	while ((now = time(NULL)) - start < BENCH_SECONDS);
+
+	return ((double) file_buffer_size * runs) / (difftime(now, start) * 1024 * 1024);
+}
+
+static void
+report(char *name, double speed)
+{
+	printf("%-28s %8.2f MB/s  %7d bytes  %5.1f%%\n", name, speed,
+		compressed_size, 100.0 * compressed_size / file_buffer_size);
+}
+
+int ARCH_MAINDECL
+main(int argc, char **argv)
+{
+	char *filename;
+	char name[32];
+	double speed;
+	int jobs, level, first, last;
+
+	fprintf(stdout,
+		"\nnibbench - NBZ compression benchmark\n"
+		AUTHOR VERSION "\n\n");
+
+	while (--argc && (*(++argv)[0] == '-'))
+		parseargs(argv);
+
+	if (argc < 1) usage();
+	filename = argv[0];
+
+	check_overlap();
+
+	if (compare_extension((unsigned char *) filename, (unsigned char *) "NBZ"))
+	{
+		if(!(compressed_size = load_file(filename, compressed_buffer))) exit(0);
+		if(!(file_buffer_size = LZ_UncompressBounded(compressed_buffer, file_buffer, compressed_size, sizeof(file_buffer)))) exit(0);
+	}
+	else if (compare_extension((unsigned char *) filename, (unsigned char *) "NIB"))
+	{
+		if(!(file_buffer_size = load_file(filename, file_buffer))) exit(0);
+	}
+	else
+	{
+		printf("Unknown image type = %s!\n", filename);
+		exit(0);
+	}
+	printf("\n%d bytes of NIB data, %d seconds per test\n\n", file_buffer_size, BENCH_SECONDS);
+
+	/* -Z picks one level, otherwise all of them are measured */
+	level = first = last = compress_level;
+	if (!level)
+	{
+		first = 1;
+		last = 9;
+	}
+	jobs = align_jobs;
+	align_jobs = 1;
+	for (compress_level = first; compress_level <= last; compress_level++)
+	{
+		speed = bench(bench_serial);
+		sprintf(name, "LZ_CompressLevel, level %d", compress_level);
+		report(name, speed);
+	}
+	compress_level = level;
+
+	align_jobs = jobs;
+	speed = bench(bench_parallel);
+	sprintf(name, "compress_nbz, %d jobs", align_jobs);
+	report(name, speed);
+
+	/* the parallel stream has to decode like any other NBZ */
+	if ((LZ_Uncompress(compressed_buffer, check_buffer, compressed_size) != file_buffer_size) ||
+		(memcmp(file_buffer, check_buffer, file_buffer_size) != 0))
+	{
+		printf("Parallel stream does not decode to the input!\n");
+		exit(1);
+	}
+
+	speed = bench(bench_uncompress);
+	report("LZ_Uncompress", speed);
+
+	return 0;
+}
+
+void
+usage(void)
+{
+	printf(
+	"usage: nibbench [-j<jobs>] [-Z<level>] <filename>\n"
+	"\nsupported file extensions:\n"
+	"NIB, NBZ\n");
+	exit(1);
+}
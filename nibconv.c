@@ -4,17 +4,20 @@
     based on code from MNIB, by Dr. Markus Brenner
 */
 
+#define _DEFAULT_SOURCE		/* clock_gettime() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "mnibarch.h"
 #include "gcr.h"
 #include "nibtools.h"
-#include "lz.h"
 #include "prot.h"
+#include "crc.h"
 
 int _dowildcard = 1;
 
@@ -24,7 +27,6 @@ BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_density[MAX_HALFTRACKS_1541 + 2];
 BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
 size_t track_length[MAX_HALFTRACKS_1541 + 2];
-int file_buffer_size;
 int start_track, end_track, track_inc;
 int reduce_sync, reduce_badgcr, reduce_gap;
 int fix_gcr, align, force_align;
@@ -55,169 +57,695 @@ int track_match=0;
 int old_g64=0;
 int read_killer=1;
 int backwards=0;
+int align_jobs=1;
+int compress_level=0;
 
-int ARCH_MAINDECL
-main(int argc, char **argv)
+/* what to do with an output file that exists */
+#define OVERWRITE_ASK	0
+#define OVERWRITE_YES	1
+#define OVERWRITE_NO	2
+
+int overwrite = OVERWRITE_ASK;
+char *output_pattern = NULL;
+
+/* buffers of one conversion, the globals for a single one, a set per worker in a batch */
+typedef struct
 {
-	char inname[256], outname[256];
-	char *dotpos;
-	FILE *fp;
-	int t;
+	BYTE *track_buffer;
+	BYTE *track_density;
+	size_t *track_length;
+	BYTE *track_alignment;
+	BYTE *file_buffer;
+	BYTE *compressed_buffer;
+	int cache;				/* share decoded sectors between the output passes */
+	int thread_clock;		/* batch worker, its stages count its own thread only */
+	clock_t read_time, write_time;	/* CPU time spent per stage */
+} conversion;
 
-	start_track = 1 * 2;
-	end_track = 42 * 2;
-	track_inc = 1;
-	fix_gcr = 1;
-	reduce_sync = 4;
-	skip_halftracks = 0;
-	align = ALIGN_NONE;
-	force_align = ALIGN_NONE;
-	gap_match_length = 7;
-	cap_min_ignore = 0;
-	verbose = 0;
-	rpm_real = 295;
+static clock_t
+stage_clock(conversion *conv)
+{
+#ifdef ARCH_THREAD_CLOCK
+	struct timespec ts;
 
-	/* default is to reduce sync */
-	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
-	//memset(track_length, 0, MAX_TRACKS_1541+1);
-	for(t=0; t<MAX_TRACKS_1541+1; t++)
-		track_length[t] = NIB_TRACK_LENGTH; // I do not recall why this was done, but left at MAX
+	if ((conv->thread_clock) && (arch_thread_clock(&ts) == 0))
+		return (clock_t) ts.tv_sec * CLOCKS_PER_SEC + (clock_t) (ts.tv_nsec / (1000000000L / CLOCKS_PER_SEC));
+#endif
+	return clock();
+}
 
-	fprintf(stdout,
-		"\nnibconv - converts a CBM disk image from one format to another.\n"
-		AUTHOR VERSION "\n\n");
+/* every conversion starts from empty track buffers */
+static void
+clear_conversion(conversion *conv)
+{
+	int t;
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
+	memset(conv->track_buffer, 0x00, (MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH);
+	memset(conv->track_density, 0x00, MAX_HALFTRACKS_1541 + 2);
+	memset(conv->track_alignment, 0x00, MAX_HALFTRACKS_1541 + 2);
+	memset(conv->track_length, 0x00, (MAX_HALFTRACKS_1541 + 2) * sizeof(size_t));
+	for(t=0; t<MAX_TRACKS_1541+1; t++)
+		conv->track_length[t] = NIB_TRACK_LENGTH; // I do not recall why this was done, but left at MAX
+}
 
-	while (--argc && (*(++argv)[0] == '-'))
-		parseargs(argv);
+/*
+	Returns 0 if the file exists and is not to be replaced.  A batch never
+	asks, without -Y it skips existing files.
+*/
+static int
+check_overwrite(char *outname, int batch)
+{
+	FILE *fp;
+	int answer, c;
 
-	if(argc < 1)	usage();
+	if (!(fp=fopen(outname,"r")))
+		return 1;
+	fclose(fp);
 
-	strcpy(inname, argv[0]);
+	if (overwrite == OVERWRITE_YES)
+		return 1;
 
-	if(argc < 2)
+	if ((overwrite == OVERWRITE_NO) || (batch))
 	{
-		strcpy(outname, inname);
-		dotpos = strrchr(outname, '.');
-		if (dotpos != NULL) *dotpos = '\0';
-
-		 if(compare_extension(inname, "G64"))
-			strcat(outname, ".d64");
-		else
-			strcat(outname, ".g64");
+		printf("%s exists, skipped\n", outname);
+		return 0;
 	}
-	else
-		strcpy(outname, argv[1]);
 
-	printf("Converting %s -> %s\n\n",inname, outname);
+	printf("%s exists - Overwrite? (y/N)", outname);
+	answer = getchar();
 
-	if( (fp=fopen(outname,"r")) )
-	{
-		fclose(fp);
-		printf("File exists - Overwrite? (y/N)");
-		if(getchar() != 'y') exit(0);
-	}
+	/* leave nothing behind for the next question */
+	for (c = answer; (c != '\n') && (c != EOF); c = getchar());
+	return (answer == 'y');
+}
+
+static int
+convert(align_context *ctx, conversion *conv, char *inname, char *outname)
+{
+	clock_t start;
+	int file_buffer_size;
+
+	align_printf(ctx, "Converting %s -> %s\n\n",inname, outname);
 
 	/* convert */
-	if (compare_extension(inname, "D64"))
+	start = stage_clock(conv);
+	if (compare_extension((unsigned char *) inname, (unsigned char *) "D64"))
 	{
-		if(!(read_d64(inname, track_buffer, track_density, track_length))) exit(0);
+		if(!(read_d64_r(ctx, inname, conv->track_buffer, conv->track_density, conv->track_length))) return 0;
 		//skip_halftracks=1;
 	}
-	else if (compare_extension(inname, "G64"))
-	{
-		if(!(read_g64(inname, track_buffer, track_density, track_length))) exit(0);
-		if(sync_align_buffer)	sync_tracks(track_buffer, track_density, track_length, track_alignment);
-	}
-	else if (compare_extension(inname, "NBZ"))
+	else if (compare_extension((unsigned char *) inname, (unsigned char *) "G64"))
 	{
-		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(inname, compressed_buffer))) exit(0);
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
-		if( (compare_extension(outname, "G64")) || (compare_extension(outname, "D64")) )
-			align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_g64_r(ctx, inname, conv->track_buffer, conv->track_density, conv->track_length))) return 0;
+		if(ctx->sync_align_buffer)	sync_tracks_r(ctx, conv->track_buffer, conv->track_density, conv->track_length, conv->track_alignment);
 	}
-	else if (compare_extension(inname, "NIB"))
+	else if ((compare_extension((unsigned char *) inname, (unsigned char *) "NBZ")) || (compare_extension((unsigned char *) inname, (unsigned char *) "NBZ2")) ||
+		(compare_extension((unsigned char *) inname, (unsigned char *) "NIB")))
 	{
-		if(!(file_buffer_size = load_file(inname, file_buffer))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
-		if( (compare_extension(outname, "G64")) || (compare_extension(outname, "D64")) )
-			align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nib_file_r(ctx, inname, conv->track_buffer, conv->track_density, conv->track_length, conv->track_alignment,
+			(compare_extension((unsigned char *) outname, (unsigned char *) "G64")) || (compare_extension((unsigned char *) outname, (unsigned char *) "D64"))))) return 0;
+		search_fat_tracks_r(ctx, conv->track_buffer, conv->track_density, conv->track_length);
 	}
-	else if (compare_extension(inname, "NB2"))
+	else if (compare_extension((unsigned char *) inname, (unsigned char *) "NB2"))
 	{
-		if(!(read_nb2(inname, track_buffer, track_density, track_length))) exit(0);
-		if( (compare_extension(outname, "G64")) || (compare_extension(outname, "D64")) )
-			align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nb2_r(ctx, inname, conv->track_buffer, conv->track_density, conv->track_length))) return 0;
+		if( (compare_extension((unsigned char *) outname, (unsigned char *) "G64")) || (compare_extension((unsigned char *) outname, (unsigned char *) "D64")) )
+			align_tracks_r(ctx, conv->track_buffer, conv->track_density, conv->track_length, conv->track_alignment);
+		search_fat_tracks_r(ctx, conv->track_buffer, conv->track_density, conv->track_length);
 	}
 	else
 	{
-		printf("Unknown input file type\n");
-		exit(0);
+		align_printf(ctx, "Unknown input file type\n");
+		return 0;
 	}
+	conv->read_time += stage_clock(conv) - start;
+
+	/* share decoded sectors between the output passes */
+	if (conv->cache)
+		attach_sector_cache(conv->track_buffer);
 
-	if (compare_extension(outname, "D64"))
+	start = stage_clock(conv);
+	if (compare_extension((unsigned char *) outname, (unsigned char *) "D64"))
 	{
-		if(!(write_d64(outname, track_buffer, track_density, track_length))) exit(0);
-		printf("\nWARNING!\nConverting to D64 is a lossy conversion.\n");
-		printf("All individual sector header and gap information is lost.\n");
-		printf("It is suggested you use the G64 format for most disks.\n");
+		if(!(write_d64_r(ctx, outname, conv->track_buffer, conv->track_density, conv->track_length))) return 0;
+		align_printf(ctx, "\nWARNING!\nConverting to D64 is a lossy conversion.\n");
+		align_printf(ctx, "All individual sector header and gap information is lost.\n");
+		align_printf(ctx, "It is suggested you use the G64 format for most disks.\n");
 	}
-	else if (compare_extension(outname, "G64"))
+	else if (compare_extension((unsigned char *) outname, (unsigned char *) "G64"))
 	{
-		if(skip_halftracks) track_inc = 2;
-		if(!(write_g64(outname, track_buffer, track_density, track_length))) exit(0);
+		if(!(write_g64_r(ctx, outname, conv->track_buffer, conv->track_density, conv->track_length))) return 0;
 
-		if (compare_extension(inname, "D64"))
+		if (compare_extension((unsigned char *) inname, (unsigned char *) "D64"))
 		{
-			printf("\nWARNING!\nConverting from D64/G64 to G64 is not normally useful.\n");
-			printf("No individual sector header or gap information is stored in a D64 image,\n");
-			printf("so it has to be recontructed to make this conversion.  If the program you are\n");
-			printf("trying to use needs this information (such as for protection),\nit may still fail.\n");
+			align_printf(ctx, "\nWARNING!\nConverting from D64/G64 to G64 is not normally useful.\n");
+			align_printf(ctx, "No individual sector header or gap information is stored in a D64 image,\n");
+			align_printf(ctx, "so it has to be recontructed to make this conversion.  If the program you are\n");
+			align_printf(ctx, "trying to use needs this information (such as for protection),\nit may still fail.\n");
 		}
 	}
-	else if ((compare_extension(outname, "NBZ"))||(compare_extension(outname, "NIB")))
+	else if ((compare_extension((unsigned char *) outname, (unsigned char *) "NBZ"))||(compare_extension((unsigned char *) outname, (unsigned char *) "NBZ2"))||(compare_extension((unsigned char *) outname, (unsigned char *) "NIB")))
 	{
 		//if(skip_halftracks) track_inc = 1;
 		//else track_inc = 2; /* yes, I know it's reversed */
 
 		/* handle cases of making NIB from other formats for testing */
-		if( (compare_extension(inname, "D64")) ||
-			(compare_extension(inname, "G64")))
+		if( (compare_extension((unsigned char *) inname, (unsigned char *) "D64")) ||
+			(compare_extension((unsigned char *) inname, (unsigned char *) "G64")))
 		{
-			rig_tracks(track_buffer, track_density, track_length, track_alignment);
+			rig_tracks_r(ctx, conv->track_buffer, conv->track_density, conv->track_length, conv->track_alignment);
 		}
 
-		if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) exit(0);
-
-		if (compare_extension(outname, "NBZ"))
+		if (compare_extension((unsigned char *) outname, (unsigned char *) "NBZ2"))
 		{
-			if(!(file_buffer_size = LZ_CompressFast(file_buffer, compressed_buffer, file_buffer_size))) exit(0);
-			if(!(save_file(outname, compressed_buffer, file_buffer_size))) exit(0);
+			if(!(file_buffer_size = write_nbz2_r(ctx, conv->compressed_buffer, conv->track_buffer, conv->track_density, conv->track_length))) return 0;
+			if(!(save_file_r(ctx, outname, conv->compressed_buffer, file_buffer_size))) return 0;
 		}
 		else
 		{
-			if(!(save_file(outname, file_buffer, file_buffer_size))) exit(0);
+			if(!(file_buffer_size = write_nib_r(ctx, conv->file_buffer, conv->track_buffer, conv->track_density, conv->track_length))) return 0;
+
+			if (compare_extension((unsigned char *) outname, (unsigned char *) "NBZ"))
+			{
+				if(!(file_buffer_size = compress_nbz_r(ctx, conv->file_buffer, conv->compressed_buffer, file_buffer_size))) return 0;
+				if(!(save_file_r(ctx, outname, conv->compressed_buffer, file_buffer_size))) return 0;
+			}
+			else
+			{
+				if(!(save_file_r(ctx, outname, conv->file_buffer, file_buffer_size))) return 0;
+			}
 		}
 	}
-	else if (compare_extension(outname, "NB2"))
+	else if (compare_extension((unsigned char *) outname, (unsigned char *) "NB2"))
 	{
-		printf("Output to NB2 format makes no sense from this input file.\n");
-		exit(0);
+		align_printf(ctx, "Output to NB2 format makes no sense from this input file.\n");
+		return 0;
 	}
 	else
 	{
-		printf("Unknown output file type\n");
-		exit(0);
+		align_printf(ctx, "Unknown output file type\n");
+		return 0;
+	}
+	conv->write_time += stage_clock(conv) - start;
+
+	return 1;
+}
+
+/*
+	Output name for a batch file: '*' in the pattern stands for the input
+	name without path and extension, a pattern without '*' is just the
+	new extension.  Returns 0 if the name does not fit.
+*/
+static int
+batch_name(char *inname, char *outname, size_t size)
+{
+	char base[256];
+	char *name, *p;
+
+	name = inname;
+	for (p = inname; *p; p++)
+		if ((*p == '/') || (*p == '\\') || (*p == ':'))
+			name = p + 1;
+
+	strncpy(base, name, sizeof(base) - 1);
+	base[sizeof(base) - 1] = '\0';
+	if ((p = strrchr(base, '.')))
+		*p = '\0';
+
+	if (strlen(inname) + strlen(output_pattern) + 2 > size)
+	{
+		printf("Output name for %s is too long\n", inname);
+		return 0;
+	}
+
+	if (!(p = strchr(output_pattern, '*')))
+	{
+		/* same place as the input */
+		strcpy(outname, inname);
+		outname[(name - inname) + strlen(base)] = '\0';
+		strcat(outname, ".");
+		strcat(outname, output_pattern);
+		return 1;
+	}
+
+	memcpy(outname, output_pattern, p - output_pattern);
+	outname[p - output_pattern] = '\0';
+	strcat(outname, base);
+	strcat(outname, p + 1);
+	return 1;
+}
+
+/* keep the name of a failed input for the summary */
+static void
+add_failure(char ***failed, int *failures, char *name)
+{
+	char **names;
+
+	printf("Conversion of %s failed\n", name);
+	if ((names = realloc(*failed, (*failures + 1) * sizeof(char *))))
+	{
+		*failed = names;
+		if ((names[*failures] = malloc(strlen(name) + 1)))
+			strcpy(names[*failures], name);
+	}
+	else
+		*failed = NULL;
+	(*failures)++;
+}
+
+/*
+	One file of a batch.  Its output is kept until the files before it
+	are printed, so a batch on threads prints the same as a serial one.
+*/
+#define BATCH_CONVERT	0
+#define BATCH_SKIPPED	1
+#define BATCH_FAILED	2
+
+typedef struct
+{
+	char *inname;
+	char outname[512];
+	int state;
+	int ok;
+	long bytes;
+	char *output;
+	int done;
+} batch_file;
+
+typedef struct
+{
+	batch_file *file;
+	int count;
+	int next;			/* file the next free worker takes */
+	clock_t read_time, write_time;	/* CPU time of the workers per stage */
+#if defined(ARCH_THREADS) && defined(ARCH_LOCKS)
+	arch_mutex lock;
+	arch_cond changed;
+#endif
+} batch;
+
+static void
+convert_batch_file(align_context *ctx, conversion *conv, batch_file *file)
+{
+	FILE *fp;
+
+	clear_conversion(conv);
+	if ((file->ok = convert(ctx, conv, file->inname, file->outname)))
+	{
+		if ((fp = fopen(file->inname, "rb")))
+		{
+			fseek(fp, 0, SEEK_END);
+			file->bytes = ftell(fp);
+			fclose(fp);
+		}
+	}
+}
+
+static int
+alloc_conversion(conversion *conv)
+{
+	memset(conv, 0, sizeof(conversion));
+	conv->track_buffer = malloc((MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH);
+	conv->track_density = malloc(MAX_HALFTRACKS_1541 + 2);
+	conv->track_length = malloc((MAX_HALFTRACKS_1541 + 2) * sizeof(size_t));
+	conv->track_alignment = malloc(MAX_HALFTRACKS_1541 + 2);
+	conv->file_buffer = calloc(MAX_HALFTRACKS_1541 + 2, NIB_TRACK_LENGTH);
+	conv->compressed_buffer = calloc(MAX_HALFTRACKS_1541 + 2, NIB_TRACK_LENGTH);
+
+	return ((conv->track_buffer) && (conv->track_density) && (conv->track_length) &&
+		(conv->track_alignment) && (conv->file_buffer) && (conv->compressed_buffer));
+}
+
+static void
+free_conversion(conversion *conv)
+{
+	free(conv->track_buffer);
+	free(conv->track_density);
+	free(conv->track_length);
+	free(conv->track_alignment);
+	free(conv->file_buffer);
+	free(conv->compressed_buffer);
+}
+
+#if defined(ARCH_THREADS) && defined(ARCH_LOCKS)
+typedef struct
+{
+	batch *b;
+	conversion conv;
+} batch_worker;
+
+static ARCH_THREADFUNC
+batch_thread(void *arg)
+{
+	batch_worker *worker = (batch_worker *) arg;
+	batch *b = worker->b;
+	align_context ctx;
+	int i;
+
+	arch_lock(&b->lock);
+	for (;;)
+	{
+		while ((b->next < b->count) && (b->file[b->next].state != BATCH_CONVERT))
+			b->next++;
+		if (b->next == b->count)
+			break;
+		i = b->next++;
+		arch_unlock(&b->lock);
+
+		/* every file starts from the options given, tracks are not split up again */
+		init_align_context(&ctx);
+		ctx.buffered = 1;
+		ctx.jobs = 1;
+		convert_batch_file(&ctx, &worker->conv, &b->file[i]);
+
+		arch_lock(&b->lock);
+		b->file[i].output = ctx.log_buffer;
+		b->file[i].done = 1;
+		arch_cond_broadcast(&b->changed);
+	}
+	arch_unlock(&b->lock);
+	return 0;
+}
+
+/*
+	Convert the files on worker threads, each with buffers of its own.
+	Output is printed in file order as it comes in, finish is called for
+	each file in that order.  Returns the number of threads that ran, 0
+	if none could be started.
+*/
+static int
+convert_batch_threads(batch *b, int jobs, void (*finish)(batch_file *file))
+{
+	batch_worker worker[MAX_ALIGN_JOBS];
+	arch_thread thread[MAX_ALIGN_JOBS];
+	int started, i;
+
+	for (i = 0; i < jobs; i++)
+	{
+		worker[i].b = b;
+		if (!alloc_conversion(&worker[i].conv))
+		{
+			printf("Could not allocate track buffers\n");
+			exit(1);
+		}
+		worker[i].conv.thread_clock = 1;
+	}
+
+	arch_mutex_init(&b->lock);
+	arch_cond_init(&b->changed);
+
+	/* tables built on first use, do it before there are threads */
+	crcInit();
+	init_GCR_tables();
+
+	for (started = 0; started < jobs; started++)
+		if (!arch_thread_create(&thread[started], batch_thread, &worker[started]))
+			break;
+
+	if (started)
+	{
+		arch_lock(&b->lock);
+		for (i = 0; i < b->count; i++)
+		{
+			if (b->file[i].state != BATCH_CONVERT)
+				continue;
+
+			while (!b->file[i].done)
+				arch_cond_wait(&b->changed, &b->lock);
+			arch_unlock(&b->lock);
+
+			if (b->file[i].output)
+				fputs(b->file[i].output, stdout);
+			free(b->file[i].output);
+			finish(&b->file[i]);
+
+			arch_lock(&b->lock);
+		}
+		arch_unlock(&b->lock);
+
+		for (i = 0; i < started; i++)
+			arch_thread_join(thread[i]);
+	}
+
+	arch_cond_destroy(&b->changed);
+	arch_mutex_destroy(&b->lock);
+	for (i = 0; i < jobs; i++)
+	{
+		b->read_time += worker[i].conv.read_time;
+		b->write_time += worker[i].conv.write_time;
+		free_conversion(&worker[i].conv);
+	}
+
+	return started;
+}
+#endif
+
+/* failed inputs for the summary, in the order they are reported */
+static char **failed;
+static int failures;
+
+static void
+finish_batch_file(batch_file *file)
+{
+	if (!file->ok)
+		add_failure(&failed, &failures, file->inname);
+	printf("\n");
+}
+
+/*
+	Convert every input, names starting with '@' are files with one input
+	name per line and directories give the image files below them.  Output
+	names and existing files are settled first, then the conversions run,
+	with -j on that many threads.  Returns the number of failed conversions.
+*/
+static int
+convert_batch(int argc, char **argv)
+{
+	batch b;
+	batch_file *file;
+	conversion conv;
+	align_context ctx;
+	char **names = NULL;
+	time_t start;
+	long bytes = 0;
+	int count = 0, done = 0, skipped = 0, threads = 0, jobs = 0, stage_times, seconds, i, j;
+
+	start = time(NULL);
+	for (i = 0; i < argc; i++)
+		if (!collect_images(argv[i], &names, &count))
+			add_failure(&failed, &failures, argv[i]);
+
+	memset(&b, 0, sizeof(b));
+	if ((count) && (!(b.file = calloc(count, sizeof(batch_file)))))
+	{
+		printf("Could not allocate file list\n");
+		return 1;
+	}
+	b.count = count;
+
+	/* questions about existing files come before any conversion output */
+	for (i = 0; i < count; i++)
+	{
+		file = &b.file[i];
+		file->inname = names[i];
+
+		if (!batch_name(file->inname, file->outname, sizeof(file->outname)))
+		{
+			file->state = BATCH_FAILED;
+			add_failure(&failed, &failures, file->inname);
+			continue;
+		}
+
+		/* two inputs must not write the same file */
+		for (j = 0; j < i; j++)
+			if ((b.file[j].state == BATCH_CONVERT) && (!strcmp(b.file[j].outname, file->outname)))
+				break;
+		if (j < i)
+		{
+			printf("%s is also the output of %s\n", file->outname, b.file[j].inname);
+			file->state = BATCH_FAILED;
+			add_failure(&failed, &failures, file->inname);
+			continue;
+		}
+
+		if (!check_overwrite(file->outname, 1))
+		{
+			file->state = BATCH_SKIPPED;
+			skipped++;
+			continue;
+		}
+
+		if ((skip_halftracks) && (compare_extension((unsigned char *) file->outname, (unsigned char *) "G64")))
+			track_inc = 2;
+		jobs++;
+	}
+
+#if defined(ARCH_THREADS) && defined(ARCH_LOCKS)
+	if (jobs > align_jobs) jobs = align_jobs;
+	if (jobs > MAX_ALIGN_JOBS) jobs = MAX_ALIGN_JOBS;
+	if (jobs > 1)
+		threads = convert_batch_threads(&b, jobs, finish_batch_file);
+#endif
+
+	/* one file after the other, each can still use -j for its tracks */
+	if (!threads)
+	{
+		if (!alloc_conversion(&conv))
+		{
+			printf("Could not allocate track buffers\n");
+			exit(1);
+		}
+		conv.cache = 1;
+
+		for (i = 0; i < count; i++)
+		{
+			if (b.file[i].state != BATCH_CONVERT)
+				continue;
+
+			init_align_context(&ctx);
+			convert_batch_file(&ctx, &conv, &b.file[i]);
+			finish_batch_file(&b.file[i]);
+		}
+		b.read_time = conv.read_time;
+		b.write_time = conv.write_time;
+		free_conversion(&conv);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (b.file[i].ok)
+		{
+			done++;
+			bytes += b.file[i].bytes;
+		}
+		free(names[i]);
 	}
+	free(b.file);
+	free(names);
+	seconds = (int) difftime(time(NULL), start);
+
+	printf("\nBatch summary: %d converted, %d skipped, %d failed in %d seconds\n",
+		done, skipped, failures, seconds);
+	printf("%ld bytes read", bytes);
+	if (seconds)
+		printf(", %.2f MB/s", (double) bytes / (seconds * 1024 * 1024));
+#ifdef ARCH_THREAD_CLOCK
+	stage_times = 1;
+#else
+	stage_times = !threads;		/* a worker's process clock would count the others too */
+#endif
+	if (threads)
+		printf("\nConverted on %d threads", threads);
+	if (stage_times)
+		printf("\nCPU time: reading %.2fs, writing %.2fs",
+			(double) b.read_time / CLOCKS_PER_SEC, (double) b.write_time / CLOCKS_PER_SEC);
+	printf("\n");
+
+	for (i = 0; (failed) && (i < failures); i++)
+	{
+		if (failed[i])
+			printf("Failed: %s\n", failed[i]);
+		free(failed[i]);
+	}
+	free(failed);
+
+	return failures;
+}
+
+int ARCH_MAINDECL
+main(int argc, char **argv)
+{
+	char inname[256], outname[256];
+	char *dotpos;
+	conversion conv;
+	align_context ctx;
+
+	start_track = 1 * 2;
+	end_track = 42 * 2;
+	track_inc = 1;
+	fix_gcr = 1;
+	reduce_sync = 4;
+	skip_halftracks = 0;
+	align = ALIGN_NONE;
+	force_align = ALIGN_NONE;
+	gap_match_length = 7;
+	cap_min_ignore = 0;
+	verbose = 0;
+	rpm_real = 295;
+
+	/* default is to reduce sync */
+	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
+
+	fprintf(stdout,
+		"\nnibconv - converts a CBM disk image from one format to another.\n"
+		AUTHOR VERSION "\n\n");
+
+	/* clear heap buffers */
+	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
+	memset(file_buffer, 0x00, sizeof(file_buffer));
+
+	while (--argc && (*(++argv)[0] == '-'))
+	{
+		switch ((*argv)[1])
+		{
+			case 'O':
+				output_pattern = &(*argv)[2];
+				printf("* Batch conversion to %s\n", output_pattern);
+				break;
+
+			case 'Y':
+				overwrite = OVERWRITE_YES;
+				printf("* Overwrite existing files\n");
+				break;
+
+			case 'N':
+				overwrite = OVERWRITE_NO;
+				printf("* Skip existing files\n");
+				break;
+
+			default:
+				parseargs(argv);
+				break;
+		}
+	}
+
+	if(argc < 1)	usage();
+
+	if ((output_pattern) && (*output_pattern))
+		return (convert_batch(argc, argv)) ? 1 : 0;
+
+	strcpy(inname, argv[0]);
+
+	if(argc < 2)
+	{
+		strcpy(outname, inname);
+		dotpos = strrchr(outname, '.');
+		if (dotpos != NULL) *dotpos = '\0';
+
+		 if(compare_extension((unsigned char *) inname, (unsigned char *) "G64"))
+			strcat(outname, ".d64");
+		else
+			strcat(outname, ".g64");
+	}
+	else
+		strcpy(outname, argv[1]);
+
+	if (!check_overwrite(outname, 0)) exit(0);
+
+	memset(&conv, 0, sizeof(conv));
+	conv.track_buffer = track_buffer;
+	conv.track_density = track_density;
+	conv.track_length = track_length;
+	conv.track_alignment = track_alignment;
+	conv.file_buffer = file_buffer;
+	conv.compressed_buffer = compressed_buffer;
+	conv.cache = 1;
+	clear_conversion(&conv);
+
+	if ((skip_halftracks) && (compare_extension((unsigned char *) outname, (unsigned char *) "G64")))
+		track_inc = 2;
+	init_align_context(&ctx);
+	if (!convert(&ctx, &conv, inname, outname)) exit(0);
 
 	return 0;
 }
@@ -227,11 +755,16 @@ usage(void)
 {
 	printf(
 	"usage: nibconv [options] <infile>.ext1 <outfile>.ext2\n"
+	"       nibconv [options] -O<pattern> <infile>|<directory>|@<listfile>...\n"
 	"\nsupported file extensions for ext1:\n"
-	"NIB, NB2, D64, G64\n"
+	"NIB, NBZ, NBZ2, NB2, D64, G64\n"
 	"\nsupported file extensions for ext2:\n"
-	"D64, G64\n"
-	"\noptions:\n");
+	"D64, G64, NIB, NBZ, NBZ2\n"
+	"\noptions:\n"
+	" -O[pattern]: Batch mode, '*' in the pattern is the input name (-Og64/*.g64),\n"
+	"              a pattern without '*' is the output extension (-Og64)\n"
+	" -Y: Overwrite existing output files\n"
+	" -N: Skip existing output files\n");
 
 	switchusage();
 	exit(1);
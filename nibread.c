@@ -69,6 +69,10 @@ int sync_align_buffer=0;
 int fattrack=0;
 int old_g64=0;
 int backwards=0;
+int align_jobs=1;
+int compress_level=0;
+int read_pipeline=0;
+int nb2_match=0;
 
 BYTE density_map;
 float motor_speed;
@@ -179,6 +183,12 @@ main(int argc, char *argv[])
 			use_floppycode_ihs = 1; // ihs floppy code!
 			break;
 
+		case 'Z':
+			compress_level = atoi(&(*argv)[2]);
+			if ((compress_level < 1) || (compress_level > 9)) compress_level = LZ_DEFAULT_LEVEL;
+			printf("* NBZ compression level %d\n", compress_level);
+			break;
+
 		case 'A':
 			align_report = 1;
 			printf("* Track Alignment Report\n");
@@ -264,6 +274,20 @@ main(int argc, char *argv[])
 			printf("* Read retries set to %d\n", error_retries);
 			break;
 
+		case 'O':
+			read_pipeline = atoi(&(*argv)[2]);
+			if (read_pipeline < 1) read_pipeline = 1;
+			align_jobs = read_pipeline;	/* also compresses NBZ output */
+			printf("* Analyze tracks on %d thread(s) while the drive reads ahead\n", read_pipeline);
+			break;
+
+		case 'N':
+			nb2_match = atoi(&(*argv)[2]);
+			if (nb2_match < 1) nb2_match = 2;
+			if (nb2_match > NB2_PASSES) nb2_match = NB2_PASSES;
+			printf("* Adaptive NB2, stop each density once %d passes agree\n", nb2_match);
+			break;
+
 		case 'm':
 			printf("* Minimum capacity ignore on\n");
 			cap_min_ignore = 1;
@@ -468,7 +492,7 @@ int disk2file(CBM_FILE fd, char *filename)
 	{
 		if(!(read_floppy(fd, track_buffer, track_density, track_length))) return 0;
 		if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) return 0;
-		if(!(file_buffer_size = LZ_CompressFast(file_buffer, compressed_buffer, file_buffer_size))) return 0;
+		if(!(file_buffer_size = compress_nbz(file_buffer, compressed_buffer, file_buffer_size))) return 0;
 		if(!(save_file(filename, compressed_buffer, file_buffer_size))) return 0;
 
 		if(interactive_mode)
@@ -490,7 +514,7 @@ int disk2file(CBM_FILE fd, char *filename)
 
 				if(!(read_floppy(fd, track_buffer, track_density, track_length))) return 0;
 				if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) return 0;
-				if(!(file_buffer_size = LZ_CompressFast(file_buffer, compressed_buffer, file_buffer_size))) return 0;
+				if(!(file_buffer_size = compress_nbz(file_buffer, compressed_buffer, file_buffer_size))) return 0;
 				if(!(save_file(newfilename, compressed_buffer, file_buffer_size))) return 0;
 			}
 		}
@@ -517,11 +541,14 @@ usage(void)
 //	     " -m: Disable minimum capacity check\n"
 	     " -V: Verbose (output more detailed track data)\n"
 	     " -h: Read halftracks\n"
+	     " -O[n]: Overlap track reads with analysis on [n] threads, compress NBZ on as many\n"
+	     " -N[n]: Adaptive NB2, stop a density after [n] matching passes\n"
 	     " -t: Extended parallel port tests\n"
 	     " -j: Use Index Hole Sensor  (1541/1571 SC+ compatible IHS)\n"
 	     " -x: Track Alignment Report (1541/1571 SC+ compatible IHS)\n"
 	     " -y: Deep Bitrate Analysis  (1541/1571 SC+ compatible IHS)\n"
 	     " -z: Test Index Hole Sensor (1541/1571 SC+ compatible IHS)\n"
+	     " -Z[n]: NBZ compression level 'n' (1 fast - 9 small)\n"
 	     );
 	exit(1);
 }
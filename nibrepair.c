@@ -22,17 +22,13 @@
 #include "mnibarch.h"
 #include "gcr.h"
 #include "nibtools.h"
-#include "lz.h"
 
 int _dowildcard = 1;
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_density[MAX_HALFTRACKS_1541 + 2];
 BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
 size_t track_length[MAX_HALFTRACKS_1541 + 2];
-int file_buffer_size;
 int start_track, end_track, track_inc;
 int reduce_sync, reduce_badgcr, reduce_gap;
 int fix_gcr, align, force_align;
@@ -63,6 +59,8 @@ int track_match=0;
 int old_g64=0;
 int read_killer=1;
 int backwards=0;
+int align_jobs=1;
+int compress_level=0;
 
 /* local prototypes */
 int repair(void);
@@ -92,8 +90,6 @@ main(int argc, char **argv)
 		AUTHOR VERSION "\n\n");
 
 	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
 	memset(track_buffer, 0x00, sizeof(track_buffer));
 
 	/* default is to reduce sync */
@@ -113,31 +109,22 @@ main(int argc, char **argv)
 	printf("%s -> %s\n",inname, outname);
 
 	/* convert */
-	if (compare_extension(inname, "G64"))
+	if (compare_extension((unsigned char *) inname, (unsigned char *) "G64"))
 	{
 		if(!(read_g64(inname, track_buffer, track_density, track_length))) exit(0);
 		if(sync_align_buffer)	sync_tracks(track_buffer, track_density, track_length, track_alignment);
 	}
-	else if (compare_extension(inname, "NBZ"))
+	else if ((compare_extension((unsigned char *) inname, (unsigned char *) "NBZ")) || (compare_extension((unsigned char *) inname, (unsigned char *) "NBZ2")) ||
+		(compare_extension((unsigned char *) inname, (unsigned char *) "NIB")))
 	{
-		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(inname, compressed_buffer))) exit(0);
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-	}
-	else if (compare_extension(inname, "NIB"))
-	{
-		if(!(file_buffer_size = load_file(inname, file_buffer))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_nib_file(inname, track_buffer, track_density, track_length, track_alignment, 1))) exit(0);
 	}
-	else if (compare_extension(inname, "NB2"))
+	else if (compare_extension((unsigned char *) inname, (unsigned char *) "NB2"))
 	{
 		if(!(read_nb2(inname, track_buffer, track_density, track_length))) exit(0);
 		align_tracks(track_buffer, track_density, track_length, track_alignment);
 	}
-	else if (compare_extension(inname, "D64"))
+	else if (compare_extension((unsigned char *) inname, (unsigned char *) "D64"))
 	{
 		if(!(read_d64(inname, track_buffer, track_density, track_length))) exit(0);
 	}
@@ -14,22 +14,54 @@
 #include "nibtools.h"
 #include "prot.h"
 #include "md5.h"
-#include "lz.h"
 
 int _dowildcard = 1;
 
 char bitrate_range[4] = { 43 * 2, 31 * 2, 25 * 2, 18 * 2 };
 
+/* what scandisk() and scan_image() found, for collection records */
+typedef struct
+{
+	BYTE id[3], cosmetic_id[3];
+	size_t errors, empty, badgcr;
+	int fat, rapidlok, wrong_density;
+	BYTE formatted[MAX_HALFTRACKS_1541 + 2];
+	size_t track_errors[MAX_HALFTRACKS_1541 + 2];
+	size_t badgcr_tracks[MAX_HALFTRACKS_1541 + 2];
+	size_t fat_tracks[MAX_HALFTRACKS_1541 + 2];
+	size_t rapidlok_tracks[MAX_HALFTRACKS_1541 + 2];
+	unsigned int crc_dir, crc;
+	unsigned char md5_dir[16], md5[16];
+} scan_result;
+
+/*
+	A loaded image and what its scan found.  Collection workers have one
+	each, with buffers of their own and their output kept in ctx.
+*/
+typedef struct
+{
+	BYTE *track_buffer;
+	BYTE *track_density;
+	size_t *track_length;
+	BYTE *track_alignment;
+	align_context *ctx;		/* options and output */
+	int cache;				/* decode sectors through the sector cache */
+	scan_result scan;
+} scan_job;
+
 int load_image(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int load_image_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
 int compare_disks(void);
-int scandisk(void);
-int raw_track_info(BYTE *gcrdata, size_t length);
-int dump_headers(BYTE * gcrdata, size_t length);
-size_t check_fat(int track);
+int scandisk(scan_job *job);
+int raw_track_info(align_context *ctx, BYTE *gcrdata, size_t length);
+int dump_headers(align_context *ctx, BYTE * gcrdata, size_t length);
+size_t check_fat(scan_job *job, int track);
 size_t check_rapidlok(int track);
+int scan_image(scan_job *job, char *filename);
+int dump_raw_tracks(scan_job *job, char *filename, int copy);
+int scan_collection(int argc, char **argv);
+void crcInit(void);	/* crc.h would clash with the crc global */
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_buffer2[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 size_t track_length[MAX_HALFTRACKS_1541 + 2];
@@ -39,14 +71,9 @@ BYTE track_density2[MAX_HALFTRACKS_1541 + 2];
 BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
 BYTE track_alignment2[MAX_HALFTRACKS_1541 + 2];
 
-size_t fat_tracks[MAX_HALFTRACKS_1541 + 2];
-size_t rapidlok_tracks[MAX_HALFTRACKS_1541 + 2];
-size_t badgcr_tracks[MAX_HALFTRACKS_1541 + 2];
-
 int start_track, end_track, track_inc;
 int imagetype, mode;
 int align, force_align;
-int file_buffer_size;
 int fix_gcr;
 int reduce_sync;
 int reduce_badgcr;
@@ -78,6 +105,8 @@ int track_match=0;
 int old_g64=0;
 int read_killer=1;
 int backwards=0;
+int align_jobs=1;
+int compress_level=0;
 
 unsigned char md5_hash_result[16];
 unsigned char md5_dir_hash_result[16];
@@ -85,11 +114,20 @@ unsigned char md5_hash_result2[16];
 unsigned char md5_dir_hash_result2[16];
 int crc, crc_dir, crc2, crc2_dir;
 
+/* collection mode writes one record per image to this file */
+char *record_file = NULL;
+
+/* raw track dumps of scanned images go to this directory, if set */
+char *raw_dump_dir = NULL;
+#define RAW_DUMP_NAME_LENGTH 512
+
 int ARCH_MAINDECL
 main(int argc, char *argv[])
 {
 	char file1[256];
 	char file2[256];
+	align_context ctx;
+	scan_job job;
 	int i;
 
 	start_track = 1 * 2;
@@ -116,8 +154,6 @@ main(int argc, char *argv[])
 		usage();
 
 	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
 	memset(track_buffer, 0x00, sizeof(track_buffer));
 	memset(track_buffer2, 0x00, sizeof(track_buffer2));
 
@@ -125,9 +161,33 @@ main(int argc, char *argv[])
 	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
 
 	while (--argc && (*(++argv)[0] == '-'))
-		parseargs(argv);
+	{
+		switch ((*argv)[1])
+		{
+			case 'W':
+				raw_dump_dir = (*argv)[2] ? &(*argv)[2] : "raw";
+				printf("* Raw track dumps to %s\n", raw_dump_dir);
+				break;
+
+			case 'O':
+				record_file = &(*argv)[2];
+				printf("* Collection scan, records to %s\n", record_file);
+				break;
+
+			default:
+				parseargs(argv);
+				break;
+		}
+	}
 
 	if (argc < 0)	usage();
+
+	if ((record_file) && (*record_file))
+	{
+		if (argc < 1) usage();
+		exit((scan_collection(argc, argv)) ? 1 : 0);
+	}
+
 	strcpy(file1, argv[0]);
 
 	if (argc > 1)
@@ -142,6 +202,10 @@ main(int argc, char *argv[])
 		if(!(load_image(file1, track_buffer, track_density, track_length))) exit(0);
 		if(!(load_image(file2, track_buffer2, track_density2, track_length2))) exit(0);
 
+		/* decode sectors once for all compare/CRC/MD5 passes */
+		attach_sector_cache(track_buffer);
+		attach_sector_cache(track_buffer2);
+
 		compare_disks();
 
 		/* disk 1 */
@@ -211,70 +275,629 @@ main(int argc, char *argv[])
 	else 	// just scan for errors, etc.
 	{
 		if(!load_image(file1, track_buffer, track_density, track_length)) exit(0);
+		init_align_context(&ctx);
+		memset(&job, 0, sizeof(job));
+		job.track_buffer = track_buffer;
+		job.track_density = track_density;
+		job.track_length = track_length;
+		job.track_alignment = track_alignment;
+		job.ctx = &ctx;
+		job.cache = 1;
+		scan_image(&job, file1);
+		if (raw_dump_dir)
+			dump_raw_tracks(&job, file1, 0);
+	}
 
-		scandisk();
+	exit(0);
+}
 
-		printf("\n%s\n", file1);
+/*
+	<raw_dump_dir>/<image name>.raw, or <image name>.<copy>.raw for the
+	later images of the same name in a collection (x/game.nib, y/game.nib,
+	game.g64).  Returns 0 if the name doesn't fit into RAW_DUMP_NAME_LENGTH.
+*/
+static int
+raw_dump_name(char *filename, int copy, char *dumpname)
+{
+	char *name, *p;
+	int stem;
 
-		crc = crc_dir_track(track_buffer, track_length);
-		printf("BAM/DIR CRC:\t0x%X\n", crc);
-		crc = crc_all_tracks(track_buffer, track_length);
-		printf("Full CRC:\t0x%X\n", crc);
+	name = filename;
+	for (p = filename; *p; p++)
+		if ((*p == '/') || (*p == '\\') || (*p == ':'))
+			name = p + 1;
 
-		memset(md5_hash_result, 0 , sizeof(md5_hash_result));
-		md5_dir_track(track_buffer, track_length, md5_hash_result);
-		printf("BAM/DIR MD5:\t0x");
-		for (i = 0; i < 16; i++)
-		 	printf ("%02x", md5_hash_result[i]);
-		printf("\n");
+	if (strlen(raw_dump_dir) + strlen(name) + 16 > RAW_DUMP_NAME_LENGTH)
+		return 0;
 
-		memset(md5_hash_result, 0 , sizeof(md5_hash_result));
-		md5_all_tracks(track_buffer, track_length, md5_hash_result);
-		printf("Full MD5:\t0x");
-		for (i = 0; i < 16; i++)
-			printf ("%02x", md5_hash_result[i]);
-		printf("\n");
+	sprintf(dumpname, "%s/%s", raw_dump_dir, name);
+	if ((p = strrchr(dumpname, '.')) && (p > dumpname + strlen(raw_dump_dir)))
+		*p = '\0';
+	stem = strlen(dumpname);
+
+	if (copy)
+		sprintf(dumpname + stem, ".%d.raw", copy);
+	else
+		strcpy(dumpname + stem, ".raw");
+	return 1;
+}
+
+/*
+	Dump the formatted tracks, as scandisk() left them, for nibwrite -R.
+	A dump left by an earlier scan of the image is overwritten.
+*/
+int
+dump_raw_tracks(scan_job *job, char *filename, int copy)
+{
+	char dumpname[RAW_DUMP_NAME_LENGTH];
+	size_t dump_length[MAX_HALFTRACKS_1541 + 2];
+	int track;
+
+	if (!raw_dump_name(filename, copy, dumpname))
+	{
+		align_printf(job->ctx, "Raw dump name for %s is too long\n", filename);
+		return 0;
 	}
 
-	exit(0);
+	if (copy)
+		align_printf(job->ctx, "Raw tracks of %s go to %s\n", filename, dumpname);
+
+	for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track++)
+		dump_length[track] = job->scan.formatted[track] ? job->track_length[track] : 0;
+
+	return write_raw_dump_r(job->ctx, dumpname, job->track_buffer, job->track_density, dump_length);
 }
 
-int load_image(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+/* scan the loaded image, then print its CRC and MD5 sums */
+int
+scan_image(scan_job *job, char *filename)
 {
-	if (compare_extension(filename, "D64"))
+	int i;
+
+	/* decode sectors once for all scan/CRC/MD5 passes */
+	if (job->cache)
+		attach_sector_cache(job->track_buffer);
+
+	scandisk(job);
+
+	align_printf(job->ctx, "\n%s\n", filename);
+
+	job->scan.crc_dir = crc_dir_track_r(job->ctx, job->track_buffer, job->track_length);
+	align_printf(job->ctx, "BAM/DIR CRC:\t0x%X\n", job->scan.crc_dir);
+	job->scan.crc = crc_all_tracks_r(job->ctx, job->track_buffer, job->track_length);
+	align_printf(job->ctx, "Full CRC:\t0x%X\n", job->scan.crc);
+
+	md5_dir_track_r(job->ctx, job->track_buffer, job->track_length, job->scan.md5_dir);
+	align_printf(job->ctx, "BAM/DIR MD5:\t0x");
+	for (i = 0; i < 16; i++)
+	 	align_printf(job->ctx, "%02x", job->scan.md5_dir[i]);
+	align_printf(job->ctx, "\n");
+
+	md5_all_tracks_r(job->ctx, job->track_buffer, job->track_length, job->scan.md5);
+	align_printf(job->ctx, "Full MD5:\t0x");
+	for (i = 0; i < 16; i++)
+		align_printf(job->ctx, "%02x", job->scan.md5[i]);
+	align_printf(job->ctx, "\n");
+
+	return 1;
+}
+
+/* text that is safe inside a JSON string or a quoted CSV field */
+static void
+write_text(align_context *out, BYTE *text, size_t length, int csv)
+{
+	size_t i;
+
+	for (i = 0; (i < length) && (text[i]); i++)
 	{
-		if(!(read_d64(filename, track_buffer, track_density, track_length))) return 0;
+		if ((csv) && (text[i] == '"'))
+			align_printf(out, "\"\"");
+		else if ((!csv) && ((text[i] == '"') || (text[i] == '\\')))
+			align_printf(out, "\\%c", text[i]);
+		else if ((text[i] < 0x20) || (text[i] > 0x7e))
+			align_printf(out, csv ? "?" : "\\u%04x", text[i]);
+		else
+			align_printf(out, "%c", text[i]);
 	}
-	else if (compare_extension(filename, "G64"))
+}
+
+static void
+write_md5(align_context *out, unsigned char *md5)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		align_printf(out, "%02x", md5[i]);
+}
+
+/*
+	One JSON line per image: the scandisk() totals, the sums, and the
+	formatted tracks with density, length, weak GCR bytes, FAT and
+	RapidLok flags and errors.
+*/
+static void
+write_json_record(align_context *out, scan_job *job, char *filename, int ok)
+{
+	scan_result *scan = &job->scan;
+	int track, first = 1;
+
+	align_printf(out, "{\"file\":\"");
+	write_text(out, (BYTE *) filename, strlen(filename), 0);
+	align_printf(out, "\",\"status\":\"%s\"", ok ? "ok" : "failed");
+
+	if (ok)
 	{
-		if(!(read_g64(filename, track_buffer, track_density, track_length))) return 0;
-		if(sync_align_buffer) sync_tracks(track_buffer, track_density, track_length, track_alignment);
+		align_printf(out, ",\"disk_id\":\"");
+		write_text(out, scan->id, 2, 0);
+		align_printf(out, "\",\"cosmetic_id\":\"");
+		write_text(out, scan->cosmetic_id, 2, 0);
+		align_printf(out, "\",\"errors\":%u,\"empty\":%u,\"weak_gcr\":%u,\"fat_tracks\":%d,\"rapidlok_tracks\":%d,\"wrong_density\":%d",
+			(unsigned int) scan->errors, (unsigned int) scan->empty, (unsigned int) scan->badgcr,
+			scan->fat, scan->rapidlok, scan->wrong_density);
+		align_printf(out, ",\"bam_crc\":\"%08X\",\"full_crc\":\"%08X\",\"bam_md5\":\"", scan->crc_dir, scan->crc);
+		write_md5(out, scan->md5_dir);
+		align_printf(out, "\",\"full_md5\":\"");
+		write_md5(out, scan->md5);
+		align_printf(out, "\",\"tracks\":[");
+
+		for (track = start_track; track <= end_track; track ++)
+		{
+			if (!scan->formatted[track])
+				continue;
+
+			align_printf(out, "%s{\"track\":%.1f,\"length\":%u,\"density\":%d,\"weak_gcr\":%u,\"fat\":%d,\"rapidlok\":%d,\"errors\":%u}",
+				first ? "" : ",", (float) track / 2, (unsigned int) job->track_length[track], job->track_density[track] & 3,
+				(unsigned int) scan->badgcr_tracks[track], scan->fat_tracks[track] ? 1 : 0, scan->rapidlok_tracks[track] ? 1 : 0,
+				(unsigned int) scan->track_errors[track]);
+			first = 0;
+		}
+		align_printf(out, "]");
 	}
-	else if (compare_extension(filename, "NBZ"))
+	align_printf(out, "}\n");
+}
+
+/* a CSV column of track[:value] pairs, for the formatted tracks where value is set */
+static void
+write_track_list(align_context *out, scan_job *job, size_t *values, int with_value)
+{
+	int track, first = 1;
+
+	align_printf(out, ",");
+	for (track = start_track; track <= end_track; track ++)
 	{
-		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(filename, compressed_buffer))) return 0;
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		if ((!job->scan.formatted[track]) || (!values[track]))
+			continue;
+
+		align_printf(out, "%s%.1f", first ? "" : " ", (float) track / 2);
+		if (with_value)
+			align_printf(out, ":%u", (unsigned int) values[track]);
+		first = 0;
 	}
-	else if (compare_extension(filename, "NIB"))
+}
+
+/*
+	One CSV line per image, with the per-track data as lists of
+	track:value pairs.
+*/
+static void
+write_csv_record(align_context *out, scan_job *job, char *filename, int ok)
+{
+	scan_result *scan = &job->scan;
+	int track, first = 1;
+
+	align_printf(out, "\"");
+	write_text(out, (BYTE *) filename, strlen(filename), 1);
+	align_printf(out, "\",%s", ok ? "ok" : "failed");
+
+	if (!ok)
 	{
-		if(!(file_buffer_size = load_file(filename, file_buffer))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		align_printf(out, ",,,,,,,,,,,,,,,,,\n");
+		return;
 	}
-	else if (compare_extension(filename, "NB2"))
+
+	align_printf(out, ",\"");
+	write_text(out, scan->id, 2, 1);
+	align_printf(out, "\",\"");
+	write_text(out, scan->cosmetic_id, 2, 1);
+	align_printf(out, "\",%u,%u,%u,%d,%d,%d,%08X,%08X,",
+		(unsigned int) scan->errors, (unsigned int) scan->empty, (unsigned int) scan->badgcr,
+		scan->fat, scan->rapidlok, scan->wrong_density, scan->crc_dir, scan->crc);
+	write_md5(out, scan->md5_dir);
+	align_printf(out, ",");
+	write_md5(out, scan->md5);
+
+	align_printf(out, ",");
+	for (track = start_track; track <= end_track; track ++)
 	{
-		if(!(read_nb2(filename, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		if (!scan->formatted[track])
+			continue;
+
+		align_printf(out, "%s%.1f:%d", first ? "" : " ", (float) track / 2, job->track_density[track] & 3);
+		first = 0;
 	}
+
+	write_track_list(out, job, scan->badgcr_tracks, 1);
+	write_track_list(out, job, scan->fat_tracks, 0);
+	write_track_list(out, job, scan->rapidlok_tracks, 0);
+	write_track_list(out, job, scan->track_errors, 1);
+	align_printf(out, "\n");
+}
+
+/* one image of a collection, its output is kept until the images before it are printed */
+typedef struct
+{
+	char *name;
+	int ok;
+	long bytes;
+	char *output;
+	char *record;
+	int done;
+	int dump_copy;		/* earlier images with the same raw dump name */
+} collection_image;
+
+typedef struct
+{
+	collection_image *image;
+	int count;
+	int next;			/* image the next free worker takes */
+	int csv;
+#if defined(ARCH_THREADS) && defined(ARCH_LOCKS)
+	int threaded;
+	arch_mutex lock;
+	arch_cond changed;
+#endif
+} collection;
+
+/*
+	Raw dump names are given out in image order before scanning, so a
+	scan of the same collection writes the same files again.
+*/
+static void
+number_raw_dumps(collection *c)
+{
+	char (*dumpname)[RAW_DUMP_NAME_LENGTH];
+	int i, j;
+
+	if ((!c->count) || (!(dumpname = malloc(c->count * sizeof(*dumpname)))))
+		return;
+
+	for (i = 0; i < c->count; i++)
+	{
+		if (!raw_dump_name(c->image[i].name, 0, dumpname[i]))
+			dumpname[i][0] = '\0';
+
+		for (j = 0; j < i; j++)
+			if ((dumpname[i][0]) && (strcmp(dumpname[i], dumpname[j]) == 0))
+				c->image[i].dump_copy++;
+	}
+	free(dumpname);
+}
+
+/* load and scan image i into job, then write its record to out */
+static void
+scan_collection_image(collection *c, scan_job *job, align_context *out, int i, clock_t *load_time, clock_t *scan_time)
+{
+	collection_image *image = &c->image[i];
+	clock_t start;
+	FILE *fp;
+
+	memset(job->track_buffer, 0x00, (MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH);
+	memset(job->track_length, 0x00, (MAX_HALFTRACKS_1541 + 2) * sizeof(size_t));
+	memset(job->track_density, 0x00, MAX_HALFTRACKS_1541 + 2);
+	memset(job->track_alignment, 0x00, MAX_HALFTRACKS_1541 + 2);
+	memset(&job->scan, 0, sizeof(job->scan));
+
+	align_printf(job->ctx, "\n[%d/%d] %s\n", i + 1, c->count, image->name);
+
+	start = clock();
+	image->ok = load_image_r(job->ctx, image->name, job->track_buffer, job->track_density, job->track_length, job->track_alignment);
+	*load_time += clock() - start;
+
+	if (image->ok)
+	{
+		start = clock();
+		scan_image(job, image->name);
+		*scan_time += clock() - start;
+
+		if ((fp = fopen(image->name, "rb")))
+		{
+			fseek(fp, 0, SEEK_END);
+			image->bytes = ftell(fp);
+			fclose(fp);
+		}
+	}
+
+	if ((raw_dump_dir) && (image->ok))
+		dump_raw_tracks(job, image->name, image->dump_copy);
+
+	if (c->csv)
+		write_csv_record(out, job, image->name, image->ok);
+	else
+		write_json_record(out, job, image->name, image->ok);
+}
+
+static int
+alloc_scan_job(scan_job *job)
+{
+	memset(job, 0, sizeof(scan_job));
+	job->track_buffer = malloc((MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH);
+	job->track_density = malloc(MAX_HALFTRACKS_1541 + 2);
+	job->track_length = malloc((MAX_HALFTRACKS_1541 + 2) * sizeof(size_t));
+	job->track_alignment = malloc(MAX_HALFTRACKS_1541 + 2);
+
+	return ((job->track_buffer) && (job->track_density) && (job->track_length) && (job->track_alignment));
+}
+
+static void
+free_scan_job(scan_job *job)
+{
+	free(job->track_buffer);
+	free(job->track_density);
+	free(job->track_length);
+	free(job->track_alignment);
+}
+
+#if defined(ARCH_THREADS) && defined(ARCH_LOCKS)
+typedef struct
+{
+	collection *c;
+	scan_job job;
+} collection_worker;
+
+static ARCH_THREADFUNC
+collection_thread(void *arg)
+{
+	collection_worker *worker = (collection_worker *) arg;
+	collection *c = worker->c;
+	align_context ctx, out;
+	clock_t load_time = 0, scan_time = 0;	/* not reported, the process clock counts all threads */
+	int i;
+
+	arch_lock(&c->lock);
+	while (c->next < c->count)
+	{
+		i = c->next++;
+		arch_unlock(&c->lock);
+
+		/* every image starts from the options given, tracks are not split up again */
+		init_align_context(&ctx);
+		ctx.buffered = 1;
+		ctx.jobs = 1;
+		init_align_context(&out);
+		out.buffered = 1;
+		worker->job.ctx = &ctx;
+		scan_collection_image(c, &worker->job, &out, i, &load_time, &scan_time);
+
+		arch_lock(&c->lock);
+		c->image[i].output = ctx.log_buffer;
+		c->image[i].record = out.log_buffer;
+		c->image[i].done = 1;
+		arch_cond_broadcast(&c->changed);
+	}
+	arch_unlock(&c->lock);
+	return 0;
+}
+
+/*
+	Scan the images on worker threads, each with buffers of its own.
+	The output and records are written in image order as they come in.
+	Returns the number of threads that ran, 0 if none could be started.
+*/
+static int
+scan_collection_threads(collection *c, FILE *records, int jobs)
+{
+	collection_worker worker[MAX_ALIGN_JOBS];
+	arch_thread thread[MAX_ALIGN_JOBS];
+	int started, i;
+
+	for (i = 0; i < jobs; i++)
+	{
+		worker[i].c = c;
+		if (!alloc_scan_job(&worker[i].job))
+		{
+			printf("Could not allocate track buffers\n");
+			exit(1);
+		}
+	}
+
+	arch_mutex_init(&c->lock);
+	arch_cond_init(&c->changed);
+	c->threaded = 1;
+
+	/* tables built on first use, do it before there are threads */
+	crcInit();
+	init_GCR_tables();
+
+	for (started = 0; started < jobs; started++)
+		if (!arch_thread_create(&thread[started], collection_thread, &worker[started]))
+			break;
+
+	if (started)
+	{
+		arch_lock(&c->lock);
+		for (i = 0; i < c->count; i++)
+		{
+			while (!c->image[i].done)
+				arch_cond_wait(&c->changed, &c->lock);
+			arch_unlock(&c->lock);
+
+			if (c->image[i].output)
+				fputs(c->image[i].output, stdout);
+			if (c->image[i].record)
+				fputs(c->image[i].record, records);
+			fflush(records);
+			free(c->image[i].output);
+			free(c->image[i].record);
+
+			arch_lock(&c->lock);
+		}
+		arch_unlock(&c->lock);
+
+		for (i = 0; i < started; i++)
+			arch_thread_join(thread[i]);
+	}
+
+	arch_cond_destroy(&c->changed);
+	arch_mutex_destroy(&c->lock);
+	c->threaded = 0;
+	for (i = 0; i < jobs; i++)
+		free_scan_job(&worker[i].job);
+
+	return started;
+}
+#endif
+
+/*
+	Scan every image named on the command line, in list files or in the
+	directory trees given, and write a record for each one.  With -j the
+	images are scanned on that many threads.  Returns the number of images
+	that could not be scanned.
+*/
+int
+scan_collection(int argc, char **argv)
+{
+	collection c;
+	collection_image *image;
+	char **names = NULL;
+	int count = 0, failures = 0, threads = 0, i;
+	long bytes = 0;
+	clock_t load_time = 0, scan_time = 0;
+	time_t wall;
+	double seconds;
+	align_context ctx, out;
+	scan_job job;
+	FILE *records;
+
+	for (i = 0; i < argc; i++)
+		if (!collect_images(argv[i], &names, &count))
+			failures++;
+
+	memset(&c, 0, sizeof(c));
+	c.count = count;
+	c.csv = compare_extension((unsigned char *) record_file, (unsigned char *) "CSV");
+	if ((count) && (!(c.image = calloc(count, sizeof(collection_image)))))
+	{
+		printf("Could not allocate image list\n");
+		return 1;
+	}
+	for (i = 0; i < count; i++)
+		c.image[i].name = names[i];
+	if (raw_dump_dir)
+		number_raw_dumps(&c);
+
+	if (!(records = fopen(record_file, "w")))
+	{
+		printf("Couldn't create record file %s!\n", record_file);
+		return 1;
+	}
+
+	if (c.csv)
+		fprintf(records, "file,status,disk_id,cosmetic_id,errors,empty,weak_gcr,fat_tracks,rapidlok_tracks,wrong_density,"
+			"bam_crc,full_crc,bam_md5,full_md5,densities,weak_gcr_tracks,fat,rapidlok,error_tracks\n");
+
+	waitkey = 0;
+	wall = time(NULL);
+
+#if defined(ARCH_THREADS) && defined(ARCH_LOCKS)
+	threads = align_jobs;
+	if (threads > MAX_ALIGN_JOBS) threads = MAX_ALIGN_JOBS;
+	if (threads > count) threads = count;
+	if (threads > 1)
+		threads = scan_collection_threads(&c, records, threads);
+	else
+		threads = 0;
+#endif
+
+	/* one image after the other, each can still use -j for its tracks */
+	if (!threads)
+	{
+		if (!alloc_scan_job(&job))
+		{
+			printf("Could not allocate track buffers\n");
+			exit(1);
+		}
+		job.cache = 1;
+		job.ctx = &ctx;
+
+		for (i = 0; i < count; i++)
+		{
+			/* reading an image changes some options, every image starts from the same ones */
+			init_align_context(&ctx);
+			init_align_context(&out);
+			out.log = records;
+
+			scan_collection_image(&c, &job, &out, i, &load_time, &scan_time);
+			fflush(records);
+		}
+		free_scan_job(&job);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		image = &c.image[i];
+		if (!image->ok)
+			failures++;
+		bytes += image->bytes;
+		free(image->name);
+	}
+	free(c.image);
+	free(names);
+	fclose(records);
+
+	seconds = difftime(time(NULL), wall);
+	printf("\n---------------------------------------------------------------------\n");
+	printf("%d images scanned, %d failed, %ld bytes in %.0f seconds\n", count, failures, bytes, seconds);
+	if (seconds > 0)
+		printf("%.2f images/s, %.2f MB/s\n", count / seconds, bytes / (seconds * 1024 * 1024));
+	if (threads)
+		printf("Scanned on %d threads\n", threads);
 	else
+		printf("CPU time: loading %.2fs, scanning %.2fs\n",
+			(double) load_time / CLOCKS_PER_SEC, (double) scan_time / CLOCKS_PER_SEC);
+	printf("Records written to %s\n", record_file);
+
+	return failures;
+}
+
+int load_image(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+	int ok;
+
+	init_align_context(&ctx);
+	ok = load_image_r(&ctx, filename, track_buffer, track_density, track_length, track_alignment);
+	sync_align_buffer = ctx.sync_align_buffer;
+	fattrack = ctx.fattrack;
+
+	return ok;
+}
+
+int load_image_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+{
+	if (compare_extension((unsigned char *) filename, (unsigned char *) "D64"))
 	{
-		printf("Unknown image type = %s!\n", filename);
+		if(!(read_d64_r(ctx, filename, track_buffer, track_density, track_length))) return 0;
+	}
+	else if (compare_extension((unsigned char *) filename, (unsigned char *) "G64"))
+	{
+		if(!(read_g64_r(ctx, filename, track_buffer, track_density, track_length))) return 0;
+		if(ctx->sync_align_buffer) sync_tracks_r(ctx, track_buffer, track_density, track_length, track_alignment);
+	}
+	else if ((compare_extension((unsigned char *) filename, (unsigned char *) "NBZ")) || (compare_extension((unsigned char *) filename, (unsigned char *) "NBZ2")) ||
+		(compare_extension((unsigned char *) filename, (unsigned char *) "NIB")))
+	{
+		if(!(read_nib_file_r(ctx, filename, track_buffer, track_density, track_length, track_alignment, 1))) return 0;
+		if(ctx->fattrack!=99) search_fat_tracks_r(ctx, track_buffer, track_density, track_length);
+	}
+	else if (compare_extension((unsigned char *) filename, (unsigned char *) "NB2"))
+	{
+		if(!(read_nb2_r(ctx, filename, track_buffer, track_density, track_length))) return 0;
+		align_tracks_r(ctx, track_buffer, track_density, track_length, track_alignment);
+		if(ctx->fattrack!=99) search_fat_tracks_r(ctx, track_buffer, track_density, track_length);
+	}
+	else
+	{
+		align_printf(ctx, "Unknown image type = %s!\n", filename);
 		return 0;
 	}
 	return 1;
@@ -463,7 +1086,7 @@ compare_disks(void)
 }
 
 int
-scandisk(void)
+scandisk(scan_job *job)
 {
 	BYTE id[3], cosmetic_id[3];
 	int track = 0;
@@ -476,101 +1099,101 @@ scandisk(void)
 	size_t errors = 0, temp_errors = 0;
 	int defdensity;
 	char errorstring[0x1000];
-	char testfilename[16];
-	FILE *trkout;
 
 	// clear buffers
-	memset(badgcr_tracks, 0, sizeof(badgcr_tracks));
-	memset(fat_tracks, 0, sizeof(fat_tracks));
-	memset(rapidlok_tracks, 0, sizeof(rapidlok_tracks));
+	memset(&job->scan, 0, sizeof(job->scan));
 	errorstring[0] = '\0';
 
-	printf("\nScanning...\n");
+	align_printf(job->ctx, "\nScanning...\n");
 
 	// extract disk id from track 18
 	memset(id, 0, 3);
-	extract_id(track_buffer + (36 * NIB_TRACK_LENGTH), id);
-	printf("\ndisk id: %s\n", id);
+	extract_id(job->track_buffer + (36 * NIB_TRACK_LENGTH), id);
+	align_printf(job->ctx, "\ndisk id: %s\n", id);
 
 	// collect and print "cosmetic" disk id for comparison
 	memset(cosmetic_id, 0, 3);
-	extract_cosmetic_id(track_buffer + (36 * NIB_TRACK_LENGTH), cosmetic_id);
-	printf("cosmetic disk id: %s\n", cosmetic_id);
+	extract_cosmetic_id(job->track_buffer + (36 * NIB_TRACK_LENGTH), cosmetic_id);
+	align_printf(job->ctx, "cosmetic disk id: %s\n", cosmetic_id);
+
+	memcpy(job->scan.id, id, 3);
+	memcpy(job->scan.cosmetic_id, cosmetic_id, 3);
 
 	if(waitkey) getchar();
 
 	// check each track for various things
 	for (track = start_track; track <= end_track; track ++)
 	{
-		if(!check_formatted(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track]))
+		if(!check_formatted(job->track_buffer + (track * NIB_TRACK_LENGTH), job->track_length[track]))
 		{
 			//printf(":UNFORMATTED\n");
 			continue;
 		}
 		else
-			printf("%4.1f: %d",(float) track/2, track_length[track]);
+			align_printf(job->ctx, "%4.1f: %d",(float) track/2, (int) job->track_length[track]);
+		job->scan.formatted[track] = 1;
 
-		if (track_length[track] > 0)
+		if (job->track_length[track] > 0)
 		{
-			track_density[track] = check_sync_flags(track_buffer + (track * NIB_TRACK_LENGTH),
-				track_density[track]&3, track_length[track]);
+			job->track_density[track] = check_sync_flags(job->track_buffer + (track * NIB_TRACK_LENGTH),
+				job->track_density[track]&3, job->track_length[track]);
 
-			printf(" (density:%d", track_density[track]&3);
+			align_printf(job->ctx, " (density:%d", job->track_density[track]&3);
 
-			if (track_density[track] & BM_NO_SYNC)
-				printf(":NOSYNC");
-			else if (track_density[track] & BM_FF_TRACK)
-				printf(":KILLER");
+			if (job->track_density[track] & BM_NO_SYNC)
+				align_printf(job->ctx, ":NOSYNC");
+			else if (job->track_density[track] & BM_FF_TRACK)
+				align_printf(job->ctx, ":KILLER");
 
 			// establish default density and warn
 			defdensity = speed_map[track/2];
 
-			if ((track_density[track] & 3) != defdensity)
+			if ((job->track_density[track] & 3) != defdensity)
 			{
-				printf("!=%d?) ", defdensity);
+				align_printf(job->ctx, "!=%d?) ", defdensity);
 				if(track < 36*2) total_wrong_density++;
 				if(waitkey) getchar();
 			}
 			else
-				printf(") ");
+				align_printf(job->ctx, ") ");
 
 			if(increase_sync)
 			{
-				added_sync = lengthen_sync(track_buffer + (NIB_TRACK_LENGTH * track),
-					track_length[track], NIB_TRACK_LENGTH);
+				added_sync = lengthen_sync(job->track_buffer + (NIB_TRACK_LENGTH * track),
+					job->track_length[track], NIB_TRACK_LENGTH);
 
-				printf("[sync:%d] ", added_sync);
-				track_length[track] += added_sync;
+				align_printf(job->ctx, "[sync:%d] ", added_sync);
+				job->track_length[track] += added_sync;
 			}
 
 			// detect bad GCR '000' bits
-			badgcr_tracks[track] =
-			  check_bad_gcr(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]);
+			job->scan.badgcr_tracks[track] =
+			  check_bad_gcr_r(job->ctx, job->track_buffer + (NIB_TRACK_LENGTH * track), job->track_length[track]);
 
-			if (badgcr_tracks[track])
+			if (job->scan.badgcr_tracks[track])
 			{
-				//printf("weak:%d ", badgcr_tracks[track]);
-				totalgcr += badgcr_tracks[track];
+				//printf("weak:%d ", job->scan.badgcr_tracks[track]);
+				totalgcr += job->scan.badgcr_tracks[track];
 			}
 
 			/* check for rapidlok track
-			rapidlok_tracks[track] = check_rapidlok(track);
+			job->scan.rapidlok_tracks[track] = check_rapidlok(track);
 
-			if (rapidlok_tracks[track]) totalrl++;
+			if (job->scan.rapidlok_tracks[track]) totalrl++;
 			if ((totalrl) && (track == 72))
 			{
-				printf("RAPIDLOK KEYTRACK ");
-				rapidlok_tracks[track] = 1;
+				align_printf(job->ctx, "RAPIDLOK KEYTRACK ");
+				job->scan.rapidlok_tracks[track] = 1;
 			}
 			*/
 
 			/* check for FAT track */
-			if(fattrack!=99)
+			if(job->ctx->fattrack!=99)
 			{
 				if (track < end_track - track_inc)
 				{
-					fat_tracks[track] = check_fat(track);
-					if (fat_tracks[track]) totalfat++;
+					job->scan.fat_tracks[track] = check_fat(job, track);
+					if (job->scan.fat_tracks[track]) totalfat++;
 				}
 			}
 
@@ -581,91 +1204,91 @@ scandisk(void)
 				tracks above 35 are always CBM errors
 			*/
 			if(track/2 <= 35)
-				temp_errors = check_errors(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track], track, id, errorstring);
+				temp_errors = check_errors(job->track_buffer + (NIB_TRACK_LENGTH * track), job->track_length[track], track, id, errorstring);
 			else /* everything is a CBM error above track 35 */
 				temp_errors = 0;
 
+			job->scan.track_errors[track] = temp_errors;
 			if (temp_errors)
 			{
 				errors += temp_errors;
-				printf("%s", errorstring);
+				align_printf(job->ctx, "%s", errorstring);
 				if(waitkey) getchar();
 			}
 
-			temp_empty = check_empty(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track], track, id, errorstring);
+			temp_empty = check_empty(job->track_buffer + (NIB_TRACK_LENGTH * track), job->track_length[track], track, id, errorstring);
 			if (temp_empty)
 			{
 				empty += temp_empty;
-				if(verbose>1) printf(" %s", errorstring);
+				if(job->ctx->verbose>1) align_printf(job->ctx, " %s", errorstring);
 			}
 
-			if (verbose>1)
+			if (job->ctx->verbose>1)
 			{
-					dump_headers(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]);
-					raw_track_info(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]);
+					dump_headers(job->ctx, job->track_buffer + (NIB_TRACK_LENGTH * track), job->track_length[track]);
+					raw_track_info(job->ctx, job->track_buffer + (NIB_TRACK_LENGTH * track), job->track_length[track]);
 			}
 		}
 		else
 		{
-			printf("(%d", track_density[track]&3);
-			printf(":UNFORMATTED");
-		}
-		printf("\n");
-
-		// process and dump to disk for manual compare
-		//track_length[track] = compress_halftrack(track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], track_length[track]);
-
-		sprintf(testfilename, "raw/tr%.1fd%d", (float) track/2, (track_density[track] & 3));
-		if(NULL != (trkout = fopen(testfilename, "w")))
-		{
-			fwrite(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track], 1, trkout);
-			fclose(trkout);
+			align_printf(job->ctx, "(%d", job->track_density[track]&3);
+			align_printf(job->ctx, ":UNFORMATTED");
 		}
+		align_printf(job->ctx, "\n");
 	}
-	printf("\n---------------------------------------------------------------------\n");
-	printf("%d unrecognized sectors (CBM disk errors) detected\n", errors);
-	printf("%d known empty sectors detected\n", empty);
-	printf("%d bad GCR bytes detected\n", totalgcr);
-	printf("%d fat tracks detected\n", totalfat);
-	printf("%d rapidlok tracks detected\n", totalrl);
-	printf("%d tracks with non-standard density\n", total_wrong_density);
+	align_printf(job->ctx, "\n---------------------------------------------------------------------\n");
+	align_printf(job->ctx, "%d unrecognized sectors (CBM disk errors) detected\n", (int) errors);
+	align_printf(job->ctx, "%d known empty sectors detected\n", (int) empty);
+	align_printf(job->ctx, "%d bad GCR bytes detected\n", (int) totalgcr);
+	align_printf(job->ctx, "%d fat tracks detected\n", totalfat);
+	align_printf(job->ctx, "%d rapidlok tracks detected\n", totalrl);
+	align_printf(job->ctx, "%d tracks with non-standard density\n", total_wrong_density);
+
+	job->scan.errors = errors;
+	job->scan.empty = empty;
+	job->scan.badgcr = totalgcr;
+	job->scan.fat = totalfat;
+	job->scan.rapidlok = totalrl;
+	job->scan.wrong_density = total_wrong_density;
 	return 1;
 }
 
 int
-dump_headers(BYTE * gcrdata, size_t length)
+dump_headers(align_context *ctx, BYTE * gcrdata, size_t length)
 {
 	BYTE header[10];
 	BYTE *gcr_ptr, *gcr_end;
+	sync_map map;
 
 	gcr_ptr = gcrdata;
 	gcr_end = gcrdata + length;
+	build_sync_map(gcrdata, gcr_end, &map);
 
 	do
 	{
-		if (!find_sync(&gcr_ptr, gcr_end))
+		if (!map_find_sync(&map, &gcr_ptr))
 			return 0;
 
 		convert_4bytes_from_GCR(gcr_ptr, header);
 		convert_4bytes_from_GCR(gcr_ptr + 5, header + 4);
 
 		if(header[0] == 0x08) // only parse headers
-			printf("\n%.2x %.2x %.2x %.2x = typ:%.2x -- blh:%.2x -- trk:%d -- sec:%d -- id:%c%c",
+			align_printf(ctx, "\n%.2x %.2x %.2x %.2x = typ:%.2x -- blh:%.2x -- trk:%d -- sec:%d -- id:%c%c",
 				*gcr_ptr, *(gcr_ptr+1), *(gcr_ptr+2), *(gcr_ptr+3), header[0], header[1], header[3], header[2], header[5], header[4]);
 		else // data block should follow
-			printf("\n%.2x %.2x %.2x %.2x = typ:%.2x",
+			align_printf(ctx, "\n%.2x %.2x %.2x %.2x = typ:%.2x",
 				*gcr_ptr, *(gcr_ptr+1), *(gcr_ptr+2), *(gcr_ptr+3), header[0]);
 
 	} while (gcr_ptr < (gcr_end - 10));
 
-	printf("\n");
+	align_printf(ctx, "\n");
 
 	return 1;
 }
 
 
 int
-raw_track_info(BYTE * gcrdata, size_t length)
+raw_track_info(align_context *ctx, BYTE * gcrdata, size_t length)
 {
 	size_t sync_cnt = 0;
 	size_t sync_len[NIB_TRACK_LENGTH];
@@ -675,7 +1298,8 @@ raw_track_info(BYTE * gcrdata, size_t length)
 	*/
 	size_t bad_cnt = 0;
 	size_t bad_len[NIB_TRACK_LENGTH];
-	size_t i, locked;
+	size_t i, locked, pos, run;
+	badgcr_map badmap;
 
 	memset(sync_len, 0, sizeof(sync_len));
 	/* memset(gap_len, 0, sizeof(gap_len)); */
@@ -700,10 +1324,10 @@ raw_track_info(BYTE * gcrdata, size_t length)
 		}
 	}
 
-	printf("\nSYNCS:%d (", sync_cnt);
+	align_printf(ctx, "\nSYNCS:%d (", (int) sync_cnt);
 	for (i = 1; i <= sync_cnt; i++)
-		printf("%d-", sync_len[i]);
-	printf(")");
+		align_printf(ctx, "%d-", (int) sync_len[i]);
+	align_printf(ctx, ")");
 
 	/* count gaps/lengths - this code is innacurate, since gaps are of course not always 0x55 - they rarely are */
 	/*
@@ -724,65 +1348,52 @@ raw_track_info(BYTE * gcrdata, size_t length)
 		}
 	}
 
-	printf("\nGAPS :%d (", gap_cnt);
+	align_printf(ctx, "\nGAPS :%d (", gap_cnt);
 	for (i = 1; i <= gap_cnt; i++)
-		printf("%d-", gap_len[i]);
-	printf(")");
+		align_printf(ctx, "%d-", gap_len[i]);
+	align_printf(ctx, ")");
 	*/
 
 	/* count bad gcr lengths */
-	for (locked = 0, i = 0; i < length - 1; i++)
-	{
-		if (locked)
-		{
-			if (is_bad_gcr(gcrdata, length, i))
-				bad_len[bad_cnt]++;
-			else
-				locked = 0;
-		}
-		else if (is_bad_gcr(gcrdata, length, i))
-		{
-			locked = 1;
-			bad_cnt++;
-			bad_len[bad_cnt] = 1;
-		}
-	}
+	build_badgcr_map(gcrdata, length, &badmap);
+	for (i = 0; (pos = next_badgcr_run(&badmap, i, length - 1, &run)) < length - 1; i = pos + run)
+		bad_len[++bad_cnt] = run;
 
-	printf("\nBADGCR:%d (", bad_cnt);
+	align_printf(ctx, "\nBADGCR:%d (", (int) bad_cnt);
 	for (i = 1; i <= bad_cnt; i++)
-		printf("%d-", bad_len[i]);
-	printf(")");
+		align_printf(ctx, "%d-", (int) bad_len[i]);
+	align_printf(ctx, ")");
 
 	return 1;
 }
 
-size_t check_fat(int track)
+size_t check_fat(scan_job *job, int track)
 {
 	size_t diff = 0;
 	char errorstring[0x1000];
 
-	if (track_length[track] > 0 && track_length[track+2] > 0 && track_length[track] != 8192 && track_length[track+2] != 8192)
+	if (job->track_length[track] > 0 && job->track_length[track+2] > 0 && job->track_length[track] != 8192 && job->track_length[track+2] != 8192)
 	{
 		diff = compare_tracks(
-		  track_buffer + (track * NIB_TRACK_LENGTH),
-		  track_buffer + ((track+2) * NIB_TRACK_LENGTH),
-		  track_length[track],
-		  track_length[track+2], 1, errorstring);
+		  job->track_buffer + (track * NIB_TRACK_LENGTH),
+		  job->track_buffer + ((track+2) * NIB_TRACK_LENGTH),
+		  job->track_length[track],
+		  job->track_length[track+2], 1, errorstring);
 
-		if(verbose>1) printf("%s",errorstring);
+		if(job->ctx->verbose>1) align_printf(job->ctx, "%s",errorstring);
 
 		if (diff<=10)
 		{
-			printf("*FAT diff=%d*",(int)diff);
+			align_printf(job->ctx, "*FAT diff=%d*",(int)diff);
 			return 1;
 		}
 		else if (diff<34) /* 34 happens on empty formatted disks */
 		{
-			printf("*Possible FAT diff=%d*",(int)diff);
+			align_printf(job->ctx, "*Possible FAT diff=%d*",(int)diff);
 			return 1;
 		}
 		else
-			if(verbose>1) printf("diff=%d",(int)diff);
+			if(job->ctx->verbose>1) align_printf(job->ctx, "diff=%d",(int)diff);
 	}
 	return 0;
 }
@@ -868,7 +1479,10 @@ size_t check_rapidlok(int track)
 void
 usage(void)
 {
-	printf("usage: nibscan [options] <filename1> [filename2]\n\n");
+	printf("usage: nibscan [options] <filename1> [filename2]\n");
+	printf("       nibscan [options] -O<records.jsonl|records.csv> <file|directory|@listfile>...\n\n");
+	printf(" -W[dir]: Dump the raw tracks of each image to dir/<name>.raw (default: raw)\n");
+	printf(" -O[file]: Write a JSON line (or CSV for .csv) per image to file\n");
 	switchusage();
 	exit(1);
 }
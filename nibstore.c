@@ -0,0 +1,1043 @@
+/*
+    NIBSTORE - part of the NIBTOOLS package for 1541/1571 disk image nibbling
+
+	Keeps NIB and NB2 dumps in a track store.  Every halftrack (or NB2
+	pass) is filed under the MD5 of its aligned track and the MD5 of its
+	raw data, so a track that turns up in many images (blank tracks, common
+	loaders) is only stored once.  Another raw copy of a stored aligned
+	track is kept as a delta to it, so any image can be rebuilt with its
+	own raw tracks as NIB, NBZ, NBZ2 or G64, and an NB2 image as NB2.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mnibarch.h"
+#include "gcr.h"
+#include "nibtools.h"
+#include "prot.h"
+#include "md5.h"
+#include "lz.h"
+
+/*
+	Store file layout: a 0x10 byte header, then chunks that are only ever
+	appended.  Every chunk starts with its type and a little endian size.
+
+	'T' track record: MD5 of density and aligned track, MD5 of the raw
+	    track, density, flags, 2 zero bytes, then the raw track as an LZ
+	    frame, stored as is with NBZ2_STORED, or with STORE_DELTA as the
+	    MD5 of a raw track with the same key, a marker byte and an LZ block
+	    that refers back into that raw track.
+	'I' image manifest: 0x40 bytes of name, halftrack flag, track count,
+	    image kind, a zero byte, the file header of an NB2 image, then per
+	    halftrack or NB2 pass: number, density byte of the image, exact
+	    flag, a zero byte, MD5 of the track record, MD5 of the raw track.
+*/
+#define STORE_HEADER_LENGTH	0x10
+#define STORE_CHUNK_HEADER	8
+#define STORE_TRACK_HEADER	36
+#define STORE_NAME_LENGTH	0x40
+#define STORE_IMAGE_HEADER	(STORE_NAME_LENGTH + 4)
+#define STORE_IMAGE_ENTRY	36
+#define STORE_DELTA			0x02	/* frame refers back into another raw track */
+#define STORE_DELTA_HEADER	17
+#define STORE_IMAGE_NIB		0
+#define STORE_IMAGE_NB2		1
+#define STORE_MAX_PASSES	((MAX_HALFTRACKS_1541 + 2) * 4 * NB2_PASSES)
+#define STORE_FILE_HEADER	0x100	/* of a NIB or NB2 file */
+#define STORE_NB2_HEADER	(STORE_FILE_HEADER * 2)	/* header and pass table */
+#define STORE_MANIFEST_LENGTH	(STORE_IMAGE_HEADER + STORE_NB2_HEADER + (STORE_MAX_PASSES * STORE_IMAGE_ENTRY))
+
+int _dowildcard = 1;
+
+BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+BYTE raw_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+BYTE nb2_buffer[STORE_NB2_HEADER + (STORE_MAX_PASSES * NIB_TRACK_LENGTH)];
+BYTE track_density[MAX_HALFTRACKS_1541 + 2];
+BYTE track_marks[MAX_HALFTRACKS_1541 + 2];	/* density bytes of the image, marks included */
+BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
+size_t track_length[MAX_HALFTRACKS_1541 + 2];
+int file_buffer_size;
+int start_track, end_track, track_inc;
+int reduce_sync, reduce_badgcr, reduce_gap;
+int fix_gcr, align, force_align;
+int gap_match_length;
+int cap_min_ignore;
+int skip_halftracks;
+int verbose;
+int rpm_real;
+int auto_capacity_adjust;
+int skew;
+int align_disk;
+int ihs;
+int mode;
+int unformat_passes;
+int capacity_margin;
+int align_delay;
+int increase_sync = 0;
+int presync = 0;
+BYTE fillbyte = 0xfe;
+BYTE drive = 8;
+char * cbm_adapter = "";
+int use_floppycode_srq = 0;
+int override_srq = 0;
+int extra_capacity_margin=5;
+int sync_align_buffer=0;
+int fattrack=0;
+int track_match=0;
+int old_g64=0;
+int read_killer=1;
+int backwards=0;
+int align_jobs=1;
+int compress_level=0;
+
+/* what is known about a track record without reading it */
+typedef struct
+{
+	BYTE key[16];
+	BYTE raw[16];
+	long offset;	/* of the frame in the store file */
+	int size;
+	BYTE density;
+	BYTE flags;
+} store_record;
+
+typedef struct
+{
+	char name[STORE_NAME_LENGTH];
+	long offset;	/* of the manifest in the store file */
+	int size;
+} store_image;
+
+/* what adding an image did with its tracks */
+typedef struct
+{
+	int tracks;
+	int new_tracks;
+	int exact;		/* raw track already stored */
+	int delta;		/* kept as a delta to the same aligned track */
+} store_counts;
+
+static store_record *records;
+static int record_count, record_max;
+static int *record_hash, hash_size;	/* open addressing, -1 is free */
+static store_image *images;
+static int image_count, image_max;
+static long store_end;
+static BYTE manifest[STORE_MANIFEST_LENGTH];
+
+/* passes of the NB2 image being added, in file order */
+static BYTE *pass_data[STORE_MAX_PASSES];
+static BYTE pass_track[STORE_MAX_PASSES];
+static BYTE pass_density[STORE_MAX_PASSES];
+static BYTE pass_key[STORE_MAX_PASSES][16];
+static int pass_count;
+
+static void
+put_dword(BYTE *p, DWORD value)
+{
+	p[0] = (BYTE) value;
+	p[1] = (BYTE) (value >> 8);
+	p[2] = (BYTE) (value >> 16);
+	p[3] = (BYTE) (value >> 24);
+}
+
+static DWORD
+get_dword(BYTE *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((DWORD) p[3] << 24);
+}
+
+/* raw may be NULL to take any record with the same aligned key */
+static int
+find_record(BYTE *key, BYTE *raw)
+{
+	int i;
+
+	if (!hash_size)
+		return -1;
+
+	for (i = get_dword(key) & (hash_size - 1); record_hash[i] >= 0; i = (i + 1) & (hash_size - 1))
+		if ((memcmp(records[record_hash[i]].key, key, 16) == 0) &&
+			((!raw) || (memcmp(records[record_hash[i]].raw, raw, 16) == 0)))
+			return record_hash[i];
+
+	return -1;
+}
+
+static void
+hash_record(int index)
+{
+	int i;
+
+	for (i = get_dword(records[index].key) & (hash_size - 1); record_hash[i] >= 0; i = (i + 1) & (hash_size - 1));
+	record_hash[i] = index;
+}
+
+static int
+add_record(BYTE *header, long offset, int size)
+{
+	store_record *record;
+	int i;
+
+	if (record_count == record_max)
+	{
+		record_max = (record_max) ? record_max * 2 : 1024;
+		if (!(records = realloc(records, record_max * sizeof(store_record))))
+		{
+			printf("Could not allocate store index\n");
+			exit(0);
+		}
+	}
+
+	/* keep the hash table at most half full */
+	if ((record_count + 1) * 2 > hash_size)
+	{
+		hash_size = (hash_size) ? hash_size * 2 : 4096;
+		free(record_hash);
+		if (!(record_hash = malloc(hash_size * sizeof(int))))
+		{
+			printf("Could not allocate store index\n");
+			exit(0);
+		}
+		memset(record_hash, 0xff, hash_size * sizeof(int));
+		for (i = 0; i < record_count; i++)
+			hash_record(i);
+	}
+
+	record = &records[record_count];
+	memcpy(record->key, header, 16);
+	memcpy(record->raw, header + 16, 16);
+	record->density = header[32];
+	record->flags = header[33];
+	record->offset = offset;
+	record->size = size;
+	hash_record(record_count);
+
+	return record_count++;
+}
+
+static void
+add_image(BYTE *header, long offset, int size)
+{
+	if (image_count == image_max)
+	{
+		image_max = (image_max) ? image_max * 2 : 256;
+		if (!(images = realloc(images, image_max * sizeof(store_image))))
+		{
+			printf("Could not allocate store index\n");
+			exit(0);
+		}
+	}
+
+	memcpy(images[image_count].name, header, STORE_NAME_LENGTH);
+	images[image_count].name[STORE_NAME_LENGTH - 1] = '\0';
+	images[image_count].offset = offset;
+	images[image_count].size = size;
+	image_count++;
+}
+
+/*
+	Open a store and index its chunks.  A chunk cut short by an interrupted
+	run is dropped, the next one is written over it.
+*/
+static FILE *
+open_store(char *filename, int create)
+{
+	FILE *fp;
+	BYTE header[STORE_IMAGE_HEADER];
+	BYTE chunk[STORE_CHUNK_HEADER];
+	long offset, file_size;
+	int size;
+
+	if ((fp = fopen(filename, "r+b")) == NULL)
+	{
+		if ((!create) || ((fp = fopen(filename, "w+b")) == NULL))
+		{
+			printf("Couldn't open store %s!\n", filename);
+			return NULL;
+		}
+
+		memset(header, 0, STORE_HEADER_LENGTH);
+		memcpy(header, "NBS-1541-STORE", 14);
+		header[14] = 1;
+		if (fwrite(header, STORE_HEADER_LENGTH, 1, fp) != 1)
+		{
+			printf("Couldn't write store %s!\n", filename);
+			fclose(fp);
+			return NULL;
+		}
+		printf("Created store %s\n", filename);
+		store_end = STORE_HEADER_LENGTH;
+		return fp;
+	}
+
+	if ((fread(header, STORE_HEADER_LENGTH, 1, fp) != 1) || (memcmp(header, "NBS-1541-STORE", 14) != 0))
+	{
+		printf("%s is not a track store!\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	file_size = ftell(fp);
+	fseek(fp, STORE_HEADER_LENGTH, SEEK_SET);
+
+	store_end = STORE_HEADER_LENGTH;
+	while (fread(chunk, STORE_CHUNK_HEADER, 1, fp) == 1)
+	{
+		offset = store_end + STORE_CHUNK_HEADER;
+		size = get_dword(chunk + 4);
+		if ((size < 0) || (size > file_size - offset))
+			break;
+
+		if ((chunk[0] == 'T') && (size > STORE_TRACK_HEADER) && (size <= STORE_TRACK_HEADER + NBZ2_FRAME_LENGTH))
+		{
+			if (fread(header, STORE_TRACK_HEADER, 1, fp) != 1)
+				break;
+			add_record(header, offset + STORE_TRACK_HEADER, size - STORE_TRACK_HEADER);
+		}
+		else if ((chunk[0] == 'I') && (size >= STORE_IMAGE_HEADER) && (size <= STORE_MANIFEST_LENGTH))
+		{
+			if (fread(header, STORE_IMAGE_HEADER, 1, fp) != 1)
+				break;
+			add_image(header, offset, size);
+		}
+		else
+			break;
+
+		if (fseek(fp, offset + size, SEEK_SET) != 0)
+			break;
+		store_end = offset + size;
+	}
+
+	if (file_size != store_end)
+		printf("Store is damaged after %ld bytes, later data is dropped\n", store_end);
+
+	printf("Store %s: %d images, %d track records\n", filename, image_count, record_count);
+	return fp;
+}
+
+static int
+append_chunk(FILE *fp, BYTE type, BYTE *header, int header_size, BYTE *data, int size)
+{
+	BYTE chunk[STORE_CHUNK_HEADER];
+
+	memset(chunk, 0, sizeof(chunk));
+	chunk[0] = type;
+	put_dword(chunk + 4, header_size + size);
+
+	fseek(fp, store_end, SEEK_SET);
+	if ((fwrite(chunk, sizeof(chunk), 1, fp) != 1) ||
+		(fwrite(header, header_size, 1, fp) != 1) ||
+		((size) && (fwrite(data, size, 1, fp) != 1)))
+	{
+		printf("Couldn't write to store!\n");
+		exit(0);
+	}
+	store_end += sizeof(chunk) + header_size + size;
+	return sizeof(chunk) + header_size + size;
+}
+
+/* the key of a track is the MD5 of its density and aligned data */
+static void
+track_key(int track, BYTE *key)
+{
+	md5_context ctx;
+
+	md5_starts(&ctx);
+	md5_update(&ctx, &track_density[track], 1);
+	md5_update(&ctx, track_buffer + (track * NIB_TRACK_LENGTH), (int) track_length[track]);
+	md5_finish(&ctx, key);
+}
+
+/* a name that was added more than once by an older nibstore means the last copy */
+static int
+find_image(char *name)
+{
+	int i;
+
+	for (i = image_count - 1; i >= 0; i--)
+		if (strcmp(images[i].name, name) == 0)
+			break;
+
+	return i;
+}
+
+/*
+	Images are filed under the path they are added with, so dumps of the
+	same name from different directories stay apart.  A name that is
+	already in the store is refused.
+*/
+static int
+store_name(char *filename, char *name)
+{
+	char *p = filename;
+	int i;
+
+	while ((p[0] == '.') && ((p[1] == '/') || (p[1] == '\\')))
+		p += 2;
+
+	if (strlen(p) >= STORE_NAME_LENGTH)
+	{
+		printf("%s: name is too long for the store, add it from a closer directory\n", filename);
+		return 0;
+	}
+
+	for (i = 0; p[i]; i++)
+		name[i] = (p[i] == '\\') ? '/' : p[i];
+	name[i] = '\0';
+
+	if (find_image(name) >= 0)
+	{
+		printf("%s is already in the store, skipped\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+/* read the raw track of a record, checked against its MD5 */
+static int
+read_record(FILE *fp, int index, BYTE *track_data)
+{
+	store_record *record = &records[index];
+	BYTE frame[NBZ2_FRAME_LENGTH];
+	BYTE pair[NIB_TRACK_LENGTH * 2];
+	BYTE digest[16];
+	int base;
+
+	fseek(fp, record->offset, SEEK_SET);
+	if (fread(frame, record->size, 1, fp) != 1)
+		return 0;
+
+	if (record->flags & NBZ2_STORED)
+	{
+		if (record->size != NIB_TRACK_LENGTH)
+			return 0;
+		memcpy(track_data, frame, NIB_TRACK_LENGTH);
+	}
+	else if (record->flags & STORE_DELTA)
+	{
+		/* the base is always a whole record */
+		if ((record->size < STORE_DELTA_HEADER) || ((base = find_record(record->key, frame)) < 0) ||
+			(records[base].flags & STORE_DELTA) || (!read_record(fp, base, pair)))
+			return 0;
+
+		if (LZ_UncompressBlock(frame + STORE_DELTA_HEADER, pair, NIB_TRACK_LENGTH,
+			record->size - STORE_DELTA_HEADER, frame[16], sizeof(pair)) != sizeof(pair))
+			return 0;
+		memcpy(track_data, pair + NIB_TRACK_LENGTH, NIB_TRACK_LENGTH);
+	}
+	else if (LZ_UncompressBounded(frame, track_data, record->size, NIB_TRACK_LENGTH) != NIB_TRACK_LENGTH)
+		return 0;
+
+	md5(track_data, NIB_TRACK_LENGTH, digest);
+	return (memcmp(record->raw, digest, 16) == 0);
+}
+
+/*
+	File a raw track under the aligned key in header, which gets the MD5
+	of the raw track added.  A raw track that is already stored is only
+	referred to.  When its aligned key is stored, the raw track mostly
+	repeats that record's, and is kept as a delta to it if that is
+	smaller.  Returns the bytes added to the store.
+*/
+static int
+store_raw_track(FILE *fp, BYTE *header, BYTE *raw, BYTE density, store_counts *counts)
+{
+	BYTE frame[NBZ2_FRAME_LENGTH];
+	BYTE delta[NBZ2_FRAME_LENGTH];
+	BYTE pair[NIB_TRACK_LENGTH * 2];
+	BYTE *data = frame;
+	int base, size, delta_size, added;
+
+	counts->tracks++;
+	md5(raw, NIB_TRACK_LENGTH, header + 16);
+	if (find_record(header, header + 16) >= 0)
+	{
+		counts->exact++;
+		return 0;
+	}
+
+	header[32] = density;
+	size = LZ_CompressLevel(raw, frame, NIB_TRACK_LENGTH, compress_level);
+	if ((size <= 0) || (size >= NIB_TRACK_LENGTH))
+	{
+		header[33] = NBZ2_STORED;
+		data = raw;
+		size = NIB_TRACK_LENGTH;
+	}
+
+	base = find_record(header, NULL);
+	if ((base >= 0) && (!(records[base].flags & STORE_DELTA)) && (read_record(fp, base, pair)))
+	{
+		memcpy(pair + NIB_TRACK_LENGTH, raw, NIB_TRACK_LENGTH);
+		memcpy(delta, records[base].raw, 16);
+		delta[16] = (BYTE) LZ_Marker(raw, NIB_TRACK_LENGTH);
+		delta_size = STORE_DELTA_HEADER + LZ_CompressFastBlock(pair, delta + STORE_DELTA_HEADER,
+			NIB_TRACK_LENGTH, sizeof(pair), delta[16], compress_level);
+
+		if (delta_size < size)
+		{
+			header[33] = STORE_DELTA;
+			data = delta;
+			size = delta_size;
+		}
+	}
+
+	if (header[33] & STORE_DELTA)
+		counts->delta++;
+	else
+		counts->new_tracks++;
+
+	added = append_chunk(fp, 'T', header, STORE_TRACK_HEADER, data, size);
+	add_record(header, store_end - size, size);
+	return added;
+}
+
+static int
+read_raw_tracks(char *filename, BYTE *present)
+{
+	image_view view;
+	BYTE *entry;
+	int track, i, halftracks = 0;
+
+	memset(present, 0, MAX_HALFTRACKS_1541 + 2);
+	memset(raw_buffer, 0, sizeof(raw_buffer));
+	memset(track_density, 0, sizeof(track_density));
+	memset(track_marks, 0, sizeof(track_marks));
+
+	if ((!compare_extension((unsigned char *) filename, (unsigned char *) "NIB")) &&
+		(!compare_extension((unsigned char *) filename, (unsigned char *) "NBZ")) &&
+		(!compare_extension((unsigned char *) filename, (unsigned char *) "NBZ2")))
+	{
+		printf("Unknown image type = %s!\n", filename);
+		return -1;
+	}
+
+	if (!open_image_view(filename, &view))
+		return -1;
+
+	/* the view drops the marks in the density bytes, the manifest keeps them */
+	if (compare_extension((unsigned char *) filename, (unsigned char *) "NBZ2"))
+	{
+		for (entry = view.image + 0x10; (entry < view.image + NBZ2_HEADER_LENGTH) && (entry[0]); entry += 16)
+			if (entry[0] <= MAX_HALFTRACKS_1541 + 1)
+				track_marks[entry[0]] = entry[1];
+	}
+	else
+	{
+		for (i = 0x10; (i < STORE_FILE_HEADER) && (view.image[i]); i += 2)
+			if (view.image[i] <= MAX_HALFTRACKS_1541 + 1)
+				track_marks[view.image[i]] = view.image[i + 1];
+	}
+
+	for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track++)
+	{
+		if ((!view.track[track]) && (!view.frame[track]))
+			continue;
+
+		if (!view_read_track(&view, track, raw_buffer + (track * NIB_TRACK_LENGTH)))
+		{
+			printf("Bad data in track %d, left out\n", track);
+			continue;
+		}
+		track_density[track] = view.density[track];
+		present[track] = 1;
+		if (track & 1)
+			halftracks = 1;
+	}
+	close_image_view(&view);
+	return halftracks;
+}
+
+/*
+	Split an NB2 file in nb2_buffer into its passes, in file order, and
+	key each of them.  Returns the length of the file header, 0 if the
+	file can't be stored.
+*/
+static int
+read_nb2_passes(char *filename)
+{
+	BYTE table[STORE_FILE_HEADER];
+	BYTE *header = nb2_buffer;
+	FILE *fpin;
+	long size, offset;
+	int header_size, entry, track, density, pass, passes, round, found, i;
+
+	if ((fpin = fopen(filename, "rb")) == NULL)
+	{
+		printf("Couldn't open input file %s!\n", filename);
+		return 0;
+	}
+
+	fseek(fpin, 0, SEEK_END);
+	size = ftell(fpin);
+	rewind(fpin);
+	if ((size < STORE_FILE_HEADER) || (size > (long) sizeof(nb2_buffer)) || (fread(nb2_buffer, size, 1, fpin) != 1) ||
+		(memcmp(header, "MNIB-1541-RAW", 13) != 0))
+	{
+		printf("%s isn't an NB2 file that can be stored!\n", filename);
+		fclose(fpin);
+		return 0;
+	}
+	fclose(fpin);
+
+	/* adaptive captures have the passes of every track in a table, the others four at each density */
+	header_size = STORE_FILE_HEADER;
+	if (header[14] & NB2_ADAPTIVE)
+	{
+		header_size += sizeof(table);
+		if (size < header_size)
+		{
+			printf("%s: NB2 pass table is missing\n", filename);
+			return 0;
+		}
+		memcpy(table, nb2_buffer + STORE_FILE_HEADER, sizeof(table));
+	}
+	else
+		memset(table, (NB2_PASSES << 4) | NB2_PASSES, sizeof(table));
+
+	pass_count = 0;
+	offset = header_size;
+	for (entry = 0; (entry < (STORE_FILE_HEADER - 0x10) / 2) && (header[0x10 + (entry * 2)]); entry++)
+	{
+		track = header[0x10 + (entry * 2)];
+		if (track > MAX_HALFTRACKS_1541 + 1)
+		{
+			printf("%s: bad track %d in NB2 header\n", filename, track);
+			return 0;
+		}
+
+		for (density = 0; density < 4; density++)
+		{
+			passes = (int) NB2_PASS_COUNT(table, entry, density);
+			for (pass = 0; (pass < passes) && (offset + NIB_TRACK_LENGTH <= size); pass++)
+			{
+				if (pass_count == STORE_MAX_PASSES)
+				{
+					printf("%s: too many NB2 passes\n", filename);
+					return 0;
+				}
+				pass_data[pass_count] = nb2_buffer + offset;
+				pass_track[pass_count] = (BYTE) track;
+				pass_density[pass_count] = (BYTE) density;
+				pass_count++;
+				offset += NIB_TRACK_LENGTH;
+			}
+		}
+	}
+
+	if (offset != size)
+		printf("%s: %ld bytes after the last whole pass are left out\n", filename, size - offset);
+
+	/* align the n-th pass of every track together, as the tracks of one image */
+	for (round = 0; ; round++)
+	{
+		memset(track_buffer, 0, sizeof(track_buffer));
+		memset(track_density, 0, sizeof(track_density));
+		for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track++)
+			track_length[track] = NIB_TRACK_LENGTH;
+
+		for (i = 0, found = 0; i < pass_count; i++)
+		{
+			for (pass = 0, passes = 0; pass < i; pass++)
+				if (pass_track[pass] == pass_track[i])
+					passes++;
+
+			if (passes == round)
+			{
+				memcpy(track_buffer + (pass_track[i] * NIB_TRACK_LENGTH), pass_data[i], NIB_TRACK_LENGTH);
+				track_density[pass_track[i]] = pass_density[i];
+				found = 1;
+			}
+		}
+		if (!found)
+			break;
+
+		align_tracks(track_buffer, track_density, track_length, track_alignment);
+
+		for (i = 0; i < pass_count; i++)
+		{
+			for (pass = 0, passes = 0; pass < i; pass++)
+				if (pass_track[pass] == pass_track[i])
+					passes++;
+
+			if (passes == round)
+				track_key(pass_track[i], pass_key[i]);
+		}
+	}
+
+	return header_size;
+}
+
+/*
+	File the tracks of one image.  Returns the number of bytes added to
+	the store, adds the raw size of the image to *raw_bytes.
+*/
+static int
+add_store_image(FILE *fp, char *filename, double *raw_bytes, int *track_total)
+{
+	BYTE present[MAX_HALFTRACKS_1541 + 2];
+	BYTE header[STORE_TRACK_HEADER];
+	BYTE *entry;
+	char name[STORE_NAME_LENGTH];
+	store_counts counts;
+	int track, halftracks, header_size, i, size, added = 0;
+
+	printf("\nAdding %s\n", filename);
+
+	if (!store_name(filename, name))
+		return 0;
+
+	memset(&counts, 0, sizeof(counts));
+	memset(manifest, 0, STORE_IMAGE_HEADER);
+	strcpy((char *) manifest, name);
+
+	if (compare_extension((unsigned char *) filename, (unsigned char *) "NB2"))
+	{
+		if (!(header_size = read_nb2_passes(filename)))
+			return 0;
+
+		manifest[STORE_NAME_LENGTH] = 1;
+		manifest[STORE_NAME_LENGTH + 2] = STORE_IMAGE_NB2;
+		memcpy(manifest + STORE_IMAGE_HEADER, nb2_buffer, header_size);
+		entry = manifest + STORE_IMAGE_HEADER + header_size;
+
+		for (i = 0; i < pass_count; i++)
+		{
+			memset(header, 0, sizeof(header));
+			memcpy(header, pass_key[i], 16);
+			added += store_raw_track(fp, header, pass_data[i], pass_density[i], &counts);
+
+			entry[0] = pass_track[i];
+			entry[1] = pass_density[i];
+			entry[2] = 1;
+			memcpy(entry + 4, header, 32);
+			entry += STORE_IMAGE_ENTRY;
+		}
+		*raw_bytes += header_size + (pass_count * NIB_TRACK_LENGTH);
+	}
+	else
+	{
+		if ((halftracks = read_raw_tracks(filename, present)) < 0)
+			return 0;
+
+		/* the raw tracks stay in raw_buffer, keys come from aligned copies */
+		memcpy(track_buffer, raw_buffer, sizeof(track_buffer));
+		for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track++)
+			track_length[track] = NIB_TRACK_LENGTH;
+		align_tracks(track_buffer, track_density, track_length, track_alignment);
+
+		manifest[STORE_NAME_LENGTH] = (BYTE) halftracks;
+		entry = manifest + STORE_IMAGE_HEADER;
+
+		for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track++)
+		{
+			if (!present[track])
+				continue;
+
+			memset(header, 0, sizeof(header));
+			track_key(track, header);
+			added += store_raw_track(fp, header, raw_buffer + (track * NIB_TRACK_LENGTH), track_density[track], &counts);
+
+			entry[0] = (BYTE) track;
+			entry[1] = track_marks[track];
+			entry[2] = 1;
+			memcpy(entry + 4, header, 32);
+			entry += STORE_IMAGE_ENTRY;
+		}
+		manifest[STORE_NAME_LENGTH + 1] = (BYTE) counts.tracks;
+		*raw_bytes += NIB_HEADER_SIZE + (counts.tracks * NIB_TRACK_LENGTH);
+	}
+
+	size = (int) (entry - manifest);
+	added += append_chunk(fp, 'I', manifest, size, NULL, 0);
+	add_image(manifest, store_end - size, size);
+	fflush(fp);
+
+	printf("%s: %d %s, %d new, %d identical, %d kept as a delta to the same aligned track\n",
+		name, counts.tracks, (manifest[STORE_NAME_LENGTH + 2] == STORE_IMAGE_NB2) ? "passes" : "tracks",
+		counts.new_tracks, counts.exact, counts.delta);
+
+	*track_total += counts.tracks;
+	return added;
+}
+
+static int
+read_manifest(FILE *fp, int image)
+{
+	fseek(fp, images[image].offset, SEEK_SET);
+	if (fread(manifest, images[image].size, 1, fp) != 1)
+	{
+		printf("Couldn't read manifest of %s\n", images[image].name);
+		return 0;
+	}
+
+	if (manifest[STORE_NAME_LENGTH + 2] > STORE_IMAGE_NB2)
+	{
+		printf("%s was stored by a newer nibstore\n", images[image].name);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+	Rebuild a NIB image into track_buffer.  Stores from before raw tracks
+	were always kept may file a track under the record of another dump,
+	that track gets the other dump's raw data, which aligns the same.
+*/
+static int
+get_store_image(FILE *fp, int image)
+{
+	char *name = images[image].name;
+	BYTE *entry;
+	int i, index, track, tracks, inexact = 0;
+
+	memset(track_buffer, 0, sizeof(track_buffer));
+	memset(track_density, 0, sizeof(track_density));
+	tracks = manifest[STORE_NAME_LENGTH + 1];
+	if (STORE_IMAGE_HEADER + (tracks * STORE_IMAGE_ENTRY) > images[image].size)
+	{
+		printf("Manifest of %s is damaged\n", name);
+		return 0;
+	}
+	track_inc = (manifest[STORE_NAME_LENGTH]) ? 1 : 2;
+	start_track = MAX_HALFTRACKS_1541 + 1;
+	end_track = 0;
+
+	for (i = 0; i < tracks; i++)
+	{
+		entry = manifest + STORE_IMAGE_HEADER + (i * STORE_IMAGE_ENTRY);
+		track = entry[0];
+
+		if (track > MAX_HALFTRACKS_1541 + 1)
+			index = -1;
+		else if (((index = find_record(entry + 4, entry + 20)) < 0) && (!entry[2]))
+			index = find_record(entry + 4, NULL);
+
+		if (index < 0)
+		{
+			printf("Track record for track %d of %s is missing\n", track, name);
+			return 0;
+		}
+
+		if (!read_record(fp, index, track_buffer + (track * NIB_TRACK_LENGTH)))
+		{
+			printf("Track record for track %d of %s is damaged\n", track, name);
+			return 0;
+		}
+
+		track_density[track] = entry[1];
+		if (!entry[2])
+			inexact++;
+		if (track < start_track)
+			start_track = track;
+		if (track > end_track)
+			end_track = track;
+	}
+
+	printf("Rebuilt %s from %d track records", name, tracks);
+	if (inexact)
+		printf(", %d of them from another dump", inexact);
+	printf("\n");
+
+	return tracks;
+}
+
+/* rebuild an NB2 image into nb2_buffer, returns its size */
+static int
+get_store_nb2(FILE *fp, int image)
+{
+	char *name = images[image].name;
+	BYTE *header = manifest + STORE_IMAGE_HEADER;
+	BYTE *entry;
+	int header_size, passes, index, i;
+
+	header_size = STORE_FILE_HEADER + ((header[14] & NB2_ADAPTIVE) ? STORE_FILE_HEADER : 0);
+	if (STORE_IMAGE_HEADER + header_size > images[image].size)
+	{
+		printf("Manifest of %s is damaged\n", name);
+		return 0;
+	}
+	passes = (images[image].size - STORE_IMAGE_HEADER - header_size) / STORE_IMAGE_ENTRY;
+	memcpy(nb2_buffer, header, header_size);
+
+	for (i = 0; i < passes; i++)
+	{
+		entry = header + header_size + (i * STORE_IMAGE_ENTRY);
+		if (((index = find_record(entry + 4, entry + 20)) < 0) ||
+			(!read_record(fp, index, nb2_buffer + header_size + (i * NIB_TRACK_LENGTH))))
+		{
+			printf("Track record for pass %d of %s is missing or damaged\n", i, name);
+			return 0;
+		}
+	}
+
+	printf("Rebuilt %s from %d track records\n", name, passes);
+	return header_size + (passes * NIB_TRACK_LENGTH);
+}
+
+static int
+list_store(void)
+{
+	int i;
+
+	for (i = 0; i < image_count; i++)
+		printf("%s\n", images[i].name);
+
+	printf("\n%d images, %d track records, %ld bytes\n", image_count, record_count, store_end);
+	return 1;
+}
+
+int ARCH_MAINDECL
+main(int argc, char **argv)
+{
+	FILE *fp;
+	char *command, *storename, *outname;
+	time_t start;
+	double added = 0, raw_bytes = 0;
+	int t, image, tracks = 0, seconds;
+
+	start_track = 1 * 2;
+	end_track = 42 * 2;
+	track_inc = 1;
+	fix_gcr = 1;
+	reduce_sync = 4;
+	skip_halftracks = 0;
+	align = ALIGN_NONE;
+	force_align = ALIGN_NONE;
+	gap_match_length = 7;
+	cap_min_ignore = 0;
+	verbose = 0;
+	rpm_real = 295;
+
+	/* default is to reduce sync */
+	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
+	for(t=0; t<MAX_TRACKS_1541+1; t++)
+		track_length[t] = NIB_TRACK_LENGTH;
+
+	fprintf(stdout,
+		"\nnibstore - deduplicating track store for NIB images.\n"
+		AUTHOR VERSION "\n\n");
+
+	while (--argc && (*(++argv)[0] == '-'))
+		parseargs(argv);
+
+	if (argc < 2) usage();
+	command = argv[0];
+	storename = argv[1];
+
+	if (strcmp(command, "add") == 0)
+	{
+		if (argc < 3) usage();
+		if (!(fp = open_store(storename, 1))) exit(0);
+
+		start = time(NULL);
+		for (t = 2; t < argc; t++)
+			added += add_store_image(fp, argv[t], &raw_bytes, &tracks);
+		seconds = (int) difftime(time(NULL), start);
+
+		printf("\nAdded %d tracks (%.0f bytes as NIB) in %d seconds", tracks, raw_bytes, seconds);
+		if (seconds)
+			printf(", %.2f MB/s", raw_bytes / (seconds * 1024 * 1024));
+		printf("\n%.0f bytes written to the store", added);
+		if (added)
+			printf(", dedupe ratio %.2f:1", raw_bytes / added);
+		printf("\n");
+	}
+	else if (strcmp(command, "get") == 0)
+	{
+		if (argc < 4) usage();
+		outname = argv[3];
+		if (!(fp = open_store(storename, 0))) exit(0);
+		if ((image = find_image(argv[2])) < 0)
+		{
+			printf("Image %s is not in the store\n", argv[2]);
+			exit(0);
+		}
+		if (!read_manifest(fp, image)) exit(0);
+
+		if ((manifest[STORE_NAME_LENGTH + 2] == STORE_IMAGE_NB2) ||
+			(compare_extension((unsigned char *) outname, (unsigned char *) "NB2")))
+		{
+			/* the passes of an NB2 image only make up an NB2 file */
+			if ((manifest[STORE_NAME_LENGTH + 2] != STORE_IMAGE_NB2) ||
+				(!compare_extension((unsigned char *) outname, (unsigned char *) "NB2")))
+			{
+				printf("Only NB2 images are rebuilt as NB2, and only as NB2\n");
+				exit(0);
+			}
+			if(!(file_buffer_size = get_store_nb2(fp, image))) exit(0);
+			if(!(save_file(outname, nb2_buffer, file_buffer_size))) exit(0);
+		}
+		else if (!get_store_image(fp, image)) exit(0);
+		else if ((compare_extension((unsigned char *) outname, (unsigned char *) "NIB")) ||
+			(compare_extension((unsigned char *) outname, (unsigned char *) "NBZ")))
+		{
+			if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) exit(0);
+			if (compare_extension((unsigned char *) outname, (unsigned char *) "NBZ"))
+			{
+				if(!(file_buffer_size = compress_nbz(file_buffer, compressed_buffer, file_buffer_size))) exit(0);
+				if(!(save_file(outname, compressed_buffer, file_buffer_size))) exit(0);
+			}
+			else if(!(save_file(outname, file_buffer, file_buffer_size))) exit(0);
+		}
+		else if (compare_extension((unsigned char *) outname, (unsigned char *) "NBZ2"))
+		{
+			if(!(file_buffer_size = write_nbz2(compressed_buffer, track_buffer, track_density, track_length))) exit(0);
+			if(!(save_file(outname, compressed_buffer, file_buffer_size))) exit(0);
+		}
+		else if (compare_extension((unsigned char *) outname, (unsigned char *) "G64"))
+		{
+			/* the same steps as nibconv takes from a NIB file, which drops the density marks */
+			memset(track_length, 0, sizeof(track_length));
+			for(t=0; t<MAX_TRACKS_1541+1; t++)
+				track_length[t] = NIB_TRACK_LENGTH;
+			for(t=0; t<MAX_HALFTRACKS_1541+2; t++)
+				track_density[t] %= BM_MATCH;
+			align_tracks(track_buffer, track_density, track_length, track_alignment);
+			search_fat_tracks(track_buffer, track_density, track_length);
+			start_track = 1 * 2;
+			end_track = 42 * 2;
+			track_inc = (skip_halftracks) ? 2 : 1;
+			if(!(write_g64(outname, track_buffer, track_density, track_length))) exit(0);
+		}
+		else
+		{
+			printf("Unknown output file type\n");
+			exit(0);
+		}
+	}
+	else if (strcmp(command, "list") == 0)
+	{
+		if (!(fp = open_store(storename, 0))) exit(0);
+		list_store();
+	}
+	else
+		usage();
+
+	fclose(fp);
+	return 0;
+}
+
+void
+usage(void)
+{
+	printf(
+	"usage: nibstore [options] add <store> <image>...\n"
+	"       nibstore [options] get <store> <name> <outfile>\n"
+	"       nibstore list <store>\n"
+	"\nsupported file extensions for images:\n"
+	"NIB, NBZ, NBZ2, NB2\n"
+	"\nsupported file extensions for outfile:\n"
+	"NIB, NBZ, NBZ2, G64, NB2 (for NB2 images)\n"
+	"\noptions:\n");
+
+	switchusage();
+	exit(1);
+}
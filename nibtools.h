@@ -39,6 +39,21 @@
 
 #define DENSITY_SAMPLES 2
 
+/* passes of a track at each density in an NB2 file, the adaptive capture (-N) can stop earlier */
+#define NB2_PASSES 4
+
+/*
+	Adaptive NB2 files have this flag in header byte 14 and a table of the
+	passes each track has after the header, a nibble per density and two
+	bytes per track entry.
+*/
+#define NB2_ADAPTIVE 0x01
+#define NB2_PASS_COUNT(table, entry, density) \
+	(((table)[((entry) * 2) + ((density) >> 1)] >> (((density) & 1) * 4)) & 0x0f)
+
+/* most worker threads for aligning tracks (-j) */
+#define MAX_ALIGN_JOBS 16
+
 /* custom density maps for reading */
 #define DENSITY_STANDARD 0
 #define DENSITY_RAPIDLOK	1
@@ -106,9 +121,45 @@ extern int sync_align_buffer;
 extern int fattrack;
 extern int old_g64;
 extern int backwards;
+extern int align_jobs;
+extern int compress_level;
+extern int read_pipeline;
+extern int nb2_match;
 
 #include "ihs.h"
 
+/*
+	An image file opened for reading.  The tracks point straight into the
+	file data and are never written, callers that change a track read it
+	into their own buffer first.  There is no copy on write: the aligners
+	read the raw track from here and write the aligned one to the caller's
+	buffer, and everything that patches tracks works on that buffer.
+*/
+typedef struct
+{
+	BYTE *data;		/* file contents, mapped or read */
+	size_t size;
+	int mapped;
+	BYTE *image;	/* NIB data, uncompressed for NBZ */
+	size_t image_size;
+	int g64;
+	int tracks;		/* highest halftrack listed */
+	BYTE *track[MAX_HALFTRACKS_1541 + 2];	/* NULL if not in image */
+	size_t length[MAX_HALFTRACKS_1541 + 2];
+	BYTE density[MAX_HALFTRACKS_1541 + 2];
+	BYTE *frame[MAX_HALFTRACKS_1541 + 2];	/* compressed track (NBZ2) */
+	size_t frame_size[MAX_HALFTRACKS_1541 + 2];
+	DWORD crc[MAX_HALFTRACKS_1541 + 2];
+} image_view;
+
+/* NBZ2 header: NIB style fields, then 16 bytes of index per track */
+#define NBZ2_HEADER_LENGTH	(0x10 + 16 * (MAX_HALFTRACKS_1541 + 2))
+#define NBZ2_STORED			0x01	/* frame holds the raw track */
+#define NBZ2_FRAME_LENGTH	(NIB_TRACK_LENGTH * 2)	/* LZ worst case is 257/256 of a track */
+
+/* raw track dump header: 16 bytes of index per track, like NBZ2 */
+#define RAW_DUMP_HEADER_LENGTH	(0x10 + 16 * (MAX_HALFTRACKS_1541 + 2))
+
 /* common */
 void usage(void);
 
@@ -125,22 +176,56 @@ void parseargs(char *argv[]);
 void switchusage(void);
 int load_file(char *filename, BYTE *file_buffer);
 int save_file(char *filename, BYTE *file_buffer, int length);
+int save_file_r(align_context *ctx, char *filename, BYTE *file_buffer, int length);
 int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int read_nib_file(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment, int aligned);
+int read_nib_file_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment, int aligned);
+int open_image_view(char *filename, image_view *view);
+int open_image_view_r(align_context *ctx, char *filename, image_view *view);
+void close_image_view(image_view *view);
+BYTE *view_track(image_view *view, int track);
+size_t view_read_track(image_view *view, int track, BYTE *buffer);
+int view_to_tracks(image_view *view, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int view_to_tracks_r(align_context *ctx, image_view *view, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int align_view_tracks(image_view *view, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+int align_view_tracks_r(align_context *ctx, image_view *view, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
 int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int read_nb2_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int read_g64_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int read_d64_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 int write_nib(BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int write_nib_r(align_context *ctx, BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int write_nbz2(BYTE *file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int write_nbz2_r(align_context *ctx, BYTE *file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int compress_nbz(BYTE *file_buffer, BYTE *compressed_buffer, int file_buffer_size);
+int compress_nbz_r(align_context *ctx, BYTE *file_buffer, BYTE *compressed_buffer, int file_buffer_size);
+int write_raw_dump(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int write_raw_dump_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int read_raw_dump(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int write_g64_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int write_d64_r(align_context *ctx, char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE track_density, size_t track_length);
+size_t compress_halftrack_r(align_context * ctx, int halftrack, BYTE *track_buffer, BYTE track_density, size_t track_length);
 int align_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+int align_tracks_r(align_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
 int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+int rig_tracks_r(align_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
 int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+int sync_tracks_r(align_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
 int write_dword(FILE * fd, DWORD * buf, int num);
+int collect_images(char *filename, char ***names, int *count);
 unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length);
 unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length);
 unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned char *result);
 unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned char *result);
+unsigned int crc_dir_track_r(align_context *ctx, BYTE *track_buffer, size_t *track_length);
+unsigned int crc_all_tracks_r(align_context *ctx, BYTE *track_buffer, size_t *track_length);
+unsigned int md5_dir_track_r(align_context *ctx, BYTE *track_buffer, size_t *track_length, unsigned char *result);
+unsigned int md5_all_tracks_r(align_context *ctx, BYTE *track_buffer, size_t *track_length, unsigned char *result);
 
 /* read.c */
 BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer);
@@ -153,7 +238,7 @@ int TrackAlignmentReport(CBM_FILE fd);
 
 /* write.c */
 void master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-void master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+void master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length, int dumped);
 void prep_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, size_t tracklen);
 void write_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 void unformat_disk(CBM_FILE fd);
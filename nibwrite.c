@@ -15,7 +15,6 @@
 #include "gcr.h"
 #include "nibtools.h"
 #include "prot.h"
-#include "lz.h"
 
 int _dowildcard = 1;
 
@@ -23,14 +22,11 @@ char bitrate_range[4] = { 43 * 2, 31 * 2, 25 * 2, 18 * 2 };
 char bitrate_value[4] = { 0x00, 0x20, 0x40, 0x60 };
 char density_branch[4] = { 0xb1, 0xb5, 0xb7, 0xb9 };
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
 BYTE track_density[MAX_HALFTRACKS_1541 + 2];
 BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
 size_t track_length[MAX_HALFTRACKS_1541 + 2];
 
-int file_buffer_size;
 int start_track, end_track, track_inc;
 int reduce_sync;
 int fix_gcr, aggressive_gcr;
@@ -68,9 +64,12 @@ int old_g64=0;
 int read_killer=1;
 int extended_parallel_test=0;
 int backwards=0;
+int align_jobs=1;
+int compress_level=0;
 
 CBM_FILE fd;
 FILE *fplog;
+int raw_dumped = 0;
 
 int ARCH_MAINDECL
 main(int argc, char *argv[])
@@ -112,8 +111,6 @@ main(int argc, char *argv[])
 	align = ALIGN_NONE;
 
 	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
 	memset(track_buffer, 0x00, sizeof(track_buffer));
 
 	/* default is to reduce sync */
@@ -141,6 +138,15 @@ main(int argc, char *argv[])
 			exit(0);
 		}
 	}
+	else if ((mode == MODE_WRITE_RAW) && (argc > 0))
+	{
+		/* a raw track dump from nibscan -W, instead of the raw/ track files */
+		if(!(raw_dumped = read_raw_dump(filename, track_buffer, track_density, track_length)))
+		{
+			printf("\nRaw track dump loading failed\n");
+			exit(0);
+		}
+	}
 
 #ifdef DJGPP
 	calibrate();
@@ -206,33 +212,23 @@ main(int argc, char *argv[])
 int loadimage(char *filename)
 {
 	/* read and remaster disk */
-	if (compare_extension(filename, "D64"))
+	if (compare_extension((unsigned char *) filename, (unsigned char *) "D64"))
 	{
 		if(!(read_d64(filename, track_buffer, track_density, track_length))) return 0;
 	}
-	else if (compare_extension(filename, "G64"))
+	else if (compare_extension((unsigned char *) filename, (unsigned char *) "G64"))
 	{
 		if(!(read_g64(filename, track_buffer, track_density, track_length))) return 0;
 		if(sync_align_buffer)	sync_tracks(track_buffer, track_density, track_length, track_alignment);
 		search_fat_tracks(track_buffer, track_density, track_length);
 	}
-	else if (compare_extension(filename, "NBZ"))
+	else if ((compare_extension((unsigned char *) filename, (unsigned char *) "NBZ")) || (compare_extension((unsigned char *) filename, (unsigned char *) "NBZ2")) ||
+		(compare_extension((unsigned char *) filename, (unsigned char *) "NIB")))
 	{
-		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(filename, compressed_buffer))) return 0;
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
-	}
-	else if (compare_extension(filename, "NIB"))
-	{
-		if(!(file_buffer_size = load_file(filename, file_buffer))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_nib_file(filename, track_buffer, track_density, track_length, track_alignment, 1))) return 0;
 		search_fat_tracks(track_buffer, track_density, track_length);
 	}
-	else if (compare_extension(filename, "NB2"))
+	else if (compare_extension((unsigned char *) filename, (unsigned char *) "NB2"))
 	{
 		if(!(read_nb2(filename, track_buffer, track_density, track_length))) return 0;
 		align_tracks(track_buffer, track_density, track_length, track_alignment);
@@ -262,7 +258,7 @@ int writeimage(CBM_FILE fd)
 	//	init_aligned_disk(fd);
 
 	if(mode == MODE_WRITE_RAW)
-		master_disk_raw(fd, track_buffer, track_density, track_length);
+		master_disk_raw(fd, track_buffer, track_density, track_length, raw_dumped);
 	else
 		master_disk(fd, track_buffer, track_density, track_length);
 
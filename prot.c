@@ -12,13 +12,13 @@
 extern int fattrack;
 
 /* I don't like this kludge, but it is necessary to fix old files that lacked halftracks */
-void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+void search_fat_tracks_r(align_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
 {
 	int track, numfats=0;
 	size_t diff=0;
 	char errorstring[0x1000];
 
-	if(!fattrack) /* autodetect fat tracks */
+	if(!ctx->fattrack) /* autodetect fat tracks */
 	{
 		//printf("Searching for fat tracks...\n");
 		for (track=2; track<=MAX_HALFTRACKS_1541-1; track+=2)
@@ -32,11 +32,11 @@ void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_le
 				  track_length[track],
 				  track_length[track+2], 1, errorstring);
 
-				if(verbose>1) printf("%4.1f: %d\n",(float)track/2,diff);
+				if(ctx->verbose>1) align_printf(ctx, "%4.1f: %d\n",(float)track/2,(int) diff);
 
 				if (diff<2) /* 34 happens on empty formatted disks */
 				{
-					printf("Likely fat track found on T%d/%d (diff=%d)\n",track/2,(track/2)+1,(int)diff);
+					align_printf(ctx, "Likely fat track found on T%d/%d (diff=%d)\n",track/2,(track/2)+1,(int)diff);
 
 					memcpy(track_buffer + ((track+1) * NIB_TRACK_LENGTH),
 						track_buffer + (track * NIB_TRACK_LENGTH),
@@ -46,10 +46,10 @@ void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_le
 					track_density[track+1] = track_density[track];
 
 					if(!numfats)
-						fattrack=track;
+						ctx->fattrack=track;
 					else
 					{
-						printf("These are likely not fat tracks, just repeat data - Ignoring\n");
+						align_printf(ctx, "These are likely not fat tracks, just repeat data - Ignoring\n");
 						//fattrack=0;
 					}
 					numfats++;
@@ -57,29 +57,40 @@ void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_le
 			}
 		}
 	}
-	else if(fattrack!=99) /* manually overridden */
+	else if(ctx->fattrack!=99) /* manually overridden */
 	{
-		printf("Handle FAT track on %d\n",fattrack/2);
+		align_printf(ctx, "Handle FAT track on %d\n",ctx->fattrack/2);
 
-		memcpy(track_buffer + ((fattrack+1) * NIB_TRACK_LENGTH),
-			track_buffer + (fattrack * NIB_TRACK_LENGTH),
+		memcpy(track_buffer + ((ctx->fattrack+1) * NIB_TRACK_LENGTH),
+			track_buffer + (ctx->fattrack * NIB_TRACK_LENGTH),
 			NIB_TRACK_LENGTH);
 
-		track_length[fattrack+1] = track_length[fattrack];
-		track_density[fattrack+1] = track_density[fattrack];
+		track_length[ctx->fattrack+1] = track_length[ctx->fattrack];
+		track_density[ctx->fattrack+1] = track_density[ctx->fattrack];
 	}
 }
 
+void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+{
+	align_context ctx;
+
+	init_align_context(&ctx);
+	search_fat_tracks_r(&ctx, track_buffer, track_density, track_length);
+	fattrack = ctx.fattrack;
+}
+
 /* this routine tries to "fix" non-sync aligned images created from RAW Kryoflux stream files */
 /* PROBLEM: This simple implementation can miss sync like 01111111 11111110 which is 14 bits and valid... */
 /* PROBLEM: Many KF G64s begin the track in the middle of a sector, and is missed by this routine also */
-size_t sync_align(BYTE *buffer, int length)
+size_t sync_align_r(align_context * ctx, BYTE *buffer, int length)
 {
     int i, j;
-    int bytes, bits;
+    int bytes, bits, fill;
+    size_t ones;
 	BYTE temp_buffer[NIB_TRACK_LENGTH];
 	//BYTE *marker_pos;
 
+	invalidate_sector_cache(buffer);
 	memset(temp_buffer, 0x00, NIB_TRACK_LENGTH);
 
     // first align buffer to a sync, shuffling
@@ -101,7 +112,7 @@ size_t sync_align(BYTE *buffer, int length)
 	memcpy(temp_buffer, buffer+i, length-i);
 	memcpy(temp_buffer+length-i, buffer, i);
     memcpy(buffer, temp_buffer, length);
-    if(verbose>1) printf("{shuff:%d}", i);
+    if(ctx->verbose>1) align_printf(ctx, "{shuff:%d}", i);
 
     // shift buffer left to edge of sync marks
     for (i=0; i<length; i++)
@@ -118,14 +129,25 @@ size_t sync_align(BYTE *buffer, int length)
 				bytes++;
 				if(i+bytes>length) break;
 			}
-			if(verbose>1) printf("(%d)", bytes);
+			if(ctx->verbose>1) align_printf(ctx, "(%d)", bytes);
 
-			//shift left until MSB cleared
-			while(buffer[i] & 0x80)
+			if(i+bytes < length)
 			{
+				//shift left until MSB cleared, the byte after the run feeds its MSB into every shift
+				fill = buffer[i+bytes] >> 7;
+				ones = count_one_bits(buffer+i, 0, bytes*8);
+				if((ones == (size_t)bytes*8) && fill) ones = 9;
+
+				bits = (ones > 8) ? 9 : (int)ones;
+				if((ones > 8) && (ctx->verbose)) align_printf(ctx, "error shift too long!");
+				shift_bits_left(buffer+i, bytes, (ones > 8) ? 8 : ones, fill);
+			}
+			else while(buffer[i] & 0x80)
+			{
+				//the run reaches the end of the track, shift bit by bit
 				if(bits++>7)
 				{
-					if(verbose) printf("error shift too long!");
+					if(ctx->verbose) align_printf(ctx, "error shift too long!");
 					break;
 				}
 
@@ -136,46 +158,25 @@ size_t sync_align(BYTE *buffer, int length)
 				}
 				//buffer[i+j] |= 0x1;
 			}
-			if(verbose>1) printf("[bits:%d]",bits);
+			if(ctx->verbose>1) align_printf(ctx, "[bits:%d]",bits);
 		}
     }
     return 1;
 }
 
-void shift_buffer_left(BYTE *buffer, int length, int n)
+size_t sync_align(BYTE *buffer, int length)
 {
-    int i;
-    BYTE tempbuf[NIB_TRACK_LENGTH + 1];
-    BYTE carry;
-    int carryshift = 8 - n;
-
-    memcpy(tempbuf, buffer, length);
-    tempbuf[length] = 0x00;
+	return sync_align_r(default_align_context(), buffer, length);
+}
 
-    // shift buffer left by n bits
-    for (i = 0; i < length; i++)
-    {
-        carry = tempbuf[i+1];
-        buffer[i] = (tempbuf[i] << n) | (carry >> carryshift);
-    }
+void shift_buffer_left(BYTE *buffer, int length, int n)
+{
+    bitshift(buffer, length, n);
 }
 
 void shift_buffer_right(BYTE *buffer, int length, int n)
 {
-    int i;
-    BYTE tempbuf[NIB_TRACK_LENGTH];
-    BYTE carry;
-    int carryshift = 8 - n;
-
-    memcpy(tempbuf, buffer, length);
-
-    // shift buffer right by n bits
-    carry = 0;
-    for (i = 0; i < length; i++)
-    {
-        buffer[i] = (tempbuf[i] >> n) | (carry << carryshift);
-        carry = tempbuf[i];
-    }
+    bitshift(buffer, length, -n);
 }
 
 BYTE *
@@ -269,7 +270,7 @@ align_vmax_cw(BYTE * work_buffer, size_t tracklen)
 }
 
 BYTE *
-align_pirateslayer(BYTE * work_buffer, size_t tracklen)
+align_pirateslayer_r(align_context * ctx, BYTE * work_buffer, size_t tracklen)
 {
 	BYTE *pos, *buffer_end;
 	BYTE backup_buffer[NIB_TRACK_LENGTH*2];
@@ -294,7 +295,7 @@ align_pirateslayer(BYTE * work_buffer, size_t tracklen)
 			}
 			pos++;
 		}
-		printf(">>%d", shift+1);
+		align_printf(ctx, ">>%d", shift+1);
 		shift_buffer_right(work_buffer, tracklen, 1);
 	}
 
@@ -304,6 +305,12 @@ align_pirateslayer(BYTE * work_buffer, size_t tracklen)
 	return NULL;
 }
 
+BYTE *
+align_pirateslayer(BYTE * work_buffer, size_t tracklen)
+{
+	return align_pirateslayer_r(default_align_context(), work_buffer, tracklen);
+}
+
 /* RL detector routine for nibtools.
 
 Try to find longest good gcr run of RL-TH, check for RL/DOS format,
@@ -337,14 +344,12 @@ sync before sector 0.
 */
 
 
-/* RLTV: Global value. Early RL versions have TV info on T17, not T18.
+/* ctx->rl_tv: Early RL versions have TV info on T17, not T18.
    RL TV standard is output only when RL version is recognized on T18,
-   so we have to remember this value. */
-static int RLTV = 0;
-
+   so the context remembers this value between tracks. */
 
 BYTE *
-align_rl_special(BYTE * work_buffer, size_t tracklen)
+align_rl_special_r(align_context * ctx, BYTE * work_buffer, size_t tracklen)
 {
 	BYTE *pos, *pos2, *pos3, *pos4, *pos5, *pos6, *buffer_end, *key, *key_PreKS_Sync, *key_PreSec0_Sync, *key_KS;
 	int longest, numGG, numFF, num55, num7B, num4B, numXX, Found_RL_TrackHeader, len_temp;
@@ -502,7 +507,7 @@ align_rl_special(BYTE * work_buffer, size_t tracklen)
 						pos5 = pos+183;
 						//printf("<%2X.%2X.%2X.%2X>",*pos2,*pos3,*pos4,*pos5);
 						/* RL1-TV: */
-						if ( (*pos2 == 0x54) && (*pos3 == 0xB4) && (*pos4 == 0xD5) && (*pos5 == 0x7B) ) RLTV = 1; /* 1=NTSC */
+						if ( (*pos2 == 0x54) && (*pos3 == 0xB4) && (*pos4 == 0xD5) && (*pos5 == 0x7B) ) ctx->rl_tv = 1; /* 1=NTSC */
 					}
 				}
 
@@ -535,9 +540,9 @@ align_rl_special(BYTE * work_buffer, size_t tracklen)
 						pos6 = pos+199;
 						//printf("<%2X.%2X.%2X.%2X.%2X>",*pos2,*pos3,*pos4,*pos5,*pos6);
 						/* RL2-TV: */
-						if ( (*pos2 == 0xF2) && (*pos3 == 0x65) && (*pos4 == 0xBF) && (*pos5 == 0x27) && (*pos6 == 0xDE) ) RLTV = 1; /* 1=NTSC */
-						if ( (*pos2 == 0x92) && (*pos3 == 0xBD) && (*pos4 == 0x3B) && (*pos5 == 0x2A) && (*pos6 == 0xD6) ) RLTV = 1; /* 1=NTSC */
-						if ( (*pos2 == 0xF2) && (*pos3 == 0x55) && (*pos4 == 0x2F) && (*pos5 == 0x25) && (*pos6 == 0x52) ) RLTV = 2; /* 1=PAL */
+						if ( (*pos2 == 0xF2) && (*pos3 == 0x65) && (*pos4 == 0xBF) && (*pos5 == 0x27) && (*pos6 == 0xDE) ) ctx->rl_tv = 1; /* 1=NTSC */
+						if ( (*pos2 == 0x92) && (*pos3 == 0xBD) && (*pos4 == 0x3B) && (*pos5 == 0x2A) && (*pos6 == 0xD6) ) ctx->rl_tv = 1; /* 1=NTSC */
+						if ( (*pos2 == 0xF2) && (*pos3 == 0x55) && (*pos4 == 0x2F) && (*pos5 == 0x25) && (*pos6 == 0x52) ) ctx->rl_tv = 2; /* 1=PAL */
 					}
 				}
 
@@ -562,9 +567,9 @@ align_rl_special(BYTE * work_buffer, size_t tracklen)
 						pos4 = pos+198;
 						pos5 = pos+199;
 						//printf("<%2X.%2X.%2X.%2X>",*pos2,*pos3,*pos4,*pos5);
-						if ( (*pos2 == 0xAF) && (*pos3 == 0x9A) && (*pos4 == 0xE6) && (*pos5 == 0xB5) ) RLTV = 1; /* RL6: 1=NTSC, RL7: 1=PAL!! */
-						if ( (*pos2 == 0x9E) && (*pos3 == 0xAA) && (*pos4 == 0xE5) && (*pos5 == 0x73) ) RLTV = 2; /* RL6: 2=PAL */
-						if ( (*pos2 == 0x96) && (*pos3 == 0xEA) && (*pos4 == 0xE5) && (*pos5 == 0xE9) ) RLTV = 3; /* RL7: 3=NTSC */
+						if ( (*pos2 == 0xAF) && (*pos3 == 0x9A) && (*pos4 == 0xE6) && (*pos5 == 0xB5) ) ctx->rl_tv = 1; /* RL6: 1=NTSC, RL7: 1=PAL!! */
+						if ( (*pos2 == 0x9E) && (*pos3 == 0xAA) && (*pos4 == 0xE5) && (*pos5 == 0x73) ) ctx->rl_tv = 2; /* RL6: 2=PAL */
+						if ( (*pos2 == 0x96) && (*pos3 == 0xEA) && (*pos4 == 0xE5) && (*pos5 == 0xE9) ) ctx->rl_tv = 3; /* RL7: 3=NTSC */
 					}
 				}
 				RLT17S0Identified = 0;
@@ -656,13 +661,13 @@ cont:
 	if ( (RL_Hdr_Found > 0) && ( (RL_Sec_Found > 0) || (DOS_Sec_Found > 0) ) )
 	{
 		/* RL track with $75 sector headers and $6B/$55 data sectors */
-		printf("[RL");
+		align_printf(ctx, "[RL");
 		if (Found_Max_RL_TrackHeader == 1)
 		{
 			if (MaxNum4B > 0) /* reveal $7B extra sectors that contain randomly distributed $4B */
-				printf(":THX:%d+%d+%d{%d}+%d->%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNum4B, MaxNumXX, MaxNum55+MaxNum7B+MaxNumXX);
+				align_printf(ctx, ":THX:%d+%d+%d{%d}+%d->%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNum4B, MaxNumXX, MaxNum55+MaxNum7B+MaxNumXX);
 			else
-				printf(":TH:%d+%d+%d+%d->%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNumXX, MaxNum55+MaxNum7B+MaxNumXX);
+				align_printf(ctx, ":TH:%d+%d+%d+%d->%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNumXX, MaxNum55+MaxNum7B+MaxNumXX);
 		}
 		else
 		{
@@ -670,25 +675,25 @@ cont:
 			if (longest_PreSec0_Sync > 0)
 			{
 				if (DOSSecAlignRule == 1)
-					printf(":DOS-Sec0]"); /* align to DOS-Sec0 with longest preceding sync */
+					align_printf(ctx, ":DOS-Sec0]"); /* align to DOS-Sec0 with longest preceding sync */
 				else
-					printf(":DOS-MaxSync]");
+					align_printf(ctx, ":DOS-MaxSync]");
 				key = key_PreSec0_Sync; /* align to DOS-Hdr with longest preceding sync */
 			}
 			else
-				printf("]"); /* not even DOS sector found */
+				align_printf(ctx, "]"); /* not even DOS sector found */
 		}
 	}
 	else if ( (DOS_Hdr_Found > 0) && (DOS_Sec_Found > 0) )
 	{
 		/* DOS track with $55/$52 IDs, no $75 IDs */
-		printf("[DOS");
+		align_printf(ctx, "[DOS");
 		if (Found_Max_RL_TrackHeader == 1)
 		{
 			if (MaxNum4B > 0) /* reveal $7B extra sectors that contain randomly distributed $4B */
-				printf(":THX:%d+%d+%d{%d}+%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNum4B, MaxNumXX);
+				align_printf(ctx, ":THX:%d+%d+%d{%d}+%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNum4B, MaxNumXX);
 			else
-				printf(":TH:%d+%d+%d+%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNumXX);
+				align_printf(ctx, ":TH:%d+%d+%d+%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNumXX);
 		}
 		else
 		{
@@ -696,56 +701,62 @@ cont:
 			if (longest_PreSec0_Sync > 0)
 			{
 				if (DOSSecAlignRule == 1)
-					printf(":DOS-Sec0]"); /* align to DOS-Sec0 with longest preceding sync */
+					align_printf(ctx, ":DOS-Sec0]"); /* align to DOS-Sec0 with longest preceding sync */
 				else
-					printf(":DOS-MaxSync]");
+					align_printf(ctx, ":DOS-MaxSync]");
 				key = key_PreSec0_Sync; /* align to DOS-Hdr with longest preceding sync */
 			}
 			else
-				printf("]"); /* not even DOS sector found */
+				align_printf(ctx, "]"); /* not even DOS sector found */
 		}
 	}
 	else if ( (RL_Sec_Found > 0) && (RL_Hdr_Found == 0) && (NonRLStruct == 0) && (100 < RL_Sec_Len) && (RL_Sec_Len < 350) )
 	{
 		/* RL-KS found, place it at end of track buffer */
-		printf("[RL-KS:%d]", RL_Sec_Len); /* KS in first half of double-track-buffer */
+		align_printf(ctx, "[RL-KS:%d]", RL_Sec_Len); /* KS in first half of double-track-buffer */
 		key = key_KS + RL_Sec_Len; /* key --> first byte after RL-KS */
 		if (key >= work_buffer + tracklen)
 			key = key_PreKS_Sync; /* choose sync-start in first half of double-track-buffer */
 	}
 	else
-		printf("[Unknown!]"); /* Unknown track format */
+		align_printf(ctx, "[Unknown!]"); /* Unknown track format */
 
 	if (RLver)
 	{
-		printf("<RL%d", RLver);
+		align_printf(ctx, "<RL%d", RLver);
 		if (RLver == 7)
 		{
 			/* TV is only printed when RL version is recognized */
-			if (RLTV == 1)
-				printf("-PAL> ");
-			else if (RLTV == 3)
-				printf("-NTSC> ");
+			if (ctx->rl_tv == 1)
+				align_printf(ctx, "-PAL> ");
+			else if (ctx->rl_tv == 3)
+				align_printf(ctx, "-NTSC> ");
 			else
-				printf("-TV?> ");
+				align_printf(ctx, "-TV?> ");
 		}
 		else
 		{
 			/* TV is only printed when RL version is recognized */
-			if (RLTV == 1)
-				printf("-NTSC> ");
-			else if (RLTV == 2)
-				printf("-PAL> ");
+			if (ctx->rl_tv == 1)
+				align_printf(ctx, "-NTSC> ");
+			else if (ctx->rl_tv == 2)
+				align_printf(ctx, "-PAL> ");
 			else
-				printf("-TV?> ");
+				align_printf(ctx, "-TV?> ");
 		}
 	}
 	else
-		printf(" ");
+		align_printf(ctx, " ");
 
 	return key;
 }
 
+BYTE *
+align_rl_special(BYTE * work_buffer, size_t tracklen)
+{
+	return align_rl_special_r(default_align_context(), work_buffer, tracklen);
+}
+
 // Line up the track cycle to the start of the longest gap mark
 // this helps some custom protection tracks master properly
 BYTE *
@@ -796,35 +807,23 @@ auto_gap(BYTE * work_buffer, size_t tracklen)
 BYTE *
 find_bad_gap(BYTE * work_buffer, size_t tracklen)
 {
-	BYTE *pos, *buffer_end, *key_temp, *key;
-	int run, longest;
+	BYTE *key;
+	size_t pos, start, run, longest;
+	badgcr_map map;
 
-	run = 0;
 	longest = 0;
-	pos = work_buffer;
-	buffer_end = work_buffer + tracklen + 1;
-	key = key_temp = NULL;
+	key = NULL;
+	build_badgcr_map(work_buffer, tracklen + 1, &map);
 
-	/* try to find longest bad gcr run */
-	while (pos < buffer_end)
+	/* try to find longest bad gcr run, not counting one cut off by the end */
+	for (pos = 0; (start = next_badgcr_run(&map, pos, map.length, &run)) < map.length; pos = start + run)
 	{
-		if (is_bad_gcr(work_buffer, buffer_end - work_buffer,
-		  pos - work_buffer))
+		if ((start + run < map.length) && (run > longest))
 		{
 			// mark next GCR byte
-			key_temp = pos + 1;
-			run++;
+			key = work_buffer + start + run;
+			longest = run;
 		}
-		else
-		{
-			if (run > longest)
-			{
-				key = key_temp;
-				longest = run;
-			}
-			run = 0;
-		}
-		pos++;
 	}
 
 	/* first byte after bad run */
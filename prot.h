@@ -1,13 +1,17 @@
 /* prot.h */
 void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+void search_fat_tracks_r(align_context *ctx, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 size_t sync_align(BYTE *buffer, int length);
+size_t sync_align_r(align_context * ctx, BYTE *buffer, int length);
 void shift_buffer_left(BYTE * buffer, int length, int n);
 void shift_buffer_right(BYTE * buffer, int length, int n);
 BYTE *align_vmax(BYTE * work_buffer, size_t track_len);
 BYTE *align_vmax_cw(BYTE * work_buffer, size_t track_len);
 BYTE *align_vmax_new(BYTE * work_buffer, size_t tracklen);
 BYTE *align_pirateslayer(BYTE * work_buffer, size_t tracklen);
+BYTE *align_pirateslayer_r(align_context * ctx, BYTE * work_buffer, size_t tracklen);
 BYTE *align_rl_special(BYTE * work_buffer, size_t tracklen);
+BYTE *align_rl_special_r(align_context * ctx, BYTE * work_buffer, size_t tracklen);
 BYTE *auto_gap(BYTE * work_buffer, size_t track_len);
 BYTE *find_bad_gap(BYTE * work_buffer, size_t tracklen);
 BYTE *find_long_sync(BYTE * work_buffer, size_t tracklen);
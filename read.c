@@ -12,11 +12,109 @@
 #include "mnibarch.h"
 #include "gcr.h"
 #include "nibtools.h"
+#include "crc.h"
+
+/* extra reads of a track to verify it against the first (-V) */
+#define TRACK_MATCH_READS 3
+
+/* most bad GCR in an adaptive NB2 read (-N) at another density, one byte in this many */
+#define NB2_BAD_GCR_RATIO 100
+
+/* halftracks the pipelined reader (-O) can have between drive and analysis */
+#define READ_PIPELINE_SLOTS 4
+
+/* reads of a track the sector consensus keeps, later ones only count as retries */
+#define CONSENSUS_READS 16
+
+/* most GCR bytes from a block header to its data block */
+#define DATA_BLOCK_DISTANCE 100
+
+/* bad reads of a sector it takes to vote on its bytes */
+#define CONSENSUS_BYTE_VOTES 3
+
+#define CONSENSUS_NONE	0	/* no winner */
+#define CONSENSUS_GOOD	1	/* most good reads agree */
+#define CONSENSUS_VOTED	2	/* byte vote of bad reads gives a good checksum */
+#define CONSENSUS_WEAK	3	/* byte vote with weak bytes left */
 
 static BYTE diskid[3];
 extern int drivetype;
 
-BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
+/*
+	Messages of a track read, for the screen and the log file.  They are
+	printed right away, or buffered when the track is analyzed on another
+	thread and has to wait for its turn.
+*/
+typedef struct
+{
+	align_context screen;
+	align_context log;
+} read_output;
+
+/* retry state of paranoia_read_halftrack() for one halftrack */
+typedef struct
+{
+	int halftrack;
+	read_output out;
+	BYTE raw[NIB_TRACK_LENGTH];			/* first pass read, the result */
+	BYTE raw_verify[NIB_TRACK_LENGTH];
+	BYTE gcr[NIB_TRACK_LENGTH];			/* track cycles */
+	BYTE gcr_verify[NIB_TRACK_LENGTH];
+	BYTE raw_best[NIB_TRACK_LENGTH];	/* read with the shortest cycle */
+	BYTE align;
+	BYTE density, density_verify;
+	size_t length, length_verify, best, errors;
+	size_t pass, verify_pass;
+	int verifying;
+	char errorstring[0x1000];
+	/* sectors of every first pass read, for the consensus */
+	int reads, base;
+	size_t base_errors, base_missing;
+	BYTE raw_base[NIB_TRACK_LENGTH];	/* read with the fewest sectors missing, then errors */
+	BYTE sector_error[CONSENSUS_READS][SECTOR_INDEX_SIZE];
+	BYTE sector_data[CONSENSUS_READS][SECTOR_INDEX_SIZE][260];
+	BYTE header_error[CONSENSUS_READS][SECTOR_INDEX_SIZE];
+	BYTE header_gcr[CONSENSUS_READS][SECTOR_INDEX_SIZE][10];
+} track_read;
+
+static void
+init_read_output(read_output *out, int buffered)
+{
+	init_align_context(&out->screen);
+	init_align_context(&out->log);
+	out->log.log = fplog;
+	out->screen.buffered = buffered;
+	out->log.buffered = buffered;
+}
+
+static void
+flush_read_output(read_output *out)
+{
+	if (out->screen.log_buffer)
+	{
+		fputs(out->screen.log_buffer, stdout);
+		free(out->screen.log_buffer);
+	}
+	if (out->log.log_buffer)
+	{
+		if (fplog) fputs(out->log.log_buffer, fplog);
+		free(out->log.log_buffer);
+	}
+	out->screen.log_buffer = out->log.log_buffer = NULL;
+	out->screen.log_used = out->screen.log_size = 0;
+	out->log.log_used = out->log.log_size = 0;
+	fflush(stdout);
+}
+
+static BYTE scan_track_r(read_output *out, CBM_FILE fd, int track);
+
+/*
+	Read a halftrack into buffer.  A known density from an earlier read of
+	the track skips the density scan, -1 only skips it when the track was
+	the last one read.
+*/
+static BYTE
+read_halftrack_r(read_output *out, CBM_FILE fd, int halftrack, BYTE * buffer, int known_density)
 {
 	BYTE density;
     int i, newtrack;
@@ -26,10 +124,10 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	newtrack = (lasttrack == halftrack) ? 0 : 1;
 	lasttrack = halftrack;
 
-	if(newtrack)
+	if((newtrack) && (known_density < 0))
 	{
-		printf("\n%4.1f: ", (float) halftrack / 2);
-		fprintf(fplog, "\n%4.1f: ", (float) halftrack / 2);
+		align_printf(&out->screen, "\n%4.1f: ", (float) halftrack / 2);
+		align_printf(&out->log, "\n%4.1f: ", (float) halftrack / 2);
 
 		step_to_halftrack(fd, halftrack);
 
@@ -38,7 +136,7 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 		else if (Use_SCPlus_IHS)
 			density = Scan_Track_SCPlus_IHS(fd, halftrack, buffer);  // deep scan track density (1541/1571 SC+ compatible IHS was initially checked)
 		else
-			density = scan_track(fd, halftrack);
+			density = scan_track_r(out, fd, halftrack);
 
 		/* Set bitrate to the default density and scan for NOSYNC/KILLER */
 		/* If you don't do this, some 1541-II and 1571 drives can timeout */
@@ -49,33 +147,35 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	}
 	else
 	{
-		// this is the same track we just read
-		density = last_density;
-		printf("\n      ");
-		fprintf(fplog, "\n      ");
+		// this is the same track we just read, or one we come back to
+		if(newtrack)
+			step_to_halftrack(fd, halftrack);
+		density = (known_density < 0) ? last_density : (BYTE) known_density;
+		align_printf(&out->screen, "\n      ");
+		align_printf(&out->log, "\n      ");
 	}
 
 	/* output current density */
-	printf("(%d",density&3);
-	fprintf(fplog,"(%d",density&3);
+	align_printf(&out->screen, "(%d",density&3);
+	align_printf(&out->log, "(%d",density&3);
 
 	if ( (density&3) != speed_map[halftrack/2])
-		printf("!=%d", speed_map[halftrack/2]);
+		align_printf(&out->screen, "!=%d", speed_map[halftrack/2]);
 
 	if(density & BM_FF_TRACK)
 	{
-		printf(" KILLER");
-		fprintf(fplog, " KILLER!");
+		align_printf(&out->screen, " KILLER");
+		align_printf(&out->log, " KILLER!");
 	}
 
 	if(density & BM_NO_SYNC)
 	{
-		printf(" NOSYNC!");
-		fprintf(fplog," NOSYNC!");
+		align_printf(&out->screen, " NOSYNC!");
+		align_printf(&out->log, " NOSYNC!");
 	}
 
-	printf(") ");
-	fprintf(fplog,") ");
+	align_printf(&out->screen, ") ");
+	align_printf(&out->log, ") ");
 
 	// bail if we don't want to read killer tracks
 	// some drives/disks timeout
@@ -88,7 +188,7 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	if((density) != last_density)
 	{
 		set_density(fd, density&3);
-		if(verbose>2) printf("[D]");
+		if(verbose>2) align_printf(&out->screen, "[D]");
 		last_density = density;
 	}
 
@@ -113,8 +213,8 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 		else
 		{
 			// If we got a timeout, reset the port before retrying.
-			printf("!");
-			fprintf(fplog,"(timeout) ");
+			align_printf(&out->screen, "!");
+			align_printf(&out->log, "(timeout) ");
 			fflush(stdout);
 			burst_read(fd);
 			//delay(500);
@@ -132,196 +232,796 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	return (density);
 }
 
-BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
+BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 {
-	BYTE buffer1[NIB_TRACK_LENGTH];
-	BYTE buffer2[NIB_TRACK_LENGTH];
-	BYTE cbuffer1[NIB_TRACK_LENGTH];
-	BYTE cbuffer2[NIB_TRACK_LENGTH];
-	BYTE bbuffer[NIB_TRACK_LENGTH];
-	BYTE *cbufn, *cbufo, *bufn, *bufo;
-	BYTE align;
-	size_t leno, lenn, gcr_diff;
-	BYTE denso, densn;
-	size_t i, l, badgcr, retries, errors, best;
-	char errorstring[0x1000];
+	read_output out;
+
+	init_read_output(&out, 0);
+	return read_halftrack_r(&out, fd, halftrack, buffer, -1);
+}
+
+static void
+start_track_read(track_read *t, int halftrack, int buffered)
+{
+	t->halftrack = halftrack;
+	init_read_output(&t->out, buffered);
+	t->best = NIB_TRACK_LENGTH;
+	t->density = t->density_verify = 0;
+	t->length = t->length_verify = 0;
+	t->errors = 0;
+	t->pass = t->verify_pass = 0;
+	t->verifying = 0;
+	t->errorstring[0] = '\0';
+	t->reads = 0;
+}
+
+/* extraction keeps the shared context (RapidLok TV standard) unless buffered,
+   read_floppy() doesn't buffer RapidLok alignment */
+static align_context *
+track_read_context(track_read *t)
+{
+	return (t->out.screen.buffered) ? &t->out.screen : default_align_context();
+}
+
+/* cleared buffer for the next read of the track */
+static BYTE *
+track_read_buffer(track_read *t)
+{
+	BYTE *buffer = (t->verifying) ? t->raw_verify : t->raw;
 
-	badgcr = 0;
-	errors = 0;
-	retries = 3;
-	best = NIB_TRACK_LENGTH;
-	denso = 0;
-	densn = 0;
-	leno = 0;
-	lenn = 0;
-	bufn = buffer1;
-	bufo = buffer2;
-	cbufn = cbuffer1;
-	cbufo = cbuffer2;
-
-	errorstring[0] = '\0';
-
-	// First pass at normal track read
-	for (l = 0; l <= error_retries; l ++)
-	{
-		memset(bufo, 0, NIB_TRACK_LENGTH);
-		denso = read_halftrack(fd, halftrack, bufo);
-
-		// if we have a killer track, exit processing
-		if(denso & BM_FF_TRACK)
+	memset(buffer, 0, NIB_TRACK_LENGTH);
+	return buffer;
+}
+
+/* reads after the first keep the density the first one found */
+static BYTE
+read_track_pass(CBM_FILE fd, track_read *t)
+{
+	int known_density = ((t->pass) || (t->verifying)) ? t->density : -1;
+
+	return read_halftrack_r(&t->out, fd, t->halftrack, track_read_buffer(t), known_density);
+}
+
+/*
+	Sector consensus.  Every read of the first pass keeps its decoded
+	sectors.  A sector is settled when more good reads agree on it than on
+	anything else, or when a byte by byte vote of its bad reads gives back
+	a good checksum.  Bytes the bad reads don't agree on are weak, they go
+	back into the track as bad GCR.
+*/
+/* header and data block of the sector can be found, so they can be replaced */
+static int
+sector_located(sector_index *index, int sector)
+{
+	return ((index->header[sector] != NULL) && (index->data[sector] != NULL) &&
+		(index->data[sector] > index->header[sector]) &&
+		(index->data[sector] - index->header[sector] < DATA_BLOCK_DISTANCE));
+}
+
+static void
+record_sectors(track_read *t, size_t errors)
+{
+	sector_index index;
+	size_t missing;
+	int sector;
+
+	if (t->reads == CONSENSUS_READS)
+		return;
+
+	index_GCR_sectors(t->gcr, t->gcr + t->length, t->halftrack/2, diskid, &index);
+	for (sector = 0, missing = 0; sector < sector_map[t->halftrack/2]; sector++)
+	{
+		t->sector_error[t->reads][sector] = convert_indexed_sector(&index, sector, t->sector_data[t->reads][sector]);
+
+		if (index.header[sector] != NULL)
 		{
-			printf("[Killer Track] ");
-			fprintf(fplog, "[Killer Track] %s (%d)", errorstring, leno);
-			memcpy(buffer, bufo, NIB_TRACK_LENGTH);
-			return (denso);
+			t->header_error[t->reads][sector] = index.header_error[sector];
+			memcpy(t->header_gcr[t->reads][sector], index.header[sector], 10);
 		}
+		else
+			t->header_error[t->reads][sector] = HEADER_NOT_FOUND;
+
+		if (!sector_located(&index, sector))
+			missing++;
+	}
+
+	if ((!t->reads) || (missing < t->base_missing) ||
+		((missing == t->base_missing) && (errors < t->base_errors)))
+	{
+		t->base = t->reads;
+		t->base_errors = errors;
+		t->base_missing = missing;
+		memcpy(t->raw_base, t->raw, NIB_TRACK_LENGTH);
+	}
+	t->reads++;
+}
+
+static int
+vote_sector(track_read *t, int sector, BYTE *block, BYTE *weak)
+{
+	BYTE value, checksum;
+	int read, other, count, most, second, winner, votes, i;
+
+	/* the data most good reads agree on, it has to beat everything else */
+	most = second = 0;
+	winner = -1;
+	for (read = 0; read < t->reads; read++)
+	{
+		if (t->sector_error[read][sector] != SECTOR_OK)
+			continue;
 
-		// Find track cycle and length
-		memset(cbufo, 0, NIB_TRACK_LENGTH);
-		leno = extract_GCR_track(cbufo, bufo, &align, halftrack/2, capacity_min[denso & 3], capacity_max[denso & 3]);
+		for (count = 0, other = 0; other < t->reads; other++)
+			if ((t->sector_error[other][sector] == SECTOR_OK) &&
+				(memcmp(t->sector_data[read][sector], t->sector_data[other][sector], 258) == 0))
+				count++;
 
-		printf("%d ", leno);
-		fprintf(fplog, "%d ", leno);
+		if ((winner >= 0) && (memcmp(t->sector_data[read][sector], t->sector_data[winner][sector], 258) == 0))
+			continue;
 
-		// If we get nothing we are on an empty track (unformatted)
-		if (!leno)
+		if (count > most)
 		{
-			printf("[Unformatted Track] ");
-			fprintf(fplog, "[Unformatted Track] %s (%d)", errorstring, leno);
-			memcpy(buffer, bufo, NIB_TRACK_LENGTH);
-			return (denso);
+			second = most;
+			most = count;
+			winner = read;
 		}
+		else if (count > second)
+			second = count;
+	}
 
-		/* keep best track cycle in case we don't get another good one
-			1) disk is destroyed during reading)
-			2) subsequest reads show no valid cycle
-		*/
-		if(leno < best)
+	if (winner >= 0)
+	{
+		if (most == second)
+			return CONSENSUS_NONE;
+		memcpy(block, t->sector_data[winner][sector], 260);
+		return CONSENSUS_GOOD;
+	}
+
+	/* no good read, vote on the bytes of the bad ones */
+	for (votes = 0, read = 0; read < t->reads; read++)
+		if ((t->sector_error[read][sector] == BAD_DATA_CHECKSUM) || (t->sector_error[read][sector] == BAD_GCR_CODE))
+			votes++;
+
+	if (votes < CONSENSUS_BYTE_VOTES)
+		return CONSENSUS_NONE;
+
+	memset(weak, 0, 260);
+	for (i = 0; i < 260; i++)
+	{
+		most = 0;
+		for (read = 0; read < t->reads; read++)
+		{
+			if ((t->sector_error[read][sector] != BAD_DATA_CHECKSUM) && (t->sector_error[read][sector] != BAD_GCR_CODE))
+				continue;
+
+			value = t->sector_data[read][sector][i];
+			for (count = 0, other = 0; other < t->reads; other++)
+				if (((t->sector_error[other][sector] == BAD_DATA_CHECKSUM) || (t->sector_error[other][sector] == BAD_GCR_CODE)) &&
+					(t->sector_data[other][sector][i] == value))
+					count++;
+
+			if (count > most)
+			{
+				most = count;
+				block[i] = value;
+			}
+		}
+		weak[i] = (most * 2 <= votes);
+	}
+
+	for (checksum = 0, i = 1; i < 257; i++)
+		checksum ^= block[i];
+
+	for (i = 0; i < 258; i++)
+		if (weak[i])
+			return CONSENSUS_WEAK;
+
+	return ((block[0] == 0x07) && (checksum == block[257])) ? CONSENSUS_VOTED : CONSENSUS_WEAK;
+}
+
+/* every sector of the track has been settled by the reads so far */
+static int
+consensus_reached(track_read *t)
+{
+	BYTE block[260], weak[260];
+	int sector, result;
+
+	for (sector = 0; sector < sector_map[t->halftrack/2]; sector++)
+	{
+		result = vote_sector(t, sector, block, weak);
+		if ((result != CONSENSUS_GOOD) && (result != CONSENSUS_VOTED))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+	A read that starts inside a sector holds the data block of the sector
+	before its first header, without a header of its own.  Returns that
+	block and sets the sector it belongs to, NULL if there is none.
+*/
+static BYTE *
+leading_data_block(BYTE *raw, sector_index *index, int sectors, int *sector)
+{
+	BYTE *first = NULL, *pos, *block = NULL;
+	int i;
+
+	for (i = 0; i < sectors; i++)
+	{
+		if ((index->header[i] != NULL) && ((first == NULL) || (index->header[i] < first)))
+		{
+			first = index->header[i];
+			*sector = i;
+		}
+	}
+
+	if (first == NULL)
+		return NULL;
+
+	for (pos = raw; (find_sync(&pos, first)) && (pos + 325 <= first); )
+		block = pos;
+
+	if ((block == NULL) || (first - block >= 325 + DATA_BLOCK_DISTANCE))
+		return NULL;
+
+	*sector = (*sector + sectors - 1) % sectors;
+	return block;
+}
+
+static void
+patch_data_block(BYTE *block, BYTE *end, BYTE *data, BYTE *mask)
+{
+	size_t length, i;
+
+	length = ((size_t)(end - block) < 325) ? (size_t)(end - block) : 325;
+	for (i = 0; i < length; i++)
+		if ((!mask) || (mask[i]))
+			block[i] = data[i];
+}
+
+/*
+	Write a block header and/or data block into every copy of the sector
+	in a raw read.  With a mask only the data bytes it flags are written.
+*/
+static int
+patch_sector(BYTE *raw, int track, int sector, BYTE *header, BYTE *data, BYTE *mask)
+{
+	sector_index index;
+	BYTE *pos, *end, *block;
+	int copies = 0, leading;
+
+	end = raw + NIB_TRACK_LENGTH;
+	if (data)
+	{
+		index_GCR_sectors(raw, end, track, diskid, &index);
+		if (((block = leading_data_block(raw, &index, sector_map[track], &leading)) != NULL) && (leading == sector))
 		{
-			best = leno;
-			memcpy(bbuffer, bufo, NIB_TRACK_LENGTH);
+			patch_data_block(block, end, data, mask);
+			copies++;
 		}
+	}
+
+	for (pos = raw; pos < end - 10; pos = index.header[sector] + 10)
+	{
+		index_GCR_sectors(pos, end, track, diskid, &index);
+		if (index.header[sector] == NULL)
+			break;
 
-		// if we get less than what a track holds,
-		// try again, probably bad read or a bad GCR match
-		if (leno < capacity_min[denso & 3] - CAP_ALLOWANCE)
+		if (!sector_located(&index, sector))
+			continue;
+
+		if (header)
+			memcpy(index.header[sector], header, 10);
+
+		if (data)
+			patch_data_block(index.data[sector], end, data, mask);
+		copies++;
+	}
+	return copies;
+}
+
+/*
+	Rebuild the track from the read with the fewest sectors missing (then
+	errors) and the sectors the reads agree on.  Tracks that read clean,
+	and those without a single good sector (protection), stay as they are.
+*/
+static int
+rebuild_track(track_read *t)
+{
+	BYTE block[260], weak[260], gcr[325], gcr_mask[325];
+	BYTE *header, *data, *mask;
+	int sector, result, rebuilt, read, i, bit;
+	size_t errors;
+
+	if ((!t->reads) || (!t->base_errors) || (t->base_errors >= sector_map[t->halftrack/2]))
+		return 0;
+
+	memcpy(t->raw, t->raw_base, NIB_TRACK_LENGTH);
+
+	rebuilt = 0;
+	for (sector = 0; sector < sector_map[t->halftrack/2]; sector++)
+	{
+		/* a good header from another read for a damaged one */
+		header = NULL;
+		if ((t->header_error[t->base][sector] != SECTOR_OK) && (t->header_error[t->base][sector] != HEADER_NOT_FOUND))
 		{
-			printf("Short Read! ");
-			fprintf(fplog, "[%d<%d!] ", leno, capacity_min[denso & 3] - CAP_ALLOWANCE);
-			//if(l < (error_retries - 3)) l = error_retries - 3;
-			//continue;
+			for (read = 0; read < t->reads; read++)
+			{
+				if (t->header_error[read][sector] == SECTOR_OK)
+				{
+					header = t->header_gcr[read][sector];
+					break;
+				}
+			}
 		}
 
-		// if we get more than capacity
-		// try again to make sure it's intentional
-		if (leno > capacity_max[denso & 3] + CAP_ALLOWANCE)
+		data = mask = NULL;
+		result = vote_sector(t, sector, block, weak);
+		if (result == CONSENSUS_WEAK)
+		{
+			/*
+				The rest of the block stays as the base read has it, bad GCR
+				there may be part of the protection.  Ten GCR bits per byte,
+				the GCR bytes holding weak ones go bad.
+			*/
+			memset(gcr, 0x00, sizeof(gcr));
+			memset(gcr_mask, 0, sizeof(gcr_mask));
+			for (i = 0; i < 260; i++)
+			{
+				bit = ((i / 4) * 40) + ((i % 4) * 10);
+				if (weak[i])
+				{
+					memset(gcr_mask + (bit / 8), 1, ((bit + 9) / 8) - (bit / 8) + 1);
+					data = gcr;
+				}
+			}
+			mask = gcr_mask;
+		}
+		else if ((result != CONSENSUS_NONE) &&
+			/* nothing to do if the base read already has it */
+			!((t->sector_error[t->base][sector] == SECTOR_OK) &&
+			  (memcmp(t->sector_data[t->base][sector], block, 258) == 0)))
 		{
-			printf("Long Read! ");
-			fprintf(fplog, "[%d>%d!] ", leno, capacity_max[denso & 3] + CAP_ALLOWANCE);
-			//if(l < (error_retries - 3)) l = error_retries - 3;
-			//continue;
+			convert_block_to_GCR(block, gcr, 65);
+			data = gcr;
 		}
 
-		// check for CBM DOS errors
-		errors = check_errors(cbufo, leno, halftrack, diskid, errorstring);
-		fprintf(fplog, "%s", errorstring);
+		if (((header) || (data)) && (patch_sector(t->raw, t->halftrack/2, sector, header, data, mask)))
+			rebuilt++;
+	}
 
-		// If there are a lot of errors, the track probably doesn't contain
-		// any CBM sectors (protection)
-		if(!errors)
-			printf("[CBM OK]");
-		else if ((errors == sector_map[halftrack/2]) || (halftrack > 70))
-			printf("[NDOS] ");
-		else
-			printf("%s", errorstring);
+	/* the result is the base read now, look at it again */
+	memset(t->gcr, 0, NIB_TRACK_LENGTH);
+	t->length = extract_GCR_track_r(track_read_context(t), t->gcr, t->raw, &t->align,
+		t->halftrack/2, capacity_min[t->density & 3], capacity_max[t->density & 3]);
+	errors = t->errors = check_errors(t->gcr, t->length, t->halftrack, diskid, t->errorstring);
 
-		// if we got all good sectors we dont retry
-		if (errors == 0) break;
+	if ((rebuilt) || (t->base != t->reads - 1))
+	{
+		align_printf(&t->out.screen, " (consensus:%d/%d, %d errors) ", rebuilt, t->reads, (int) errors);
+		align_printf(&t->out.log, " (consensus:%d/%d, %d errors) ", rebuilt, t->reads, (int) errors);
+	}
+	return 1;
+}
 
-		// all bad sectors (protection) and we have a valid cycle
-		if ((errors == sector_map[halftrack/2]) &&
-			(leno < NIB_TRACK_LENGTH) && (l > 0) )
-			break;
+/* sectors the reads agree on that the rebuilt track doesn't give back */
+static int
+settled_errors(track_read *t)
+{
+	sector_index index;
+	BYTE block[260], weak[260], sector_data[260];
+	int sector, result, errors = 0;
+
+	index_GCR_sectors(t->gcr, t->gcr + t->length, t->halftrack/2, diskid, &index);
+	for (sector = 0; sector < sector_map[t->halftrack/2]; sector++)
+	{
+		result = vote_sector(t, sector, block, weak);
+		if ((result != CONSENSUS_GOOD) && (result != CONSENSUS_VOTED))
+			continue;
+
+		if ((convert_indexed_sector(&index, sector, sector_data) != SECTOR_OK) ||
+			(memcmp(sector_data, block, 258) != 0))
+			errors++;
+	}
+	return errors;
+}
+
+static int
+finish_track_read(track_read *t)
+{
+	align_printf(&t->out.log, "%s (%d)", t->errorstring, (int) t->length);
+	return 0;
+}
 
-		// all bad sectors (protection) and no cycle, we limit retries
-		if ((errors == sector_map[halftrack/2]) && (leno == NIB_TRACK_LENGTH))
+/* first pass is over, start verifying the track against it */
+static int
+end_first_pass(track_read *t)
+{
+	size_t badgcr;
+
+	/* rebuild from the sector consensus, or keep best cycle if ended with none */
+	if (rebuild_track(t))
+	{
+		/* a settled sector didn't make it into the track, keep reading */
+		if ((t->errors) && (t->pass < error_retries) && (settled_errors(t)))
 		{
-			if(l < (error_retries - 1))	l = error_retries - 1;
+			align_printf(&t->out.screen, " (retrying) ");
+			align_printf(&t->out.log, " (retrying) ");
+			t->pass++;
+			return 1;
 		}
 	}
+	else if ((t->length == NIB_TRACK_LENGTH) && (t->best < t->length))
+	{
+		align_printf(&t->out.screen, " (reverted) ");
+		memcpy(t->raw, t->raw_best, NIB_TRACK_LENGTH);
+	}
 
-	/* keep best cycle if ended with none */
-	if((leno == NIB_TRACK_LENGTH) && (best < leno))
+	// Fix bad GCR in track for compare
+	if ((badgcr = check_bad_gcr_r(track_read_context(t), t->gcr, t->length)) != 0)
 	{
-		printf(" (reverted) ");
-		memcpy(bufo, bbuffer, NIB_TRACK_LENGTH);
+		align_printf(&t->out.screen, " (weakgcr:%d) ", (int) badgcr);
+		align_printf(&t->out.log, " (weakgcr:%d) ", (int) badgcr);
 	}
 
+	// Try to verify our read
+	// Don't bother to compare unformatted or bad data
+	if ((track_match) && (t->length != NIB_TRACK_LENGTH))
+	{
+		t->verifying = 1;
+		return 1;
+	}
+	return finish_track_read(t);
+}
+
+static int
+check_verify_read(track_read *t, BYTE density)
+{
+	size_t gcr_diff;
+
+	t->density_verify = density;
+
+	memset(t->gcr_verify, 0, NIB_TRACK_LENGTH);
+	t->length_verify = extract_GCR_track_r(track_read_context(t), t->gcr_verify, t->raw_verify, &t->align,
+		t->halftrack/2, capacity_min[density & 3], capacity_max[density & 3]);
+
+	align_printf(&t->out.screen, "%d ", (int) t->length_verify);
+	align_printf(&t->out.log, "%d ", (int) t->length_verify);
+
 	// Fix bad GCR in track for compare
-	if ((badgcr = check_bad_gcr(cbufo, leno)) != 0)
+	check_bad_gcr_r(track_read_context(t), t->gcr_verify, t->length_verify);
+
+	// compare raw gcr data
+	gcr_diff = compare_tracks(t->gcr, t->gcr_verify, t->length, t->length_verify, 1, t->errorstring);
+	if(verbose) align_printf(&t->out.screen, "VERIFY: diff:%.4d ", (int)gcr_diff);
+	align_printf(&t->out.log, "VERIFY: diff:%.4d ", (int)gcr_diff);
+	if(gcr_diff <= 10)
+	{
+		if(verbose) align_printf(&t->out.screen, "OK ");
+		return finish_track_read(t);
+	}
+
+	// compare sector data
+	if (compare_sectors(t->gcr, t->gcr_verify, t->length, t->length_verify, diskid, diskid, t->halftrack, t->errorstring) == sector_map[t->halftrack/2])
+	{
+		if(verbose) align_printf(&t->out.screen, " - sector match ");
+		align_printf(&t->out.log, " - sector match ");
+		return finish_track_read(t);
+	}
+	else
+	{
+		if(verbose) align_printf(&t->out.screen, " - NO sector match ");
+		align_printf(&t->out.log, " - NO sector match ");
+		align_printf(&t->out.log, "%s", t->errorstring);
+		if(verbose) align_printf(&t->out.screen, "%s", t->errorstring);
+	}
+
+	if (++t->verify_pass < TRACK_MATCH_READS)
+		return 1;
+	return finish_track_read(t);
+}
+
+/*
+	Look at a read of the track and decide if it has to be read again.
+	The read went to the buffer track_read_buffer() returned.
+*/
+static int
+check_track_read(track_read *t, BYTE density)
+{
+	size_t errors;
+
+	if (t->verifying)
+		return check_verify_read(t, density);
+
+	t->density = density;
+
+	// if we have a killer track, exit processing
+	if(density & BM_FF_TRACK)
+	{
+		align_printf(&t->out.screen, "[Killer Track] ");
+		align_printf(&t->out.log, "[Killer Track] %s (%d)", t->errorstring, (int) t->length);
+		return 0;
+	}
+
+	// Find track cycle and length
+	memset(t->gcr, 0, NIB_TRACK_LENGTH);
+	t->length = extract_GCR_track_r(track_read_context(t), t->gcr, t->raw, &t->align,
+		t->halftrack/2, capacity_min[density & 3], capacity_max[density & 3]);
+
+	align_printf(&t->out.screen, "%d ", (int) t->length);
+	align_printf(&t->out.log, "%d ", (int) t->length);
+
+	// If we get nothing we are on an empty track (unformatted)
+	if (!t->length)
+	{
+		align_printf(&t->out.screen, "[Unformatted Track] ");
+		align_printf(&t->out.log, "[Unformatted Track] %s (%d)", t->errorstring, (int) t->length);
+		return 0;
+	}
+
+	/* keep best track cycle in case we don't get another good one
+		1) disk is destroyed during reading)
+		2) subsequest reads show no valid cycle
+	*/
+	if(t->length < t->best)
+	{
+		t->best = t->length;
+		memcpy(t->raw_best, t->raw, NIB_TRACK_LENGTH);
+	}
+
+	// if we get less than what a track holds,
+	// try again, probably bad read or a bad GCR match
+	if (t->length < capacity_min[density & 3] - CAP_ALLOWANCE)
+	{
+		align_printf(&t->out.screen, "Short Read! ");
+		align_printf(&t->out.log, "[%d<%d!] ", (int) t->length, (int) (capacity_min[density & 3] - CAP_ALLOWANCE));
+	}
+
+	// if we get more than capacity
+	// try again to make sure it's intentional
+	if (t->length > capacity_max[density & 3] + CAP_ALLOWANCE)
+	{
+		align_printf(&t->out.screen, "Long Read! ");
+		align_printf(&t->out.log, "[%d>%d!] ", (int) t->length, (int) (capacity_max[density & 3] + CAP_ALLOWANCE));
+	}
+
+	// check for CBM DOS errors
+	errors = t->errors = check_errors(t->gcr, t->length, t->halftrack, diskid, t->errorstring);
+	align_printf(&t->out.log, "%s", t->errorstring);
+
+	// If there are a lot of errors, the track probably doesn't contain
+	// any CBM sectors (protection)
+	if(!errors)
+		align_printf(&t->out.screen, "[CBM OK]");
+	else if ((errors == sector_map[t->halftrack/2]) || (t->halftrack > 70))
+		align_printf(&t->out.screen, "[NDOS] ");
+	else
+		align_printf(&t->out.screen, "%s", t->errorstring);
+
+	record_sectors(t, errors);
+
+	// if we got all good sectors we dont retry
+	if (errors == 0)
+		return end_first_pass(t);
+
+	// the reads so far agree on every sector
+	if ((errors < sector_map[t->halftrack/2]) && (consensus_reached(t)))
+	{
+		align_printf(&t->out.screen, "[consensus]");
+		align_printf(&t->out.log, "[consensus]");
+		return end_first_pass(t);
+	}
+
+	// all bad sectors (protection) and we have a valid cycle
+	if ((errors == sector_map[t->halftrack/2]) &&
+		(t->length < NIB_TRACK_LENGTH) && (t->pass > 0) )
+		return end_first_pass(t);
+
+	// all bad sectors (protection) and no cycle, we limit retries
+	if ((errors == sector_map[t->halftrack/2]) && (t->length == NIB_TRACK_LENGTH))
+	{
+		if(t->pass < (error_retries - 1)) t->pass = error_retries - 1;
+	}
+
+	if (++t->pass <= error_retries)
+		return 1;
+	return end_first_pass(t);
+}
+
+BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
+{
+	track_read *t;
+	BYTE density;
+
+	if (!(t = malloc(sizeof(track_read))))
 	{
-		printf(" (weakgcr:%d) ", badgcr);
-		fprintf(fplog, " (weakgcr:%d) ", badgcr);
+		printf("Could not allocate track read buffers\n");
+		exit(1);
 	}
 
-	if(track_match)
+	start_track_read(t, halftrack, 0);
+	do
+		density = read_track_pass(fd, t);
+	while (check_track_read(t, density));
+
+	memcpy(buffer, t->raw, NIB_TRACK_LENGTH);
+	density = t->density;
+	free(t);
+	return density;
+}
+
+#ifdef ARCH_LOCKS
+/*
+	Pipelined reading (-O).  The calling thread owns the drive and keeps
+	reading halftracks into a ring of slots, the analysis threads run the
+	paranoia_read_halftrack() checks on them.  A track that wants another
+	read goes back to the drive, which takes it before the next new track.
+	Once a track has asked for that the drive stays with it until it is
+	done, so a bad track does not step the head back and forth.  Slots are
+	given back in track order once their output is printed.
+*/
+#define SLOT_READING	0
+#define SLOT_READ		1	/* waiting for analysis */
+#define SLOT_ANALYZING	2
+#define SLOT_WANTED		3	/* analysis wants another read */
+#define SLOT_DONE		4
+
+typedef struct
+{
+	arch_mutex lock;
+	arch_cond changed;
+	track_read *slot[READ_PIPELINE_SLOTS];
+	int state[READ_PIPELINE_SLOTS];
+	BYTE density[READ_PIPELINE_SLOTS];	/* of the last read */
+	int retried[READ_PIPELINE_SLOTS];	/* track asked for another read */
+	int head, used;						/* oldest slot, slots in flight */
+	int finished;						/* no more reads coming */
+} track_pipeline;
+
+static ARCH_THREADFUNC
+analysis_thread(void *arg)
+{
+	track_pipeline *pipeline = (track_pipeline *) arg;
+	int i, s = 0, more;
+
+	arch_lock(&pipeline->lock);
+	for (;;)
 	{
-		// Try to verify our read
+		for (i = 0; i < pipeline->used; i++)
+		{
+			s = (pipeline->head + i) % READ_PIPELINE_SLOTS;
+			if (pipeline->state[s] == SLOT_READ)
+				break;
+		}
+
+		if (i == pipeline->used)
+		{
+			if (pipeline->finished)
+				break;
+			arch_cond_wait(&pipeline->changed, &pipeline->lock);
+			continue;
+		}
+
+		pipeline->state[s] = SLOT_ANALYZING;
+		arch_unlock(&pipeline->lock);
+
+		more = check_track_read(pipeline->slot[s], pipeline->density[s]);
+
+		arch_lock(&pipeline->lock);
+		pipeline->state[s] = (more) ? SLOT_WANTED : SLOT_DONE;
+		if (more) pipeline->retried[s] = 1;
+		arch_cond_broadcast(&pipeline->changed);
+	}
+	arch_unlock(&pipeline->lock);
+	return 0;
+}
 
-		// Don't bother to compare unformatted or bad data
-		if (leno == NIB_TRACK_LENGTH) retries = 0;
+static void
+read_floppy_pipelined(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density)
+{
+	track_pipeline pipeline;
+	arch_thread thread[MAX_ALIGN_JOBS];
+	track_read *t;
+	BYTE density;
+	int jobs, started, track, i, s = 0;
 
-		// normal data, verify
-		for (i = 0; i < retries; i++)
+	memset(&pipeline, 0, sizeof(pipeline));
+	for (i = 0; i < READ_PIPELINE_SLOTS; i++)
+	{
+		if (!(pipeline.slot[i] = malloc(sizeof(track_read))))
 		{
-			memset(bufn, 0, NIB_TRACK_LENGTH);
-			densn = read_halftrack(fd, halftrack, bufn);
+			printf("Could not allocate track read buffers\n");
+			exit(1);
+		}
+	}
+	arch_mutex_init(&pipeline.lock);
+	arch_cond_init(&pipeline.changed);
 
-			memset(cbufn, 0, NIB_TRACK_LENGTH);
-			lenn = extract_GCR_track(cbufn, bufn, &align, halftrack/2, capacity_min[densn & 3], capacity_max[densn & 3]);
+	/* the CRC table is built on first use, do it before there are threads */
+	crcInit();
 
-			printf("%d ", lenn);
-			fprintf(fplog, "%d ", lenn);
+	jobs = read_pipeline;
+	if (jobs > MAX_ALIGN_JOBS) jobs = MAX_ALIGN_JOBS;
+	for (started = 0; started < jobs; started++)
+		if (!arch_thread_create(&thread[started], analysis_thread, &pipeline))
+			break;
 
-			// Fix bad GCR in track for compare
-			if ((badgcr = check_bad_gcr(cbufn, lenn)) != 0)
+	track = start_track;
+	if (started)
+	{
+		arch_lock(&pipeline.lock);
+		for (;;)
+		{
+			/* print finished tracks in order */
+			while ((pipeline.used) && (pipeline.state[pipeline.head] == SLOT_DONE))
 			{
-				//printf("(weakgcr:%d)", badgcr);
-				//fprintf(fplog, "(weakgcr:%d) ", badgcr);
+				t = pipeline.slot[pipeline.head];
+				track_density[t->halftrack] = t->density;
+				memcpy(track_buffer + (t->halftrack * NIB_TRACK_LENGTH), t->raw, NIB_TRACK_LENGTH);
+				flush_read_output(&t->out);
+				pipeline.head = (pipeline.head + 1) % READ_PIPELINE_SLOTS;
+				pipeline.used--;
 			}
 
-			// compare raw gcr data
-			gcr_diff = compare_tracks(cbufo, cbufn, leno, lenn, 1, errorstring);
-			if(verbose) printf("VERIFY: diff:%.4d ", (int)gcr_diff);
-			fprintf(fplog, "VERIFY: diff:%.4d ", (int)gcr_diff);
-			if(gcr_diff <= 10)
+			/* tracks that want another read go first, the head is still close */
+			for (i = 0; i < pipeline.used; i++)
 			{
-				if(verbose) printf("OK ");
-				break;
+				s = (pipeline.head + i) % READ_PIPELINE_SLOTS;
+				if (pipeline.state[s] == SLOT_WANTED)
+					break;
 			}
 
-			// compare sector data
-			if (compare_sectors(cbufo, cbufn, leno, lenn, diskid, diskid, halftrack, errorstring) == sector_map[halftrack/2])
+			if (i == pipeline.used)
 			{
-				if(verbose) printf(" - sector match ");
-				fprintf(fplog, " - sector match ");
-				break;
-			}
-			else
-			{
-				if(verbose) printf(" - NO sector match ");
-				fprintf(fplog, " - NO sector match ");
-				fprintf(fplog, "%s", errorstring);
-				if(verbose) printf("%s", errorstring);
+				for (i = 0; i < pipeline.used; i++)
+				{
+					s = (pipeline.head + i) % READ_PIPELINE_SLOTS;
+					if ((pipeline.retried[s]) && (pipeline.state[s] != SLOT_DONE))
+						break;
+				}
+
+				if ((track > end_track) || (pipeline.used == READ_PIPELINE_SLOTS) || (i < pipeline.used))
+				{
+					if (!pipeline.used)
+						break;
+					arch_cond_wait(&pipeline.changed, &pipeline.lock);
+					continue;
+				}
+				s = (pipeline.head + pipeline.used) % READ_PIPELINE_SLOTS;
+				start_track_read(pipeline.slot[s], track, 1);
+				pipeline.retried[s] = 0;
+				pipeline.used++;
+				track += track_inc;
 			}
+
+			pipeline.state[s] = SLOT_READING;
+			t = pipeline.slot[s];
+			arch_unlock(&pipeline.lock);
+
+			density = read_track_pass(fd, t);
+
+			arch_lock(&pipeline.lock);
+			pipeline.density[s] = density;
+			pipeline.state[s] = SLOT_READ;
+			arch_cond_broadcast(&pipeline.changed);
 		}
+		pipeline.finished = 1;
+		arch_cond_broadcast(&pipeline.changed);
+		arch_unlock(&pipeline.lock);
+
+		for (i = 0; i < started; i++)
+			arch_thread_join(thread[i]);
 	}
 
-	//printf("\n");
-	fprintf(fplog, "%s (%d)", errorstring, leno);
-	memcpy(buffer, bufo, NIB_TRACK_LENGTH);
-	return denso;
+	/* no analysis thread, read the rest the usual way */
+	for (; track <= end_track; track += track_inc)
+		track_density[track] = paranoia_read_halftrack(fd, track, track_buffer + (track * NIB_TRACK_LENGTH));
+
+	arch_cond_destroy(&pipeline.changed);
+	arch_mutex_destroy(&pipeline.lock);
+	for (i = 0; i < READ_PIPELINE_SLOTS; i++)
+		free(pipeline.slot[i]);
 }
+#endif
 
 int
 read_floppy(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
@@ -335,6 +1035,20 @@ read_floppy(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 
 	if(!rawmode) get_disk_id(fd);
 
+#ifdef ARCH_LOCKS
+	/* RapidLok alignment carries the TV standard from track to track */
+	for (track = start_track; track <= end_track; track += track_inc)
+		if (align_map[track/2] == ALIGN_RAPIDLOK)
+			break;
+
+	if ((read_pipeline) && (track > end_track))
+	{
+		read_floppy_pipelined(fd, track_buffer, track_density);
+		step_to_halftrack(fd, 18*2);
+		return 1;
+	}
+#endif
+
 	//for (track = end_track; track >= start_track; track -= track_inc)
 	for (track = start_track; track <= end_track; track += track_inc)
 		track_density[track] = paranoia_read_halftrack(fd, track, track_buffer + (track * NIB_TRACK_LENGTH));
@@ -343,14 +1057,31 @@ read_floppy(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 	return 1;
 }
 
+/*
+	A read at a density other than the one the track was written at has
+	no cycle of the length that density holds, or bad GCR all over it.
+*/
+static int
+nb2_cycle_found(size_t length, size_t badgcr, int density)
+{
+	return ((length > 0) && (length < NIB_TRACK_LENGTH) &&
+		(length + CAP_ALLOWANCE >= capacity_min[density]) &&
+		(length <= capacity_max[density] + CAP_ALLOWANCE) &&
+		(badgcr <= length / NB2_BAD_GCR_RATIO));
+}
+
 int write_nb2(CBM_FILE fd, char * filename)
 {
 	BYTE density;
 	FILE * fpout;
-	int track, i, header_entry, pass;
-	BYTE pass_density;
+	int track, i, header_entry, pass, agree, passes;
+	BYTE pass_density, align;
 	BYTE buffer[NIB_TRACK_LENGTH];
+	BYTE gcr[NIB_TRACK_LENGTH], last_gcr[NIB_TRACK_LENGTH];
+	size_t length, last_length, badgcr;
 	char header[0x100];
+	BYTE pass_table[0x100];
+	char errorstring[0x1000];
 
 	printf("\n");
 	fprintf(fplog,"\n");
@@ -364,13 +1095,21 @@ int write_nb2(CBM_FILE fd, char * filename)
 
 	/* write initial NIB-header */
 	memset(header, 0x00, sizeof(header));
-	sprintf(header, "MNIB-1541-RAW%c%c%c", 2, 0, 1);
+	sprintf(header, "MNIB-1541-RAW%c%c%c", 2, (nb2_match) ? NB2_ADAPTIVE : 0, 1);
 
 	if (fwrite(header, sizeof(header), 1, fpout) != 1) {
 		printf("unable to write NB2 header\n");
 		return 0;
 	}
 
+	/* room for the pass table, it is filled in at the end */
+	memset(pass_table, 0x00, sizeof(pass_table));
+	if ((nb2_match) && (fwrite(pass_table, sizeof(pass_table), 1, fpout) != 1))
+	{
+		printf("unable to write NB2 pass table\n");
+		return 0;
+	}
+
 	get_disk_id(fd);
 
 	header_entry = 0;
@@ -384,11 +1123,14 @@ int write_nb2(CBM_FILE fd, char * filename)
 
 		header[0x10 + (header_entry * 2)] = (BYTE) track;
 		header[0x10 + (header_entry * 2) + 1] = density;
-		header_entry++;
 
 		step_to_halftrack(fd, track);
 
-		/* make 16 passes of track, four for each density */
+		/*
+			make 16 passes of track, four for each density.  The adaptive
+			capture stops once nb2_match passes in a row agree, and leaves
+			out other densities that give no track cycle.
+		*/
 		for(pass_density = 0; pass_density < 4; pass_density ++)
 		{
 			printf("%4.1f: (%d) ", (float) track / 2, pass_density);
@@ -396,7 +1138,9 @@ int write_nb2(CBM_FILE fd, char * filename)
 
 			set_density(fd, pass_density);
 
-			for(pass = 0; pass < 4; pass ++)
+			agree = passes = 0;
+			last_length = 0;
+			for(pass = 0; pass < NB2_PASSES; pass ++)
 			{
 				for (i = 0; i < 10; i++)
 				{
@@ -417,6 +1161,32 @@ int write_nb2(CBM_FILE fd, char * filename)
 					}
 				}
 
+				if (nb2_match)
+				{
+					memset(gcr, 0, sizeof(gcr));
+					length = extract_GCR_track(gcr, buffer, &align, track/2,
+						capacity_min[pass_density], capacity_max[pass_density]);
+
+					badgcr = check_bad_gcr(gcr, length);
+					if ((pass == 0) && (pass_density != (density & 3)) && (!nb2_cycle_found(length, badgcr, pass_density)))
+					{
+						printf("- no cycle");
+						fprintf(fplog, "- no cycle");
+						break;
+					}
+
+					/* the same test as the read verification, reads start anywhere on the track */
+					if ((pass) &&
+						((compare_tracks(last_gcr, gcr, last_length, length, 1, errorstring) <= 10) ||
+						 (compare_sectors(last_gcr, gcr, last_length, length, diskid, diskid, track, errorstring) == sector_map[track/2])))
+						agree++;
+					else
+						agree = 1;
+
+					memcpy(last_gcr, gcr, sizeof(gcr));
+					last_length = length;
+				}
+
 				/* save track to disk */
 				if (fwrite(buffer, sizeof(buffer), 1, fpout) != 1)
 				{
@@ -426,11 +1196,21 @@ int write_nb2(CBM_FILE fd, char * filename)
 				}
 				fflush(fpout);
 				printf("%d ", pass+1);
+				passes++;
+
+				if ((nb2_match) && (agree >= nb2_match))
+				{
+					printf("- match");
+					fprintf(fplog, "- match");
+					break;
+				}
 			}
+			pass_table[(header_entry * 2) + (pass_density >> 1)] |= (BYTE)(passes << ((pass_density & 1) * 4));
 
 			printf("\n");
 			fprintf(fplog,"\n");
 		}
+		header_entry++;
 	}
 
 	/* fill NB2-header */
@@ -441,6 +1221,12 @@ int write_nb2(CBM_FILE fd, char * filename)
 		return 0;
 	}
 
+	if ((nb2_match) && (fwrite(pass_table, sizeof(pass_table), 1, fpout) != 1))
+	{
+		printf("unable to rewrite NB2 pass table\n");
+		return 0;
+	}
+
 	fclose(fpout);
 	step_to_halftrack(fd, 18 * 2);
 	return 1;
@@ -482,8 +1268,8 @@ void get_disk_id(CBM_FILE fd)
 }
 
 /* $152b Density Scan */
-BYTE
-scan_track(CBM_FILE fd, int track)
+static BYTE
+scan_track_r(read_output *out, CBM_FILE fd, int track)
 {
 	BYTE density, killer_info;
 	BYTE scanned_density = 0xff;
@@ -548,7 +1334,7 @@ scan_track(CBM_FILE fd, int track)
 	if(scanned_density == 0xff)
 	{
 		density = speed_map[track/2];
-		printf("{NONGCR:%d}",density);
+		align_printf(&out->screen, "{NONGCR:%d}",density);
 	}
 	else
 		density = scanned_density;
@@ -556,6 +1342,15 @@ scan_track(CBM_FILE fd, int track)
 	return (density | killer_info);
 }
 
+BYTE
+scan_track(CBM_FILE fd, int track)
+{
+	read_output out;
+
+	init_read_output(&out, 0);
+	return scan_track_r(&out, fd, track);
+}
+
 // Track Alignment Report, by Arnd
 int TrackAlignmentReport(CBM_FILE fd)
 {
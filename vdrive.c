@@ -0,0 +1,983 @@
+/*
+	vdrive.c - virtual 1541/1571 drive for running nibread and nibwrite
+	without hardware.
+
+	This stands in for the OpenCBM library the way cbm.c and kernel.c do
+	under DOS.  The drive side of the burst protocol is simulated on top
+	of a disk image, so drive.c, read.c, write.c and ihs.c run unchanged.
+	The adapter name given with -@ sets up the drive:
+
+		-@<image>[,option...]
+
+	<image> is a NIB, NBZ, NB2, G64 or D64 file that is in the drive.
+	Leave it out to start with a blank disk.  The options are:
+
+		rpm=n		motor speed (300)
+		jitter=n	largest speed change between revolutions, in rpm (0)
+		noise=n		weak bits flipped in each track read (0)
+		timeout=n	percentage of track transfers that time out (0)
+		latency=n	milliseconds taken by each drive command (0)
+		seed=n		start of the random sequence (1)
+		drive=1571	identify as a 1571
+		ihs		drive has a working index hole sensor
+		spin		wait for the drive in real time
+		save=<file>	write the disk surface to a G64 file when done
+
+	Without spin every wait goes on a virtual clock instead, so a run
+	gives the same results and the same drive time each time.
+*/
+
+#define _DEFAULT_SOURCE		/* usleep() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mnibarch.h"
+#include "gcr.h"
+#include "nibtools.h"
+#include "ihs.h"
+
+#define VD_TRACKS (MAX_HALFTRACKS_1541 + 2)
+#define VD_QUEUE_LENGTH 0x800
+#define VD_STEP_TIME 6	/* ms per halftrack */
+
+/* disk surface, one track cycle of vd_length bytes per halftrack */
+static BYTE *vd_track;
+static BYTE vd_density[VD_TRACKS];
+static size_t vd_length[VD_TRACKS];
+
+/* settings */
+static double vd_rpm = 300;
+static double vd_jitter, vd_latency;
+static int vd_noise, vd_timeout, vd_1571, vd_ihs, vd_spin;
+static char vd_save[256];
+static unsigned long vd_seed = 1;
+
+/* drive state */
+static int vd_halftrack = 18 * 2;
+static BYTE vd_via;		/* $1c00 */
+static int vd_running, vd_ihs_on, vd_secadr;
+static BYTE vd_code[0x800 - 0x300];
+static size_t vd_code_size;
+
+/* command packets, 00 55 aa ff cmd args... */
+static BYTE vd_packet[32];
+static int vd_packet_length, vd_packet_need;
+
+/* answers waiting for the host */
+static BYTE vd_queue[VD_QUEUE_LENGTH];
+static int vd_queue_head, vd_queue_tail;
+static BYTE vd_transfer[NIB_TRACK_LENGTH];
+static int vd_transfer_pending, vd_transfer_timeout, vd_write_pending;
+
+/* virtual clock in ms, and statistics */
+static double vd_clock;
+static long vd_commands, vd_reads, vd_writes, vd_timeouts;
+
+/* bytes per minute at each density */
+static const double vd_bitrate[4] = { DENSITY0, DENSITY1, DENSITY2, DENSITY3 };
+
+static unsigned int
+vd_random(void)
+{
+	vd_seed = (vd_seed * 1103515245 + 12345) & 0xffffffffUL;
+	return (unsigned int) (vd_seed >> 16) & 0x7fff;
+}
+
+static void
+vd_wait(double ms)
+{
+	vd_clock += ms;
+	if ((vd_spin) && (ms > 0))
+		usleep((unsigned long) (ms * 1000));
+}
+
+/* the host's delays count on the drive clock */
+void
+vdrive_delay(int ms)
+{
+	vd_wait(ms);
+}
+
+/* motor speed for the next revolution */
+static double
+vd_speed(void)
+{
+	return vd_rpm + vd_jitter * ((vd_random() / 16383.5) - 1);
+}
+
+static BYTE
+vd_bitrate_setting(void)
+{
+	return (vd_via >> 5) & 3;
+}
+
+static void
+vd_wait_bytes(size_t length, int density)
+{
+	vd_wait(length * 60000.0 / vd_bitrate[density]);
+}
+
+static void
+vd_wait_revolution(void)
+{
+	vd_wait(60000 / vd_speed());
+}
+
+/* byte of the track cycle under the head right now */
+static size_t
+vd_position(int track)
+{
+	double turns = vd_clock * vd_rpm / 60000;
+
+	turns -= (long) turns;
+	return (size_t) (turns * vd_length[track]) % vd_length[track];
+}
+
+/*
+	Track the head reads from, or -1 for an empty surface.  Between two
+	tracks it picks up the one below.
+*/
+static int
+vd_source(int halftrack)
+{
+	if ((halftrack < 1) || (halftrack >= VD_TRACKS))
+		return -1;
+	if (vd_length[halftrack])
+		return halftrack;
+	if ((halftrack & 1) && (vd_length[halftrack - 1]))
+		return halftrack - 1;
+	return -1;
+}
+
+static void
+vd_answer(BYTE c)
+{
+	if (vd_queue_tail < VD_QUEUE_LENGTH)
+		vd_queue[vd_queue_tail++] = c;
+}
+
+/*
+	Read length bytes of a track from start on, at the bitrate the drive
+	is set to.  A track written at another density is read bit by bit with
+	the wrong clock.  Zero bytes have no flux transitions and read back
+	as noise.
+*/
+static void
+vd_read_bytes(int track, size_t start, BYTE *buffer, size_t length)
+{
+	BYTE *data = vd_track + (track * NIB_TRACK_LENGTH);
+	size_t i, bit, bits = vd_length[track] * 8;
+	double pos, step;
+	int b, n;
+
+	step = vd_bitrate[vd_density[track]] / vd_bitrate[vd_bitrate_setting()];
+
+	if (step == 1)
+	{
+		for (i = 0; i < length; i++)
+		{
+			buffer[i] = data[(start + i) % vd_length[track]];
+			if (!buffer[i])
+				buffer[i] = (BYTE) vd_random();
+		}
+	}
+	else
+	{
+		pos = start * 8.0;
+		for (i = 0; i < length; i++)
+		{
+			buffer[i] = 0;
+			for (b = 0; b < 8; b++)
+			{
+				bit = (size_t) pos % bits;
+				buffer[i] <<= 1;
+				if (data[bit >> 3])
+					buffer[i] |= (data[bit >> 3] >> (7 - (bit & 7))) & 1;
+				else
+					buffer[i] |= vd_random() & 1;
+				pos += step;
+			}
+		}
+	}
+
+	for (n = 0; n < vd_noise; n++)
+		buffer[vd_random() % length] ^= (BYTE) (1 << (vd_random() & 7));
+}
+
+/* start of the first sync mark at or after start, or -1 */
+static long
+vd_find_sync(int track, size_t start)
+{
+	BYTE *data = vd_track + (track * NIB_TRACK_LENGTH);
+	size_t i, pos, length = vd_length[track];
+
+	for (i = 0; i < length; i++)
+	{
+		pos = (start + i) % length;
+		if ((data[pos] == 0xff) && (data[(pos + length - 1) % length] != 0xff))
+			return (long) pos;
+	}
+	return -1;
+}
+
+/*
+	Set up a track transfer.  index starts it at the index hole, else at
+	the next sync mark, or anywhere with nosync set.
+*/
+static void
+vd_start_transfer(int index, int nosync)
+{
+	int track = vd_source(vd_halftrack);
+	long start = 0;
+	size_t i;
+
+	vd_reads++;
+	vd_transfer_pending = 1;
+	vd_transfer_timeout = ((int) (vd_random() % 100) < vd_timeout);
+
+	if (track < 0)
+	{
+		/* empty surface, nothing to sync on */
+		vd_transfer_timeout |= !nosync;
+		for (i = 0; i < NIB_TRACK_LENGTH; i++)
+			vd_transfer[i] = (BYTE) vd_random();
+	}
+	else
+	{
+		if (!index)
+		{
+			start = (long) vd_position(track);
+			if (!nosync)
+			{
+				/* a track without syncs hangs the drive code */
+				start = vd_find_sync(track, start);
+				if (start < 0)
+				{
+					vd_transfer_timeout = 1;
+					start = 0;
+				}
+			}
+		}
+		vd_read_bytes(track, start, vd_transfer, NIB_TRACK_LENGTH);
+	}
+	vd_wait_bytes(NIB_TRACK_LENGTH, vd_bitrate_setting());
+}
+
+/*
+	Deep bitrate analysis of one revolution from the index hole: a bit cell
+	class (0-5) for each byte, $ff for each sync mark and $55 at the end.
+	The surface has one density per track, so each byte gets the class of
+	the density it was written with.
+*/
+static void
+vd_start_analysis(void)
+{
+	int track = vd_source(vd_halftrack);
+	BYTE *data;
+	size_t i, count = 0;
+
+	memset(vd_transfer, 0, NIB_TRACK_LENGTH);
+	vd_transfer_pending = 1;
+	vd_transfer_timeout = ((int) (vd_random() % 100) < vd_timeout) || (!(vd_ihs && vd_ihs_on));
+
+	if (track >= 0)
+	{
+		data = vd_track + (track * NIB_TRACK_LENGTH);
+		for (i = 0; (i < vd_length[track]) && (count < NIB_TRACK_LENGTH - 7); i++)
+		{
+			if (data[i] != 0xff)
+				vd_transfer[count++] = vd_density[track];
+			else if ((!i) || (data[i - 1] != 0xff))
+				vd_transfer[count++] = 0xff;
+		}
+	}
+	vd_transfer[count] = 0x55;
+	vd_wait_revolution();
+}
+
+/*
+	Write length bytes at the current bitrate, starting at the index.
+	What doesn't fit in a revolution wraps over the start, and a short
+	write leaves the end of the old track in place.
+*/
+static void
+vd_write_bytes(int halftrack, BYTE *data, size_t length)
+{
+	BYTE old[NIB_TRACK_LENGTH];
+	BYTE *track = vd_track + (halftrack * NIB_TRACK_LENGTH);
+	size_t i, old_length, cap;
+
+	if ((halftrack < 1) || (halftrack >= VD_TRACKS))
+		return;
+
+	cap = (size_t) (vd_bitrate[vd_bitrate_setting()] / vd_speed());
+	if (cap > NIB_TRACK_LENGTH)
+		cap = NIB_TRACK_LENGTH;
+
+	old_length = vd_length[halftrack];
+	memcpy(old, track, NIB_TRACK_LENGTH);
+
+	for (i = 0; i < cap; i++)
+		track[i] = (old_length) ? old[i % old_length] : 0;
+	for (i = 0; i < length; i++)
+		track[i % cap] = data[i];
+	for (i = cap; i < NIB_TRACK_LENGTH; i++)
+		track[i] = 0;
+
+	vd_length[halftrack] = cap;
+	vd_density[halftrack] = vd_bitrate_setting();
+	vd_writes++;
+	vd_wait_bytes(length, vd_bitrate_setting());
+}
+
+static void
+vd_fill_track(int halftrack, BYTE fill)
+{
+	BYTE buffer[NIB_TRACK_LENGTH];
+
+	memset(buffer, fill, sizeof(buffer));
+	vd_write_bytes(halftrack, buffer, sizeof(buffer));
+}
+
+/* argument bytes that follow each command */
+static int
+vd_arguments(BYTE cmd)
+{
+	switch (cmd)
+	{
+		case FL_STEPTO:
+		case FL_FILLTRACK:
+		case FL_ALIGNDISK:
+			return 1;
+
+		case FL_MOTOR:
+		case FL_WRITE:
+		case FL_READ_MEM:
+			return 2;
+
+		case FL_DENSITY:
+			return 3;
+
+		default:
+			return 0;
+	}
+}
+
+static void
+vd_command(BYTE cmd, BYTE *args)
+{
+	int track, bin, i;
+	BYTE flags, status;
+	unsigned int cap;
+
+	vd_commands++;
+	vd_wait(vd_latency);
+
+	/* anything the host didn't pick up is gone */
+	vd_queue_head = vd_queue_tail = 0;
+	vd_transfer_pending = vd_write_pending = 0;
+
+	track = vd_source(vd_halftrack);
+
+	switch (cmd)
+	{
+		case FL_STEPTO:
+			vd_wait(abs(args[0] - vd_halftrack) * VD_STEP_TIME);
+			vd_halftrack = args[0];
+			vd_answer(0);
+			break;
+
+		case FL_MOTOR:
+			vd_via = (vd_via & args[0]) | args[1];
+			vd_answer(0);
+			break;
+
+		case FL_DENSITY:
+			vd_via = (vd_via & args[1]) | args[2];
+			vd_answer(0);
+			break;
+
+		case FL_RESET:
+			vd_running = 0;
+			break;
+
+		case FL_READNORMAL:
+			vd_answer(0);
+			vd_start_transfer(0, 0);
+			break;
+
+		case FL_READWOSYNC:
+			vd_answer(0);
+			vd_start_transfer(0, 1);
+			break;
+
+		case FL_READIHS:
+			vd_answer(0);
+			vd_start_transfer(1, 1);
+			vd_transfer_timeout |= !vd_ihs;
+			break;
+
+		case FL_IHS_READ_SCP:
+			vd_answer(0);
+			vd_start_transfer(1, 1);
+			vd_transfer_timeout |= !(vd_ihs && vd_ihs_on);
+			break;
+
+		case FL_SCANKILLER:
+			vd_wait_revolution();
+			if (track < 0)
+				vd_answer(BM_NO_SYNC);
+			else
+				vd_answer(check_sync_flags(vd_track + (track * NIB_TRACK_LENGTH), 0,
+					vd_length[track]) & (BM_FF_TRACK | BM_NO_SYNC));
+			break;
+
+		case FL_SCANDENSITY:
+			/* bit cell statistics, highest density first */
+			vd_wait_revolution();
+			flags = (track < 0) ? BM_NO_SYNC :
+				check_sync_flags(vd_track + (track * NIB_TRACK_LENGTH), 0, vd_length[track]);
+			for (bin = 3; bin >= 0; bin--)
+			{
+				if (flags & (BM_NO_SYNC | BM_FF_TRACK))
+					vd_answer(0);
+				else if (bin == vd_density[track])
+					vd_answer((BYTE) (0x48 + (vd_random() & 7)));
+				else
+					vd_answer((BYTE) (vd_random() & 0x0f));
+			}
+			vd_answer(0);
+			break;
+
+		case FL_CAPACITY:
+			vd_wait_revolution();
+			cap = (unsigned int) (vd_bitrate[vd_bitrate_setting()] / vd_speed());
+			vd_answer((BYTE) (cap & 0xff));
+			vd_answer((BYTE) (cap >> 8));
+			break;
+
+		case FL_WRITE:
+			vd_write_pending = 1;
+			break;
+
+		case FL_FILLTRACK:
+			vd_fill_track(vd_halftrack, args[0]);
+			vd_answer(0);
+			break;
+
+		case FL_TEST:
+			for (i = 0; i < 0x100; i++)
+				vd_answer((BYTE) i);
+			vd_answer(0);
+			break;
+
+		case FL_VERIFY_CODE:
+			for (i = 0; i < (int) sizeof(vd_code); i++)
+				vd_answer(vd_code[i]);
+			vd_answer(0);
+			break;
+
+		case FL_IHS_ON:
+			vd_ihs_on = 1;
+			vd_answer(0);
+			break;
+
+		case FL_IHS_OFF:
+			vd_ihs_on = 0;
+			vd_answer(0);
+			break;
+
+		case FL_IHS_PRESENT:
+		case FL_IHS_PRESENT2:
+			/* 0 found, 8 no index hole seen, 16 sensor disabled */
+			status = (!vd_ihs_on) ? 16 : ((vd_ihs) ? 0 : 8);
+			vd_wait_revolution();
+			if (cmd == FL_IHS_PRESENT2)
+			{
+				vd_answer(status);
+				break;
+			}
+			vd_answer(0);
+			memset(vd_transfer, status, NIB_TRACK_LENGTH);
+			vd_transfer_pending = 1;
+			vd_transfer_timeout = 0;
+			break;
+
+		case FL_DBR_ANALYSIS:
+			vd_answer(0);
+			vd_start_analysis();
+			break;
+
+		case FL_READ_MEM:
+			vd_answer(0);
+			break;
+
+		default:
+			vd_answer(0);
+			break;
+	}
+}
+
+/* feed bytes sent by the host to the drive code */
+static void
+vd_receive(BYTE c)
+{
+	static const BYTE header[4] = { 0x00, 0x55, 0xaa, 0xff };
+
+	if (!vd_running)
+		return;
+
+	if (vd_packet_length < 4)
+	{
+		if (c == header[vd_packet_length])
+			vd_packet[vd_packet_length++] = c;
+		else
+			vd_packet_length = (c == header[0]);
+		return;
+	}
+
+	vd_packet[vd_packet_length++] = c;
+	if (vd_packet_length == 5)
+		vd_packet_need = 5 + vd_arguments(c);
+
+	if (vd_packet_length == vd_packet_need)
+	{
+		vd_packet_length = 0;
+		vd_command(vd_packet[4], vd_packet + 5);
+	}
+}
+
+static BYTE
+vd_send(void)
+{
+	if (vd_queue_head < vd_queue_tail)
+		return vd_queue[vd_queue_head++];
+	return 0;
+}
+
+static int
+vd_send_n(unsigned char *buffer, unsigned int length)
+{
+	unsigned int i, count;
+
+	for (i = 0; (i < length) && (vd_queue_head < vd_queue_tail); i++)
+		buffer[i] = vd_queue[vd_queue_head++];
+
+	if (i == length)
+		return 1;
+
+	/* the rest comes from a track transfer */
+	if ((!vd_transfer_pending) || (vd_transfer_timeout))
+	{
+		if (vd_transfer_pending)
+			vd_timeouts++;
+		vd_transfer_pending = 0;
+		return 0;
+	}
+	vd_transfer_pending = 0;
+
+	count = length - i;
+	if (count > NIB_TRACK_LENGTH)
+		count = NIB_TRACK_LENGTH;
+	memcpy(buffer + i, vd_transfer, count);
+	return 1;
+}
+
+static int
+vd_send_track(unsigned char *buffer, unsigned int length)
+{
+	vd_queue_head = vd_queue_tail;
+	return vd_send_n(buffer, length);
+}
+
+static int
+vd_receive_track(unsigned char *buffer, unsigned int length, int srq)
+{
+	unsigned int i;
+
+	if (!vd_write_pending)
+		return 0;
+	vd_write_pending = 0;
+
+	if ((int) (vd_random() % 100) < vd_timeout)
+	{
+		vd_timeouts++;
+		return 0;
+	}
+
+	/* the parallel drive code stops at a zero byte */
+	if (!srq)
+	{
+		for (i = 0; (i < length) && (buffer[i]); i++);
+		length = i;
+	}
+	vd_write_bytes(vd_halftrack, buffer, length);
+	return 1;
+}
+
+/* DOS commands on the command channel */
+static void
+vd_dos_command(const char *cmd, size_t length)
+{
+	if (!length)
+		length = strlen(cmd);
+
+	/* M-E starts the drive code once it's there */
+	if ((length >= 3) && (memcmp(cmd, "M-E", 3) == 0) && (vd_code_size))
+	{
+		vd_running = 1;
+		vd_packet_length = 0;
+		vd_queue_head = vd_queue_tail = 0;
+		vd_answer(0);
+	}
+}
+
+/*
+	Put the image in the drive.  Tracks with a known length are taken as
+	they are, raw NIB and NB2 tracks are cut down to one track cycle.
+*/
+static int
+vd_load(char *filename)
+{
+	BYTE *buffer;
+	BYTE alignment[VD_TRACKS], align_byte;
+	int saved_start_track = start_track, saved_end_track = end_track, saved_track_inc = track_inc;
+	int track, result;
+	size_t i;
+
+	if (!(buffer = calloc(VD_TRACKS, NIB_TRACK_LENGTH)))
+	{
+		printf("Error: Could not allocate memory for the virtual disk.\n");
+		return 0;
+	}
+
+	start_track = 1 * 2;
+	end_track = 41 * 2;
+	track_inc = 2;
+
+	if (compare_extension((unsigned char *) filename, (unsigned char *) "D64"))
+		result = read_d64(filename, buffer, vd_density, vd_length);
+	else if (compare_extension((unsigned char *) filename, (unsigned char *) "G64"))
+		result = read_g64(filename, buffer, vd_density, vd_length);
+	else if (compare_extension((unsigned char *) filename, (unsigned char *) "NB2"))
+		result = read_nb2(filename, buffer, vd_density, vd_length);
+	else if ((compare_extension((unsigned char *) filename, (unsigned char *) "NIB")) ||
+		(compare_extension((unsigned char *) filename, (unsigned char *) "NBZ")) ||
+		(compare_extension((unsigned char *) filename, (unsigned char *) "NBZ2")))
+		result = read_nib_file(filename, buffer, vd_density, vd_length, alignment, 0);
+	else
+	{
+		printf("Unknown image type = %s!\n", filename);
+		result = 0;
+	}
+
+	start_track = saved_start_track;
+	end_track = saved_end_track;
+	track_inc = saved_track_inc;
+
+	for (track = 0; (result) && (track < VD_TRACKS); track++)
+	{
+		vd_density[track] &= 3;
+		if ((track < 2) || ((vd_length[track]) && (vd_length[track] < NIB_TRACK_LENGTH)))
+		{
+			memcpy(vd_track + (track * NIB_TRACK_LENGTH), buffer + (track * NIB_TRACK_LENGTH), NIB_TRACK_LENGTH);
+			continue;
+		}
+
+		for (i = 0; (i < NIB_TRACK_LENGTH) && (!buffer[(track * NIB_TRACK_LENGTH) + i]); i++);
+		if (i == NIB_TRACK_LENGTH)
+		{
+			vd_length[track] = 0;
+			continue;
+		}
+
+		vd_length[track] = extract_GCR_track(vd_track + (track * NIB_TRACK_LENGTH),
+			buffer + (track * NIB_TRACK_LENGTH), &align_byte, track / 2,
+			capacity_min[vd_density[track]], capacity_max[vd_density[track]]);
+	}
+
+	free(buffer);
+	return result;
+}
+
+/*
+	The adapter name carries the image and drive settings, see the top of
+	this file.  Returns 0 when the drive is ready.
+*/
+static int
+vd_open(char *adapter)
+{
+	char spec[512], *option, *value;
+
+	if (!(vd_track = calloc(VD_TRACKS, NIB_TRACK_LENGTH)))
+	{
+		printf("Error: Could not allocate memory for the virtual disk.\n");
+		return -1;
+	}
+	memset(vd_density, 0, sizeof(vd_density));
+	memset(vd_length, 0, sizeof(vd_length));
+
+	if (strlen(adapter) >= sizeof(spec))
+	{
+		printf("Virtual drive settings are too long\n");
+		return -1;
+	}
+	strcpy(spec, adapter);
+
+	for (option = strtok(spec, ","); option; option = strtok(NULL, ","))
+	{
+		if ((value = strchr(option, '=')) != NULL)
+			*value++ = '\0';
+
+		if (!value)
+		{
+			if (strcmp(option, "ihs") == 0)
+				vd_ihs = 1;
+			else if (strcmp(option, "spin") == 0)
+				vd_spin = 1;
+			else if (option == spec)
+			{
+				if (!vd_load(option))
+					return -1;
+			}
+			else
+			{
+				printf("Unknown virtual drive setting '%s'\n", option);
+				return -1;
+			}
+		}
+		else if (strcmp(option, "rpm") == 0)
+			vd_rpm = atof(value);
+		else if (strcmp(option, "jitter") == 0)
+			vd_jitter = atof(value);
+		else if (strcmp(option, "noise") == 0)
+			vd_noise = atoi(value);
+		else if (strcmp(option, "timeout") == 0)
+			vd_timeout = atoi(value);
+		else if (strcmp(option, "latency") == 0)
+			vd_latency = atof(value);
+		else if (strcmp(option, "seed") == 0)
+			vd_seed = strtoul(value, NULL, 10);
+		else if (strcmp(option, "drive") == 0)
+			vd_1571 = (atoi(value) == 1571);
+		else if ((strcmp(option, "save") == 0) && (strlen(value) < sizeof(vd_save)))
+			strcpy(vd_save, value);
+		else
+		{
+			printf("Unknown virtual drive setting '%s'\n", option);
+			return -1;
+		}
+	}
+
+	if ((vd_rpm < 200) || (vd_rpm > 400))
+	{
+		printf("Virtual drive speed out of range\n");
+		return -1;
+	}
+
+	printf("Virtual %d drive at %.1f rpm\n", (vd_1571) ? 1571 : 1541, vd_rpm);
+	return 0;
+}
+
+int CBMAPIDECL
+cbm_driver_open_ex(CBM_FILE *f, char *adapter)
+{
+	*f = (CBM_FILE) 1;
+	return vd_open((adapter) ? adapter : "");
+}
+
+int CBMAPIDECL
+cbm_driver_open(CBM_FILE *f, int port)
+{
+	return cbm_driver_open_ex(f, cbm_adapter);
+}
+
+void CBMAPIDECL
+cbm_driver_close(CBM_FILE f)
+{
+	int saved_track_inc = track_inc;
+
+	printf("Virtual drive: %ld commands, %ld track reads, %ld track writes, %ld timeouts, %.1f s drive time\n",
+		vd_commands, vd_reads, vd_writes, vd_timeouts, vd_clock / 1000);
+
+	if ((vd_save[0]) && (vd_track))
+	{
+		track_inc = 1;
+		write_g64(vd_save, vd_track, vd_density, vd_length);
+		track_inc = saved_track_inc;
+	}
+
+	free(vd_track);
+	vd_track = NULL;
+}
+
+int CBMAPIDECL
+cbm_reset(CBM_FILE f)
+{
+	vd_running = 0;
+	return 0;
+}
+
+int CBMAPIDECL
+cbm_listen(CBM_FILE f, unsigned char dev, unsigned char secadr)
+{
+	vd_secadr = secadr;
+	return 0;
+}
+
+int CBMAPIDECL
+cbm_talk(CBM_FILE f, unsigned char dev, unsigned char secadr)
+{
+	vd_secadr = secadr;
+	return 0;
+}
+
+int CBMAPIDECL
+cbm_unlisten(CBM_FILE f)
+{
+	return 0;
+}
+
+int CBMAPIDECL
+cbm_untalk(CBM_FILE f)
+{
+	return 0;
+}
+
+int CBMAPIDECL
+cbm_raw_write(CBM_FILE f, const void *buf, size_t size)
+{
+	if (vd_secadr == 15)
+		vd_dos_command((const char *) buf, size);
+	return (int) size;
+}
+
+/* memory reads only ever look at job results, which are all OK */
+int CBMAPIDECL
+cbm_raw_read(CBM_FILE f, void *buf, size_t size)
+{
+	memset(buf, 0x01, size);
+	return (int) size;
+}
+
+int CBMAPIDECL
+cbm_exec_command(CBM_FILE f, unsigned char dev, const void *cmd, size_t len)
+{
+	vd_dos_command((const char *) cmd, len);
+	return 0;
+}
+
+int CBMAPIDECL
+cbm_device_status(CBM_FILE f, unsigned char dev, void *buf, size_t bufsize)
+{
+	const char *status = (vd_1571) ? "73,CBM DOS V3.0 1571,00,00" : "73,CBM DOS V2.6 1541,00,00";
+
+	if (bufsize)
+	{
+		strncpy((char *) buf, status, bufsize - 1);
+		((char *) buf)[bufsize - 1] = '\0';
+	}
+	return 73;
+}
+
+int CBMAPIDECL
+cbm_upload(CBM_FILE f, unsigned char dev, int adr, const void *prog, size_t size)
+{
+	if ((adr < 0x300) || (adr + size > 0x800))
+		return -1;
+
+	memcpy(vd_code + (adr - 0x300), prog, size);
+	if (adr + size - 0x300 > vd_code_size)
+		vd_code_size = adr + size - 0x300;
+	return (int) size;
+}
+
+unsigned char CBMAPIDECL
+cbm_parallel_burst_read(CBM_FILE f)
+{
+	return vd_send();
+}
+
+void CBMAPIDECL
+cbm_parallel_burst_write(CBM_FILE f, unsigned char c)
+{
+	vd_receive(c);
+}
+
+#ifndef OPENCBM_42
+int CBMAPIDECL
+cbm_parallel_burst_read_n(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
+{
+	return vd_send_n(Buffer, Length);
+}
+
+int CBMAPIDECL
+cbm_parallel_burst_write_n(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
+{
+	unsigned int i;
+
+	for (i = 0; i < Length; i++)
+		vd_receive(Buffer[i]);
+	return 1;
+}
+#endif
+
+int CBMAPIDECL
+cbm_parallel_burst_read_track(CBM_FILE f, unsigned char *buffer, unsigned int length)
+{
+	return vd_send_track(buffer, length);
+}
+
+int CBMAPIDECL
+cbm_parallel_burst_read_track_var(CBM_FILE f, unsigned char *buffer, unsigned int length)
+{
+	return vd_send_track(buffer, length);
+}
+
+int CBMAPIDECL
+cbm_parallel_burst_write_track(CBM_FILE f, unsigned char *buffer, unsigned int length)
+{
+	return vd_receive_track(buffer, length, 0);
+}
+
+unsigned char CBMAPIDECL
+cbm_srq_burst_read(CBM_FILE f)
+{
+	return vd_send();
+}
+
+void CBMAPIDECL
+cbm_srq_burst_write(CBM_FILE f, unsigned char c)
+{
+	vd_receive(c);
+}
+
+int CBMAPIDECL
+cbm_srq_burst_read_n(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
+{
+	return vd_send_n(Buffer, Length);
+}
+
+int CBMAPIDECL
+cbm_srq_burst_write_n(CBM_FILE f, unsigned char *Buffer, unsigned int Length)
+{
+	unsigned int i;
+
+	for (i = 0; i < Length; i++)
+		vd_receive(Buffer[i]);
+	return 1;
+}
+
+int CBMAPIDECL
+cbm_srq_burst_read_track(CBM_FILE f, unsigned char *buffer, unsigned int length)
+{
+	return vd_send_track(buffer, length);
+}
+
+int CBMAPIDECL
+cbm_srq_burst_write_track(CBM_FILE f, unsigned char *buffer, unsigned int length)
+{
+	return vd_receive_track(buffer, length, 1);
+}
@@ -261,46 +261,73 @@ master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 	}
 }
 
-void
-master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+/*
+	Read raw/tr<track>d<density>, the old one file per track dump, into
+	trackbuf.  Returns the length, 0 if there is no file for the track.
+*/
+static size_t
+read_raw_track_file(int track, BYTE *trackbuf, int *density)
 {
-	int track, density;
-	BYTE trackbuf[NIB_TRACK_LENGTH];
 	char testfilename[16];
 	FILE *trkin = '\0';
 	size_t length;
 
+	// read in raw track at density (in filename)
+	for (*density = 3; *density >= 0; (*density)--)
+	{
+		sprintf(testfilename, "raw/tr%.1fd%d", (float) track/2, *density);
+
+		if( (trkin = fopen(testfilename, "rb")) )
+		{
+			if(verbose) printf(" [%s] ", testfilename);
+			break;
+		}
+	}
+
+	if (!trkin)
+		return 0;
+
+	/* erase mem and grab data from file */
+	memset(trackbuf, 0x00, NIB_TRACK_LENGTH);
+	fseek(trkin, 0, SEEK_END);
+	length = ftell(trkin);
+	rewind(trkin);
+	if (length > NIB_TRACK_LENGTH)
+		length = NIB_TRACK_LENGTH;
+	fread(trackbuf, length, 1, trkin); // @@@SRT: check success
+	fclose(trkin);
+
+	if(length == 0)
+		length = NIB_TRACK_LENGTH;
+
+	return length;
+}
+
+/*
+	Master the tracks of a raw track dump that was read into the buffers
+	(dumped), or else of the raw/ track files.
+*/
+void
+master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length, int dumped)
+{
+	int track, density;
+	size_t length;
+
 	for (track=backwards?end_track:start_track; backwards?(track>=start_track):(track<=end_track); backwards?(track-=track_inc):(track+=track_inc))
 	{
 		printf("\n%4.1f:", (float) track / 2);
 
-		// read in raw track at density (in filename)
-		for (density = 3; density >= 0; density--)
+		if (dumped)
 		{
-			sprintf(testfilename, "raw/tr%.1fd%d", (float) track/2, density);
-
-			if( (trkin = fopen(testfilename, "rb")) )
-			{
-				if(verbose) printf(" [%s] ", testfilename);
-				break;
-			}
+			length = track_length[track];
+			density = track_density[track] & 3;
 		}
+		else
+			length = read_raw_track_file(track, track_buffer + (track * NIB_TRACK_LENGTH), &density);
 
-		if (trkin)
+		if (length)
 		{
-			/* erase mem and grab data from file */
-			memset(trackbuf, 0x00, sizeof(trackbuf));
-			fseek(trkin, 0, SEEK_END);
-			length = ftell(trkin);
-			rewind(trkin);
-			fread(trackbuf, length, 1, trkin); // @@@SRT: check success
-			fclose(trkin);
-
-			if(length == 0)
-				length = NIB_TRACK_LENGTH;
-
 			/* process track */
-			memcpy(track_buffer + (track * NIB_TRACK_LENGTH), trackbuf, NIB_TRACK_LENGTH);
 			track_density[track] = check_sync_flags(track_buffer + (track * NIB_TRACK_LENGTH), density, length);
 			//length = compress_halftrack(track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], length);
 
@@ -322,7 +349,7 @@ master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *tr
 			master_track(fd, track_buffer, track_density, track, length);
 		}
 		else
-			printf(" [missing track file - skipped]");
+			printf(dumped ? " [not in dump - skipped]" : " [missing track file - skipped]");
 	}
 }
 